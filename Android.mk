@@ -8,17 +8,47 @@ LOCAL_PATH := $(call my-dir)
 
 bsdrm_srcs = \
 	bsdrm/src/app.c \
+	bsdrm/src/blob_cache.c \
+	bsdrm/src/bo_pool.c \
+	bsdrm/src/color.c \
+	bsdrm/src/commit_log.c \
+	bsdrm/src/compositor.c \
+	bsdrm/src/crtc_crc.c \
 	bsdrm/src/debug.c \
 	bsdrm/src/draw.c \
 	bsdrm/src/drm_connectors.c \
 	bsdrm/src/drm_fb.c \
+	bsdrm/src/drm_modifiers.c \
 	bsdrm/src/drm_open.c \
 	bsdrm/src/drm_pipe.c \
+	bsdrm/src/drm_sysfs.c \
 	bsdrm/src/egl.c \
 	bsdrm/src/gl.c \
+	bsdrm/src/hash.c \
+	bsdrm/src/kms_snapshot.c \
 	bsdrm/src/mmap.c \
 	bsdrm/src/open.c \
-	bsdrm/src/pipe.c
+	bsdrm/src/pipe.c \
+	bsdrm/src/plane_caps.c \
+	bsdrm/src/present_stats.c \
+	bsdrm/src/rotate.c \
+	bsdrm/src/scale.c \
+	bsdrm/src/writeback.c
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := $(bsdrm_srcs) atomic_replay.c
+
+LOCAL_MODULE := atomic_replay
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/bsdrm/include \
+	$(VENDOR_SDK_INCLUDES)
+LOCAL_CFLAGS := -O2 -g -W -Wall
+LOCAL_SHARED_LIBRARIES := libdrm libminigbm
+
+include $(BUILD_EXECUTABLE)
 
 include $(CLEAR_VARS)
 
@@ -49,3 +79,18 @@ LOCAL_CFLAGS := -O2 -g -W -Wall
 LOCAL_SHARED_LIBRARIES := libdrm libminigbm
 
 include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := $(bsdrm_srcs) reference_test.c
+
+LOCAL_MODULE := reference_test
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/bsdrm/include \
+	$(VENDOR_SDK_INCLUDES)
+LOCAL_CFLAGS := -O2 -g -W -Wall
+LOCAL_SHARED_LIBRARIES := libdrm libminigbm
+
+include $(BUILD_EXECUTABLE)
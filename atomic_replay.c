@@ -0,0 +1,700 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Replays a bs_commit_log, as recorded by atomictest -r or an atomic bs_app, on the main display's
+ * card and measures how long the driver takes to check, commit and flip each request. The logged
+ * CRTCs, connectors and planes are mapped to the card's by their index in the kernel's lists and
+ * properties by name. Blobs are recreated from their logged contents and framebuffers are
+ * allocated in the logged size. In-fences are dropped since the producers are gone.
+ */
+
+#include <getopt.h>
+#include <poll.h>
+
+#include "bs_drm.h"
+
+#define FLIP_TIMEOUT_MS 1000
+
+struct id_map_entry {
+	uint32_t from;
+	uint32_t to;
+};
+
+struct id_map {
+	struct id_map_entry *entries;
+	size_t count;
+};
+
+struct replay_prop {
+	uint32_t object_id;
+	uint32_t prop_id;
+	char name[DRM_PROP_NAME_LEN];
+};
+
+struct replay_fb {
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	struct gbm_bo *bo;
+	uint32_t fb_id;
+};
+
+struct replay_samples {
+	int64_t *ns;
+	size_t count;
+	size_t capacity;
+};
+
+struct replay {
+	int fd;
+	struct gbm_device *gbm;
+	drmEventContext event_ctx;
+
+	// The card's objects of each type in the kernel's order.
+	uint32_t *objects[BS_COMMIT_LOG_OBJECT_TYPES];
+	uint32_t object_counts[BS_COMMIT_LOG_OBJECT_TYPES];
+	struct replay_prop *props;
+	size_t prop_count;
+
+	struct id_map object_map;
+	struct id_map blob_map;
+	struct id_map fb_map;
+	// The CRTC each plane and connector is on after the commits so far, to know which flip.
+	struct id_map crtc_of;
+	// Property records of the log, which stay mapped for the whole replay.
+	const struct bs_commit_log_property **logged_props;
+	size_t logged_prop_count;
+
+	uint32_t *blobs;
+	size_t blob_count;
+	// Framebuffers are shared by all logged ones of the same size and format and never removed
+	// before the end, since one might still be on screen.
+	struct replay_fb *fbs;
+	size_t fb_count;
+
+	// CRTCs, by index, whose flip event is still outstanding.
+	uint32_t pending_crtcs;
+	int64_t flip_start_ns;
+
+	struct replay_samples recorded;
+	struct replay_samples check;
+	struct replay_samples commit;
+	struct replay_samples flip;
+	uint64_t commits;
+	uint64_t test_only;
+	uint64_t skipped;
+	uint64_t diverged;
+	uint64_t dropped_fences;
+	uint64_t flip_timeouts;
+};
+
+static bool paced = false;
+static bool verbose = false;
+static bool json = false;
+
+static void id_map_set(struct id_map *map, uint32_t from, uint32_t to)
+{
+	for (size_t i = 0; i < map->count; i++) {
+		if (map->entries[i].from == from) {
+			map->entries[i].to = to;
+			return;
+		}
+	}
+
+	map->entries = realloc(map->entries, (map->count + 1) * sizeof(*map->entries));
+	assert(map->entries);
+	map->entries[map->count].from = from;
+	map->entries[map->count].to = to;
+	map->count++;
+}
+
+// Returns 0 for ids that were never mapped.
+static uint32_t id_map_get(const struct id_map *map, uint32_t from)
+{
+	for (size_t i = 0; i < map->count; i++) {
+		if (map->entries[i].from == from)
+			return map->entries[i].to;
+	}
+
+	return 0;
+}
+
+static void samples_add(struct replay_samples *samples, int64_t ns)
+{
+	if (samples->count == samples->capacity) {
+		samples->capacity = samples->capacity ? samples->capacity * 2 : 256;
+		samples->ns = realloc(samples->ns, samples->capacity * sizeof(int64_t));
+		assert(samples->ns);
+	}
+	samples->ns[samples->count++] = ns;
+}
+
+static void replay_add_props(struct replay *replay, uint32_t object_id, uint32_t object_type)
+{
+	drmModeObjectPropertiesPtr props =
+	    drmModeObjectGetProperties(replay->fd, object_id, object_type);
+	if (!props)
+		return;
+
+	for (uint32_t i = 0; i < props->count_props; i++) {
+		drmModePropertyPtr prop = drmModeGetProperty(replay->fd, props->props[i]);
+		if (!prop)
+			continue;
+
+		replay->props =
+		    realloc(replay->props, (replay->prop_count + 1) * sizeof(*replay->props));
+		assert(replay->props);
+		struct replay_prop *replay_prop = &replay->props[replay->prop_count++];
+		replay_prop->object_id = object_id;
+		replay_prop->prop_id = prop->prop_id;
+		memcpy(replay_prop->name, prop->name, sizeof(replay_prop->name));
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+}
+
+static void page_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
+			      unsigned int tv_usec, unsigned int crtc_id, void *user_data)
+{
+	struct replay *replay = user_data;
+	for (uint32_t i = 0; i < replay->object_counts[BS_COMMIT_LOG_CRTCS]; i++) {
+		if (replay->objects[BS_COMMIT_LOG_CRTCS][i] != crtc_id ||
+		    !(replay->pending_crtcs & (1u << i)))
+			continue;
+
+		replay->pending_crtcs &= ~(1u << i);
+		if (!replay->pending_crtcs) {
+			int64_t flip_ns = (int64_t)tv_sec * 1000000000 + (int64_t)tv_usec * 1000;
+			samples_add(&replay->flip, flip_ns - replay->flip_start_ns);
+		}
+	}
+}
+
+static bool replay_open(struct replay *replay)
+{
+	replay->fd = bs_drm_open_main_display();
+	if (replay->fd < 0) {
+		bs_debug_error("failed to open card for display");
+		return false;
+	}
+
+	if (drmSetClientCap(replay->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) ||
+	    drmSetClientCap(replay->fd, DRM_CLIENT_CAP_ATOMIC, 1)) {
+		bs_debug_error("failed to enable atomic modesetting");
+		return false;
+	}
+
+	replay->gbm = gbm_create_device(replay->fd);
+	if (!replay->gbm) {
+		bs_debug_error("failed to create gbm device");
+		return false;
+	}
+
+	drmModeRes *res = drmModeGetResources(replay->fd);
+	drmModePlaneRes *plane_res = drmModeGetPlaneResources(replay->fd);
+	if (!res || !plane_res) {
+		bs_debug_error("failed to get kms resources");
+		if (plane_res)
+			drmModeFreePlaneResources(plane_res);
+		if (res)
+			drmModeFreeResources(res);
+		return false;
+	}
+
+	const uint32_t *ids[BS_COMMIT_LOG_OBJECT_TYPES] = { res->crtcs, res->connectors,
+							      plane_res->planes };
+	const uint32_t counts[BS_COMMIT_LOG_OBJECT_TYPES] = { res->count_crtcs,
+							       res->count_connectors,
+							       plane_res->count_planes };
+	const uint32_t object_types[BS_COMMIT_LOG_OBJECT_TYPES] = {
+		DRM_MODE_OBJECT_CRTC, DRM_MODE_OBJECT_CONNECTOR, DRM_MODE_OBJECT_PLANE
+	};
+	for (uint32_t t = 0; t < BS_COMMIT_LOG_OBJECT_TYPES; t++) {
+		replay->objects[t] = calloc(counts[t] + 1, sizeof(uint32_t));
+		assert(replay->objects[t]);
+		memcpy(replay->objects[t], ids[t], counts[t] * sizeof(uint32_t));
+		replay->object_counts[t] = counts[t];
+		for (uint32_t i = 0; i < counts[t]; i++)
+			replay_add_props(replay, ids[t][i], object_types[t]);
+	}
+
+	drmModeFreePlaneResources(plane_res);
+	drmModeFreeResources(res);
+
+	replay->event_ctx.version = DRM_EVENT_CONTEXT_VERSION;
+	replay->event_ctx.page_flip_handler2 = page_flip_handler;
+	return true;
+}
+
+static void replay_close(struct replay *replay)
+{
+	for (size_t i = 0; i < replay->fb_count; i++) {
+		drmModeRmFB(replay->fd, replay->fbs[i].fb_id);
+		gbm_bo_destroy(replay->fbs[i].bo);
+	}
+	for (size_t i = 0; i < replay->blob_count; i++)
+		drmModeDestroyPropertyBlob(replay->fd, replay->blobs[i]);
+	for (uint32_t t = 0; t < BS_COMMIT_LOG_OBJECT_TYPES; t++)
+		free(replay->objects[t]);
+
+	free(replay->fbs);
+	free(replay->blobs);
+	free(replay->props);
+	free(replay->logged_props);
+	free(replay->object_map.entries);
+	free(replay->blob_map.entries);
+	free(replay->fb_map.entries);
+	free(replay->crtc_of.entries);
+	free(replay->recorded.ns);
+	free(replay->check.ns);
+	free(replay->commit.ns);
+	free(replay->flip.ns);
+	if (replay->gbm)
+		gbm_device_destroy(replay->gbm);
+	if (replay->fd >= 0)
+		close(replay->fd);
+}
+
+// Waits up to timeout_ms, or until there are no more pending flips if negative, for flip events.
+static void replay_dispatch(struct replay *replay, int timeout_ms)
+{
+	int64_t deadline_ns = bs_debug_gettime_ns() + (int64_t)abs(timeout_ms) * 1000000;
+	for (;;) {
+		int64_t remaining_ns = deadline_ns - bs_debug_gettime_ns();
+		if ((timeout_ms < 0 && !replay->pending_crtcs) || remaining_ns <= 0)
+			break;
+
+		struct pollfd pfd = { replay->fd, POLLIN, 0 };
+		int ret = poll(&pfd, 1, (remaining_ns + 999999) / 1000000);
+		if (ret > 0)
+			drmHandleEvent(replay->fd, &replay->event_ctx);
+		else if (ret < 0 && errno != EINTR)
+			break;
+	}
+
+	if (timeout_ms < 0 && replay->pending_crtcs) {
+		replay->flip_timeouts++;
+		replay->pending_crtcs = 0;
+	}
+}
+
+static void replay_objects(struct replay *replay, const struct bs_commit_log_objects *objects)
+{
+	const uint32_t *ids = objects->ids;
+	for (uint32_t t = 0; t < BS_COMMIT_LOG_OBJECT_TYPES; t++) {
+		if (objects->counts[t] > replay->object_counts[t])
+			bs_debug_warning("log has %u objects of type %u, the card only %u",
+					 objects->counts[t], t, replay->object_counts[t]);
+		for (uint32_t i = 0; i < objects->counts[t] && i < replay->object_counts[t]; i++)
+			id_map_set(&replay->object_map, ids[i], replay->objects[t][i]);
+		ids += objects->counts[t];
+	}
+}
+
+static void replay_blob(struct replay *replay, const struct bs_commit_log_blob *blob)
+{
+	uint32_t blob_id = 0;
+	if (drmModeCreatePropertyBlob(replay->fd, blob->data, blob->length, &blob_id)) {
+		bs_debug_warning("failed to create blob of %u bytes", blob->length);
+	} else {
+		replay->blobs =
+		    realloc(replay->blobs, (replay->blob_count + 1) * sizeof(*replay->blobs));
+		assert(replay->blobs);
+		replay->blobs[replay->blob_count++] = blob_id;
+	}
+	id_map_set(&replay->blob_map, blob->blob_id, blob_id);
+}
+
+static uint32_t fb_format(const struct bs_commit_log_fb *fb)
+{
+	if (fb->bpp == 16)
+		return DRM_FORMAT_RGB565;
+	if (fb->bpp == 32 && fb->depth == 32)
+		return DRM_FORMAT_ARGB8888;
+	if (fb->bpp == 32 && fb->depth == 30)
+		return DRM_FORMAT_XRGB2101010;
+	// Includes planar formats, which GETFB reports without a depth.
+	return DRM_FORMAT_XRGB8888;
+}
+
+static void replay_fb(struct replay *replay, const struct bs_commit_log_fb *fb)
+{
+	uint32_t format = fb_format(fb);
+	for (size_t i = 0; i < replay->fb_count; i++) {
+		struct replay_fb *replay_fb = &replay->fbs[i];
+		if (replay_fb->width == fb->width && replay_fb->height == fb->height &&
+		    replay_fb->format == format) {
+			id_map_set(&replay->fb_map, fb->fb_id, replay_fb->fb_id);
+			return;
+		}
+	}
+
+	struct gbm_bo *bo =
+	    gbm_bo_create(replay->gbm, fb->width, fb->height, format, GBM_BO_USE_SCANOUT);
+	uint32_t fb_id = bo ? bs_drm_fb_create_gbm(bo) : 0;
+	if (!fb_id) {
+		bs_debug_warning("failed to create %ux%u framebuffer", fb->width, fb->height);
+		if (bo)
+			gbm_bo_destroy(bo);
+		id_map_set(&replay->fb_map, fb->fb_id, 0);
+		return;
+	}
+
+	replay->fbs = realloc(replay->fbs, (replay->fb_count + 1) * sizeof(*replay->fbs));
+	assert(replay->fbs);
+	struct replay_fb *replay_fb = &replay->fbs[replay->fb_count++];
+	replay_fb->width = fb->width;
+	replay_fb->height = fb->height;
+	replay_fb->format = format;
+	replay_fb->bo = bo;
+	replay_fb->fb_id = fb_id;
+	id_map_set(&replay->fb_map, fb->fb_id, fb_id);
+}
+
+static const struct bs_commit_log_property *logged_property(struct replay *replay,
+							    uint32_t prop_id)
+{
+	for (size_t i = 0; i < replay->logged_prop_count; i++) {
+		if (replay->logged_props[i]->prop_id == prop_id)
+			return replay->logged_props[i];
+	}
+
+	return NULL;
+}
+
+static uint32_t replay_prop_id(struct replay *replay, uint32_t object_id, const char *name)
+{
+	for (size_t i = 0; i < replay->prop_count; i++) {
+		if (replay->props[i].object_id == object_id && !strcmp(replay->props[i].name, name))
+			return replay->props[i].prop_id;
+	}
+
+	return 0;
+}
+
+static int crtc_index(struct replay *replay, uint32_t crtc_id)
+{
+	for (uint32_t i = 0; i < replay->object_counts[BS_COMMIT_LOG_CRTCS]; i++) {
+		if (replay->objects[BS_COMMIT_LOG_CRTCS][i] == crtc_id)
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Translates one logged property into the request. Returns false if the card has nothing to
+ * apply it to. Adds the CRTCs the property involves to crtc_mask, which for a plane or connector
+ * are both the one it is on and the one it moves to.
+ */
+static bool replay_item(struct replay *replay, drmModeAtomicReqPtr req,
+			const struct bs_commit_log_item *item, bool test_only,
+			int32_t *out_fence_fd, uint32_t *crtc_mask)
+{
+	const struct bs_commit_log_property *logged = logged_property(replay, item->prop_id);
+	uint32_t object_id = id_map_get(&replay->object_map, item->object_id);
+	if (!logged || !object_id)
+		return false;
+
+	uint32_t prop_id = replay_prop_id(replay, object_id, logged->name);
+	if (!prop_id)
+		return false;
+
+	uint64_t value = item->value;
+	if (!strcmp(logged->name, "IN_FENCE_FD")) {
+		if ((int64_t)value >= 0)
+			replay->dropped_fences++;
+		value = (uint64_t)-1;
+	} else if (!strcmp(logged->name, "OUT_FENCE_PTR")) {
+		value = value ? (uint64_t)(uintptr_t)out_fence_fd : 0;
+	} else if (!strcmp(logged->name, "FB_ID")) {
+		value = value ? id_map_get(&replay->fb_map, value) : 0;
+		if (item->value && !value)
+			return false;
+	} else if (value && (logged->flags & DRM_MODE_PROP_BLOB)) {
+		value = id_map_get(&replay->blob_map, value);
+		if (!value)
+			return false;
+	} else if (value && (logged->flags & DRM_MODE_PROP_EXTENDED_TYPE) == DRM_MODE_PROP_OBJECT) {
+		value = id_map_get(&replay->object_map, value);
+		if (!value)
+			return false;
+	}
+
+	int index = crtc_index(replay, object_id);
+	if (index < 0)
+		index = crtc_index(replay, id_map_get(&replay->crtc_of, object_id));
+	if (index >= 0)
+		*crtc_mask |= 1u << index;
+	if (!strcmp(logged->name, "CRTC_ID")) {
+		if ((index = crtc_index(replay, value)) >= 0)
+			*crtc_mask |= 1u << index;
+		if (!test_only)
+			id_map_set(&replay->crtc_of, object_id, value);
+	}
+
+	return drmModeAtomicAddProperty(req, object_id, prop_id, value) >= 0;
+}
+
+static void replay_commit(struct replay *replay, const struct bs_commit_log_commit *commit)
+{
+	drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+	assert(req);
+	int32_t out_fence_fd = -1;
+	uint32_t crtc_mask = 0;
+	uint32_t flags = commit->flags;
+	bool test_only = flags & DRM_MODE_ATOMIC_TEST_ONLY;
+	for (uint32_t i = 0; i < commit->count; i++) {
+		if (!replay_item(replay, req, &commit->items[i], test_only, &out_fence_fd,
+				 &crtc_mask)) {
+			replay->skipped++;
+			drmModeAtomicFree(req);
+			return;
+		}
+	}
+
+	bool event = flags & DRM_MODE_PAGE_FLIP_EVENT;
+	if (!test_only)
+		samples_add(&replay->recorded, commit->duration_ns);
+
+	// The kernel refuses commits to CRTCs that haven't flipped yet.
+	if (!test_only && replay->pending_crtcs)
+		replay_dispatch(replay, -FLIP_TIMEOUT_MS);
+
+	uint32_t check_flags = (flags & ~(DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT)) |
+			       DRM_MODE_ATOMIC_TEST_ONLY;
+	int64_t start_ns = bs_debug_gettime_ns();
+	int ret = drmModeAtomicCommit(replay->fd, req, check_flags, NULL);
+	int64_t check_ns = bs_debug_gettime_ns() - start_ns;
+	samples_add(&replay->check, check_ns);
+
+	int64_t commit_ns = 0;
+	if (test_only) {
+		replay->test_only++;
+	} else if (!ret) {
+		start_ns = bs_debug_gettime_ns();
+		ret = drmModeAtomicCommit(replay->fd, req, flags, replay);
+		commit_ns = bs_debug_gettime_ns() - start_ns;
+		samples_add(&replay->commit, commit_ns);
+		if (!ret && event) {
+			replay->pending_crtcs = crtc_mask;
+			replay->flip_start_ns = start_ns;
+		}
+	}
+	drmModeAtomicFree(req);
+	if (out_fence_fd >= 0)
+		close(out_fence_fd);
+
+	replay->commits++;
+	if (!ret != !commit->ret)
+		replay->diverged++;
+	if (verbose)
+		printf("commit %llu: flags 0x%x, %u properties, ret %d (recorded %d), "
+		       "check %.3f ms, commit %.3f ms (recorded %.3f ms)\n",
+		       (unsigned long long)replay->commits, flags, commit->count, ret, commit->ret,
+		       check_ns / 1000000.0, commit_ns / 1000000.0,
+		       commit->duration_ns / 1000000.0);
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a;
+	int64_t y = *(const int64_t *)b;
+	return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples.
+static int64_t percentile(const struct replay_samples *samples, unsigned int percent)
+{
+	if (!samples->count)
+		return 0;
+	size_t rank = (samples->count * percent + 99) / 100;
+	return samples->ns[rank ? rank - 1 : 0];
+}
+
+static void print_samples(const char *name, struct replay_samples *samples)
+{
+	qsort(samples->ns, samples->count, sizeof(int64_t), compare_int64);
+	int64_t max_ns = samples->count ? samples->ns[samples->count - 1] : 0;
+	if (json) {
+		printf("{\"name\": \"%s\", \"count\": %zu, \"p50_ns\": %lld, \"p90_ns\": %lld, "
+		       "\"p99_ns\": %lld, \"max_ns\": %lld}\n",
+		       name, samples->count, (long long)percentile(samples, 50),
+		       (long long)percentile(samples, 90), (long long)percentile(samples, 99),
+		       (long long)max_ns);
+	} else {
+		printf("  %s: %zu, p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n", name,
+		       samples->count, percentile(samples, 50) / 1000000.0,
+		       percentile(samples, 90) / 1000000.0, percentile(samples, 99) / 1000000.0,
+		       max_ns / 1000000.0);
+	}
+}
+
+// Checks that a record's payload holds everything its counts and lengths claim.
+static bool record_valid(const struct bs_commit_log_record *record)
+{
+	const void *payload = record + 1;
+	size_t size = record->size;
+	switch (record->type) {
+		case BS_COMMIT_LOG_RECORD_OBJECTS: {
+			const struct bs_commit_log_objects *objects = payload;
+			if (size < sizeof(*objects))
+				return false;
+			uint64_t count = 0;
+			for (uint32_t t = 0; t < BS_COMMIT_LOG_OBJECT_TYPES; t++)
+				count += objects->counts[t];
+			return count <= (size - sizeof(*objects)) / sizeof(objects->ids[0]);
+		}
+		case BS_COMMIT_LOG_RECORD_PROPERTY: {
+			const struct bs_commit_log_property *prop = payload;
+			return size >= sizeof(*prop) &&
+			       memchr(prop->name, '\0', sizeof(prop->name)) != NULL;
+		}
+		case BS_COMMIT_LOG_RECORD_BLOB: {
+			const struct bs_commit_log_blob *blob = payload;
+			return size >= sizeof(*blob) && blob->length <= size - sizeof(*blob);
+		}
+		case BS_COMMIT_LOG_RECORD_FB:
+			return size >= sizeof(struct bs_commit_log_fb);
+		case BS_COMMIT_LOG_RECORD_COMMIT: {
+			const struct bs_commit_log_commit *commit = payload;
+			return size >= sizeof(*commit) &&
+			       commit->count <= (size - sizeof(*commit)) / sizeof(commit->items[0]);
+		}
+		default:
+			return true;
+	}
+}
+
+static int run_replay(const char *path)
+{
+	struct bs_commit_log_reader *reader = bs_commit_log_reader_new(path);
+	if (!reader)
+		return 1;
+
+	struct replay replay = { 0 };
+	if (!replay_open(&replay)) {
+		replay_close(&replay);
+		bs_commit_log_reader_destroy(&reader);
+		return 1;
+	}
+
+	int64_t start_ns = bs_debug_gettime_ns();
+	const struct bs_commit_log_record *record;
+	while ((record = bs_commit_log_reader_next(reader))) {
+		const void *payload = record + 1;
+		if (!record_valid(record)) {
+			bs_debug_warning("skipping malformed record of type %u", record->type);
+			continue;
+		}
+		switch (record->type) {
+			case BS_COMMIT_LOG_RECORD_OBJECTS:
+				replay_objects(&replay, payload);
+				break;
+			case BS_COMMIT_LOG_RECORD_PROPERTY:
+				replay.logged_props =
+				    realloc(replay.logged_props, (replay.logged_prop_count + 1) *
+								     sizeof(*replay.logged_props));
+				assert(replay.logged_props);
+				replay.logged_props[replay.logged_prop_count++] = payload;
+				break;
+			case BS_COMMIT_LOG_RECORD_BLOB:
+				replay_blob(&replay, payload);
+				break;
+			case BS_COMMIT_LOG_RECORD_FB:
+				replay_fb(&replay, payload);
+				break;
+			case BS_COMMIT_LOG_RECORD_COMMIT: {
+				const struct bs_commit_log_commit *commit = payload;
+				if (paced) {
+					int64_t wait_ns =
+					    commit->time_ns - (bs_debug_gettime_ns() - start_ns);
+					if (wait_ns > 0)
+						replay_dispatch(&replay, wait_ns / 1000000);
+				}
+				replay_commit(&replay, commit);
+				break;
+			}
+			default:
+				bs_debug_warning("skipping unknown record type %u", record->type);
+				break;
+		}
+	}
+	replay_dispatch(&replay, -FLIP_TIMEOUT_MS);
+	int64_t replay_ns = bs_debug_gettime_ns() - start_ns;
+
+	if (json) {
+		printf("{\"name\": \"atomic_replay\", \"commits\": %llu, \"test_only\": %llu, "
+		       "\"skipped\": %llu, \"diverged\": %llu, \"dropped_fences\": %llu, "
+		       "\"flip_timeouts\": %llu, \"replay_ns\": %lld}\n",
+		       (unsigned long long)replay.commits, (unsigned long long)replay.test_only,
+		       (unsigned long long)replay.skipped, (unsigned long long)replay.diverged,
+		       (unsigned long long)replay.dropped_fences,
+		       (unsigned long long)replay.flip_timeouts, (long long)replay_ns);
+	} else {
+		printf("Replayed %llu commits, %llu of them TEST_ONLY, in %.3f s\n",
+		       (unsigned long long)replay.commits, (unsigned long long)replay.test_only,
+		       replay_ns / 1e9);
+		printf("  %llu skipped for objects the card lacks, %llu returned differently than "
+		       "recorded, %llu in-fences dropped, %llu flips timed out\n",
+		       (unsigned long long)replay.skipped, (unsigned long long)replay.diverged,
+		       (unsigned long long)replay.dropped_fences,
+		       (unsigned long long)replay.flip_timeouts);
+	}
+	print_samples("recorded commit", &replay.recorded);
+	print_samples("check", &replay.check);
+	print_samples("commit", &replay.commit);
+	print_samples("flip", &replay.flip);
+
+	replay_close(&replay);
+	bs_commit_log_reader_destroy(&reader);
+	return 0;
+}
+
+static const struct option longopts[] = {
+	{ "paced", no_argument, NULL, 'p' },
+	{ "verbose", no_argument, NULL, 'v' },
+	{ "json", no_argument, NULL, 'j' },
+	{ "help", no_argument, NULL, 'h' },
+	{ 0, 0, 0, 0 },
+};
+
+static void print_help(const char *argv0)
+{
+	printf("usage: %s [-p (to keep the recorded time between commits)]\n"
+	       "       [-v (to print every commit)] [-j (to print stats as JSON)] <log>\n",
+	       argv0);
+}
+
+int main(int argc, char **argv)
+{
+	int c;
+	while ((c = getopt_long(argc, argv, "pvjh", longopts, NULL)) != -1) {
+		switch (c) {
+			case 'p':
+				paced = true;
+				break;
+			case 'v':
+				verbose = true;
+				break;
+			case 'j':
+				json = true;
+				break;
+			default:
+				print_help(argv[0]);
+				return 0;
+		}
+	}
+
+	if (optind != argc - 1) {
+		print_help(argv[0]);
+		return 1;
+	}
+
+	return run_replay(argv[optind]);
+}
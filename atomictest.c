@@ -38,22 +38,19 @@
 	} while (0)
 
 #define CURSOR_SIZE 64
+// Idle buffer objects kept for reuse across test cases, enough for a few full screen planes.
+#define BO_POOL_BUDGET (64 << 20)
+// Unheld mode, CTM and gamma blobs kept for reuse, enough for a color transition's steps.
+#define BLOB_CACHE_CAPACITY 64
 
 // TODO(dcastagna): Remove these declarations once they're exported in a libsync header.
 int sw_sync_timeline_create(void);
 int sw_sync_timeline_inc(int fd, unsigned count);
 int sw_sync_fence_create(int fd, const char *name, unsigned value);
 
-// TODO(gsingh) This is defined in upstream libdrm -- remove when CROS libdrm is updated.
-#ifndef DRM_ROTATE_0
-#define DRM_ROTATE_0 (1UL << 0)
-#endif
-
-#ifndef DRM_REFLECT_Y
-#define DRM_REFLECT_Y (1UL << 5)
-#endif
-
 #define TEST_COMMIT_FAIL 1
+// Writeback captured frames other than the expected ones.
+#define TEST_CAPTURE_FAIL 2
 
 #define GAMMA_MAX_VALUE ((1 << 16) - 1)
 
@@ -81,17 +78,34 @@ static int64_t red_shift_ctm[9] = {
 // clang-format on
 
 static bool automatic = false;
+// Never sleeps and only puts frames on screen that a test actually looks at. Implies automatic.
+static bool fast = false;
+static bool use_modifiers = false;
 static struct gbm_device *gbm = NULL;
-
-static void page_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
-			      unsigned int tv_usec, void *user_data)
-{
-	// Nothing to do.
-}
+static struct bs_bo_pool *bo_pool = NULL;
+// What the planes were found to scan out, so that hopeless configurations skip the kernel.
+static bool use_plane_caps = false;
+static struct bs_plane_caps *plane_caps = NULL;
+// Every atomic commit is recorded here if set, to be replayed by atomic_replay.
+static const char *record_path = NULL;
+static struct bs_commit_log *commit_log = NULL;
+static bool json = false;
+// Runs each test on all selected CRTCs at once, with their changes merged into single commits.
+static bool concurrent = false;
+// Composes what every committed frame should look like in software, to check scanout against.
+static bool compose_expected = false;
+static struct bs_compositor *compositor = NULL;
+// Captures committed frames through the card's writeback connector to compare them with the
+// expected ones. Implies compose_expected.
+static bool use_writeback = false;
+static struct bs_writeback *writeback = NULL;
 
 struct atomictest_property {
 	uint32_t pid;
 	uint64_t value;
+	// The value the kernel has, known when committed is set, so only changes get committed.
+	uint64_t committed_value;
+	bool committed;
 };
 
 struct atomictest_plane {
@@ -115,6 +129,12 @@ struct atomictest_plane {
 	struct atomictest_property in_fence_fd;
 	struct atomictest_property rotation;
 	struct atomictest_property ctm;
+	struct atomictest_property zpos;
+	struct atomictest_property alpha;
+	struct atomictest_property blend_mode;
+
+	// Set when the plane's changes should go into the next commit.
+	bool staged;
 };
 
 struct atomictest_connector {
@@ -122,6 +142,7 @@ struct atomictest_connector {
 	struct atomictest_property crtc_id;
 	struct atomictest_property edid;
 	struct atomictest_property dpms;
+	bool staged;
 };
 
 struct atomictest_crtc {
@@ -134,17 +155,42 @@ struct atomictest_crtc {
 	uint32_t num_primary;
 	uint32_t num_cursor;
 	uint32_t num_overlay;
+	// Plane copies past the counted ones that partition_planes gave to other CRTCs.
+	uint32_t num_lent;
 
 	struct atomictest_plane *planes;
 	struct atomictest_property mode_id;
 	struct atomictest_property active;
 	struct atomictest_property out_fence_ptr;
+	// Left as the test found it, but part of what the CRTC shows.
+	struct atomictest_property degamma_lut;
 	struct atomictest_property ctm;
 	struct atomictest_property gamma_lut;
 	struct atomictest_property gamma_lut_size;
+	bool staged;
+
+	// The connector and index into the context's modes that last passed the modeset test, or 0
+	// if none has yet.
+	uint32_t validated_connector_id;
+	uint32_t validated_mode;
+
+	// Flips of the CRTC under test, and the time from its commits to their last flip.
+	struct bs_present_stats *present_stats;
+	uint64_t commits;
+	uint64_t shared_commits;
+	int64_t commit_ns;
+
+	// What the CRTC should be showing after its last commit, if composed.
+	uint32_t *expected_frame;
+	size_t expected_frame_size;
+	// Writeback captures that differed from it, which fail the test that made them.
+	uint64_t captures_differed;
 };
 
+// Mode blobs are taken from the blob cache on first use, shared by every connector with the same
+// mode and held until the end.
 struct atomictest_mode {
+	drmModeModeInfo info;
 	uint32_t height;
 	uint32_t width;
 	uint32_t id;
@@ -152,6 +198,7 @@ struct atomictest_mode {
 
 struct atomictest_context {
 	int fd;
+	struct bs_kms_snapshot *snapshot;
 	uint32_t num_crtcs;
 	uint32_t num_connectors;
 	uint32_t num_modes;
@@ -159,14 +206,74 @@ struct atomictest_context {
 	struct atomictest_connector *connectors;
 	struct atomictest_crtc *crtcs;
 	struct atomictest_mode *modes;
+	struct bs_blob_cache *blobs;
+	// Rebuilt in place for every commit from the staged objects' changed properties.
 	drmModeAtomicReqPtr pset;
 	drmEventContext drm_event_ctx;
+	// Properties in the current request and how many it would have without dirty tracking.
+	uint64_t request_props;
+	uint64_t request_full_props;
+	// Indices of the CRTCs the request involves, which are the only ones to send flip events.
+	uint32_t request_crtc_mask;
+	// CRTCs whose flip event for the last commit has yet to arrive.
+	uint32_t pending_flips;
+	uint64_t commits;
+	uint64_t committed_props;
+	uint64_t committed_full_props;
+	// Commits that fast mode only checked with TEST_ONLY and folded into a later commit.
+	uint64_t coalesced_commits;
+	// Committed frames with planes the compositor can't read, so nothing to expect.
+	uint64_t expected_skipped;
+	// Frames test_orientation rotated in software for planes that couldn't rotate themselves.
+	uint64_t software_rotations;
+	uint64_t software_rotated_pixels;
+	int64_t software_rotate_ns;
+	// The CRTC the writeback connector should capture and the one the kernel has it on.
+	uint32_t writeback_crtc_id;
+	uint32_t committed_writeback_crtc_id;
+	struct gbm_bo *capture_bo;
+	uint32_t capture_fb_id;
+	uint64_t captures_matched;
+	uint64_t captures_differed;
+	int64_t capture_compare_ns;
 
 	struct bs_mapper *mapper;
+	// Set while a test runs on several CRTCs at once.
+	struct atomictest_lockstep *lockstep;
+};
+
+/*
+ * Runs a test on several CRTCs at once. Every CRTC's test gets a thread, but only the one holding
+ * the lock runs. commit() hands over to the next thread and the last one to get there commits the
+ * changes of all of them in a single request.
+ */
+struct atomictest_lockstep {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	// Threads still in their test and how many of them wait for the next commit.
+	uint32_t running;
+	uint32_t waiting;
+	uint64_t generation;
+	int result;
 };
 
 typedef int (*test_function)(struct atomictest_context *ctx, struct atomictest_crtc *crtc);
 
+static void page_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
+			      unsigned int tv_usec, unsigned int crtc_id, void *user_data)
+{
+	struct atomictest_context *ctx = user_data;
+	for (uint32_t i = 0; i < ctx->num_crtcs; i++) {
+		struct atomictest_crtc *crtc = &ctx->crtcs[i];
+		if (crtc->crtc_id != crtc_id)
+			continue;
+
+		if (crtc->present_stats)
+			bs_present_stats_flip(crtc->present_stats, sequence, tv_sec, tv_usec);
+		ctx->pending_flips &= ~(1u << i);
+	}
+}
+
 struct atomictest_testcase {
 	const char *name;
 	test_function test_func;
@@ -183,18 +290,20 @@ enum draw_format_type {
 };
 // clang-format on
 
-static int drmModeCreatePropertyBlob64(int fd, const void *data, size_t length, uint64_t *id)
+// Sets a blob property's value to a cached blob with the contents, to be let go with put_blob().
+static int get_blob(struct atomictest_context *ctx, const void *data, size_t length, uint64_t *id)
 {
-	uint32_t ctm_blob_id = 0;
-	int ret = drmModeCreatePropertyBlob(fd, data, length, &ctm_blob_id);
-	*id = ctm_blob_id;
-	return ret;
+	*id = bs_blob_cache_get(ctx->blobs, data, length);
+	return *id ? 0 : -ENOMEM;
 }
 
-static int drmModeDestroyPropertyBlob64(int fd, uint64_t id)
+// Clears the value as well, so a blob that may be gone is never committed again.
+static int put_blob(struct atomictest_context *ctx, uint64_t *id)
 {
-	CHECK(id < (1ull << 32));
-	return drmModeDestroyPropertyBlob(fd, (uint32_t)id);
+	CHECK(*id < (1ull << 32));
+	bs_blob_cache_put(ctx->blobs, (uint32_t)*id);
+	*id = 0;
+	return 0;
 }
 
 static int32_t get_format_idx(struct atomictest_plane *plane, uint32_t format)
@@ -281,132 +390,457 @@ static int draw_to_plane(struct bs_mapper *mapper, struct atomictest_plane *plan
 	return 0;
 }
 
-static int get_prop(int fd, drmModeObjectPropertiesPtr props, const char *name,
-		    struct atomictest_property *bs_prop)
+struct prop_name_entry {
+	uint32_t pid;
+	char name[DRM_PROP_NAME_LEN];
+};
+
+/*
+ * Property names keyed by property id. Property ids are device wide, so each property is fetched
+ * with drmModeGetProperty once no matter how many objects have it.
+ */
+struct prop_name_cache {
+	int fd;
+	size_t capacity;
+	size_t count;
+	struct prop_name_entry *entries;
+	uint64_t ioctls;
+	int64_t ioctl_ns;
+	// The drmModeGetProperty calls a scan of the object's properties per name would have made.
+	uint64_t scan_ioctls;
+};
+
+struct prop_table_entry {
+	char name[DRM_PROP_NAME_LEN];
+	uint32_t pid;
+	uint64_t value;
+	// Position in the object's property list, which decides what a scan by name would cost.
+	uint32_t position;
+};
+
+// An open addressed name to property hash of one object.
+struct prop_table {
+	struct prop_name_cache *cache;
+	size_t count;
+	size_t capacity;
+	struct prop_table_entry *entries;
+};
+
+static uint32_t hash_name(const char *name)
+{
+	return (uint32_t)bs_hash_bytes(BS_HASH_INIT, name, strlen(name));
+}
+
+static uint32_t hash_pid(uint32_t pid)
 {
-	/* Property ID should always be > 0. */
-	bs_prop->pid = 0;
-	drmModePropertyPtr prop;
-	for (uint32_t i = 0; i < props->count_props; i++) {
-		if (bs_prop->pid)
-			break;
+	return pid * 2654435761u;
+}
 
-		prop = drmModeGetProperty(fd, props->props[i]);
-		if (prop) {
-			if (!strcmp(prop->name, name)) {
-				bs_prop->pid = prop->prop_id;
-				bs_prop->value = props->prop_values[i];
-			}
-			drmModeFreeProperty(prop);
+static void prop_name_cache_init(struct prop_name_cache *cache, int fd)
+{
+	memset(cache, 0, sizeof(*cache));
+	cache->fd = fd;
+	cache->capacity = 64;
+	cache->entries = calloc(cache->capacity, sizeof(struct prop_name_entry));
+	assert(cache->entries);
+}
+
+static void prop_name_cache_insert(struct prop_name_cache *cache, uint32_t pid, const char *name)
+{
+	if ((cache->count + 1) * 2 > cache->capacity) {
+		struct prop_name_entry *old_entries = cache->entries;
+		size_t old_capacity = cache->capacity;
+		cache->capacity *= 2;
+		cache->count = 0;
+		cache->entries = calloc(cache->capacity, sizeof(struct prop_name_entry));
+		assert(cache->entries);
+		for (size_t i = 0; i < old_capacity; i++) {
+			if (old_entries[i].pid)
+				prop_name_cache_insert(cache, old_entries[i].pid,
+						       old_entries[i].name);
 		}
+		free(old_entries);
+	}
+
+	size_t mask = cache->capacity - 1;
+	size_t slot = hash_pid(pid) & mask;
+	while (cache->entries[slot].pid)
+		slot = (slot + 1) & mask;
+	cache->entries[slot].pid = pid;
+	snprintf(cache->entries[slot].name, DRM_PROP_NAME_LEN, "%s", name);
+	cache->count++;
+}
+
+// Returns the name of the property or NULL if it could not be fetched.
+static const char *prop_name_cache_get(struct prop_name_cache *cache, uint32_t pid)
+{
+	size_t mask = cache->capacity - 1;
+	for (size_t slot = hash_pid(pid) & mask; cache->entries[slot].pid;
+	     slot = (slot + 1) & mask) {
+		if (cache->entries[slot].pid == pid)
+			return cache->entries[slot].name;
+	}
+
+	int64_t start_ns = bs_debug_gettime_ns();
+	drmModePropertyPtr prop = drmModeGetProperty(cache->fd, pid);
+	cache->ioctl_ns += bs_debug_gettime_ns() - start_ns;
+	cache->ioctls++;
+	if (!prop)
+		return NULL;
+
+	prop_name_cache_insert(cache, pid, prop->name);
+	drmModeFreeProperty(prop);
+	return prop_name_cache_get(cache, pid);
+}
+
+static void prop_name_cache_finish(struct prop_name_cache *cache)
+{
+	free(cache->entries);
+	cache->entries = NULL;
+}
+
+static void prop_table_init(struct prop_table *table, struct prop_name_cache *cache,
+			    drmModeObjectPropertiesPtr props)
+{
+	memset(table, 0, sizeof(*table));
+	table->cache = cache;
+	table->capacity = 16;
+	while (props && table->capacity < props->count_props * 2)
+		table->capacity *= 2;
+	table->entries = calloc(table->capacity, sizeof(struct prop_table_entry));
+	assert(table->entries);
+
+	size_t mask = table->capacity - 1;
+	for (uint32_t i = 0; props && i < props->count_props; i++) {
+		const char *name = prop_name_cache_get(cache, props->props[i]);
+		if (!name)
+			continue;
+
+		size_t slot = hash_name(name) & mask;
+		while (table->entries[slot].pid)
+			slot = (slot + 1) & mask;
+		struct prop_table_entry *entry = &table->entries[slot];
+		snprintf(entry->name, DRM_PROP_NAME_LEN, "%s", name);
+		entry->pid = props->props[i];
+		entry->value = props->prop_values[i];
+		entry->position = i;
+		table->count++;
+	}
+}
+
+static void prop_table_finish(struct prop_table *table)
+{
+	free(table->entries);
+	table->entries = NULL;
+}
+
+static int get_prop(struct prop_table *table, const char *name, struct atomictest_property *bs_prop)
+{
+	/* Property ID should always be > 0. */
+	bs_prop->pid = 0;
+	size_t mask = table->capacity - 1;
+	for (size_t slot = hash_name(name) & mask; table->entries[slot].pid;
+	     slot = (slot + 1) & mask) {
+		struct prop_table_entry *entry = &table->entries[slot];
+		if (strcmp(entry->name, name))
+			continue;
+		bs_prop->pid = entry->pid;
+		bs_prop->value = entry->value;
+		bs_prop->committed_value = entry->value;
+		bs_prop->committed = true;
+		table->cache->scan_ioctls += entry->position + 1;
+		return 0;
 	}
 
-	return (bs_prop->pid == 0) ? -1 : 0;
+	table->cache->scan_ioctls += table->count;
+	return -1;
 }
 
-static int get_connector_props(int fd, struct atomictest_connector *connector,
-			       drmModeObjectPropertiesPtr props)
+static int get_connector_props(struct atomictest_connector *connector, struct prop_table *props)
 {
-	CHECK_RESULT(get_prop(fd, props, "CRTC_ID", &connector->crtc_id));
-	CHECK_RESULT(get_prop(fd, props, "EDID", &connector->edid));
-	CHECK_RESULT(get_prop(fd, props, "DPMS", &connector->dpms));
+	CHECK_RESULT(get_prop(props, "CRTC_ID", &connector->crtc_id));
+	CHECK_RESULT(get_prop(props, "EDID", &connector->edid));
+	CHECK_RESULT(get_prop(props, "DPMS", &connector->dpms));
 	return 0;
 }
 
-static int get_crtc_props(int fd, struct atomictest_crtc *crtc, drmModeObjectPropertiesPtr props)
+static int get_crtc_props(struct atomictest_crtc *crtc, struct prop_table *props)
 {
-	CHECK_RESULT(get_prop(fd, props, "MODE_ID", &crtc->mode_id));
-	CHECK_RESULT(get_prop(fd, props, "ACTIVE", &crtc->active));
-	CHECK_RESULT(get_prop(fd, props, "OUT_FENCE_PTR", &crtc->out_fence_ptr));
+	CHECK_RESULT(get_prop(props, "MODE_ID", &crtc->mode_id));
+	CHECK_RESULT(get_prop(props, "ACTIVE", &crtc->active));
+	CHECK_RESULT(get_prop(props, "OUT_FENCE_PTR", &crtc->out_fence_ptr));
 
 	/*
 	 * The atomic API makes no guarantee a property is present in object. This test
 	 * requires the above common properties since a plane is undefined without them.
 	 * Other properties (i.e: ctm) are optional.
 	 */
-	get_prop(fd, props, "CTM", &crtc->ctm);
-	get_prop(fd, props, "GAMMA_LUT", &crtc->gamma_lut);
-	get_prop(fd, props, "GAMMA_LUT_SIZE", &crtc->gamma_lut_size);
+	get_prop(props, "DEGAMMA_LUT", &crtc->degamma_lut);
+	get_prop(props, "CTM", &crtc->ctm);
+	get_prop(props, "GAMMA_LUT", &crtc->gamma_lut);
+	get_prop(props, "GAMMA_LUT_SIZE", &crtc->gamma_lut_size);
 	return 0;
 }
 
-static int get_plane_props(int fd, struct atomictest_plane *plane, drmModeObjectPropertiesPtr props)
+static int get_plane_props(struct atomictest_plane *plane, struct prop_table *props)
 {
-	CHECK_RESULT(get_prop(fd, props, "CRTC_ID", &plane->crtc_id));
-	CHECK_RESULT(get_prop(fd, props, "FB_ID", &plane->fb_id));
-	CHECK_RESULT(get_prop(fd, props, "CRTC_X", &plane->crtc_x));
-	CHECK_RESULT(get_prop(fd, props, "CRTC_Y", &plane->crtc_y));
-	CHECK_RESULT(get_prop(fd, props, "CRTC_W", &plane->crtc_w));
-	CHECK_RESULT(get_prop(fd, props, "CRTC_H", &plane->crtc_h));
-	CHECK_RESULT(get_prop(fd, props, "SRC_X", &plane->src_x));
-	CHECK_RESULT(get_prop(fd, props, "SRC_Y", &plane->src_y));
-	CHECK_RESULT(get_prop(fd, props, "SRC_W", &plane->src_w));
-	CHECK_RESULT(get_prop(fd, props, "SRC_H", &plane->src_h));
-	CHECK_RESULT(get_prop(fd, props, "type", &plane->type));
-	CHECK_RESULT(get_prop(fd, props, "IN_FENCE_FD", &plane->in_fence_fd));
+	CHECK_RESULT(get_prop(props, "CRTC_ID", &plane->crtc_id));
+	CHECK_RESULT(get_prop(props, "FB_ID", &plane->fb_id));
+	CHECK_RESULT(get_prop(props, "CRTC_X", &plane->crtc_x));
+	CHECK_RESULT(get_prop(props, "CRTC_Y", &plane->crtc_y));
+	CHECK_RESULT(get_prop(props, "CRTC_W", &plane->crtc_w));
+	CHECK_RESULT(get_prop(props, "CRTC_H", &plane->crtc_h));
+	CHECK_RESULT(get_prop(props, "SRC_X", &plane->src_x));
+	CHECK_RESULT(get_prop(props, "SRC_Y", &plane->src_y));
+	CHECK_RESULT(get_prop(props, "SRC_W", &plane->src_w));
+	CHECK_RESULT(get_prop(props, "SRC_H", &plane->src_h));
+	CHECK_RESULT(get_prop(props, "type", &plane->type));
+	CHECK_RESULT(get_prop(props, "IN_FENCE_FD", &plane->in_fence_fd));
 
 	/*
 	 * The atomic API makes no guarantee a property is present in object. This test
 	 * requires the above common properties since a plane is undefined without them.
 	 * Other properties (i.e: rotation and ctm) are optional.
 	 */
-	get_prop(fd, props, "rotation", &plane->rotation);
-	get_prop(fd, props, "PLANE_CTM", &plane->ctm);
+	get_prop(props, "rotation", &plane->rotation);
+	get_prop(props, "PLANE_CTM", &plane->ctm);
+	get_prop(props, "zpos", &plane->zpos);
+	get_prop(props, "alpha", &plane->alpha);
+	get_prop(props, "pixel blend mode", &plane->blend_mode);
 	return 0;
 }
 
-int set_connector_props(struct atomictest_connector *conn, drmModeAtomicReqPtr pset)
+static void stage_connector(struct atomictest_connector *conn)
 {
-	uint32_t id = conn->connector_id;
-	CHECK_RESULT(drmModeAtomicAddProperty(pset, id, conn->crtc_id.pid, conn->crtc_id.value));
-	return 0;
+	conn->staged = true;
+}
+
+static void stage_crtc(struct atomictest_crtc *crtc)
+{
+	crtc->staged = true;
+}
+
+static void stage_plane(struct atomictest_plane *plane)
+{
+	plane->staged = true;
+}
+
+static void unstage_crtc(struct atomictest_crtc *crtc)
+{
+	uint32_t num_planes = crtc->num_primary + crtc->num_cursor + crtc->num_overlay;
+	crtc->staged = false;
+	for (uint32_t i = 0; i < num_planes; i++)
+		crtc->planes[i].staged = false;
+}
+
+static void unstage_all(struct atomictest_context *ctx)
+{
+	for (uint32_t i = 0; i < ctx->num_connectors; i++)
+		ctx->connectors[i].staged = false;
+
+	for (uint32_t i = 0; i < ctx->num_crtcs; i++)
+		unstage_crtc(&ctx->crtcs[i]);
 }
 
-int set_crtc_props(struct atomictest_crtc *crtc, drmModeAtomicReqPtr pset)
+/*
+ * Fills props with the properties that keep their value across commits. OUT_FENCE_PTR and
+ * IN_FENCE_FD only apply to the commit they are part of, so they are handled separately.
+ */
+static uint32_t get_crtc_state_props(struct atomictest_crtc *crtc,
+				     struct atomictest_property **props)
 {
-	uint32_t id = crtc->crtc_id;
-	CHECK_RESULT(drmModeAtomicAddProperty(pset, id, crtc->mode_id.pid, crtc->mode_id.value));
-	CHECK_RESULT(drmModeAtomicAddProperty(pset, id, crtc->active.pid, crtc->active.value));
-	if (crtc->out_fence_ptr.value)
-		CHECK_RESULT(drmModeAtomicAddProperty(pset, id, crtc->out_fence_ptr.pid,
-						      crtc->out_fence_ptr.value));
+	uint32_t count = 0;
+	props[count++] = &crtc->mode_id;
+	props[count++] = &crtc->active;
 	if (crtc->ctm.pid)
-		CHECK_RESULT(drmModeAtomicAddProperty(pset, id, crtc->ctm.pid, crtc->ctm.value));
+		props[count++] = &crtc->ctm;
 	if (crtc->gamma_lut.pid)
-		CHECK_RESULT(
-		    drmModeAtomicAddProperty(pset, id, crtc->gamma_lut.pid, crtc->gamma_lut.value));
-	return 0;
+		props[count++] = &crtc->gamma_lut;
+	return count;
 }
 
-int set_plane_props(struct atomictest_plane *plane, drmModeAtomicReqPtr pset)
+static uint32_t get_plane_state_props(struct atomictest_plane *plane,
+				      struct atomictest_property **props)
 {
-	uint32_t id = plane->drm_plane.plane_id;
-	CHECK_RESULT(drmModeAtomicAddProperty(pset, id, plane->crtc_id.pid, plane->crtc_id.value));
-	CHECK_RESULT(drmModeAtomicAddProperty(pset, id, plane->fb_id.pid, plane->fb_id.value));
-	CHECK_RESULT(drmModeAtomicAddProperty(pset, id, plane->crtc_x.pid, plane->crtc_x.value));
-	CHECK_RESULT(drmModeAtomicAddProperty(pset, id, plane->crtc_y.pid, plane->crtc_y.value));
-	CHECK_RESULT(drmModeAtomicAddProperty(pset, id, plane->crtc_w.pid, plane->crtc_w.value));
-	CHECK_RESULT(drmModeAtomicAddProperty(pset, id, plane->crtc_h.pid, plane->crtc_h.value));
-	CHECK_RESULT(drmModeAtomicAddProperty(pset, id, plane->src_x.pid, plane->src_x.value));
-	CHECK_RESULT(drmModeAtomicAddProperty(pset, id, plane->src_y.pid, plane->src_y.value));
-	CHECK_RESULT(drmModeAtomicAddProperty(pset, id, plane->src_w.pid, plane->src_w.value));
-	CHECK_RESULT(drmModeAtomicAddProperty(pset, id, plane->src_h.pid, plane->src_h.value));
-	CHECK_RESULT(
-	    drmModeAtomicAddProperty(pset, id, plane->in_fence_fd.pid, plane->in_fence_fd.value));
+	uint32_t count = 0;
+	props[count++] = &plane->crtc_id;
+	props[count++] = &plane->fb_id;
+	props[count++] = &plane->crtc_x;
+	props[count++] = &plane->crtc_y;
+	props[count++] = &plane->crtc_w;
+	props[count++] = &plane->crtc_h;
+	props[count++] = &plane->src_x;
+	props[count++] = &plane->src_y;
+	props[count++] = &plane->src_w;
+	props[count++] = &plane->src_h;
 	if (plane->rotation.pid)
-		CHECK_RESULT(
-		    drmModeAtomicAddProperty(pset, id, plane->rotation.pid, plane->rotation.value));
+		props[count++] = &plane->rotation;
 	if (plane->ctm.pid)
-		CHECK_RESULT(drmModeAtomicAddProperty(pset, id, plane->ctm.pid, plane->ctm.value));
+		props[count++] = &plane->ctm;
+	return count;
+}
+
+#define MAX_STATE_PROPS 12
+
+static int add_prop(struct atomictest_context *ctx, uint32_t id, struct atomictest_property *prop,
+		    bool always)
+{
+	ctx->request_full_props++;
+	if (!always && prop->committed && prop->value == prop->committed_value)
+		return 0;
+
+	ctx->request_props++;
+	CHECK_RESULT(
+	    bs_commit_log_add_property(commit_log, ctx->pset, id, prop->pid, prop->value));
+	return 0;
+}
+
+static int add_state_props(struct atomictest_context *ctx, uint32_t id,
+			   struct atomictest_property **props, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; i++)
+		CHECK_RESULT(add_prop(ctx, id, props[i], false));
+	return 0;
+}
+
+// Rebuilds the request from the properties of staged objects that differ from the kernel's.
+static int build_request(struct atomictest_context *ctx)
+{
+	struct atomictest_property *props[MAX_STATE_PROPS];
+	bs_commit_log_set_cursor(commit_log, ctx->pset, 0);
+	ctx->request_props = 0;
+	ctx->request_full_props = 0;
+	ctx->request_crtc_mask = 0;
+
+	for (uint32_t i = 0; i < ctx->num_connectors; i++) {
+		struct atomictest_connector *conn = &ctx->connectors[i];
+		if (conn->staged)
+			CHECK_RESULT(add_prop(ctx, conn->connector_id, &conn->crtc_id, false));
+	}
+
+	if (writeback && ctx->writeback_crtc_id != ctx->committed_writeback_crtc_id) {
+		CHECK_RESULT(bs_writeback_attach(writeback, commit_log, ctx->pset,
+						 ctx->writeback_crtc_id));
+		ctx->request_props++;
+		ctx->request_full_props++;
+		// The CRTC it joins goes through a modeset, and sends a flip event for it.
+		for (uint32_t i = 0; i < ctx->num_crtcs; i++) {
+			if (ctx->crtcs[i].crtc_id == ctx->writeback_crtc_id)
+				ctx->request_crtc_mask |= 1u << i;
+		}
+	}
+
+	for (uint32_t i = 0; i < ctx->num_crtcs; i++) {
+		struct atomictest_crtc *crtc = &ctx->crtcs[i];
+		if (crtc->staged) {
+			uint64_t before = ctx->request_props;
+			uint32_t count = get_crtc_state_props(crtc, props);
+			CHECK_RESULT(add_state_props(ctx, crtc->crtc_id, props, count));
+			if (crtc->out_fence_ptr.value)
+				CHECK_RESULT(
+				    add_prop(ctx, crtc->crtc_id, &crtc->out_fence_ptr, true));
+			if (ctx->request_props != before)
+				ctx->request_crtc_mask |= 1u << i;
+		}
+
+		uint32_t num_planes = crtc->num_primary + crtc->num_cursor + crtc->num_overlay;
+		for (uint32_t j = 0; j < num_planes; j++) {
+			struct atomictest_plane *plane = &crtc->planes[j];
+			if (!plane->staged)
+				continue;
+
+			uint64_t before = ctx->request_props;
+			uint32_t id = plane->drm_plane.plane_id;
+			uint32_t count = get_plane_state_props(plane, props);
+			CHECK_RESULT(add_state_props(ctx, id, props, count));
+			if ((int64_t)plane->in_fence_fd.value >= 0)
+				CHECK_RESULT(add_prop(ctx, id, &plane->in_fence_fd, true));
+
+			// The kernel pulls in the CRTCs a changed plane leaves or joins.
+			bool on_crtc = plane->crtc_id.value || !plane->crtc_id.committed ||
+				       plane->crtc_id.committed_value;
+			if (ctx->request_props != before && on_crtc)
+				ctx->request_crtc_mask |= 1u << i;
+		}
+	}
 
 	return 0;
 }
 
-static int remove_plane_fb(struct atomictest_context *ctx, struct atomictest_plane *plane)
+static void commit_props(struct atomictest_property **props, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; i++) {
+		props[i]->committed_value = props[i]->value;
+		props[i]->committed = true;
+	}
+}
+
+/*
+ * Every CRTC has its own copy of the planes it can use, so a commit through one copy leaves the
+ * others not knowing the kernel's values anymore.
+ */
+static void forget_plane_copies(struct atomictest_context *ctx, struct atomictest_plane *plane)
+{
+	struct atomictest_property *props[MAX_STATE_PROPS];
+	for (uint32_t i = 0; i < ctx->num_crtcs; i++) {
+		struct atomictest_crtc *crtc = &ctx->crtcs[i];
+		uint32_t num_planes = crtc->num_primary + crtc->num_cursor + crtc->num_overlay;
+		for (uint32_t j = 0; j < num_planes; j++) {
+			struct atomictest_plane *copy = &crtc->planes[j];
+			if (copy == plane || copy->drm_plane.plane_id != plane->drm_plane.plane_id)
+				continue;
+
+			uint32_t count = get_plane_state_props(copy, props);
+			for (uint32_t k = 0; k < count; k++)
+				props[k]->committed = false;
+		}
+	}
+}
+
+// Records that the request built from the staged objects was committed.
+static void request_committed(struct atomictest_context *ctx)
+{
+	struct atomictest_property *props[MAX_STATE_PROPS];
+	ctx->commits++;
+	ctx->committed_props += ctx->request_props;
+	ctx->committed_full_props += ctx->request_full_props;
+
+	for (uint32_t i = 0; i < ctx->num_connectors; i++) {
+		struct atomictest_connector *conn = &ctx->connectors[i];
+		if (conn->staged) {
+			conn->crtc_id.committed_value = conn->crtc_id.value;
+			conn->crtc_id.committed = true;
+		}
+		conn->staged = false;
+	}
+	ctx->committed_writeback_crtc_id = ctx->writeback_crtc_id;
+
+	for (uint32_t i = 0; i < ctx->num_crtcs; i++) {
+		struct atomictest_crtc *crtc = &ctx->crtcs[i];
+		if (crtc->staged)
+			commit_props(props, get_crtc_state_props(crtc, props));
+		crtc->staged = false;
+
+		uint32_t num_planes = crtc->num_primary + crtc->num_cursor + crtc->num_overlay;
+		for (uint32_t j = 0; j < num_planes; j++) {
+			struct atomictest_plane *plane = &crtc->planes[j];
+			if (!plane->staged)
+				continue;
+
+			commit_props(props, get_plane_state_props(plane, props));
+			forget_plane_copies(ctx, plane);
+			// The kernel is done with the fence, which the test still owns.
+			plane->in_fence_fd.value = (uint64_t)-1;
+			plane->staged = false;
+		}
+	}
+}
+
+static int remove_plane_fb(struct atomictest_plane *plane)
 {
 	if (plane->bo && plane->fb_id.value) {
-		CHECK_RESULT(drmModeRmFB(ctx->fd, plane->fb_id.value));
-		gbm_bo_destroy(plane->bo);
+		/* The cached framebuffer stays with the buffer object in the pool. */
+		bs_bo_pool_release(bo_pool, plane->bo);
 		plane->bo = NULL;
 		plane->fb_id.value = 0;
 	}
@@ -417,18 +851,34 @@ static int remove_plane_fb(struct atomictest_context *ctx, struct atomictest_pla
 static int add_plane_fb(struct atomictest_context *ctx, struct atomictest_plane *plane)
 {
 	if (plane->format_idx < plane->drm_plane.count_formats) {
-		CHECK_RESULT(remove_plane_fb(ctx, plane));
+		CHECK_RESULT(remove_plane_fb(plane));
 		uint32_t flags = (plane->type.value == DRM_PLANE_TYPE_CURSOR) ? GBM_BO_USE_CURSOR
 									      : GBM_BO_USE_SCANOUT;
 		flags |= GBM_BO_USE_SW_WRITE_RARELY;
-		/* TODO(gsingh): add create with modifiers option. */
-		plane->bo = gbm_bo_create(gbm, plane->crtc_w.value, plane->crtc_h.value,
-					  plane->drm_plane.formats[plane->format_idx], flags);
+		uint32_t format = plane->drm_plane.formats[plane->format_idx];
+		uint64_t modifiers[BS_DRM_MAX_MODIFIERS];
+		size_t modifier_count = 0;
+		if (use_modifiers)
+			modifier_count =
+			    bs_drm_plane_modifiers(ctx->fd, plane->drm_plane.plane_id, format,
+						   modifiers, BS_ARRAY_LEN(modifiers));
+
+		/*
+		 * Every caller redraws the plane after this, so a recycled buffer object's stale
+		 * contents never reach the screen.
+		 */
+		if (modifier_count)
+			plane->bo = bs_bo_pool_acquire_modifiers(bo_pool, plane->crtc_w.value,
+								 plane->crtc_h.value, format, flags,
+								 modifiers, modifier_count);
+		else
+			plane->bo = bs_bo_pool_acquire(bo_pool, plane->crtc_w.value,
+						       plane->crtc_h.value, format, flags);
 
 		CHECK(plane->bo);
-		plane->fb_id.value = bs_drm_fb_create_gbm(plane->bo);
+		plane->fb_id.value = bs_drm_fb_create_gbm_cached(plane->bo);
 		CHECK(plane->fb_id.value);
-		CHECK_RESULT(set_plane_props(plane, ctx->pset));
+		stage_plane(plane);
 	}
 
 	return 0;
@@ -455,6 +905,26 @@ static int init_plane(struct atomictest_context *ctx, struct atomictest_plane *p
 	return 0;
 }
 
+// Returns false only if the plane capabilities rule out scaling src to dst in the format.
+static bool plane_caps_allow(struct atomictest_plane *plane, uint32_t format, uint32_t src_w,
+			     uint32_t src_h, uint32_t dst_w, uint32_t dst_h)
+{
+	if (!plane_caps || !src_w || !src_h)
+		return true;
+
+	// Every probed format has an entry without a modifier, so this plane wasn't probed.
+	uint32_t plane_id = plane->drm_plane.plane_id;
+	if (!bs_plane_caps_find(plane_caps, plane_id, format, DRM_FORMAT_MOD_INVALID))
+		return true;
+
+	uint32_t scale_x = ((uint64_t)dst_w << 16) / src_w;
+	uint32_t scale_y = ((uint64_t)dst_h << 16) / src_h;
+	if (use_modifiers)
+		return bs_plane_caps_supports_any(plane_caps, plane_id, format, scale_x, scale_y);
+	return bs_plane_caps_supports(plane_caps, plane_id, format, DRM_FORMAT_MOD_INVALID,
+				      scale_x, scale_y);
+}
+
 static int init_plane_any_format(struct atomictest_context *ctx, struct atomictest_plane *plane,
 				 uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t crtc_id,
 				 bool yuv)
@@ -462,21 +932,23 @@ static int init_plane_any_format(struct atomictest_context *ctx, struct atomicte
 	if (yuv) {
 		uint32_t i;
 		for (i = 0; i < BS_ARRAY_LEN(yuv_formats); i++)
-			if (!init_plane(ctx, plane, yuv_formats[i], x, y, w, h, crtc_id))
+			if (plane_caps_allow(plane, yuv_formats[i], w, h, w, h) &&
+			    !init_plane(ctx, plane, yuv_formats[i], x, y, w, h, crtc_id))
 				return 0;
 	} else {
 		// XRGB888 works well with our draw code, so try that first.
-		if (!init_plane(ctx, plane, DRM_FORMAT_XRGB8888, x, y, w, h, crtc_id))
+		if (plane_caps_allow(plane, DRM_FORMAT_XRGB8888, w, h, w, h) &&
+		    !init_plane(ctx, plane, DRM_FORMAT_XRGB8888, x, y, w, h, crtc_id))
 			return 0;
 
 		for (uint32_t format_idx = 0; format_idx < plane->drm_plane.count_formats;
 		     format_idx++) {
-			if (!gbm_device_is_format_supported(
-				gbm, plane->drm_plane.formats[format_idx], GBM_BO_USE_SCANOUT))
+			uint32_t format = plane->drm_plane.formats[format_idx];
+			if (!gbm_device_is_format_supported(gbm, format, GBM_BO_USE_SCANOUT) ||
+			    !plane_caps_allow(plane, format, w, h, w, h))
 				continue;
 
-			if (!init_plane(ctx, plane, plane->drm_plane.formats[format_idx], x, y, w,
-					h, crtc_id))
+			if (!init_plane(ctx, plane, format, x, y, w, h, crtc_id))
 				return 0;
 		}
 	}
@@ -496,12 +968,12 @@ static int disable_plane(struct atomictest_context *ctx, struct atomictest_plane
 	plane->crtc_id.value = 0;
 
 	if (plane->rotation.pid)
-		plane->rotation.value = DRM_ROTATE_0;
+		plane->rotation.value = DRM_MODE_ROTATE_0;
 	if (plane->ctm.pid)
 		plane->ctm.value = 0;
 
-	CHECK_RESULT(remove_plane_fb(ctx, plane));
-	CHECK_RESULT(set_plane_props(plane, ctx->pset));
+	CHECK_RESULT(remove_plane_fb(plane));
+	stage_plane(plane);
 	return 0;
 }
 
@@ -512,7 +984,7 @@ static int move_plane(struct atomictest_context *ctx, struct atomictest_crtc *cr
 	    plane->crtc_y.value < (crtc->height - plane->crtc_h.value)) {
 		plane->crtc_x.value += dx;
 		plane->crtc_y.value += dy;
-		CHECK_RESULT(set_plane_props(plane, ctx->pset));
+		stage_plane(plane);
 		return 0;
 	}
 
@@ -526,9 +998,16 @@ static int scale_plane(struct atomictest_context *ctx, struct atomictest_crtc *c
 	int32_t plane_h = (int32_t)plane->crtc_h.value + dh * plane->crtc_h.value;
 	if (plane_w > 0 && plane_h > 0 && (plane->crtc_x.value + plane_w < crtc->width) &&
 	    (plane->crtc_h.value + plane_h < crtc->height)) {
-		plane->crtc_w.value = BS_ALIGN((uint32_t)plane_w, 2);
-		plane->crtc_h.value = BS_ALIGN((uint32_t)plane_h, 2);
-		CHECK_RESULT(set_plane_props(plane, ctx->pset));
+		uint32_t w = BS_ALIGN((uint32_t)plane_w, 2);
+		uint32_t h = BS_ALIGN((uint32_t)plane_h, 2);
+		// Rounding stops tiny planes from shrinking, which loops forever on drivers that
+		// accept them.
+		if (w == plane->crtc_w.value && h == plane->crtc_h.value)
+			return -1;
+
+		plane->crtc_w.value = w;
+		plane->crtc_h.value = h;
+		stage_plane(plane);
 		return 0;
 	}
 
@@ -554,6 +1033,8 @@ static void log(struct atomictest_context *ctx)
 				printf("\t{Plane ID: %u, ", plane->drm_plane.plane_id);
 				printf("Plane format: %c%c%c%c, ", fourcc[0], fourcc[1], fourcc[2],
 				       fourcc[3]);
+				printf("Plane modifier: 0x%016llx, ",
+				       (unsigned long long)gbm_bo_get_format_modifier(plane->bo));
 				printf("Plane type: ");
 				switch (plane->type.value) {
 					case DRM_PLANE_TYPE_OVERLAY:
@@ -577,161 +1058,585 @@ static void log(struct atomictest_context *ctx)
 
 static int test_commit(struct atomictest_context *ctx)
 {
-	return drmModeAtomicCommit(ctx->fd, ctx->pset,
+	CHECK_RESULT(build_request(ctx));
+	return bs_commit_log_commit(commit_log, ctx->fd, ctx->pset,
 				   DRM_MODE_ATOMIC_ALLOW_MODESET | DRM_MODE_ATOMIC_TEST_ONLY, NULL);
 }
 
-static int commit(struct atomictest_context *ctx)
+// Fills in the layer for a plane scanning out on the CRTC, mapping its buffer. Planes without a
+// zpos property stack in the order primary, overlays, cursor.
+static bool plane_to_layer(struct atomictest_context *ctx, struct atomictest_plane *plane,
+			   uint64_t order, struct bs_compositor_layer *layer, void **map_data)
 {
-	int ret;
-	fd_set fds;
-	FD_ZERO(&fds);
-	FD_SET(ctx->fd, &fds);
-
-	log(ctx);
-	ret = drmModeAtomicCommit(ctx->fd, ctx->pset,
-				  DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
-	CHECK_RESULT(ret);
-	do {
-		ret = select(ctx->fd + 1, &fds, NULL, NULL, NULL);
-	} while (ret == -1 && errno == EINTR);
-
-	CHECK_RESULT(ret);
-	if (FD_ISSET(ctx->fd, &fds))
-		drmHandleEvent(ctx->fd, &ctx->drm_event_ctx);
+	layer->format = gbm_bo_get_format(plane->bo);
+	size_t num_bo_planes = gbm_bo_get_num_planes(plane->bo);
+	for (size_t i = 0; i < num_bo_planes && i < BS_ARRAY_LEN(layer->data); i++) {
+		layer->data[i] = bs_mapper_map(ctx->mapper, plane->bo, i, &map_data[i],
+					       &layer->strides[i]);
+		if (!layer->data[i]) {
+			while (i-- > 0)
+				bs_mapper_unmap(ctx->mapper, plane->bo, map_data[i]);
+			return false;
+		}
+	}
 
-	return 0;
+	layer->src_x = plane->src_x.value;
+	layer->src_y = plane->src_y.value;
+	layer->src_w = plane->src_w.value;
+	layer->src_h = plane->src_h.value;
+	layer->crtc_x = (int32_t)plane->crtc_x.value;
+	layer->crtc_y = (int32_t)plane->crtc_y.value;
+	layer->crtc_w = plane->crtc_w.value;
+	layer->crtc_h = plane->crtc_h.value;
+	layer->zpos = plane->zpos.pid ? plane->zpos.value : order;
+	layer->alpha = plane->alpha.pid ? plane->alpha.value : 0xffff;
+	layer->blend_mode = plane->blend_mode.pid ? plane->blend_mode.value
+						  : BS_COMPOSITOR_BLEND_PREMULTIPLIED;
+	// Plane scalers filter at least bilinearly, so that is the closer guess.
+	layer->filter = BS_SCALE_BILINEAR;
+	layer->rotation = plane->rotation.pid ? plane->rotation.value : DRM_MODE_ROTATE_0;
+	return true;
 }
 
-static int test_and_commit(struct atomictest_context *ctx, uint32_t sleep_micro_secs)
+static void unmap_layer(struct atomictest_context *ctx, struct atomictest_plane *plane,
+			void **map_data)
 {
-	sleep_micro_secs = automatic ? 0 : sleep_micro_secs;
-	if (!test_commit(ctx)) {
-		CHECK_RESULT(commit(ctx));
-		usleep(sleep_micro_secs);
-	} else {
-		return TEST_COMMIT_FAIL;
-	}
-
-	return 0;
+	size_t num_bo_planes = gbm_bo_get_num_planes(plane->bo);
+	for (size_t i = 0; i < num_bo_planes && i < 2; i++)
+		bs_mapper_unmap(ctx->mapper, plane->bo, map_data[i]);
 }
 
-static int pageflip_formats(struct atomictest_context *ctx, struct atomictest_crtc *crtc,
-			    struct atomictest_plane *plane)
+// Builds the color pipeline of a DEGAMMA_LUT, CTM and GAMMA_LUT, given as blob ids that may be 0.
+// Returns NULL if a blob can't be read or the CTM has the wrong size.
+static struct bs_color_pipeline *get_color_pipeline(struct atomictest_context *ctx,
+						    uint64_t degamma_id, uint64_t ctm_id,
+						    uint64_t gamma_id)
 {
-	int ret = 0;
-	uint32_t flags;
-	for (uint32_t i = 0; i < plane->drm_plane.count_formats; i++) {
-		flags = (plane->type.value == DRM_PLANE_TYPE_CURSOR) ? GBM_BO_USE_CURSOR
-								     : GBM_BO_USE_SCANOUT;
-		if (!gbm_device_is_format_supported(gbm, plane->drm_plane.formats[i], flags))
-			continue;
-
-		CHECK_RESULT(init_plane(ctx, plane, plane->drm_plane.formats[i], 0, 0, crtc->width,
-					crtc->height, crtc->crtc_id));
-		CHECK_RESULT(draw_to_plane(ctx->mapper, plane, DRAW_ELLIPSE));
-		ret |= test_and_commit(ctx, 1e6);
+	const uint64_t ids[3] = { degamma_id, ctm_id, gamma_id };
+	drmModePropertyBlobPtr blobs[3] = { NULL, NULL, NULL };
+	bool read = true;
+	for (int i = 0; i < 3; i++) {
+		if (ids[i]) {
+			blobs[i] = drmModeGetPropertyBlob(ctx->fd, ids[i]);
+			read &= blobs[i] != NULL;
+		}
+	}
 
-		// disable, but don't commit, since we can't have an active CRTC without any planes.
-		CHECK_RESULT(disable_plane(ctx, plane));
+	struct bs_color_pipeline *pipeline = NULL;
+	if (read && (!blobs[1] || blobs[1]->length == sizeof(struct drm_color_ctm))) {
+		size_t lut_entry = sizeof(struct drm_color_lut);
+		pipeline = bs_color_pipeline_new(
+		    blobs[0] ? blobs[0]->data : NULL, blobs[0] ? blobs[0]->length / lut_entry : 0,
+		    blobs[1] ? blobs[1]->data : NULL, blobs[2] ? blobs[2]->data : NULL,
+		    blobs[2] ? blobs[2]->length / lut_entry : 0);
 	}
 
-	return ret;
+	for (int i = 0; i < 3; i++) {
+		if (blobs[i])
+			drmModeFreePropertyBlob(blobs[i]);
+	}
+	return pipeline;
 }
 
-static uint32_t get_connection(struct atomictest_crtc *crtc, uint32_t crtc_index)
+// PLANE_CTM transforms the plane's pixels before blending, so the layer is pointed at a transformed
+// copy of its buffer. Returns false if the color pipeline can't read the plane's format.
+static bool apply_plane_ctm(struct atomictest_context *ctx, struct atomictest_plane *plane,
+			    struct bs_compositor_layer *layer, uint32_t **colored)
 {
-	uint32_t connector_id = 0;
-	uint32_t crtc_mask = 1u << crtc_index;
-	struct bs_drm_pipe pipe = { 0 };
-	struct bs_drm_pipe_plumber *plumber = bs_drm_pipe_plumber_new();
-	bs_drm_pipe_plumber_crtc_mask(plumber, crtc_mask);
-	if (bs_drm_pipe_plumber_make(plumber, &pipe))
-		connector_id = pipe.connector_id;
+	if (layer->format != DRM_FORMAT_XRGB8888 && layer->format != DRM_FORMAT_ARGB8888)
+		return false;
 
-	bs_drm_pipe_plumber_destroy(&plumber);
-	return connector_id;
+	struct bs_color_pipeline *pipeline = get_color_pipeline(ctx, 0, plane->ctm.value, 0);
+	if (!pipeline)
+		return false;
+
+	uint32_t width = gbm_bo_get_width(plane->bo);
+	uint32_t height = gbm_bo_get_height(plane->bo);
+	*colored = calloc((size_t)width * height, sizeof(uint32_t));
+	assert(*colored);
+	bs_color_pipeline_apply(pipeline, layer->data[0], layer->strides[0], *colored,
+				width * sizeof(uint32_t), width, height);
+	bs_color_pipeline_destroy(&pipeline);
+	layer->data[0] = *colored;
+	layer->strides[0] = width * sizeof(uint32_t);
+	return true;
 }
 
-static int enable_crtc(struct atomictest_context *ctx, struct atomictest_crtc *crtc)
+// The CRTC's DEGAMMA_LUT, CTM and GAMMA_LUT apply to the blended frame. Returns false if a blob
+// can't be read.
+static bool apply_crtc_color(struct atomictest_context *ctx, struct atomictest_crtc *crtc)
 {
-	drmModeAtomicSetCursor(ctx->pset, 0);
+	if (!crtc->degamma_lut.value && !crtc->ctm.value && !crtc->gamma_lut.value)
+		return true;
 
-	for (uint32_t i = 0; i < ctx->num_connectors; i++) {
-		ctx->connectors[i].crtc_id.value = 0;
-		set_connector_props(&ctx->connectors[i], ctx->pset);
-	}
+	struct bs_color_pipeline *pipeline = get_color_pipeline(
+	    ctx, crtc->degamma_lut.value, crtc->ctm.value, crtc->gamma_lut.value);
+	if (!pipeline)
+		return false;
 
-	for (uint32_t i = 0; i < ctx->num_crtcs; i++) {
-		if (&ctx->crtcs[i] == crtc) {
-			uint32_t connector_id = get_connection(crtc, i);
-			CHECK(connector_id);
-			for (uint32_t j = 0; j < ctx->num_connectors; j++) {
-				if (connector_id == ctx->connectors[j].connector_id) {
-					ctx->connectors[j].crtc_id.value = crtc->crtc_id;
-					set_connector_props(&ctx->connectors[j], ctx->pset);
-					break;
-				}
-			}
+	uint32_t stride = crtc->width * sizeof(uint32_t);
+	bs_color_pipeline_apply(pipeline, crtc->expected_frame, stride, crtc->expected_frame,
+				stride, crtc->width, crtc->height);
+	bs_color_pipeline_destroy(&pipeline);
+	return true;
+}
 
-			break;
+// Returns false if the frame has planes the compositor or the color pipeline can't read.
+static bool compose_expected_frame(struct atomictest_context *ctx, struct atomictest_crtc *crtc)
+{
+	uint32_t num_planes = crtc->num_primary + crtc->num_overlay + crtc->num_cursor;
+	struct bs_compositor_layer *layers = calloc(num_planes, sizeof(*layers));
+	struct atomictest_plane **planes = calloc(num_planes, sizeof(*planes));
+	void **map_data = calloc(2 * num_planes, sizeof(*map_data));
+	// Copies of the planes that have a PLANE_CTM, transformed by it.
+	uint32_t **colored = calloc(num_planes, sizeof(*colored));
+	assert(layers && planes && map_data && colored);
+
+	const struct {
+		uint64_t type;
+		uint32_t count;
+	} stacking[] = {
+		{ DRM_PLANE_TYPE_PRIMARY, crtc->num_primary },
+		{ DRM_PLANE_TYPE_OVERLAY, crtc->num_overlay },
+		{ DRM_PLANE_TYPE_CURSOR, crtc->num_cursor },
+	};
+	uint32_t count = 0;
+	uint64_t order = 0;
+	bool mapped = true;
+	for (uint32_t t = 0; t < BS_ARRAY_LEN(stacking) && mapped; t++) {
+		for (uint32_t i = 0; i < stacking[t].count && mapped; i++) {
+			struct atomictest_plane *plane = get_plane(crtc, i, stacking[t].type);
+			order++;
+			if (plane->crtc_id.value != crtc->crtc_id || !plane->fb_id.value ||
+			    !plane->bo)
+				continue;
+			mapped = plane_to_layer(ctx, plane, order, &layers[count],
+						&map_data[2 * count]);
+			if (mapped)
+				planes[count++] = plane;
+			if (mapped && plane->ctm.value)
+				mapped = apply_plane_ctm(ctx, plane, &layers[count - 1],
+							 &colored[count - 1]);
 		}
 	}
 
-	int ret = -EINVAL;
-	int cursor = drmModeAtomicGetCursor(ctx->pset);
-
-	for (uint32_t i = 0; i < ctx->num_modes; i++) {
-		struct atomictest_mode *mode = &ctx->modes[i];
-		drmModeAtomicSetCursor(ctx->pset, cursor);
-
-		crtc->mode_id.value = mode->id;
-		crtc->active.value = 1;
-		crtc->width = mode->width;
-		crtc->height = mode->height;
-
-		set_crtc_props(crtc, ctx->pset);
-		ret = drmModeAtomicCommit(ctx->fd, ctx->pset,
-					  DRM_MODE_ATOMIC_TEST_ONLY | DRM_MODE_ATOMIC_ALLOW_MODESET,
-					  NULL);
-		if (!ret)
-			return 0;
+	size_t frame_size = (size_t)crtc->width * crtc->height;
+	if (frame_size > crtc->expected_frame_size) {
+		free(crtc->expected_frame);
+		crtc->expected_frame = calloc(frame_size, sizeof(uint32_t));
+		assert(crtc->expected_frame);
+		crtc->expected_frame_size = frame_size;
 	}
 
-	bs_debug_error("[CRTC:%d]: failed to find mode", crtc->crtc_id);
-	return ret;
+	bool composed = mapped &&
+			bs_compositor_compose(compositor, layers, count, crtc->expected_frame,
+					      crtc->width * sizeof(uint32_t), crtc->width,
+					      crtc->height) &&
+			apply_crtc_color(ctx, crtc);
+	if (!composed)
+		ctx->expected_skipped++;
+
+	for (uint32_t i = 0; i < count; i++) {
+		unmap_layer(ctx, planes[i], &map_data[2 * i]);
+		free(colored[i]);
+	}
+	free(colored);
+	free(map_data);
+	free(planes);
+	free(layers);
+	return composed;
 }
 
-static int disable_crtc(struct atomictest_context *ctx, struct atomictest_crtc *crtc)
+// Adds capturing the frame of the CRTC the writeback connector is on to the request, if the
+// request involves it. Returns the CRTC or NULL.
+static struct atomictest_crtc *queue_capture(struct atomictest_context *ctx)
 {
-	for (uint32_t i = 0; i < ctx->num_connectors; i++) {
-		ctx->connectors[i].crtc_id.value = 0;
-		set_connector_props(&ctx->connectors[i], ctx->pset);
+	struct atomictest_crtc *crtc = NULL;
+	for (uint32_t i = 0; i < ctx->num_crtcs && ctx->writeback_crtc_id; i++) {
+		if (ctx->crtcs[i].crtc_id == ctx->writeback_crtc_id &&
+		    (ctx->request_crtc_mask & (1u << i)) && ctx->crtcs[i].active.value)
+			crtc = &ctx->crtcs[i];
 	}
+	if (!crtc)
+		return NULL;
 
-	crtc->mode_id.value = 0;
-	crtc->active.value = 0;
-	if (crtc->ctm.pid)
-		crtc->ctm.value = 0;
-	if (crtc->gamma_lut.pid)
-		crtc->gamma_lut.value = 0;
+	if (ctx->capture_bo && (gbm_bo_get_width(ctx->capture_bo) != crtc->width ||
+				gbm_bo_get_height(ctx->capture_bo) != crtc->height)) {
+		bs_bo_pool_release(bo_pool, ctx->capture_bo);
+		ctx->capture_bo = NULL;
+	}
+	if (!ctx->capture_bo) {
+		ctx->capture_bo =
+		    bs_bo_pool_acquire(bo_pool, crtc->width, crtc->height, DRM_FORMAT_XRGB8888,
+				       GBM_BO_USE_LINEAR | GBM_BO_USE_SW_READ_OFTEN);
+		if (!ctx->capture_bo)
+			return NULL;
+		ctx->capture_fb_id = bs_drm_fb_create_gbm_cached(ctx->capture_bo);
+		if (!ctx->capture_fb_id) {
+			bs_bo_pool_release(bo_pool, ctx->capture_bo);
+			ctx->capture_bo = NULL;
+			return NULL;
+		}
+	}
 
-	set_crtc_props(crtc, ctx->pset);
-	int ret = drmModeAtomicCommit(ctx->fd, ctx->pset, DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
-	CHECK_RESULT(ret);
-	return ret;
+	if (bs_writeback_queue(writeback, commit_log, ctx->pset, ctx->capture_fb_id) < 0)
+		return NULL;
+	return crtc;
 }
 
-static struct atomictest_context *new_context(uint32_t num_connectors, uint32_t num_crtcs,
-					      uint32_t num_planes)
+// Compares the captured frame with the expected one. Compositors and display blocks round
+// differently, so channels may be off by a little.
+static void compare_capture(struct atomictest_context *ctx, struct atomictest_crtc *crtc)
 {
-	struct atomictest_context *ctx = calloc(1, sizeof(*ctx));
+	int ret = bs_writeback_wait(writeback, 1000);
+	if (ret) {
+		bs_debug_warning("[CRTC:%d]: writeback capture failed: %d", crtc->crtc_id, ret);
+		return;
+	}
 
-	ctx->mapper = bs_mapper_gem_new();
-	if (ctx->mapper == NULL) {
-		bs_debug_error("failed to create mapper object");
-		free(ctx);
-		return NULL;
+	int64_t start_ns = bs_debug_gettime_ns();
+	void *map_data;
+	uint32_t stride;
+	void *capture = bs_mapper_map(ctx->mapper, ctx->capture_bo, 0, &map_data, &stride);
+	if (!capture)
+		return;
+
+	struct bs_image_diff diff;
+	if (bs_image_compare(capture, stride, crtc->expected_frame, crtc->width * sizeof(uint32_t),
+			     crtc->width, crtc->height, 2, &diff)) {
+		ctx->captures_matched++;
+	} else {
+		if (!ctx->captures_differed)
+			bs_debug_warning("[CRTC:%d]: captured frame differs from the expected one "
+					 "in %llu pixels, first at %u,%u, by up to %u",
+					 crtc->crtc_id, (unsigned long long)diff.pixels,
+					 diff.first_x, diff.first_y, diff.max_channel_diff);
+		ctx->captures_differed++;
+		crtc->captures_differed++;
+	}
+	bs_mapper_unmap(ctx->mapper, ctx->capture_bo, map_data);
+	ctx->capture_compare_ns += bs_debug_gettime_ns() - start_ns;
+}
+
+// Commits the staged changes and waits for every CRTC they involve to flip.
+static int commit_request(struct atomictest_context *ctx)
+{
+	int ret;
+	log(ctx);
+	CHECK_RESULT(build_request(ctx));
+	if (!ctx->request_props) {
+		request_committed(ctx);
+		return 0;
+	}
+
+	// Only CRTCs send flip events.
+	uint32_t crtc_mask = ctx->request_crtc_mask;
+	if (!crtc_mask) {
+		ret = bs_commit_log_commit(commit_log, ctx->fd, ctx->pset,
+					  DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+		CHECK_RESULT(ret);
+		request_committed(ctx);
+		return 0;
+	}
+
+	struct atomictest_crtc *capture_crtc = writeback ? queue_capture(ctx) : NULL;
+	int64_t start_ns = bs_debug_gettime_ns();
+	ctx->pending_flips = crtc_mask;
+	ret = bs_commit_log_commit(commit_log, ctx->fd, ctx->pset,
+				  DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_ALLOW_MODESET, ctx);
+	CHECK_RESULT(ret);
+	request_committed(ctx);
+
+	// Only commits that went through get a flip to pair with. Blocking commits can return after
+	// their flip, so they are timed from when they started.
+	for (uint32_t i = 0; i < ctx->num_crtcs; i++) {
+		if ((crtc_mask & (1u << i)) && ctx->crtcs[i].present_stats)
+			bs_present_stats_submit_at(ctx->crtcs[i].present_stats, start_ns);
+	}
+	while (ctx->pending_flips) {
+		fd_set fds;
+		FD_ZERO(&fds);
+		FD_SET(ctx->fd, &fds);
+		ret = select(ctx->fd + 1, &fds, NULL, NULL, NULL);
+		if (ret == -1 && errno == EINTR)
+			continue;
+
+		CHECK_RESULT(ret);
+		drmHandleEvent(ctx->fd, &ctx->drm_event_ctx);
+	}
+
+	int64_t commit_ns = bs_debug_gettime_ns() - start_ns;
+	for (uint32_t i = 0; i < ctx->num_crtcs; i++) {
+		if (!(crtc_mask & (1u << i)))
+			continue;
+
+		ctx->crtcs[i].commits++;
+		ctx->crtcs[i].commit_ns += commit_ns;
+		if (crtc_mask & (crtc_mask - 1))
+			ctx->crtcs[i].shared_commits++;
+		if (compositor && compose_expected_frame(ctx, &ctx->crtcs[i]) &&
+		    capture_crtc == &ctx->crtcs[i])
+			compare_capture(ctx, capture_crtc);
+	}
+
+	return 0;
+}
+
+static void lockstep_flush(struct atomictest_context *ctx)
+{
+	struct atomictest_lockstep *lockstep = ctx->lockstep;
+	lockstep->result = commit_request(ctx);
+	lockstep->waiting = 0;
+	lockstep->generation++;
+	pthread_cond_broadcast(&lockstep->cond);
+}
+
+static int commit(struct atomictest_context *ctx)
+{
+	struct atomictest_lockstep *lockstep = ctx->lockstep;
+	if (!lockstep)
+		return commit_request(ctx);
+
+	uint64_t generation = lockstep->generation;
+	if (++lockstep->waiting == lockstep->running) {
+		lockstep_flush(ctx);
+		return lockstep->result;
+	}
+
+	while (generation == lockstep->generation)
+		pthread_cond_wait(&lockstep->cond, &lockstep->lock);
+	return lockstep->result;
+}
+
+// Like coalesce_commit() for a request test_commit() already accepted, which in fast mode is all
+// there is left to do.
+static int coalesce_tested_commit(struct atomictest_context *ctx)
+{
+	if (!fast)
+		return commit(ctx);
+
+	ctx->coalesced_commits++;
+	return 0;
+}
+
+// In fast mode the request is only checked and stays staged, so its changes go out with the next
+// real commit.
+static int coalesce_commit(struct atomictest_context *ctx)
+{
+	if (fast)
+		CHECK_RESULT(test_commit(ctx));
+	return coalesce_tested_commit(ctx);
+}
+
+// Keeps a committed frame on screen for whoever is watching. Commits already wait for their flip.
+static void hold_frame(uint32_t micro_secs)
+{
+	if (!automatic)
+		usleep(micro_secs);
+}
+
+static int test_and_commit(struct atomictest_context *ctx, uint32_t sleep_micro_secs)
+{
+	if (!test_commit(ctx)) {
+		CHECK_RESULT(commit(ctx));
+		hold_frame(sleep_micro_secs);
+	} else {
+		return TEST_COMMIT_FAIL;
+	}
+
+	return 0;
+}
+
+static int pageflip_formats(struct atomictest_context *ctx, struct atomictest_crtc *crtc,
+			    struct atomictest_plane *plane)
+{
+	int ret = 0;
+	uint32_t flags;
+	for (uint32_t i = 0; i < plane->drm_plane.count_formats; i++) {
+		flags = (plane->type.value == DRM_PLANE_TYPE_CURSOR) ? GBM_BO_USE_CURSOR
+								     : GBM_BO_USE_SCANOUT;
+		if (!gbm_device_is_format_supported(gbm, plane->drm_plane.formats[i], flags))
+			continue;
+
+		CHECK_RESULT(init_plane(ctx, plane, plane->drm_plane.formats[i], 0, 0, crtc->width,
+					crtc->height, crtc->crtc_id));
+		CHECK_RESULT(draw_to_plane(ctx->mapper, plane, DRAW_ELLIPSE));
+		ret |= test_and_commit(ctx, 1e6);
+
+		// disable, but don't commit, since we can't have an active CRTC without any planes.
+		CHECK_RESULT(disable_plane(ctx, plane));
+	}
+
+	return ret;
+}
+
+// Fills connector_ids, by CRTC index, with connectors that the CRTCs in crtc_mask can all drive at
+// the same time.
+static bool get_connections(struct atomictest_context *ctx, uint32_t crtc_mask,
+			    uint32_t *connector_ids)
+{
+	size_t pipe_count = 0;
+	for (uint32_t i = 0; i < ctx->num_crtcs; i++)
+		pipe_count += !!(crtc_mask & (1u << i));
+
+	struct bs_drm_pipe *pipes = calloc(pipe_count, sizeof(*pipes));
+	struct bs_drm_pipe_plumber *plumber = bs_drm_pipe_plumber_new();
+	bs_drm_pipe_plumber_snapshot(plumber, ctx->snapshot);
+	bs_drm_pipe_plumber_crtc_mask(plumber, crtc_mask);
+	bool made = bs_drm_pipe_plumber_make_many(plumber, pipes, pipe_count, NULL);
+	for (size_t i = 0; made && i < pipe_count; i++) {
+		int crtc_index = bs_kms_snapshot_find_crtc_index(ctx->snapshot, pipes[i].crtc_id);
+		connector_ids[crtc_index] = pipes[i].connector_id;
+	}
+
+	bs_drm_pipe_plumber_destroy(&plumber);
+	free(pipes);
+	return made;
+}
+
+// Returns the index of the mode in the context's modes, creating its blob if needed, or -1.
+static int get_mode(struct atomictest_context *ctx, const drmModeModeInfo *info)
+{
+	for (uint32_t i = 0; i < ctx->num_modes; i++) {
+		if (!memcmp(&ctx->modes[i].info, info, sizeof(*info)))
+			return i;
+	}
+
+	uint32_t blob_id = bs_blob_cache_get(ctx->blobs, info, sizeof(*info));
+	if (!blob_id)
+		return -1;
+
+	ctx->modes = realloc(ctx->modes, (ctx->num_modes + 1) * sizeof(*ctx->modes));
+	assert(ctx->modes);
+	struct atomictest_mode *mode = &ctx->modes[ctx->num_modes];
+	mode->info = *info;
+	mode->id = blob_id;
+	mode->width = info->hdisplay;
+	mode->height = info->vdisplay;
+	return ctx->num_modes++;
+}
+
+static void set_crtc_mode(struct atomictest_crtc *crtc, const struct atomictest_mode *mode)
+{
+	crtc->mode_id.value = mode->id;
+	crtc->active.value = 1;
+	crtc->width = mode->width;
+	crtc->height = mode->height;
+}
+
+// Connects the CRTC in a mode that passes a test commit together with whatever else is staged.
+static int enable_crtc(struct atomictest_context *ctx, struct atomictest_crtc *crtc,
+		       uint32_t connector_id)
+{
+	drmModeConnector *connector = NULL;
+	for (uint32_t j = 0; j < ctx->num_connectors; j++) {
+		if (connector_id == ctx->connectors[j].connector_id) {
+			ctx->connectors[j].crtc_id.value = crtc->crtc_id;
+			stage_connector(&ctx->connectors[j]);
+			connector = bs_kms_snapshot_connector(ctx->snapshot, j);
+			break;
+		}
+	}
+
+	// The mode that passed for this pair before needs no probing.
+	if (connector_id && crtc->validated_connector_id == connector_id) {
+		set_crtc_mode(crtc, &ctx->modes[crtc->validated_mode]);
+		stage_crtc(crtc);
+		return 0;
+	}
+
+	int ret = -EINVAL;
+	for (uint32_t i = 0; connector && i < connector->count_modes; i++) {
+		int mode_index = get_mode(ctx, &connector->modes[i]);
+		if (mode_index < 0)
+			continue;
+
+		set_crtc_mode(crtc, &ctx->modes[mode_index]);
+		stage_crtc(crtc);
+		ret = test_commit(ctx);
+		if (!ret) {
+			crtc->validated_connector_id = connector_id;
+			crtc->validated_mode = mode_index;
+			return 0;
+		}
+	}
+
+	bs_debug_error("[CRTC:%d]: failed to find mode", crtc->crtc_id);
+	return ret;
+}
+
+static int enable_crtcs(struct atomictest_context *ctx, uint32_t crtc_mask)
+{
+	unstage_all(ctx);
+
+	for (uint32_t i = 0; i < ctx->num_connectors; i++) {
+		ctx->connectors[i].crtc_id.value = 0;
+		stage_connector(&ctx->connectors[i]);
+	}
+
+	uint32_t *connector_ids = calloc(ctx->num_crtcs, sizeof(uint32_t));
+	int ret = get_connections(ctx, crtc_mask, connector_ids) ? 0 : -1;
+	if (ret)
+		bs_debug_error("failed to find connectors for CRTC mask 0x%x", crtc_mask);
+
+	for (uint32_t i = 0; !ret && i < ctx->num_crtcs; i++) {
+		if (crtc_mask & (1u << i))
+			ret = enable_crtc(ctx, &ctx->crtcs[i], connector_ids[i]);
+	}
+
+	// The writeback connector captures the first of the CRTCs it can be on.
+	ctx->writeback_crtc_id = 0;
+	uint32_t writeback_mask = 0;
+	if (writeback)
+		writeback_mask = crtc_mask & bs_writeback_possible_crtcs(writeback);
+	if (writeback_mask)
+		ctx->writeback_crtc_id = ctx->crtcs[__builtin_ctz(writeback_mask)].crtc_id;
+
+	free(connector_ids);
+	return ret;
+}
+
+static int disable_crtcs(struct atomictest_context *ctx, uint32_t crtc_mask)
+{
+	for (uint32_t i = 0; i < ctx->num_connectors; i++) {
+		ctx->connectors[i].crtc_id.value = 0;
+		stage_connector(&ctx->connectors[i]);
+	}
+
+	for (uint32_t i = 0; i < ctx->num_crtcs; i++) {
+		struct atomictest_crtc *crtc = &ctx->crtcs[i];
+		if (!(crtc_mask & (1u << i)))
+			continue;
+
+		crtc->mode_id.value = 0;
+		crtc->active.value = 0;
+		if (crtc->crtc_id == ctx->writeback_crtc_id)
+			ctx->writeback_crtc_id = 0;
+		if (crtc->ctm.pid)
+			crtc->ctm.value = 0;
+		if (crtc->gamma_lut.pid)
+			crtc->gamma_lut.value = 0;
+		stage_crtc(crtc);
+	}
+
+	CHECK_RESULT(build_request(ctx));
+	int ret = bs_commit_log_commit(commit_log, ctx->fd, ctx->pset,
+				      DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+	CHECK_RESULT(ret);
+	request_committed(ctx);
+	return ret;
+}
+
+static struct atomictest_context *new_context(uint32_t num_connectors, uint32_t num_crtcs,
+					      uint32_t num_planes)
+{
+	struct atomictest_context *ctx = calloc(1, sizeof(*ctx));
+
+	ctx->mapper = bs_mapper_gem_new();
+	if (ctx->mapper == NULL) {
+		bs_debug_error("failed to create mapper object");
+		free(ctx);
+		return NULL;
 	}
 
 	ctx->connectors = calloc(num_connectors, sizeof(*ctx->connectors));
@@ -749,7 +1654,7 @@ static struct atomictest_context *new_context(uint32_t num_connectors, uint32_t
 	ctx->modes = NULL;
 	ctx->pset = drmModeAtomicAlloc();
 	ctx->drm_event_ctx.version = DRM_EVENT_CONTEXT_VERSION;
-	ctx->drm_event_ctx.page_flip_handler = page_flip_handler;
+	ctx->drm_event_ctx.page_flip_handler2 = page_flip_handler;
 
 	return ctx;
 }
@@ -758,10 +1663,10 @@ static void free_context(struct atomictest_context *ctx)
 {
 	for (uint32_t i = 0; i < ctx->num_crtcs; i++) {
 		uint32_t num_planes = ctx->crtcs[i].num_primary + ctx->crtcs[i].num_cursor +
-				      ctx->crtcs[i].num_overlay;
+				      ctx->crtcs[i].num_overlay + ctx->crtcs[i].num_lent;
 
 		for (uint32_t j = 0; j < num_planes; j++) {
-			remove_plane_fb(ctx, &ctx->crtcs[i].planes[j]);
+			remove_plane_fb(&ctx->crtcs[i].planes[j]);
 			free(ctx->crtcs[i].planes[j].drm_plane.formats);
 		}
 
@@ -769,9 +1674,16 @@ static void free_context(struct atomictest_context *ctx)
 		free(ctx->crtcs[i].overlay_idx);
 		free(ctx->crtcs[i].cursor_idx);
 		free(ctx->crtcs[i].primary_idx);
+		if (ctx->crtcs[i].present_stats)
+			bs_present_stats_destroy(&ctx->crtcs[i].present_stats);
+		free(ctx->crtcs[i].expected_frame);
 	}
 
+	if (ctx->capture_bo)
+		bs_bo_pool_release(bo_pool, ctx->capture_bo);
 	drmModeAtomicFree(ctx->pset);
+	if (ctx->blobs)
+		bs_blob_cache_destroy(&ctx->blobs);
 	free(ctx->modes);
 	free(ctx->crtcs);
 	free(ctx->connectors);
@@ -779,52 +1691,39 @@ static void free_context(struct atomictest_context *ctx)
 	free(ctx);
 }
 
-static struct atomictest_context *query_kms(int fd)
+static struct atomictest_context *query_kms(struct bs_kms_snapshot *snapshot)
 {
-	drmModeRes *res = drmModeGetResources(fd);
-	if (res == NULL) {
-		bs_debug_error("failed to get drm resources");
-		return false;
-	}
-
-	drmModePlaneRes *plane_res = drmModeGetPlaneResources(fd);
-	if (plane_res == NULL) {
+	int fd = bs_kms_snapshot_fd(snapshot);
+	drmModeRes *res = bs_kms_snapshot_resources(snapshot);
+	size_t plane_count = bs_kms_snapshot_plane_count(snapshot);
+	if (plane_count == 0) {
 		bs_debug_error("failed to get plane resources");
-		drmModeFreeResources(res);
 		return NULL;
 	}
 
 	struct atomictest_context *ctx =
-	    new_context(res->count_connectors, res->count_crtcs, plane_res->count_planes);
+	    new_context(res->count_connectors, res->count_crtcs, plane_count);
 	if (ctx == NULL) {
 		bs_debug_error("failed to allocate atomic context");
-		drmModeFreePlaneResources(plane_res);
-		drmModeFreeResources(res);
 		return NULL;
 	}
 
 	ctx->fd = fd;
+	ctx->snapshot = snapshot;
+	ctx->blobs = bs_blob_cache_new(fd, BLOB_CACHE_CAPACITY);
 	drmModeObjectPropertiesPtr props = NULL;
+	struct prop_name_cache prop_cache;
+	prop_name_cache_init(&prop_cache, fd);
+	struct prop_table prop_table;
 
 	for (uint32_t conn_index = 0; conn_index < res->count_connectors; conn_index++) {
 		uint32_t conn_id = res->connectors[conn_index];
 		ctx->connectors[conn_index].connector_id = conn_id;
 		props = drmModeObjectGetProperties(fd, conn_id, DRM_MODE_OBJECT_CONNECTOR);
-		get_connector_props(fd, &ctx->connectors[conn_index], props);
-
-		drmModeConnector *connector = drmModeGetConnector(fd, conn_id);
-		for (uint32_t mode_index = 0; mode_index < connector->count_modes; mode_index++) {
-			ctx->modes =
-			    realloc(ctx->modes, (ctx->num_modes + 1) * sizeof(*ctx->modes));
-			drmModeCreatePropertyBlob(fd, &connector->modes[mode_index],
-						  sizeof(drmModeModeInfo),
-						  &ctx->modes[ctx->num_modes].id);
-			ctx->modes[ctx->num_modes].width = connector->modes[mode_index].hdisplay;
-			ctx->modes[ctx->num_modes].height = connector->modes[mode_index].vdisplay;
-			ctx->num_modes++;
-		}
+		prop_table_init(&prop_table, &prop_cache, props);
+		get_connector_props(&ctx->connectors[conn_index], &prop_table);
+		prop_table_finish(&prop_table);
 
-		drmModeFreeConnector(connector);
 		drmModeFreeObjectProperties(props);
 		props = NULL;
 	}
@@ -834,7 +1733,9 @@ static struct atomictest_context *query_kms(int fd)
 		ctx->crtcs[crtc_index].crtc_id = res->crtcs[crtc_index];
 		props =
 		    drmModeObjectGetProperties(fd, res->crtcs[crtc_index], DRM_MODE_OBJECT_CRTC);
-		get_crtc_props(fd, &ctx->crtcs[crtc_index], props);
+		prop_table_init(&prop_table, &prop_cache, props);
+		get_crtc_props(&ctx->crtcs[crtc_index], &prop_table);
+		prop_table_finish(&prop_table);
 
 		drmModeFreeObjectProperties(props);
 		props = NULL;
@@ -842,17 +1743,18 @@ static struct atomictest_context *query_kms(int fd)
 
 	uint32_t overlay_idx, primary_idx, cursor_idx, idx;
 
-	for (uint32_t plane_index = 0; plane_index < plane_res->count_planes; plane_index++) {
-		drmModePlane *plane = drmModeGetPlane(fd, plane_res->planes[plane_index]);
+	for (uint32_t plane_index = 0; plane_index < plane_count; plane_index++) {
+		drmModePlane *plane = bs_kms_snapshot_plane(snapshot, plane_index);
 		if (plane == NULL) {
-			bs_debug_error("failed to get plane id %u", plane_res->planes[plane_index]);
+			bs_debug_error("failed to get plane index %u", plane_index);
 			continue;
 		}
 
 		uint32_t crtc_mask = 0;
 
-		drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(
-		    fd, plane_res->planes[plane_index], DRM_MODE_OBJECT_PLANE);
+		drmModeObjectPropertiesPtr props =
+		    drmModeObjectGetProperties(fd, plane->plane_id, DRM_MODE_OBJECT_PLANE);
+		prop_table_init(&prop_table, &prop_cache, props);
 
 		for (crtc_index = 0; crtc_index < res->count_crtcs; crtc_index++) {
 			crtc_mask = (1 << crtc_index);
@@ -863,7 +1765,7 @@ static struct atomictest_context *query_kms(int fd)
 				overlay_idx = crtc->num_overlay;
 				idx = cursor_idx + primary_idx + overlay_idx;
 				copy_drm_plane(&crtc->planes[idx].drm_plane, plane);
-				get_plane_props(fd, &crtc->planes[idx], props);
+				get_plane_props(&crtc->planes[idx], &prop_table);
 				switch (crtc->planes[idx].type.value) {
 					case DRM_PLANE_TYPE_OVERLAY:
 						crtc->overlay_idx[overlay_idx] = idx;
@@ -879,6 +1781,8 @@ static struct atomictest_context *query_kms(int fd)
 						break;
 					default:
 						bs_debug_error("invalid plane type returned");
+						prop_table_finish(&prop_table);
+						prop_name_cache_finish(&prop_cache);
 						return NULL;
 				}
 
@@ -891,13 +1795,21 @@ static struct atomictest_context *query_kms(int fd)
 			}
 		}
 
-		drmModeFreePlane(plane);
+		prop_table_finish(&prop_table);
 		drmModeFreeObjectProperties(props);
 		props = NULL;
 	}
 
-	drmModeFreePlaneResources(plane_res);
-	drmModeFreeResources(res);
+	// Scans by name would have cost as much per property as the fetches did on average.
+	int64_t saved_ns = 0;
+	if (prop_cache.ioctls)
+		saved_ns = prop_cache.ioctl_ns / (int64_t)prop_cache.ioctls *
+			   (int64_t)(prop_cache.scan_ioctls - prop_cache.ioctls);
+	printf("Property lookup: %llu drmModeGetProperty calls instead of %llu, %.3f ms saved\n",
+	       (unsigned long long)prop_cache.ioctls, (unsigned long long)prop_cache.scan_ioctls,
+	       saved_ns / 1000000.0);
+	prop_name_cache_finish(&prop_cache);
+
 	return ctx;
 }
 
@@ -982,56 +1894,178 @@ static int test_video_overlay(struct atomictest_context *ctx, struct atomictest_
 	return ret;
 }
 
-static int test_orientation(struct atomictest_context *ctx, struct atomictest_crtc *crtc)
+// Bytes per pixel of the single plane formats test_orientation can rotate in software, or 0.
+static uint32_t packed_format_cpp(uint32_t format)
 {
-	int ret = 0;
-	struct atomictest_plane *primary, *overlay;
-	for (uint32_t i = 0; i < crtc->num_overlay; i++) {
-		overlay = get_plane(crtc, i, DRM_PLANE_TYPE_OVERLAY);
-		if (!overlay->rotation.pid)
-			continue;
-
-		CHECK_RESULT(init_plane_any_format(ctx, overlay, 0, 0, crtc->width, crtc->height,
-						   crtc->crtc_id, false));
-		overlay->rotation.value = DRM_ROTATE_0;
-		set_plane_props(overlay, ctx->pset);
-		CHECK_RESULT(draw_to_plane(ctx->mapper, overlay, DRAW_LINES));
-		ret |= test_and_commit(ctx, 1e6);
+	switch (format) {
+		case DRM_FORMAT_XRGB8888:
+		case DRM_FORMAT_ARGB8888:
+		case DRM_FORMAT_XBGR8888:
+		case DRM_FORMAT_ABGR8888:
+		case DRM_FORMAT_XRGB2101010:
+			return 4;
+		case DRM_FORMAT_RGB565:
+			return 2;
+		default:
+			return 0;
+	}
+}
 
-		overlay->rotation.value = DRM_REFLECT_Y;
-		set_plane_props(overlay, ctx->pset);
-		ret |= test_and_commit(ctx, 1e6);
+// Writes the pattern to the plane's framebuffer, rotated unless rotation is DRM_MODE_ROTATE_0.
+static int write_orientation(struct atomictest_context *ctx, struct atomictest_plane *plane,
+			     const uint8_t *pattern, uint32_t cpp, uint32_t width, uint32_t height,
+			     uint32_t rotation)
+{
+	void *map_data;
+	uint32_t stride;
+	uint8_t *addr = bs_mapper_map(ctx->mapper, plane->bo, 0, &map_data, &stride);
+	CHECK(addr);
+	if (rotation == DRM_MODE_ROTATE_0) {
+		memcpy(addr, pattern, (size_t)stride * gbm_bo_get_height(plane->bo));
+	} else {
+		int64_t start_ns = bs_debug_gettime_ns();
+		CHECK(bs_rotate_plane(pattern, stride, width, height, cpp, rotation, addr, stride));
+		ctx->software_rotate_ns += bs_debug_gettime_ns() - start_ns;
+		ctx->software_rotations++;
+		ctx->software_rotated_pixels += (uint64_t)width * height;
+	}
+	bs_mapper_unmap(ctx->mapper, plane->bo, map_data);
+	return 0;
+}
 
-		CHECK_RESULT(disable_plane(ctx, overlay));
+// Returns the rotation values the plane's property advertises as a mask of their bits, which is
+// only DRM_MODE_ROTATE_0 for planes without it.
+static uint32_t supported_rotations(struct atomictest_context *ctx,
+				    struct atomictest_plane *plane)
+{
+	if (!plane->rotation.pid)
+		return DRM_MODE_ROTATE_0;
+
+	drmModePropertyPtr prop = drmModeGetProperty(ctx->fd, plane->rotation.pid);
+	if (!prop)
+		return DRM_MODE_ROTATE_0;
+
+	// Bitmask enum values are bit positions.
+	uint32_t supported = 0;
+	for (int i = 0; i < prop->count_enums; i++) {
+		if (prop->enums[i].value < 32)
+			supported |= 1u << prop->enums[i].value;
 	}
+	drmModeFreeProperty(prop);
+	return supported;
+}
 
-	for (uint32_t i = 0; i < crtc->num_primary; i++) {
-		primary = get_plane(crtc, i, DRM_PLANE_TYPE_PRIMARY);
-		if (!primary->rotation.pid)
-			continue;
+// Commits the plane with the given rotation if its property advertises the value, which then has
+// to work. Otherwise rotates the pattern into the framebuffer in software and commits that
+// unrotated. Tracks whether the framebuffer holds a rotated copy of the pattern rather than the
+// pattern itself.
+static int show_orientation(struct atomictest_context *ctx, struct atomictest_plane *plane,
+			    const uint8_t *pattern, uint32_t cpp, uint32_t width, uint32_t height,
+			    uint32_t rotation, uint32_t supported, bool *rotated_pattern)
+{
+	plane->crtc_w.value = width;
+	plane->crtc_h.value = height;
+	plane->src_w.value = width << 16;
+	plane->src_h.value = height << 16;
+	stage_plane(plane);
+
+	if ((rotation & supported) == rotation) {
+		if (*rotated_pattern)
+			CHECK_RESULT(write_orientation(ctx, plane, pattern, cpp, width, height,
+						       DRM_MODE_ROTATE_0));
+		*rotated_pattern = false;
+		if (plane->rotation.pid)
+			plane->rotation.value = rotation;
+		int ret = test_and_commit(ctx, 1e6);
+		if (ret && plane->rotation.pid)
+			plane->rotation.value = DRM_MODE_ROTATE_0;
+		return ret;
+	}
 
-		CHECK_RESULT(init_plane_any_format(ctx, primary, 0, 0, crtc->width, crtc->height,
-						   crtc->crtc_id, false));
+	// Without a pattern to rotate, values the plane doesn't advertise are left out.
+	if (!pattern)
+		return 0;
 
-		primary->rotation.value = DRM_ROTATE_0;
-		set_plane_props(primary, ctx->pset);
-		CHECK_RESULT(draw_to_plane(ctx->mapper, primary, DRAW_LINES));
-		ret |= test_and_commit(ctx, 1e6);
+	if (plane->rotation.pid)
+		plane->rotation.value = DRM_MODE_ROTATE_0;
+	CHECK_RESULT(write_orientation(ctx, plane, pattern, cpp, width, height, rotation));
+	*rotated_pattern = rotation != DRM_MODE_ROTATE_0;
+	return test_and_commit(ctx, 1e6);
+}
 
-		primary->rotation.value = DRM_REFLECT_Y;
-		set_plane_props(primary, ctx->pset);
-		ret |= test_and_commit(ctx, 1e6);
+// Shows the plane's pattern with every rotation in orientations, full screen apart from 90 and 270,
+// which show the largest square of it so that it keeps its size.
+static int orient_plane(struct atomictest_context *ctx, struct atomictest_crtc *crtc,
+			struct atomictest_plane *plane)
+{
+	static const uint32_t orientations[] = {
+		DRM_MODE_ROTATE_0,
+		DRM_MODE_ROTATE_0 | DRM_MODE_REFLECT_X,
+		DRM_MODE_ROTATE_0 | DRM_MODE_REFLECT_Y,
+		DRM_MODE_ROTATE_180,
+		DRM_MODE_ROTATE_90,
+		DRM_MODE_ROTATE_270,
+	};
+
+	CHECK_RESULT(init_plane_any_format(ctx, plane, 0, 0, crtc->width, crtc->height,
+					   crtc->crtc_id, false));
+	CHECK_RESULT(draw_to_plane(ctx->mapper, plane, DRAW_LINES));
+
+	// The drawn pattern, kept to rotate from and to put back afterwards.
+	uint32_t cpp = packed_format_cpp(gbm_bo_get_format(plane->bo));
+	uint8_t *pattern = NULL;
+	if (cpp) {
+		void *map_data;
+		uint32_t stride;
+		uint8_t *addr = bs_mapper_map(ctx->mapper, plane->bo, 0, &map_data, &stride);
+		CHECK(addr);
+		size_t size = (size_t)stride * gbm_bo_get_height(plane->bo);
+		pattern = malloc(size);
+		assert(pattern);
+		memcpy(pattern, addr, size);
+		bs_mapper_unmap(ctx->mapper, plane->bo, map_data);
+	}
 
-		CHECK_RESULT(disable_plane(ctx, primary));
+	int ret = 0;
+	bool rotated_pattern = false;
+	uint32_t supported = supported_rotations(ctx, plane);
+	uint32_t side = crtc->width < crtc->height ? crtc->width : crtc->height;
+	for (uint32_t i = 0; i < BS_ARRAY_LEN(orientations); i++) {
+		uint32_t rotation = orientations[i];
+		bool transposed = rotation & (DRM_MODE_ROTATE_90 | DRM_MODE_ROTATE_270);
+		int result = show_orientation(ctx, plane, pattern, cpp,
+					      transposed ? side : crtc->width,
+					      transposed ? side : crtc->height, rotation, supported,
+					      &rotated_pattern);
+		if (result < 0) {
+			free(pattern);
+			return result;
+		}
+		ret |= result;
 	}
 
+	free(pattern);
+	CHECK_RESULT(disable_plane(ctx, plane));
+	return ret;
+}
+
+static int test_orientation(struct atomictest_context *ctx, struct atomictest_crtc *crtc)
+{
+	int ret = 0;
+	for (uint32_t i = 0; i < crtc->num_overlay; i++)
+		ret |= orient_plane(ctx, crtc, get_plane(crtc, i, DRM_PLANE_TYPE_OVERLAY));
+
+	for (uint32_t i = 0; i < crtc->num_primary; i++)
+		ret |= orient_plane(ctx, crtc, get_plane(crtc, i, DRM_PLANE_TYPE_PRIMARY));
+
 	return ret;
 }
 
 static void *inc_timeline(void *user_data)
 {
 	int timeline_fd = (int)user_data;
-	uint32_t sleep_micro_secs = automatic ? 1e3 : 1e5;
+	// Fast mode signals right away rather than guessing how long the commit takes to block.
+	uint32_t sleep_micro_secs = fast ? 0 : automatic ? 1e3 : 1e5;
 	usleep(sleep_micro_secs);
 	sw_sync_timeline_inc(timeline_fd, 1);
 	return NULL;
@@ -1058,8 +2092,8 @@ static int test_in_fence(struct atomictest_context *ctx, struct atomictest_crtc
 	CHECK_RESULT(draw_to_plane(ctx->mapper, primary, DRAW_LINES));
 
 	primary->in_fence_fd.value = in_fence;
-	set_plane_props(primary, ctx->pset);
-	set_crtc_props(crtc, ctx->pset);
+	stage_plane(primary);
+	stage_crtc(crtc);
 
 	CHECK(
 	    !pthread_create(&inc_timeline_thread, NULL, inc_timeline, (void *)(uintptr_t)timeline));
@@ -1087,11 +2121,13 @@ static int test_out_fence(struct atomictest_context *ctx, struct atomictest_crtc
 	}
 
 	CHECK_RESULT(draw_to_plane(ctx->mapper, primary, DRAW_LINES));
-	set_plane_props(primary, ctx->pset);
+	stage_plane(primary);
 	int out_fence_fd = 0;
 	crtc->out_fence_ptr.value = (uint64_t)&out_fence_fd;
-	set_crtc_props(crtc, ctx->pset);
+	stage_crtc(crtc);
 	ret |= test_and_commit(ctx, 1e6);
+	// Later commits must not write through the pointer once this frame is gone.
+	crtc->out_fence_ptr.value = 0;
 	CHECK(out_fence_fd);
 	// |out_fence_fd| will signal when the currently scanned out buffers are replaced.
 	// In this case we're waiting with a timeout of 0 only to check that |out_fence_fd|
@@ -1114,18 +2150,18 @@ static int test_plane_ctm(struct atomictest_context *ctx, struct atomictest_crtc
 		CHECK_RESULT(init_plane(ctx, overlay, DRM_FORMAT_XRGB8888, 0, 0, crtc->width,
 					crtc->height, crtc->crtc_id));
 
-		CHECK_RESULT(drmModeCreatePropertyBlob64(
-		    ctx->fd, identity_ctm, sizeof(identity_ctm), &overlay->ctm.value));
-		set_plane_props(overlay, ctx->pset);
+		CHECK_RESULT(get_blob(
+		    ctx, identity_ctm, sizeof(identity_ctm), &overlay->ctm.value));
+		stage_plane(overlay);
 		CHECK_RESULT(draw_to_plane(ctx->mapper, overlay, DRAW_LINES));
 		ret |= test_and_commit(ctx, 1e6);
-		CHECK_RESULT(drmModeDestroyPropertyBlob64(ctx->fd, overlay->ctm.value));
+		CHECK_RESULT(put_blob(ctx, &overlay->ctm.value));
 
-		CHECK_RESULT(drmModeCreatePropertyBlob64(
-		    ctx->fd, red_shift_ctm, sizeof(red_shift_ctm), &overlay->ctm.value));
-		set_plane_props(overlay, ctx->pset);
+		CHECK_RESULT(get_blob(
+		    ctx, red_shift_ctm, sizeof(red_shift_ctm), &overlay->ctm.value));
+		stage_plane(overlay);
 		ret |= test_and_commit(ctx, 1e6);
-		CHECK_RESULT(drmModeDestroyPropertyBlob64(ctx->fd, overlay->ctm.value));
+		CHECK_RESULT(put_blob(ctx, &overlay->ctm.value));
 
 		CHECK_RESULT(disable_plane(ctx, overlay));
 	}
@@ -1137,18 +2173,18 @@ static int test_plane_ctm(struct atomictest_context *ctx, struct atomictest_crtc
 
 		CHECK_RESULT(init_plane_any_format(ctx, primary, 0, 0, crtc->width, crtc->height,
 						   crtc->crtc_id, false));
-		CHECK_RESULT(drmModeCreatePropertyBlob64(
-		    ctx->fd, identity_ctm, sizeof(identity_ctm), &primary->ctm.value));
-		set_plane_props(primary, ctx->pset);
+		CHECK_RESULT(get_blob(
+		    ctx, identity_ctm, sizeof(identity_ctm), &primary->ctm.value));
+		stage_plane(primary);
 		CHECK_RESULT(draw_to_plane(ctx->mapper, primary, DRAW_LINES));
 		ret |= test_and_commit(ctx, 1e6);
-		CHECK_RESULT(drmModeDestroyPropertyBlob64(ctx->fd, primary->ctm.value));
+		CHECK_RESULT(put_blob(ctx, &primary->ctm.value));
 
-		CHECK_RESULT(drmModeCreatePropertyBlob64(
-		    ctx->fd, red_shift_ctm, sizeof(red_shift_ctm), &primary->ctm.value));
-		set_plane_props(primary, ctx->pset);
+		CHECK_RESULT(get_blob(
+		    ctx, red_shift_ctm, sizeof(red_shift_ctm), &primary->ctm.value));
+		stage_plane(primary);
 		ret |= test_and_commit(ctx, 1e6);
-		CHECK_RESULT(drmModeDestroyPropertyBlob64(ctx->fd, primary->ctm.value));
+		CHECK_RESULT(put_blob(ctx, &primary->ctm.value));
 
 		CHECK_RESULT(disable_plane(ctx, primary));
 	}
@@ -1283,8 +2319,8 @@ static int test_overlay_downscaling(struct atomictest_context *ctx, struct atomi
 		ret |= test_and_commit(ctx, 1e6);
 
 		while (!scale_plane(ctx, crtc, overlay, -.1f, -.1f) && !test_commit(ctx)) {
-			CHECK_RESULT(commit(ctx));
-			usleep(1e6);
+			CHECK_RESULT(coalesce_tested_commit(ctx));
+			hold_frame(1e6);
 		}
 
 		disable_plane(ctx, overlay);
@@ -1308,8 +2344,8 @@ static int test_overlay_upscaling(struct atomictest_context *ctx, struct atomict
 		ret |= test_and_commit(ctx, 1e6);
 
 		while (!scale_plane(ctx, crtc, overlay, .1f, .1f) && !test_commit(ctx)) {
-			CHECK_RESULT(commit(ctx));
-			usleep(1e6);
+			CHECK_RESULT(coalesce_tested_commit(ctx));
+			hold_frame(1e6);
 		}
 
 		disable_plane(ctx, overlay);
@@ -1336,9 +2372,8 @@ static int test_crtc_ctm(struct atomictest_context *ctx, struct atomictest_crtc
 	if (!crtc->ctm.pid)
 		return 0;
 
-	CHECK_RESULT(drmModeCreatePropertyBlob64(ctx->fd, identity_ctm, sizeof(identity_ctm),
-						 &crtc->ctm.value));
-	set_crtc_props(crtc, ctx->pset);
+	CHECK_RESULT(get_blob(ctx, identity_ctm, sizeof(identity_ctm), &crtc->ctm.value));
+	stage_crtc(crtc);
 	for (uint32_t i = 0; i < crtc->num_primary; i++) {
 		primary = get_plane(crtc, i, DRM_PLANE_TYPE_PRIMARY);
 
@@ -1348,18 +2383,17 @@ static int test_crtc_ctm(struct atomictest_context *ctx, struct atomictest_crtc
 		ret |= test_and_commit(ctx, 1e6);
 
 		primary->crtc_id.value = 0;
-		CHECK_RESULT(set_plane_props(primary, ctx->pset));
+		stage_plane(primary);
 	}
 
-	CHECK_RESULT(drmModeDestroyPropertyBlob64(ctx->fd, crtc->ctm.value));
+	CHECK_RESULT(put_blob(ctx, &crtc->ctm.value));
 
-	CHECK_RESULT(drmModeCreatePropertyBlob64(ctx->fd, red_shift_ctm, sizeof(red_shift_ctm),
-						 &crtc->ctm.value));
-	set_crtc_props(crtc, ctx->pset);
+	CHECK_RESULT(get_blob(ctx, red_shift_ctm, sizeof(red_shift_ctm), &crtc->ctm.value));
+	stage_crtc(crtc);
 	for (uint32_t i = 0; i < crtc->num_primary; i++) {
 		primary = get_plane(crtc, i, DRM_PLANE_TYPE_PRIMARY);
 		primary->crtc_id.value = crtc->crtc_id;
-		CHECK_RESULT(set_plane_props(primary, ctx->pset));
+		stage_plane(primary);
 
 		ret |= test_and_commit(ctx, 1e6);
 
@@ -1367,7 +2401,7 @@ static int test_crtc_ctm(struct atomictest_context *ctx, struct atomictest_crtc
 		CHECK_RESULT(disable_plane(ctx, primary));
 	}
 
-	CHECK_RESULT(drmModeDestroyPropertyBlob64(ctx->fd, crtc->ctm.value));
+	CHECK_RESULT(put_blob(ctx, &crtc->ctm.value));
 
 	return ret;
 }
@@ -1407,10 +2441,10 @@ static int test_crtc_gamma(struct atomictest_context *ctx, struct atomictest_crt
 	    calloc(crtc->gamma_lut_size.value, sizeof(*gamma_table));
 
 	gamma_linear(gamma_table, crtc->gamma_lut_size.value);
-	CHECK_RESULT(drmModeCreatePropertyBlob64(
-	    ctx->fd, gamma_table, sizeof(struct drm_color_lut) * crtc->gamma_lut_size.value,
+	CHECK_RESULT(get_blob(
+	    ctx, gamma_table, sizeof(struct drm_color_lut) * crtc->gamma_lut_size.value,
 	    &crtc->gamma_lut.value));
-	set_crtc_props(crtc, ctx->pset);
+	stage_crtc(crtc);
 
 	for (uint32_t i = 0; i < crtc->num_primary; i++) {
 		primary = get_plane(crtc, i, DRM_PLANE_TYPE_PRIMARY);
@@ -1424,13 +2458,13 @@ static int test_crtc_gamma(struct atomictest_context *ctx, struct atomictest_crt
 		CHECK_RESULT(disable_plane(ctx, primary));
 	}
 
-	CHECK_RESULT(drmModeDestroyPropertyBlob(ctx->fd, crtc->gamma_lut.value));
+	CHECK_RESULT(put_blob(ctx, &crtc->gamma_lut.value));
 
 	gamma_step(gamma_table, crtc->gamma_lut_size.value);
-	CHECK_RESULT(drmModeCreatePropertyBlob64(
-	    ctx->fd, gamma_table, sizeof(struct drm_color_lut) * crtc->gamma_lut_size.value,
+	CHECK_RESULT(get_blob(
+	    ctx, gamma_table, sizeof(struct drm_color_lut) * crtc->gamma_lut_size.value,
 	    &crtc->gamma_lut.value));
-	set_crtc_props(crtc, ctx->pset);
+	stage_crtc(crtc);
 
 	for (uint32_t i = 0; i < crtc->num_primary; i++) {
 		primary = get_plane(crtc, i, DRM_PLANE_TYPE_PRIMARY);
@@ -1444,8 +2478,549 @@ static int test_crtc_gamma(struct atomictest_context *ctx, struct atomictest_crt
 		CHECK_RESULT(disable_plane(ctx, primary));
 	}
 
-	CHECK_RESULT(drmModeDestroyPropertyBlob(ctx->fd, crtc->gamma_lut.value));
+	CHECK_RESULT(put_blob(ctx, &crtc->gamma_lut.value));
+	free(gamma_table);
+
+	return ret;
+}
+
+#define COLOR_TRANSITION_FRAMES 60
+#define COLOR_TRANSITION_STEPS 15
+#define COLOR_PIPELINE_FRAMES 10
+
+// Night light: green and blue lose gain as the warmth goes from 0 to 1, red keeps all of it.
+static void warm_ctm(int64_t *ctm, float warmth)
+{
+	memset(ctm, 0, 9 * sizeof(*ctm));
+	ctm[0] = 0x100000000;
+	ctm[4] = (int64_t)(0x100000000 * (1.0 - warmth / 4.0));
+	ctm[8] = (int64_t)(0x100000000 * (1.0 - warmth / 2.0));
+}
+
+static void gamma_warm(struct drm_color_lut *table, int size, float warmth)
+{
+	for (int i = 0; i < size; i++) {
+		float v = (float)(i) / (float)(size - 1);
+		v *= (float)GAMMA_MAX_VALUE;
+		table[i].red = (uint16_t)v;
+		table[i].green = (uint16_t)(v * (1.0f - warmth / 4.0f));
+		table[i].blue = (uint16_t)(v * (1.0f - warmth / 2.0f));
+	}
+}
+
+// Triangle wave that warms up over COLOR_TRANSITION_STEPS frames and cools back down, so the
+// same few matrices and tables come around again and again.
+static float transition_warmth(uint32_t frame)
+{
+	uint32_t step = frame % (2 * COLOR_TRANSITION_STEPS);
+	if (step > COLOR_TRANSITION_STEPS)
+		step = 2 * COLOR_TRANSITION_STEPS - step;
+	return (float)step / COLOR_TRANSITION_STEPS;
+}
+
+// The uncached pass creates and destroys a blob for every change, the way atomictest used to.
+static int transition_blob(struct atomictest_context *ctx, bool cached, const void *data,
+			   size_t length, uint64_t *id)
+{
+	if (cached)
+		return get_blob(ctx, data, length, id);
+
+	uint32_t blob_id = 0;
+	CHECK_RESULT(drmModeCreatePropertyBlob(ctx->fd, data, length, &blob_id));
+	*id = blob_id;
+	return 0;
+}
+
+static int release_transition_blob(struct atomictest_context *ctx, bool cached, uint64_t id)
+{
+	if (!id)
+		return 0;
+	if (cached)
+		return put_blob(ctx, &id);
+	return drmModeDestroyPropertyBlob(ctx->fd, id);
+}
+
+static int color_transition_pass(struct atomictest_context *ctx, struct atomictest_crtc *crtc,
+				 bool cached, struct drm_color_lut *gamma_table, int64_t *blob_ns,
+				 int64_t *frame_ns)
+{
+	int64_t ctm[9];
+	size_t gamma_length = sizeof(struct drm_color_lut) * crtc->gamma_lut_size.value;
+	for (uint32_t frame = 0; frame <= COLOR_TRANSITION_FRAMES; frame++) {
+		uint64_t old_ctm = crtc->ctm.value;
+		uint64_t old_gamma = crtc->gamma_lut.value;
+		float warmth = transition_warmth(frame);
+
+		// The last frame goes back to no color management at all.
+		int64_t start_ns = bs_debug_gettime_ns();
+		if (frame == COLOR_TRANSITION_FRAMES) {
+			crtc->ctm.value = 0;
+			crtc->gamma_lut.value = 0;
+		} else {
+			if (crtc->ctm.pid) {
+				warm_ctm(ctm, warmth);
+				CHECK_RESULT(transition_blob(ctx, cached, ctm, sizeof(ctm),
+							     &crtc->ctm.value));
+			}
+			if (gamma_table) {
+				gamma_warm(gamma_table, crtc->gamma_lut_size.value, warmth);
+				CHECK_RESULT(transition_blob(ctx, cached, gamma_table, gamma_length,
+							     &crtc->gamma_lut.value));
+			}
+		}
+		stage_crtc(crtc);
+		int64_t blobs_ready_ns = bs_debug_gettime_ns();
+
+		CHECK_RESULT(coalesce_commit(ctx));
+
+		// The previous frame's blobs can only go once the new ones are on screen.
+		int64_t committed_ns = bs_debug_gettime_ns();
+		CHECK_RESULT(release_transition_blob(ctx, cached, old_ctm));
+		CHECK_RESULT(release_transition_blob(ctx, cached, old_gamma));
+		int64_t end_ns = bs_debug_gettime_ns();
+
+		*blob_ns += (blobs_ready_ns - start_ns) + (end_ns - committed_ns);
+		*frame_ns += end_ns - start_ns;
+	}
+
+	return 0;
+}
+
+// Runs the software color pipeline over a copy of the buffer and checks it against the per-pixel
+// reference. Returns the mean time per frame, or -1 if the two disagree.
+static int64_t time_color_pipeline(struct bs_color_pipeline *pipeline, const uint8_t *src,
+				   uint8_t *dst, uint32_t stride, uint32_t width, uint32_t height)
+{
+	int64_t start_ns = bs_debug_gettime_ns();
+	for (uint32_t i = 0; i < COLOR_PIPELINE_FRAMES; i++)
+		bs_color_pipeline_apply(pipeline, src, stride, dst, stride, width, height);
+	int64_t frame_ns = (bs_debug_gettime_ns() - start_ns) / COLOR_PIPELINE_FRAMES;
+
+	for (uint32_t y = 0; y < height; y++) {
+		const uint32_t *src_row = (const uint32_t *)(src + y * stride);
+		const uint32_t *dst_row = (const uint32_t *)(dst + y * stride);
+		for (uint32_t x = 0; x < width; x++) {
+			uint32_t expected = bs_color_pipeline_apply_pixel(pipeline, src_row[x]);
+			for (int shift = 0; shift < 24; shift += 8) {
+				int diff = (int)((expected >> shift) & 0xff) -
+					   (int)((dst_row[x] >> shift) & 0xff);
+				if (diff > 1 || diff < -1) {
+					bs_debug_error("pixel %u,%u is 0x%08x, not 0x%08x", x, y,
+						       dst_row[x], expected);
+					return -1;
+				}
+			}
+		}
+	}
+
+	return frame_ns;
+}
+
+// What applying the warmest night light on the CPU would cost a compositor whose CRTC can't.
+static int benchmark_color_pipeline(struct atomictest_context *ctx,
+				    struct atomictest_plane *plane,
+				    struct drm_color_lut *gamma_table, uint32_t gamma_size)
+{
+	uint32_t width = gbm_bo_get_width(plane->bo);
+	uint32_t height = gbm_bo_get_height(plane->bo);
+	void *map_data;
+	uint32_t stride;
+	void *addr = bs_mapper_map(ctx->mapper, plane->bo, 0, &map_data, &stride);
+	CHECK(addr);
+
+	// Reading back from scanout memory can be slow, so the pipeline works on copies.
+	uint8_t *src = malloc(stride * height);
+	uint8_t *dst = malloc(stride * height);
+	CHECK(src && dst);
+	memcpy(src, addr, stride * height);
+	bs_mapper_unmap(ctx->mapper, plane->bo, map_data);
+
+	int64_t ctm[9];
+	warm_ctm(ctm, 1.0f);
+	if (gamma_table)
+		gamma_warm(gamma_table, gamma_size, 1.0f);
+	if (!gamma_table)
+		gamma_size = 0;
+	struct bs_color_pipeline *with_ctm =
+	    bs_color_pipeline_new(NULL, 0, ctm, gamma_table, gamma_size);
+	struct bs_color_pipeline *gamma_only =
+	    bs_color_pipeline_new(NULL, 0, NULL, gamma_table, gamma_size);
+
+	int64_t ctm_ns = time_color_pipeline(with_ctm, src, dst, stride, width, height);
+	int64_t gamma_ns = time_color_pipeline(gamma_only, src, dst, stride, width, height);
+
+	bs_color_pipeline_destroy(&with_ctm);
+	bs_color_pipeline_destroy(&gamma_only);
+	free(src);
+	free(dst);
+	if (ctm_ns < 0 || gamma_ns < 0)
+		return -1;
+
+	double mpixels = ctm_ns ? (double)width * height * 1e3 / ctm_ns : 0.0;
+	printf("Software color pipeline: %ux%u in %.3f ms with the CTM (%.0f Mpixel/s), %.3f ms "
+	       "without\n",
+	       width, height, ctm_ns / 1e6, mpixels, gamma_ns / 1e6);
+	return 0;
+}
+
+static int test_color_transition(struct atomictest_context *ctx, struct atomictest_crtc *crtc)
+{
+	bool has_gamma = crtc->gamma_lut.pid && crtc->gamma_lut_size.pid &&
+			 crtc->gamma_lut_size.value > 0;
+	if ((!crtc->ctm.pid && !has_gamma) || !crtc->num_primary)
+		return 0;
+
+	struct atomictest_plane *primary = get_plane(crtc, 0, DRM_PLANE_TYPE_PRIMARY);
+	CHECK_RESULT(init_plane(ctx, primary, DRM_FORMAT_XRGB8888, 0, 0, crtc->width, crtc->height,
+				crtc->crtc_id));
+	CHECK_RESULT(draw_to_plane(ctx->mapper, primary, DRAW_STRIPE));
+
+	// Whatever an earlier test left in the properties isn't this test's to release.
+	crtc->ctm.value = 0;
+	crtc->gamma_lut.value = 0;
+	stage_crtc(crtc);
+	if (test_commit(ctx))
+		return TEST_COMMIT_FAIL;
+	CHECK_RESULT(commit(ctx));
+
+	struct drm_color_lut *gamma_table = NULL;
+	if (has_gamma) {
+		gamma_table = calloc(crtc->gamma_lut_size.value, sizeof(*gamma_table));
+		CHECK(gamma_table);
+	}
+
+	int64_t churn_blob_ns = 0, churn_frame_ns = 0;
+	int64_t cached_blob_ns = 0, cached_frame_ns = 0;
+	struct bs_blob_cache_stats before, after;
+	int ret = color_transition_pass(ctx, crtc, false, gamma_table, &churn_blob_ns,
+					&churn_frame_ns);
+	bs_blob_cache_get_stats(ctx->blobs, &before);
+	if (!ret)
+		ret = color_transition_pass(ctx, crtc, true, gamma_table, &cached_blob_ns,
+					    &cached_frame_ns);
+	bs_blob_cache_get_stats(ctx->blobs, &after);
+	if (ret) {
+		free(gamma_table);
+		return ret;
+	}
+
+	printf("Color transition: %u frames, blobs %.3f ms/frame recreated vs %.3f ms/frame "
+	       "cached (%llu hits), frame %.3f ms vs %.3f ms\n",
+	       COLOR_TRANSITION_FRAMES, churn_blob_ns / 1e6 / COLOR_TRANSITION_FRAMES,
+	       cached_blob_ns / 1e6 / COLOR_TRANSITION_FRAMES,
+	       (unsigned long long)(after.hits - before.hits),
+	       churn_frame_ns / 1e6 / COLOR_TRANSITION_FRAMES,
+	       cached_frame_ns / 1e6 / COLOR_TRANSITION_FRAMES);
+
+	ret = benchmark_color_pipeline(ctx, primary, gamma_table, crtc->gamma_lut_size.value);
 	free(gamma_table);
+	return ret;
+}
+
+#define MAX_LAYER_FORMATS 3
+#define MAX_ASSIGNMENT_LAYERS 5
+// Choices of a plane and format for a layer are numbered for the bitsets below.
+#define MAX_PLANE_CHOICES 256
+#define MAX_ASSIGNMENT_PLANES (MAX_PLANE_CHOICES / MAX_ASSIGNMENT_LAYERS / MAX_LAYER_FORMATS)
+
+// Something a compositor wants on screen. Its source is scaled to fill the destination.
+struct assignment_layer {
+	const char *name;
+	uint32_t x;
+	uint32_t y;
+	uint32_t w;
+	uint32_t h;
+	uint32_t src_w;
+	uint32_t src_h;
+	uint32_t formats[MAX_LAYER_FORMATS];
+	uint32_t num_formats;
+};
+
+struct plane_choice_set {
+	uint64_t bits[MAX_PLANE_CHOICES / 64];
+};
+
+/*
+ * Searches for the assignment of layers, bottom to top, to planes that offloads the most layers.
+ * The planes are in stacking order and a layer can only go above the planes of the layers below
+ * it, which stands in for zpos on drivers without it. Sets of choices the kernel turned down are
+ * remembered and, assuming that anything containing a failing set fails too, pruned without
+ * asking again. That assumption is a heuristic: it doesn't hold on drivers that require the
+ * primary plane, for example.
+ */
+struct assignment_search {
+	struct atomictest_context *ctx;
+	struct atomictest_crtc *crtc;
+	const struct assignment_layer *layers;
+	uint32_t num_layers;
+	// The CRTC's planes in stacking order, as many as the choice numbering has room for.
+	struct atomictest_plane *planes[MAX_ASSIGNMENT_PLANES];
+	uint32_t num_planes;
+
+	struct plane_choice_set path;
+	int32_t plane_of[MAX_ASSIGNMENT_LAYERS];
+	uint32_t format_of[MAX_ASSIGNMENT_LAYERS];
+	uint32_t best_count;
+	int32_t best_plane_of[MAX_ASSIGNMENT_LAYERS];
+	uint32_t best_format_of[MAX_ASSIGNMENT_LAYERS];
+
+	// Results of the kernel checks, so that no set is checked twice.
+	struct plane_choice_set *failed;
+	uint32_t num_failed;
+	struct plane_choice_set *passed;
+	uint32_t num_passed;
+
+	uint64_t checks;
+	uint64_t memo_hits;
+	uint64_t pruned;
+	uint64_t caps_skips;
+};
+
+static uint32_t choice_id(struct assignment_search *search, uint32_t layer, uint32_t plane,
+			  uint32_t format)
+{
+	return (layer * search->num_planes + plane) * MAX_LAYER_FORMATS + format;
+}
+
+static void choice_set_add(struct plane_choice_set *set, uint32_t id)
+{
+	set->bits[id / 64] |= 1ull << (id % 64);
+}
+
+static void choice_set_remove(struct plane_choice_set *set, uint32_t id)
+{
+	set->bits[id / 64] &= ~(1ull << (id % 64));
+}
+
+static bool choice_set_has(const struct plane_choice_set *set, uint32_t id)
+{
+	return set->bits[id / 64] & (1ull << (id % 64));
+}
+
+static bool choice_set_contains(const struct plane_choice_set *set,
+				const struct plane_choice_set *subset)
+{
+	for (uint32_t i = 0; i < BS_ARRAY_LEN(set->bits); i++) {
+		if (subset->bits[i] & ~set->bits[i])
+			return false;
+	}
+
+	return true;
+}
+
+static void choice_set_append(struct plane_choice_set **sets, uint32_t *count,
+			      const struct plane_choice_set *set)
+{
+	*sets = realloc(*sets, (*count + 1) * sizeof(**sets));
+	assert(*sets);
+	(*sets)[(*count)++] = *set;
+}
+
+// Puts the chosen layers on their planes and turns the search's other planes off.
+static int apply_choices(struct assignment_search *search, const struct plane_choice_set *set)
+{
+	for (uint32_t p = 0; p < search->num_planes; p++) {
+		struct atomictest_plane *plane = search->planes[p];
+		bool used = false;
+		for (uint32_t l = 0; l < search->num_layers && !used; l++) {
+			const struct assignment_layer *layer = &search->layers[l];
+			for (uint32_t f = 0; f < layer->num_formats; f++) {
+				if (!choice_set_has(set, choice_id(search, l, p, f)))
+					continue;
+
+				CHECK_RESULT(init_plane(search->ctx, plane, layer->formats[f],
+							layer->x, layer->y, layer->src_w,
+							layer->src_h, search->crtc->crtc_id));
+				plane->crtc_w.value = layer->w;
+				plane->crtc_h.value = layer->h;
+				used = true;
+				break;
+			}
+		}
+
+		if (!used)
+			CHECK_RESULT(disable_plane(search->ctx, plane));
+	}
+
+	return 0;
+}
+
+// Returns whether the kernel takes the set, asking it only when the answer isn't known yet.
+static bool check_choices(struct assignment_search *search, const struct plane_choice_set *set)
+{
+	for (uint32_t i = 0; i < search->num_failed; i++) {
+		if (choice_set_contains(set, &search->failed[i])) {
+			search->memo_hits++;
+			return false;
+		}
+	}
+
+	for (uint32_t i = 0; i < search->num_passed; i++) {
+		if (!memcmp(set, &search->passed[i], sizeof(*set))) {
+			search->memo_hits++;
+			return true;
+		}
+	}
+
+	search->checks++;
+	bool passed = !apply_choices(search, set) && !test_commit(search->ctx);
+	if (passed)
+		choice_set_append(&search->passed, &search->num_passed, set);
+	else
+		choice_set_append(&search->failed, &search->num_failed, set);
+	return passed;
+}
+
+/*
+ * A whole path is never checked again, so after a failure the choice is checked alone and next to
+ * each earlier choice. What fails there prunes every other path that contains it.
+ */
+static void learn_failure(struct assignment_search *search, uint32_t choice)
+{
+	struct plane_choice_set set = { 0 };
+	choice_set_add(&set, choice);
+	if (!check_choices(search, &set))
+		return;
+
+	for (uint32_t id = 0; id < MAX_PLANE_CHOICES; id++) {
+		if (id == choice || !choice_set_has(&search->path, id))
+			continue;
+
+		choice_set_add(&set, id);
+		check_choices(search, &set);
+		choice_set_remove(&set, id);
+	}
+}
+
+static void search_layer(struct assignment_search *search, uint32_t layer_index,
+			 uint32_t min_plane, uint32_t count)
+{
+	// Not even offloading every remaining layer would beat the best so far.
+	if (count + search->num_layers - layer_index <= search->best_count) {
+		search->pruned++;
+		return;
+	}
+
+	if (layer_index == search->num_layers) {
+		search->best_count = count;
+		memcpy(search->best_plane_of, search->plane_of, sizeof(search->plane_of));
+		memcpy(search->best_format_of, search->format_of, sizeof(search->format_of));
+		return;
+	}
+
+	const struct assignment_layer *layer = &search->layers[layer_index];
+	bool scaled = layer->w != layer->src_w || layer->h != layer->src_h;
+	for (uint32_t p = min_plane; p < search->num_planes; p++) {
+		struct atomictest_plane *plane = search->planes[p];
+		if (plane->type.value == DRM_PLANE_TYPE_CURSOR &&
+		    (scaled || layer->w > CURSOR_SIZE || layer->h > CURSOR_SIZE))
+			continue;
+
+		for (uint32_t f = 0; f < layer->num_formats; f++) {
+			if (get_format_idx(plane, layer->formats[f]) < 0)
+				continue;
+
+			if (!plane_caps_allow(plane, layer->formats[f], layer->src_w, layer->src_h,
+					      layer->w, layer->h)) {
+				search->caps_skips++;
+				continue;
+			}
+
+			uint32_t choice = choice_id(search, layer_index, p, f);
+			choice_set_add(&search->path, choice);
+			bool passed = check_choices(search, &search->path);
+			if (passed) {
+				search->plane_of[layer_index] = p;
+				search->format_of[layer_index] = f;
+				search_layer(search, layer_index + 1, p + 1, count + 1);
+			}
+
+			choice_set_remove(&search->path, choice);
+			if (!passed && count)
+				learn_failure(search, choice);
+		}
+	}
+
+	// Leave the layer to the compositor.
+	search->plane_of[layer_index] = -1;
+	search_layer(search, layer_index + 1, min_plane, count);
+}
+
+static int test_plane_assignment(struct atomictest_context *ctx, struct atomictest_crtc *crtc)
+{
+	uint32_t w = crtc->width;
+	uint32_t h = crtc->height;
+	// clang-format off
+	const struct assignment_layer layers[MAX_ASSIGNMENT_LAYERS] = {
+		{ "background", 0, 0, w, h, w, h,
+		  { DRM_FORMAT_XRGB8888, DRM_FORMAT_ARGB8888 }, 2 },
+		{ "video", w / 4, h / 4, BS_ALIGN(w / 2, 2), BS_ALIGN(h / 2, 2),
+		  BS_ALIGN(w / 4, 2), BS_ALIGN(h / 4, 2),
+		  { DRM_FORMAT_NV12, DRM_FORMAT_YVU420, DRM_FORMAT_XRGB8888 }, 3 },
+		{ "ui", 0, h - h / 4, w, h / 4, w, h / 4, { DRM_FORMAT_ARGB8888 }, 1 },
+		{ "toast", w - w / 4, h / 16, w / 5, h / 16, w / 5, h / 16,
+		  { DRM_FORMAT_ARGB8888 }, 1 },
+		{ "cursor", w / 2, h / 2, CURSOR_SIZE, CURSOR_SIZE, CURSOR_SIZE, CURSOR_SIZE,
+		  { DRM_FORMAT_ARGB8888 }, 1 },
+	};
+	// clang-format on
+
+	struct assignment_search search = { 0 };
+	search.ctx = ctx;
+	search.crtc = crtc;
+	search.layers = layers;
+	search.num_layers = BS_ARRAY_LEN(layers);
+	for (uint32_t l = 0; l < search.num_layers; l++)
+		search.best_plane_of[l] = -1;
+	const uint64_t types[] = { DRM_PLANE_TYPE_PRIMARY, DRM_PLANE_TYPE_OVERLAY,
+				   DRM_PLANE_TYPE_CURSOR };
+	const uint32_t counts[] = { crtc->num_primary, crtc->num_overlay, crtc->num_cursor };
+	for (uint32_t t = 0; t < BS_ARRAY_LEN(types); t++) {
+		for (uint32_t i = 0; i < counts[t]; i++) {
+			if (search.num_planes < MAX_ASSIGNMENT_PLANES)
+				search.planes[search.num_planes++] = get_plane(crtc, i, types[t]);
+		}
+	}
+
+	int64_t start_ns = bs_debug_gettime_ns();
+	search_layer(&search, 0, 0, 0);
+	int64_t search_ns = bs_debug_gettime_ns() - start_ns;
+
+	printf("Plane assignment: %u of %u layers offloaded, %llu TEST_ONLY checks, "
+	       "%llu answered from memo, %llu ruled out by plane capabilities, "
+	       "%llu branches pruned, %.3f ms\n",
+	       search.best_count, search.num_layers, (unsigned long long)search.checks,
+	       (unsigned long long)search.memo_hits, (unsigned long long)search.caps_skips,
+	       (unsigned long long)search.pruned, search_ns / 1000000.0);
+
+	struct plane_choice_set best = { 0 };
+	for (uint32_t l = 0; l < search.num_layers; l++) {
+		int32_t p = search.best_plane_of[l];
+		if (p < 0) {
+			printf("  %s: composited\n", layers[l].name);
+			continue;
+		}
+
+		uint32_t format = layers[l].formats[search.best_format_of[l]];
+		printf("  %s: plane %u, %.4s\n", layers[l].name,
+		       search.planes[p]->drm_plane.plane_id, (const char *)&format);
+		choice_set_add(&best, choice_id(&search, l, p, search.best_format_of[l]));
+	}
+
+	free(search.failed);
+	free(search.passed);
+
+	int ret = 0;
+	if (search.best_count) {
+		CHECK_RESULT(apply_choices(&search, &best));
+		for (uint32_t p = 0; p < search.num_planes; p++) {
+			if (search.planes[p]->fb_id.value)
+				CHECK_RESULT(draw_to_plane(ctx->mapper, search.planes[p],
+							   DRAW_LINES));
+		}
+
+		ret |= test_and_commit(ctx, 1e6);
+	}
 
 	return ret;
 }
@@ -1468,31 +3043,271 @@ static const struct atomictest_testcase cases[] = {
 	{ "plane_ctm", test_plane_ctm },
 	{ "crtc_ctm", test_crtc_ctm },
 	{ "crtc_gamma", test_crtc_gamma },
+	{ "color_transition", test_color_transition },
+	{ "plane_assignment", test_plane_assignment },
 };
 
 static int run_testcase(struct atomictest_context *ctx, struct atomictest_crtc *crtc,
 			test_function func)
 {
-	int cursor = drmModeAtomicGetCursor(ctx->pset);
 	uint32_t num_planes = crtc->num_primary + crtc->num_cursor + crtc->num_overlay;
+	uint64_t captures_differed = crtc->captures_differed;
 
 	int ret = func(ctx, crtc);
 
+	// Whatever the test left uncommitted is dropped, except for the modeset from enable_crtc
+	// which still has to reach the kernel if the test never committed.
+	unstage_crtc(crtc);
+	for (uint32_t i = 0; i < ctx->num_connectors; i++)
+		stage_connector(&ctx->connectors[i]);
+	stage_crtc(crtc);
+
+	/*
+	 * Pooled framebuffers outlive the test, so the planes have to be turned off explicitly
+	 * rather than by removing their framebuffers.
+	 */
 	for (uint32_t i = 0; i < num_planes; i++)
 		disable_plane(ctx, &crtc->planes[i]);
 
-	drmModeAtomicSetCursor(ctx->pset, cursor);
+	// disable_crtcs commits right after, so nothing needs to see the planes go away first.
+	CHECK_RESULT(coalesce_commit(ctx));
+	if (!fast)
+		usleep(1e6 / 60);
 
-	CHECK_RESULT(commit(ctx));
-	usleep(1e6 / 60);
+	if (ret >= 0 && crtc->captures_differed != captures_differed)
+		ret |= TEST_CAPTURE_FAIL;
+	return ret;
+}
+
+struct lockstep_testcase {
+	struct atomictest_context *ctx;
+	struct atomictest_crtc *crtc;
+	test_function func;
+	pthread_t thread;
+	int ret;
+};
 
+static void *run_lockstep_thread(void *user_data)
+{
+	struct lockstep_testcase *testcase = user_data;
+	struct atomictest_lockstep *lockstep = testcase->ctx->lockstep;
+	pthread_mutex_lock(&lockstep->lock);
+	testcase->ret = run_testcase(testcase->ctx, testcase->crtc, testcase->func);
+
+	// The others may only have been waiting on this thread to commit.
+	lockstep->running--;
+	if (lockstep->waiting && lockstep->waiting == lockstep->running)
+		lockstep_flush(testcase->ctx);
+	pthread_mutex_unlock(&lockstep->lock);
+	return NULL;
+}
+
+static int run_lockstep_testcase(struct atomictest_context *ctx, uint32_t crtc_mask,
+				 test_function func)
+{
+	struct lockstep_testcase *testcases = calloc(ctx->num_crtcs, sizeof(*testcases));
+	struct atomictest_lockstep lockstep = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	ctx->lockstep = &lockstep;
+
+	// No thread gets going before all are counted.
+	pthread_mutex_lock(&lockstep.lock);
+	uint32_t num_testcases = 0;
+	for (uint32_t i = 0; i < ctx->num_crtcs; i++) {
+		if (!(crtc_mask & (1u << i)))
+			continue;
+
+		struct lockstep_testcase *testcase = &testcases[num_testcases];
+		testcase->ctx = ctx;
+		testcase->crtc = &ctx->crtcs[i];
+		testcase->func = func;
+		if (pthread_create(&testcase->thread, NULL, run_lockstep_thread, testcase)) {
+			bs_debug_error("failed to create thread for [CRTC:%u]",
+				       ctx->crtcs[i].crtc_id);
+			break;
+		}
+
+		lockstep.running++;
+		num_testcases++;
+	}
+	pthread_mutex_unlock(&lockstep.lock);
+
+	int ret = num_testcases ? 0 : -1;
+	for (uint32_t i = 0; i < num_testcases; i++) {
+		pthread_join(testcases[i].thread, NULL);
+		if (testcases[i].ret < 0)
+			ret = testcases[i].ret;
+		else if (ret >= 0)
+			ret |= testcases[i].ret;
+	}
+
+	ctx->lockstep = NULL;
+	free(testcases);
 	return ret;
 }
 
+/*
+ * Gives each plane to only one of the CRTCs in crtc_mask so that tests running at once never
+ * fight over it. Overlays go to whichever CRTC has the fewest so far. The copies a CRTC lent out
+ * are moved past the ones it kept and are no longer counted.
+ */
+static void partition_planes(struct atomictest_context *ctx, uint32_t crtc_mask)
+{
+	uint32_t total_copies = 0;
+	for (uint32_t i = 0; i < ctx->num_crtcs; i++) {
+		struct atomictest_crtc *crtc = &ctx->crtcs[i];
+		total_copies += crtc->num_primary + crtc->num_cursor + crtc->num_overlay;
+	}
+
+	uint32_t *claimed_ids = calloc(total_copies, sizeof(uint32_t));
+	uint32_t *owners = calloc(total_copies, sizeof(uint32_t));
+	uint32_t(*kept)[3] = calloc(ctx->num_crtcs, sizeof(*kept));
+	uint32_t num_claimed = 0;
+
+	for (uint32_t i = 0; i < ctx->num_crtcs; i++) {
+		struct atomictest_crtc *crtc = &ctx->crtcs[i];
+		uint32_t num_planes = crtc->num_primary + crtc->num_cursor + crtc->num_overlay;
+		if (!(crtc_mask & (1u << i)))
+			continue;
+
+		for (uint32_t j = 0; j < num_planes; j++) {
+			uint32_t plane_id = crtc->planes[j].drm_plane.plane_id;
+			uint64_t type = crtc->planes[j].type.value;
+			uint32_t k;
+			for (k = 0; k < num_claimed && claimed_ids[k] != plane_id; k++)
+				;
+			if (k < num_claimed)
+				continue;
+
+			uint32_t owner = i;
+			for (uint32_t c = i + 1; c < ctx->num_crtcs; c++) {
+				if ((crtc_mask & (1u << c)) &&
+				    (crtc->planes[j].drm_plane.possible_crtcs & (1u << c)) &&
+				    kept[c][type] < kept[owner][type])
+					owner = c;
+			}
+
+			claimed_ids[num_claimed] = plane_id;
+			owners[num_claimed++] = owner;
+			kept[owner][type]++;
+		}
+	}
+
+	for (uint32_t i = 0; i < ctx->num_crtcs; i++) {
+		struct atomictest_crtc *crtc = &ctx->crtcs[i];
+		uint32_t num_planes = crtc->num_primary + crtc->num_cursor + crtc->num_overlay;
+		if (!(crtc_mask & (1u << i)))
+			continue;
+
+		struct atomictest_plane *planes = calloc(num_planes, sizeof(*planes));
+		uint32_t num_kept = 0;
+		uint32_t num_lent = 0;
+		crtc->num_primary = 0;
+		crtc->num_cursor = 0;
+		crtc->num_overlay = 0;
+		for (uint32_t j = 0; j < num_planes; j++) {
+			struct atomictest_plane *plane = &crtc->planes[j];
+			uint32_t k;
+			for (k = 0; claimed_ids[k] != plane->drm_plane.plane_id; k++)
+				;
+			if (owners[k] != i) {
+				planes[num_planes - ++num_lent] = *plane;
+				continue;
+			}
+
+			switch (plane->type.value) {
+				case DRM_PLANE_TYPE_OVERLAY:
+					crtc->overlay_idx[crtc->num_overlay++] = num_kept;
+					break;
+				case DRM_PLANE_TYPE_PRIMARY:
+					crtc->primary_idx[crtc->num_primary++] = num_kept;
+					break;
+				case DRM_PLANE_TYPE_CURSOR:
+					crtc->cursor_idx[crtc->num_cursor++] = num_kept;
+					break;
+			}
+			planes[num_kept++] = *plane;
+		}
+
+		memcpy(crtc->planes, planes, num_planes * sizeof(*planes));
+		crtc->num_lent = num_lent;
+		free(planes);
+	}
+
+	free(kept);
+	free(owners);
+	free(claimed_ids);
+}
+
+// Runs the named test cases, each on all CRTCs in crtc_mask at once.
+static int run_cases(struct atomictest_context *ctx, const char *name, uint32_t crtc_mask,
+		     uint32_t *num_run)
+{
+	int failed = 0;
+	for (uint32_t i = 0; i < BS_ARRAY_LEN(cases); i++) {
+		if (strcmp(cases[i].name, name) && strcmp("all", name))
+			continue;
+
+		(*num_run)++;
+		int ret = enable_crtcs(ctx, crtc_mask);
+		if (ret)
+			return ret;
+
+		if (crtc_mask & (crtc_mask - 1)) {
+			ret = run_lockstep_testcase(ctx, crtc_mask, cases[i].test_func);
+		} else {
+			uint32_t crtc_index = 0;
+			while (!(crtc_mask & (1u << crtc_index)))
+				crtc_index++;
+			ret = run_testcase(ctx, &ctx->crtcs[crtc_index], cases[i].test_func);
+		}
+
+		if (ret < 0)
+			return ret;
+		if (ret & TEST_COMMIT_FAIL)
+			bs_debug_warning("%s failed test commit, testcase not run.", cases[i].name);
+		// The other cases still run, as the mismatch may be limited to this one.
+		if (ret & TEST_CAPTURE_FAIL) {
+			bs_debug_error("%s showed frames other than the expected ones",
+				       cases[i].name);
+			failed = -1;
+		}
+
+		ret = disable_crtcs(ctx, crtc_mask);
+		if (ret)
+			return ret;
+	}
+
+	return failed;
+}
+
+static void print_crtc_stats(struct atomictest_crtc *crtc)
+{
+	char stats_name[32];
+	snprintf(stats_name, sizeof(stats_name), "atomictest crtc %u", crtc->crtc_id);
+	int64_t commit_mean_ns = crtc->commits ? crtc->commit_ns / (int64_t)crtc->commits : 0;
+	if (json) {
+		bs_present_stats_print_json(crtc->present_stats, stats_name, stdout);
+		printf("{\"name\": \"%s\", \"commits\": %llu, \"shared_commits\": %llu, "
+		       "\"commit_mean_ns\": %lld}\n",
+		       stats_name, (unsigned long long)crtc->commits,
+		       (unsigned long long)crtc->shared_commits, (long long)commit_mean_ns);
+	} else {
+		bs_present_stats_print(crtc->present_stats, stats_name, stdout);
+		printf("  commits: %llu, %llu shared with other CRTCs, "
+		       "mean %.3f ms to the last flip\n",
+		       (unsigned long long)crtc->commits, (unsigned long long)crtc->shared_commits,
+		       commit_mean_ns / 1000000.0);
+	}
+}
+
 static int run_atomictest(const char *name, uint32_t crtc_mask)
 {
 	int ret = 0;
 	uint32_t num_run = 0;
+	int64_t start_ns = bs_debug_gettime_ns();
 	int fd = bs_drm_open_main_display();
 	CHECK_RESULT(fd);
 
@@ -1517,49 +3332,180 @@ static int run_atomictest(const char *name, uint32_t crtc_mask)
 		goto destroy_gbm_device;
 	}
 
-	struct atomictest_context *ctx = query_kms(fd);
+	// Snapshot after setting the client caps so that all planes are visible.
+	struct bs_kms_snapshot *snapshot = bs_kms_snapshot_new(fd);
+	if (!snapshot) {
+		bs_debug_error("failed to snapshot kms resources");
+		ret = -1;
+		goto destroy_gbm_device;
+	}
+
+	bo_pool = bs_bo_pool_new(gbm, BO_POOL_BUDGET);
+
+	if (record_path) {
+		commit_log = bs_commit_log_new(fd, record_path);
+		if (!commit_log) {
+			ret = -1;
+			goto destroy_bo_pool;
+		}
+	}
+
+	if (compose_expected)
+		compositor = bs_compositor_new(0);
+
+	// After the snapshot, which so leaves the writeback connector out of the tests' connectors.
+	if (use_writeback) {
+		writeback = bs_writeback_new(fd);
+		if (!writeback)
+			bs_debug_warning("no writeback connector, frames won't be captured");
+		else if (!bs_writeback_supports_format(writeback, DRM_FORMAT_XRGB8888))
+			bs_writeback_destroy(&writeback);
+	}
+
+	if (use_plane_caps) {
+		plane_caps = bs_plane_caps_new(snapshot, gbm, NULL);
+		struct bs_plane_caps_stats plane_caps_stats;
+		bs_plane_caps_get_stats(plane_caps, &plane_caps_stats);
+		if (plane_caps_stats.cached)
+			printf("Plane capabilities: %zu loaded from cache in %.3f ms\n",
+			       bs_plane_caps_count(plane_caps),
+			       plane_caps_stats.load_ns / 1000000.0);
+		else
+			printf("Plane capabilities: %zu probed with %llu TEST_ONLY checks in "
+			       "%.3f ms\n",
+			       bs_plane_caps_count(plane_caps),
+			       (unsigned long long)plane_caps_stats.checks,
+			       plane_caps_stats.load_ns / 1000000.0);
+	}
+
+	struct atomictest_context *ctx = query_kms(snapshot);
 	if (!ctx) {
 		bs_debug_error("querying atomictest failed.");
 		ret = -1;
-		goto destroy_gbm_device;
+		goto destroy_bo_pool;
 	}
 
-	struct atomictest_crtc *crtc;
+	uint32_t selected_mask = 0;
 	for (uint32_t crtc_index = 0; crtc_index < ctx->num_crtcs; crtc_index++) {
-		crtc = &ctx->crtcs[crtc_index];
 		if (!((1 << crtc_index) & crtc_mask))
 			continue;
 
-		for (uint32_t i = 0; i < BS_ARRAY_LEN(cases); i++) {
-			if (strcmp(cases[i].name, name) && strcmp("all", name))
-				continue;
-
-			num_run++;
-			ret = enable_crtc(ctx, crtc);
-			if (ret)
-				goto out;
+		selected_mask |= 1u << crtc_index;
+		ctx->crtcs[crtc_index].present_stats = bs_present_stats_new();
+	}
 
-			ret = run_testcase(ctx, crtc, cases[i].test_func);
-			if (ret < 0)
-				goto out;
-			else if (ret == TEST_COMMIT_FAIL)
-				bs_debug_warning("%s failed test commit, testcase not run.",
-						 cases[i].name);
+	if (concurrent) {
+		partition_planes(ctx, selected_mask);
+		ret = run_cases(ctx, name, selected_mask, &num_run);
+		if (ret)
+			goto out;
+	} else {
+		for (uint32_t crtc_index = 0; crtc_index < ctx->num_crtcs; crtc_index++) {
+			if (!(selected_mask & (1u << crtc_index)))
+				continue;
 
-			ret = disable_crtc(ctx, crtc);
+			ret = run_cases(ctx, name, 1u << crtc_index, &num_run);
 			if (ret)
 				goto out;
 		}
 	}
 
+	for (uint32_t crtc_index = 0; crtc_index < ctx->num_crtcs; crtc_index++) {
+		if (selected_mask & (1u << crtc_index))
+			print_crtc_stats(&ctx->crtcs[crtc_index]);
+	}
+
 	ret = (num_run == 0);
 
 out:
+	printf("Atomic requests: %llu commits carried %llu properties instead of %llu\n",
+	       (unsigned long long)ctx->commits, (unsigned long long)ctx->committed_props,
+	       (unsigned long long)ctx->committed_full_props);
+	if (fast)
+		printf("Fast mode: %llu commits checked with TEST_ONLY and coalesced\n",
+		       (unsigned long long)ctx->coalesced_commits);
+
+	struct bs_blob_cache_stats blob_stats;
+	bs_blob_cache_get_stats(ctx->blobs, &blob_stats);
+	printf("Blob cache: %llu hits, %llu misses, %llu evictions, %.3f ms creating blobs\n",
+	       (unsigned long long)blob_stats.hits, (unsigned long long)blob_stats.misses,
+	       (unsigned long long)blob_stats.evictions, blob_stats.create_ns / 1e6);
+	if (compositor) {
+		struct bs_compositor_stats compositor_stats;
+		bs_compositor_get_stats(compositor, &compositor_stats);
+		uint64_t frames = compositor_stats.frames ? compositor_stats.frames : 1;
+		printf("Expected frames: %llu composed on %u threads, mean %.3f ms, max %.3f ms, "
+		       "%llu layer tiles occluded, %llu frames skipped\n",
+		       (unsigned long long)compositor_stats.frames,
+		       bs_compositor_get_num_threads(compositor),
+		       compositor_stats.compose_ns / 1e6 / frames,
+		       compositor_stats.max_compose_ns / 1e6,
+		       (unsigned long long)compositor_stats.occluded,
+		       (unsigned long long)ctx->expected_skipped);
+		if (compositor_stats.scaled)
+			printf("Reference scaler: %llu layers, mean %.3f ms, %.0f Mpixel/s\n",
+			       (unsigned long long)compositor_stats.scaled,
+			       compositor_stats.scale_ns / 1e6 / compositor_stats.scaled,
+			       compositor_stats.scaled_pixels * 1e3 / compositor_stats.scale_ns);
+		if (compositor_stats.rotated)
+			printf("Reference rotation: %llu layers, mean %.3f ms\n",
+			       (unsigned long long)compositor_stats.rotated,
+			       compositor_stats.rotate_ns / 1e6 / compositor_stats.rotated);
+	}
+	if (writeback) {
+		struct bs_writeback_stats writeback_stats;
+		bs_writeback_get_stats(writeback, &writeback_stats);
+		uint64_t captures = writeback_stats.captures ? writeback_stats.captures : 1;
+		printf("Writeback: %llu captures, %llu matched, %llu differed, %llu timeouts, "
+		       "mean %.3f ms waiting, %.3f ms comparing\n",
+		       (unsigned long long)writeback_stats.captures,
+		       (unsigned long long)ctx->captures_matched,
+		       (unsigned long long)ctx->captures_differed,
+		       (unsigned long long)writeback_stats.timeouts,
+		       writeback_stats.wait_ns / 1e6 / captures,
+		       ctx->capture_compare_ns / 1e6 / captures);
+	}
+	if (ctx->software_rotations)
+		printf("Software rotation: %llu frames, mean %.3f ms, %.0f Mpixel/s\n",
+		       (unsigned long long)ctx->software_rotations,
+		       ctx->software_rotate_ns / 1e6 / ctx->software_rotations,
+		       ctx->software_rotated_pixels * 1e3 / ctx->software_rotate_ns);
 	free_context(ctx);
+
+	struct bs_drm_fb_cache_stats fb_cache_stats;
+	bs_drm_fb_cache_get_stats(&fb_cache_stats);
+	printf("Framebuffer cache: %llu hits, %llu misses\n",
+	       (unsigned long long)fb_cache_stats.hits, (unsigned long long)fb_cache_stats.misses);
+
+	struct bs_bo_pool_stats bo_pool_stats;
+	bs_bo_pool_get_stats(bo_pool, &bo_pool_stats);
+	printf("Buffer object pool: %llu allocations, %llu reuses, %.3f ms saved, %zu KiB peak\n",
+	       (unsigned long long)bo_pool_stats.allocations,
+	       (unsigned long long)bo_pool_stats.reuses, bo_pool_stats.saved_ns / 1000000.0,
+	       bo_pool_stats.peak_resident_bytes / 1024);
+destroy_bo_pool:
+	if (commit_log) {
+		struct bs_commit_log_stats commit_log_stats;
+		bs_commit_log_get_stats(commit_log, &commit_log_stats);
+		printf("Commit log: %llu commits in %llu KiB, %.3f ms spent recording\n",
+		       (unsigned long long)commit_log_stats.commits,
+		       (unsigned long long)commit_log_stats.bytes / 1024,
+		       commit_log_stats.overhead_ns / 1000000.0);
+		bs_commit_log_destroy(&commit_log);
+	}
+	if (plane_caps)
+		bs_plane_caps_destroy(&plane_caps);
+	if (compositor)
+		bs_compositor_destroy(&compositor);
+	if (writeback)
+		bs_writeback_destroy(&writeback);
+	bs_bo_pool_destroy(&bo_pool);
+	bs_kms_snapshot_destroy(&snapshot);
 destroy_gbm_device:
 	gbm_device_destroy(gbm);
 destroy_fd:
 	close(fd);
+	printf("Suite wall time: %.3f s\n", (bs_debug_gettime_ns() - start_ns) / 1e9);
 
 	return ret;
 }
@@ -1569,12 +3515,29 @@ static const struct option longopts[] = {
 	{ "test_name", required_argument, NULL, 't' },
 	{ "help", no_argument, NULL, 'h' },
 	{ "automatic", no_argument, NULL, 'a' },
+	{ "fast", no_argument, NULL, 'f' },
+	{ "modifiers", no_argument, NULL, 'm' },
+	{ "json", no_argument, NULL, 'j' },
+	{ "concurrent", no_argument, NULL, 'C' },
+	{ "plane_caps", no_argument, NULL, 'p' },
+	{ "record", required_argument, NULL, 'r' },
+	{ "expected", no_argument, NULL, 'e' },
+	{ "writeback", no_argument, NULL, 'w' },
 	{ 0, 0, 0, 0 },
 };
 
 static void print_help(const char *argv0)
 {
-	printf("usage: %s -t <test_name> -c <crtc_index> -a (if running automatically)\n", argv0);
+	printf("usage: %s -t <test_name> -c <crtc_index> -a (if running automatically) "
+	       "-f (automatic without any sleeps or unobserved commits) "
+	       "-m (to allocate with the planes' format modifiers) -j (to print stats as JSON) "
+	       "-C (to run on all selected CRTCs at once) "
+	       "-p (to skip what the planes were probed not to support, see $BSDRM_CACHE_DIR) "
+	       "-r <path> (to record the atomic commits for atomic_replay) "
+	       "-e (to compose the expected frame of every commit in software) "
+	       "-w (to capture committed frames with a writeback connector and compare them "
+	       "with the expected ones)\n",
+	       argv0);
 	printf("A valid name test is one the following:\n");
 	for (uint32_t i = 0; i < BS_ARRAY_LEN(cases); i++)
 		printf("%s\n", cases[i].name);
@@ -1587,11 +3550,37 @@ int main(int argc, char **argv)
 	char *name = NULL;
 	int32_t crtc_idx = -1;
 	uint32_t crtc_mask = ~0;
-	while ((c = getopt_long(argc, argv, "c:t:h:a", longopts, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "c:t:h:afmjCpr:ew", longopts, NULL)) != -1) {
 		switch (c) {
 			case 'a':
 				automatic = true;
 				break;
+			case 'f':
+				automatic = true;
+				fast = true;
+				break;
+			case 'm':
+				use_modifiers = true;
+				break;
+			case 'j':
+				json = true;
+				break;
+			case 'C':
+				concurrent = true;
+				break;
+			case 'p':
+				use_plane_caps = true;
+				break;
+			case 'r':
+				record_path = optarg;
+				break;
+			case 'e':
+				compose_expected = true;
+				break;
+			case 'w':
+				use_writeback = true;
+				compose_expected = true;
+				break;
 			case 'c':
 				if (sscanf(optarg, "%d", &crtc_idx) != 1)
 					goto print;
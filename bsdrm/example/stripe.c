@@ -4,63 +4,119 @@
  * found in the LICENSE file.
  */
 
+#include <getopt.h>
+
 #include "bs_drm.h"
 
-int main()
-{
-	drmModeConnector *connector;
-	struct bs_drm_pipe pipe = { 0 };
-	struct bs_drm_pipe_plumber *plumber = bs_drm_pipe_plumber_new();
-	bs_drm_pipe_plumber_connector_ptr(plumber, &connector);
-	if (!bs_drm_pipe_plumber_make(plumber, &pipe)) {
-		bs_debug_error("failed to make pipe");
-		return 1;
-	}
-	bs_drm_pipe_plumber_destroy(&plumber);
+// The stripes shift by 50 of 256 values every frame, so every 128th frame looks the same.
+#define STRIPE_PERIOD 128
 
-	int fd = pipe.fd;
-	drmModeModeInfo *mode = &connector->modes[0];
+static const struct option longopts[] = {
+	{ "buffers", required_argument, NULL, 'b' },
+	{ "mailbox", no_argument, NULL, 'm' },
+	{ "atomic", no_argument, NULL, 'a' },
+	{ "json", no_argument, NULL, 'j' },
+	{ "record", required_argument, NULL, 'r' },
+	{ "crc", no_argument, NULL, 'c' },
+	{ "help", no_argument, NULL, 'h' },
+	{ 0, 0, 0, 0 },
+};
 
-	struct gbm_device *gbm = gbm_create_device(fd);
-	if (!gbm) {
-		bs_debug_error("failed to create gbm");
-		return 1;
-	}
+static void print_help(const char *argv0)
+{
+	printf("usage: %s [-b <buffer count, 2 to 4>] [-m (to present in mailbox mode)]\n"
+	       "       [-a (to present with nonblocking atomic commits)]\n"
+	       "       [-j (to print presentation stats as JSON)]\n"
+	       "       [-r <path> (to record the atomic commits for atomic_replay)]\n"
+	       "       [-c (to check every frame against the driver's vkms style CRCs)]\n",
+	       argv0);
+}
 
-	struct gbm_bo *bos[2];
-	uint32_t ids[2];
-	for (size_t fb_index = 0; fb_index < 2; fb_index++) {
-		bos[fb_index] =
-		    gbm_bo_create(gbm, mode->hdisplay, mode->vdisplay, GBM_FORMAT_XRGB8888,
-				  GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
-		if (bos[fb_index] == NULL) {
-			bs_debug_error("failed to allocate frame buffer");
-			return 1;
-		}
-		ids[fb_index] = bs_drm_fb_create_gbm(bos[fb_index]);
-		if (ids[fb_index] == 0) {
-			bs_debug_error("failed to create framebuffer id");
-			return 1;
+int main(int argc, char **argv)
+{
+	size_t fb_count = 2;
+	enum bs_app_present_mode present_mode = BS_APP_PRESENT_FIFO;
+	bool atomic = false;
+	bool json = false;
+	const char *record_path = NULL;
+	bool check_crcs = false;
+	int c;
+	while ((c = getopt_long(argc, argv, "b:majr:ch", longopts, NULL)) != -1) {
+		switch (c) {
+			case 'b':
+				if (sscanf(optarg, "%zu", &fb_count) != 1 || fb_count < 2 ||
+				    fb_count > 4) {
+					print_help(argv[0]);
+					return 1;
+				}
+				break;
+			case 'm':
+				present_mode = BS_APP_PRESENT_MAILBOX;
+				break;
+			case 'a':
+				atomic = true;
+				break;
+			case 'j':
+				json = true;
+				break;
+			case 'r':
+				record_path = optarg;
+				break;
+			case 'c':
+				check_crcs = true;
+				break;
+			case 'h':
+				print_help(argv[0]);
+				return 0;
+			default:
+				print_help(argv[0]);
+				return 1;
 		}
 	}
 
+	struct bs_app *app = bs_app_new();
+	bs_app_set_fb_count(app, fb_count);
+	// The stripes are drawn by the CPU, which needs a linear layout.
+	bs_app_set_fb_flags(app, GBM_BO_USE_SCANOUT | GBM_BO_USE_LINEAR);
+	bs_app_set_present_mode(app, present_mode);
+	bs_app_set_atomic(app, atomic);
+	bs_app_set_commit_log_path(app, record_path);
+	if (check_crcs)
+		bs_app_set_crtc_crc_source(app, "auto");
+	if (!bs_app_setup(app)) {
+		bs_debug_error("failed to setup app");
+		bs_app_destroy(&app);
+		return 1;
+	}
+
 	struct bs_mapper *mapper = bs_mapper_dma_buf_new();
 	if (mapper == NULL) {
 		bs_debug_error("failed to create mapper object");
+		bs_app_destroy(&app);
 		return 1;
 	}
 
+	// Hashing a frame costs about as much as drawing it, so each is hashed only the first time.
+	uint32_t crcs[STRIPE_PERIOD];
+	bool has_crc[STRIPE_PERIOD] = { false };
+	int ret = 0;
 	for (size_t frame_index = 0; frame_index < 10000; frame_index++) {
-		size_t fb_index = frame_index % 2;
-		struct gbm_bo *bo = bos[fb_index];
+		int fb_index = bs_app_acquire_fb(app);
+		if (fb_index < 0) {
+			ret = 1;
+			break;
+		}
+
+		struct gbm_bo *bo = bs_app_fb_bo(app, fb_index);
 		void *map_data;
 		uint32_t stride;
 		char *ptr = bs_mapper_map(mapper, bo, 0, &map_data, &stride);
 		if (ptr == MAP_FAILED) {
 			bs_debug_error("failed to mmap gbm buffer object");
-			return 1;
+			ret = 1;
+			break;
 		}
-		size_t bo_size = stride * mode->vdisplay;
+		size_t bo_size = stride * gbm_bo_get_height(bo);
 
 		for (size_t i = 0; i < bo_size / 4; i++) {
 			ptr[i * 4 + 0] = (i + frame_index * 50) % 256;
@@ -68,28 +124,46 @@ int main()
 			ptr[i * 4 + 2] = (i + frame_index * 50 + 170) % 256;
 			ptr[i * 4 + 3] = 0;
 		}
+		size_t period_index = frame_index % STRIPE_PERIOD;
+		if (check_crcs && !has_crc[period_index]) {
+			crcs[period_index] = bs_crtc_crc_vkms(ptr, stride, gbm_bo_get_width(bo),
+							      gbm_bo_get_height(bo));
+			has_crc[period_index] = true;
+		}
 		bs_mapper_unmap(mapper, bo, map_data);
+		if (check_crcs)
+			bs_app_set_fb_crc(app, fb_index, crcs[period_index]);
 
-		int ret = drmModeSetCrtc(fd, pipe.crtc_id, ids[fb_index], 0 /* x */, 0 /* y */,
-					 &pipe.connector_id, 1 /* connector count */, mode);
-		if (ret) {
-			bs_debug_error("failed to set crtc: %d", ret);
-			return 1;
+		if (!bs_app_present_fb(app, fb_index)) {
+			bs_debug_error("failed to present frame %zu", frame_index);
+			ret = 1;
+			break;
 		}
-		usleep(16667);
 	}
 
-	bs_mapper_destroy(mapper);
-
-	for (size_t fb_index = 0; fb_index < 2; fb_index++) {
-		gbm_bo_destroy(bos[fb_index]);
-		drmModeRmFB(fd, ids[fb_index]);
+	struct bs_app_commit_stats stats;
+	bs_app_get_commit_stats(app, &stats);
+	printf("%llu commits, %llu refused as busy\n", (unsigned long long)stats.commits,
+	       (unsigned long long)stats.busy_count);
+	struct bs_crtc_crc *crtc_crc = bs_app_crtc_crc(app);
+	if (crtc_crc) {
+		struct bs_crtc_crc_stats crc_stats;
+		bs_crtc_crc_get_stats(crtc_crc, &crc_stats);
+		printf("%llu CRCs, %llu matched, %llu mismatched, %llu unchecked, "
+		       "read in %.3f ms\n",
+		       (unsigned long long)crc_stats.entries, (unsigned long long)crc_stats.matched,
+		       (unsigned long long)crc_stats.mismatched,
+		       (unsigned long long)crc_stats.unchecked, crc_stats.read_ns / 1e6);
+		if (crc_stats.mismatched)
+			ret = 1;
 	}
+	if (json)
+		bs_present_stats_print_json(bs_app_present_stats(app), "stripe", stdout);
+	else
+		bs_present_stats_print(bs_app_present_stats(app), "stripe", stdout);
 
-	gbm_device_destroy(gbm);
-
-	drmModeFreeConnector(connector);
-	close(fd);
+	bs_mapper_destroy(mapper);
+	bs_app_destroy(&app);
 
-	return 0;
+	return ret;
 }
@@ -53,6 +53,13 @@ __attribute__((format(printf, 5, 6))) void bs_debug_print(const char *prefix, co
 
 int64_t bs_debug_gettime_ns();
 
+// hash.c
+// The FNV-1a offset basis, to start a hash with.
+#define BS_HASH_INIT 0xcbf29ce484222325ull
+
+// Continues a 64-bit FNV-1a hash over the bytes. It is meant for cache keys, not for security.
+uint64_t bs_hash_bytes(uint64_t hash, const void *data, size_t size);
+
 // pipe.c
 typedef bool (*bs_make_pipe_piece)(void *context, void *out);
 
@@ -95,6 +102,36 @@ extern const uint32_t bs_drm_connectors_external_rank[];
 
 uint32_t bs_drm_connectors_rank(const uint32_t *ranks, uint32_t connector_type);
 
+// kms_snapshot.c
+struct bs_kms_snapshot;
+
+// A class that captures a card's resources, connectors, encoders, CRTCs and planes in one pass so
+// that later queries don't need any ioctls. The fd remains owned by the caller and must outlive the
+// snapshot. Returns NULL if the card has no mode setting resources.
+struct bs_kms_snapshot *bs_kms_snapshot_new(int fd);
+void bs_kms_snapshot_destroy(struct bs_kms_snapshot **snapshot);
+int bs_kms_snapshot_fd(struct bs_kms_snapshot *self);
+drmModeRes *bs_kms_snapshot_resources(struct bs_kms_snapshot *self);
+// The index based getters follow the order of drmModeRes and return NULL for objects that could not
+// be fetched.
+size_t bs_kms_snapshot_connector_count(struct bs_kms_snapshot *self);
+drmModeConnector *bs_kms_snapshot_connector(struct bs_kms_snapshot *self, size_t index);
+drmModeConnector *bs_kms_snapshot_find_connector(struct bs_kms_snapshot *self,
+						 uint32_t connector_id);
+// Returns a copy of a snapshot connector that outlives the snapshot and is freed with
+// drmModeFreeConnector.
+drmModeConnector *bs_kms_snapshot_copy_connector(const drmModeConnector *connector);
+drmModeEncoder *bs_kms_snapshot_find_encoder(struct bs_kms_snapshot *self, uint32_t encoder_id);
+size_t bs_kms_snapshot_crtc_count(struct bs_kms_snapshot *self);
+drmModeCrtc *bs_kms_snapshot_crtc(struct bs_kms_snapshot *self, size_t index);
+// Returns -1 if the CRTC is not part of the snapshot.
+int bs_kms_snapshot_find_crtc_index(struct bs_kms_snapshot *self, uint32_t crtc_id);
+size_t bs_kms_snapshot_plane_count(struct bs_kms_snapshot *self);
+drmModePlane *bs_kms_snapshot_plane(struct bs_kms_snapshot *self, size_t index);
+// Returns the union of possible_crtcs over all of the connector's encoders.
+uint32_t bs_kms_snapshot_connector_crtc_mask(struct bs_kms_snapshot *self,
+					     drmModeConnector *connector);
+
 // drm_pipe.c
 struct bs_drm_pipe {
 	int fd;  // Always owned by the user of this library
@@ -104,6 +141,16 @@ struct bs_drm_pipe {
 };
 struct bs_drm_pipe_plumber;
 
+// Why bs_drm_pipe_plumber_make_many could not make every pipe.
+enum bs_drm_pipe_plumber_error {
+	BS_DRM_PIPE_PLUMBER_OK,
+	// Fewer connectors are connected (and not skipped by the ranks) than pipes were requested.
+	BS_DRM_PIPE_PLUMBER_TOO_FEW_CONNECTORS,
+	// Enough connectors are connected, but their possible CRTCs and the CRTC mask don't allow
+	// driving that many of them at once.
+	BS_DRM_PIPE_PLUMBER_TOO_FEW_CRTCS,
+};
+
 // A class that makes pipes with certain constraints.
 struct bs_drm_pipe_plumber *bs_drm_pipe_plumber_new();
 void bs_drm_pipe_plumber_destroy(struct bs_drm_pipe_plumber **);
@@ -116,11 +163,20 @@ void bs_drm_pipe_plumber_crtc_mask(struct bs_drm_pipe_plumber *, uint32_t crtc_m
 // Sets which card fd the plumber should use. The fd remains owned by the caller. If left unset,
 // bs_drm_pipe_plumber_make will try all available cards.
 void bs_drm_pipe_plumber_fd(struct bs_drm_pipe_plumber *, int card_fd);
+// Sets a snapshot of the card the plumber should use instead of querying the card itself. The
+// snapshot remains owned by the caller and takes precedence over bs_drm_pipe_plumber_fd.
+void bs_drm_pipe_plumber_snapshot(struct bs_drm_pipe_plumber *, struct bs_kms_snapshot *snapshot);
 // Sets a pointer to store the chosen connector in after a succesful call to
 // bs_drm_pipe_plumber_make. It's optional, but calling drmModeGetConnector yourself can be slow.
 void bs_drm_pipe_plumber_connector_ptr(struct bs_drm_pipe_plumber *, drmModeConnector **ptr);
 // Makes the pipe based on the constraints of the plumber. Returns false if no pipe worked.
 bool bs_drm_pipe_plumber_make(struct bs_drm_pipe_plumber *, struct bs_drm_pipe *pipe);
+// Makes pipe_count pipes that can all be used at the same time, each with its own connector and
+// CRTC. Among all such sets, the one with the best connector ranks is chosen. Returns false and
+// stores the reason in error, which can be NULL, if there is no such set. The connector pointer is
+// not filled in.
+bool bs_drm_pipe_plumber_make_many(struct bs_drm_pipe_plumber *, struct bs_drm_pipe *pipes,
+				   size_t pipe_count, enum bs_drm_pipe_plumber_error *error);
 
 // Makes any pipe that will work for the given card fd. Returns false if no pipe worked.
 bool bs_drm_pipe_make(int fd, struct bs_drm_pipe *pipe);
@@ -135,6 +191,9 @@ void bs_drm_fb_builder_destroy(struct bs_drm_fb_builder **);
 void bs_drm_fb_builder_gbm_bo(struct bs_drm_fb_builder *, struct gbm_bo *bo);
 // Sets the drm format parameter of the resulting framebuffer.
 void bs_drm_fb_builder_format(struct bs_drm_fb_builder *, uint32_t format);
+// Sets the format modifier of every plane of the resulting framebuffer. DRM_FORMAT_MOD_INVALID, the
+// default, leaves the layout up to the driver, as do cards without modifier support.
+void bs_drm_fb_builder_modifier(struct bs_drm_fb_builder *, uint64_t modifier);
 // Creates the framebuffer ID from the previously set parameters and returns it or 0 if there was a
 // failure.
 uint32_t bs_drm_fb_builder_create_fb(struct bs_drm_fb_builder *);
@@ -143,13 +202,514 @@ uint32_t bs_drm_fb_builder_create_fb(struct bs_drm_fb_builder *);
 // success or 0 on failure.
 uint32_t bs_drm_fb_create_gbm(struct gbm_bo *bo);
 
+// Counts of cached framebuffer requests that were answered from the cache or had to create one.
+struct bs_drm_fb_cache_stats {
+	uint64_t hits;
+	uint64_t misses;
+};
+
+// Same as bs_drm_fb_create_gbm(), but the framebuffer is kept with the buffer object and handed
+// out again for later requests of the same format and modifier. The framebuffer is removed when the
+// buffer object is destroyed, so callers must not remove it themselves. This takes over the buffer
+// object's user data.
+uint32_t bs_drm_fb_create_gbm_cached(struct gbm_bo *bo);
+// Same as bs_drm_fb_create_gbm_cached(), but the framebuffer uses the given format instead of the
+// buffer object's.
+uint32_t bs_drm_fb_create_gbm_format_cached(struct gbm_bo *bo, uint32_t format);
+// Gets the cache counts of every bs_drm_fb_create_gbm_cached() call so far.
+void bs_drm_fb_cache_get_stats(struct bs_drm_fb_cache_stats *stats);
+
+// bo_pool.c
+struct bs_bo_pool;
+
+struct bs_bo_pool_stats {
+	// Buffer objects created by the pool and the time spent creating them.
+	uint64_t allocations;
+	int64_t allocation_ns;
+	// Acquisitions answered with an idle buffer object and the creation time that avoided.
+	uint64_t reuses;
+	int64_t saved_ns;
+	// Memory of every buffer object the pool holds, whether acquired or idle.
+	size_t resident_bytes;
+	size_t peak_resident_bytes;
+};
+
+// A pool that recycles buffer objects of matching size, format, usage flags and modifier. Released
+// buffer objects are kept idle, along with any cached framebuffers, until they are acquired again
+// or the idle ones exceed the given budget in bytes, at which point the oldest are destroyed.
+struct bs_bo_pool *bs_bo_pool_new(struct gbm_device *gbm, size_t budget);
+void bs_bo_pool_destroy(struct bs_bo_pool **);
+// Returns a buffer object created with gbm_bo_create() or an idle one with the same parameters.
+struct gbm_bo *bs_bo_pool_acquire(struct bs_bo_pool *, uint32_t width, uint32_t height,
+				  uint32_t format, uint32_t flags);
+// Same as bs_bo_pool_acquire(), but the buffer object is an idle one with any of the given
+// modifiers or is created with gbm_bo_create_with_modifiers(), which ignores the flags. Cursors are
+// the exception: they are created linear with their flags, so the modifiers have to include
+// DRM_FORMAT_MOD_LINEAR.
+struct gbm_bo *bs_bo_pool_acquire_modifiers(struct bs_bo_pool *, uint32_t width, uint32_t height,
+					    uint32_t format, uint32_t flags,
+					    const uint64_t *modifiers, size_t modifier_count);
+// Returns a buffer object to the pool instead of destroying it.
+void bs_bo_pool_release(struct bs_bo_pool *, struct gbm_bo *bo);
+void bs_bo_pool_get_stats(struct bs_bo_pool *, struct bs_bo_pool_stats *stats);
+
+// blob_cache.c
+struct bs_blob_cache;
+
+struct bs_blob_cache_stats {
+	// Requests answered with an existing blob and requests that created one.
+	uint64_t hits;
+	uint64_t misses;
+	// Blobs destroyed to stay within capacity.
+	uint64_t evictions;
+	// Time spent in drmModeCreatePropertyBlob.
+	int64_t create_ns;
+};
+
+// A cache of property blobs, e.g. modes, CTMs and gamma LUTs, keyed by their contents. Blobs nobody
+// holds are kept until the cache is over capacity, at which point the least recently used ones are
+// destroyed.
+struct bs_blob_cache *bs_blob_cache_new(int fd, size_t capacity);
+void bs_blob_cache_destroy(struct bs_blob_cache **);
+// Returns the id of a held blob with the given contents, creating it if no cached one has them, or
+// 0 on failure.
+uint32_t bs_blob_cache_get(struct bs_blob_cache *, const void *data, size_t length);
+// Lets go of a blob from bs_blob_cache_get(). It stays cached, and valid, until evicted.
+void bs_blob_cache_put(struct bs_blob_cache *, uint32_t id);
+void bs_blob_cache_get_stats(struct bs_blob_cache *, struct bs_blob_cache_stats *stats);
+
+// color.c
+struct bs_color_pipeline;
+
+// Software model of the KMS color pipeline for XRGB8888 and ARGB8888 pixels: a per-channel degamma
+// LUT, the 3x3 CTM in the kernel's S31.32 sign-magnitude format, then a per-channel gamma LUT. Any
+// stage may be NULL to leave it out. LUT entries are interpolated linearly like the kernel
+// documents, and alpha passes through.
+struct bs_color_pipeline *bs_color_pipeline_new(const struct drm_color_lut *degamma,
+						size_t degamma_size, const int64_t *ctm,
+						const struct drm_color_lut *gamma,
+						size_t gamma_size);
+void bs_color_pipeline_destroy(struct bs_color_pipeline **);
+// Maps one pixel in double precision. This is the reference bs_color_pipeline_apply() follows.
+uint32_t bs_color_pipeline_apply_pixel(const struct bs_color_pipeline *, uint32_t pixel);
+// Maps a whole image using tables and vectors, within one step per channel of the reference. The
+// source and destination may be the same.
+void bs_color_pipeline_apply(const struct bs_color_pipeline *, const void *src,
+			     uint32_t src_stride, void *dst, uint32_t dst_stride, uint32_t width,
+			     uint32_t height);
+
+// scale.c
+enum bs_scale_filter {
+	BS_SCALE_NEAREST,
+	BS_SCALE_BILINEAR,
+};
+
+// An image of 32-bit pixels, in any channel order, and the rectangle of it to scale in 16.16
+// fixed point like a plane's SRC_* properties.
+struct bs_scale_source {
+	const void *data;
+	uint32_t stride;
+	uint32_t width;
+	uint32_t height;
+	uint32_t x;
+	uint32_t y;
+	uint32_t w;
+	uint32_t h;
+};
+
+// Scales the source rectangle to fill the destination the way plane scalers do, sampling at pixel
+// centers and clamping to the rectangle's edge pixels. Bilinear weights are 8-bit, so results can
+// differ from hardware filters by a step or two per channel.
+void bs_scale(const struct bs_scale_source *src, enum bs_scale_filter filter, void *dst,
+	      uint32_t dst_stride, uint32_t dst_width, uint32_t dst_height);
+
+struct bs_image_diff {
+	// Pixels with a channel off by more than the tolerance, and the first of them.
+	uint64_t pixels;
+	uint32_t first_x;
+	uint32_t first_y;
+	// Largest difference of any channel, within the tolerance or not.
+	uint8_t max_channel_diff;
+};
+
+// Compares the color channels of two XRGB8888 images. Returns true if none differs by more than
+// tolerance.
+bool bs_image_compare(const void *a, uint32_t a_stride, const void *b, uint32_t b_stride,
+		      uint32_t width, uint32_t height, uint8_t tolerance,
+		      struct bs_image_diff *diff);
+
+// rotate.c
+// Bits of the "rotation" plane property, for libdrm headers that predate them.
+#ifndef DRM_MODE_ROTATE_0
+#define DRM_MODE_ROTATE_0 (1 << 0)
+#define DRM_MODE_ROTATE_90 (1 << 1)
+#define DRM_MODE_ROTATE_180 (1 << 2)
+#define DRM_MODE_ROTATE_270 (1 << 3)
+#define DRM_MODE_REFLECT_X (1 << 4)
+#define DRM_MODE_REFLECT_Y (1 << 5)
+#endif
+#ifndef DRM_MODE_ROTATE_MASK
+#define DRM_MODE_ROTATE_MASK                                                                 \
+	(DRM_MODE_ROTATE_0 | DRM_MODE_ROTATE_90 | DRM_MODE_ROTATE_180 | DRM_MODE_ROTATE_270)
+#endif
+
+// Writes one plane of width x height elements of cpp (1, 2 or 4) bytes to dst the way a display
+// plane with the given rotation property value scans it out. Chroma planes rotate like any other
+// at their own size, with NV12's CbCr pairs as 2-byte elements. Returns false for unsupported
+// values.
+bool bs_rotate_plane(const void *src, uint32_t src_stride, uint32_t width, uint32_t height,
+		     uint32_t cpp, uint32_t rotation, void *dst, uint32_t dst_stride);
+// Size of a width x height plane after rotation; 90 and 270 swap them.
+void bs_rotate_size(uint32_t rotation, uint32_t width, uint32_t height, uint32_t *rotated_width,
+		    uint32_t *rotated_height);
+
+// compositor.c
+struct bs_compositor;
+
+// Values of the kernel's "pixel blend mode" plane property.
+enum bs_compositor_blend_mode {
+	BS_COMPOSITOR_BLEND_NONE,
+	BS_COMPOSITOR_BLEND_PREMULTIPLIED,
+	BS_COMPOSITOR_BLEND_COVERAGE,
+};
+
+// A plane as the CRTC sees it. The rectangles are those of the plane properties, so the source is
+// in 16.16 fixed point.
+struct bs_compositor_layer {
+	uint32_t format;
+	// Mapped framebuffer planes. Only NV12 uses the second.
+	const void *data[2];
+	uint32_t strides[2];
+	uint32_t src_x;
+	uint32_t src_y;
+	uint32_t src_w;
+	uint32_t src_h;
+	int32_t crtc_x;
+	int32_t crtc_y;
+	uint32_t crtc_w;
+	uint32_t crtc_h;
+	uint64_t zpos;
+	// Plane alpha, 0xffff being opaque.
+	uint16_t alpha;
+	enum bs_compositor_blend_mode blend_mode;
+	// How a scaled layer is filtered.
+	enum bs_scale_filter filter;
+	// Value of the plane's rotation property, 0 meaning DRM_MODE_ROTATE_0.
+	uint32_t rotation;
+};
+
+struct bs_compositor_stats {
+	uint64_t frames;
+	// Layer tiles skipped because an opaque layer above covered them.
+	uint64_t occluded;
+	int64_t compose_ns;
+	int64_t max_compose_ns;
+	// Layers filtered bilinearly ahead of composition, which compose_ns includes, and their
+	// destination pixels.
+	uint64_t scaled;
+	uint64_t scaled_pixels;
+	int64_t scale_ns;
+	// Layers rotated or reflected ahead of composition, also part of compose_ns.
+	uint64_t rotated;
+	int64_t rotate_ns;
+};
+
+// A software stand-in for a CRTC's plane blending, for working out what a commit should put on
+// screen. The frame is split into tiles composed by num_threads threads, or one per CPU if 0.
+struct bs_compositor *bs_compositor_new(uint32_t num_threads);
+void bs_compositor_destroy(struct bs_compositor **);
+// Composes the layers in zpos order over black into an XRGB8888 frame. Returns false, leaving the
+// frame alone, if a layer's format isn't one of XRGB8888, ARGB8888, XBGR8888, ABGR8888, RGB565 or
+// NV12, or its rotation isn't a single angle with optional reflections.
+bool bs_compositor_compose(struct bs_compositor *, const struct bs_compositor_layer *layers,
+			   size_t count, void *dst, uint32_t dst_stride, uint32_t width,
+			   uint32_t height);
+uint32_t bs_compositor_get_num_threads(struct bs_compositor *);
+void bs_compositor_get_stats(struct bs_compositor *, struct bs_compositor_stats *stats);
+
+// drm_modifiers.c
+#define BS_DRM_MAX_MODIFIERS 32
+// Fills modifiers with up to max_count of the modifiers the plane's IN_FORMATS property lists for
+// the format, in the driver's order, and returns how many it filled. Returns 0 if the plane has no
+// IN_FORMATS property or doesn't support the format.
+size_t bs_drm_plane_modifiers(int fd, uint32_t plane_id, uint32_t format, uint64_t *modifiers,
+			      size_t max_count);
+// Returns the primary plane of the given CRTC or 0 if there is none. The fd needs
+// DRM_CLIENT_CAP_UNIVERSAL_PLANES, without which no primary plane is listed.
+uint32_t bs_drm_primary_plane(int fd, uint32_t crtc_id);
+// Creates a buffer object that the plane can scan out, letting gbm pick the best of the plane's
+// modifiers for the format. Usage flags can't be combined with modifiers in gbm, so they only
+// apply when the plane lists no modifiers or none of them could be allocated, in which case this
+// falls back to gbm_bo_create().
+struct gbm_bo *bs_drm_bo_create_for_plane(struct gbm_device *gbm, uint32_t plane_id,
+					  uint32_t width, uint32_t height, uint32_t format,
+					  uint32_t flags);
+
+// plane_caps.c
+struct bs_plane_caps;
+
+// A combination of plane, format and modifier along with the range of scaling factors, as the ratio
+// of destination to source size in 16.16 fixed point, that passed a TEST_ONLY commit. Both are 0
+// if the plane can't scan out the format with the modifier at all. DRM_FORMAT_MOD_INVALID stands
+// for buffers allocated without modifiers. This is also the layout of the cache file.
+struct bs_plane_cap {
+	uint32_t plane_id;
+	uint32_t format;
+	uint64_t modifier;
+	uint32_t min_scale;
+	uint32_t max_scale;
+};
+
+struct bs_plane_caps_stats {
+	// Whether the capabilities came from the cache file instead of probing.
+	bool cached;
+	// TEST_ONLY commits made while probing.
+	uint64_t checks;
+	// Time spent loading or probing the capabilities.
+	int64_t load_ns;
+};
+
+// A class that knows what every plane of the snapshot's card can scan out. The answers are mapped
+// from a cache file in cache_dir, or the first of $BSDRM_CACHE_DIR, $XDG_CACHE_HOME and /tmp that
+// is set if that is NULL, that is keyed by the driver's name and version and by the connectors,
+// their modes and the planes. Without a matching file, every plane is probed with TEST_ONLY
+// commits, with a full screen primary plane under the others, and the file is written for later
+// runs. The card needs DRM_CLIENT_CAP_UNIVERSAL_PLANES and DRM_CLIENT_CAP_ATOMIC before the
+// snapshot is taken.
+struct bs_plane_caps *bs_plane_caps_new(struct bs_kms_snapshot *snapshot, struct gbm_device *gbm,
+					const char *cache_dir);
+void bs_plane_caps_destroy(struct bs_plane_caps **);
+size_t bs_plane_caps_count(struct bs_plane_caps *);
+const struct bs_plane_cap *bs_plane_caps_get(struct bs_plane_caps *, size_t index);
+// Returns NULL if the combination wasn't probed, e.g. because the plane doesn't list the format or
+// couldn't be shown over its CRTC's primary plane.
+const struct bs_plane_cap *bs_plane_caps_find(struct bs_plane_caps *, uint32_t plane_id,
+					      uint32_t format, uint64_t modifier);
+// Return whether the plane scans out the format, with the modifier or with any of them, at the
+// scale on each axis. Scales between the probed powers of two past the last one that passed are
+// treated as unsupported.
+bool bs_plane_caps_supports(struct bs_plane_caps *, uint32_t plane_id, uint32_t format,
+			    uint64_t modifier, uint32_t scale_x, uint32_t scale_y);
+bool bs_plane_caps_supports_any(struct bs_plane_caps *, uint32_t plane_id, uint32_t format,
+				uint32_t scale_x, uint32_t scale_y);
+void bs_plane_caps_get_stats(struct bs_plane_caps *, struct bs_plane_caps_stats *stats);
+
+// commit_log.c
+struct bs_commit_log;
+struct bs_commit_log_reader;
+
+// A log is a header followed by records, each starting on an 8 byte boundary with this.
+struct bs_commit_log_record {
+	uint32_t type;
+	// Size of the payload that follows, not counting padding.
+	uint32_t size;
+};
+
+enum bs_commit_log_record_type {
+	// struct bs_commit_log_objects, written once at the start.
+	BS_COMMIT_LOG_RECORD_OBJECTS,
+	// struct bs_commit_log_property, written before the first commit that uses it.
+	BS_COMMIT_LOG_RECORD_PROPERTY,
+	// struct bs_commit_log_blob, written whenever a commit uses a blob id with new contents.
+	BS_COMMIT_LOG_RECORD_BLOB,
+	// struct bs_commit_log_fb, written whenever a commit uses a framebuffer id with a new size.
+	BS_COMMIT_LOG_RECORD_FB,
+	// struct bs_commit_log_commit.
+	BS_COMMIT_LOG_RECORD_COMMIT,
+};
+
+enum bs_commit_log_object_type {
+	BS_COMMIT_LOG_CRTCS,
+	BS_COMMIT_LOG_CONNECTORS,
+	BS_COMMIT_LOG_PLANES,
+	BS_COMMIT_LOG_OBJECT_TYPES,
+};
+
+// The card's objects in the order the kernel lists them, which a replay maps by index.
+struct bs_commit_log_objects {
+	uint32_t counts[BS_COMMIT_LOG_OBJECT_TYPES];
+	uint32_t ids[];
+};
+
+struct bs_commit_log_property {
+	uint32_t prop_id;
+	uint32_t flags;
+	char name[DRM_PROP_NAME_LEN];
+};
+
+struct bs_commit_log_blob {
+	uint32_t blob_id;
+	uint32_t length;
+	uint8_t data[];
+};
+
+// GETFB doesn't report the format, so only the size and depth are known.
+struct bs_commit_log_fb {
+	uint32_t fb_id;
+	uint32_t width;
+	uint32_t height;
+	uint32_t bpp;
+	uint32_t depth;
+};
+
+struct bs_commit_log_item {
+	uint32_t object_id;
+	uint32_t prop_id;
+	uint64_t value;
+};
+
+// Values are as given to the kernel, so IN_FENCE_FD is an fd and OUT_FENCE_PTR a pointer.
+struct bs_commit_log_commit {
+	// When the commit was made relative to the creation of the log.
+	int64_t time_ns;
+	// How long drmModeAtomicCommit took.
+	int64_t duration_ns;
+	uint32_t flags;
+	int32_t ret;
+	uint32_t count;
+	uint32_t reserved;
+	struct bs_commit_log_item items[];
+};
+
+struct bs_commit_log_stats {
+	uint64_t commits;
+	uint64_t bytes;
+	uint64_t write_errors;
+	// Time spent outside of drmModeAtomicCommit to record the commits.
+	int64_t overhead_ns;
+};
+
+// Creates a log at path of the atomic commits made on the card. Returns NULL if the file can't be
+// created.
+struct bs_commit_log *bs_commit_log_new(int fd, const char *path);
+void bs_commit_log_destroy(struct bs_commit_log **);
+// Forward to drmModeAtomicAddProperty, drmModeAtomicSetCursor and drmModeAtomicCommit. With a
+// non-NULL log the request's properties are noted and then recorded with the commit, so every
+// change to the request has to go through these.
+int bs_commit_log_add_property(struct bs_commit_log *, drmModeAtomicReqPtr req,
+			       uint32_t object_id, uint32_t prop_id, uint64_t value);
+void bs_commit_log_set_cursor(struct bs_commit_log *, drmModeAtomicReqPtr req, int cursor);
+int bs_commit_log_commit(struct bs_commit_log *, int fd, drmModeAtomicReqPtr req, uint32_t flags,
+			 void *user_data);
+void bs_commit_log_get_stats(struct bs_commit_log *, struct bs_commit_log_stats *stats);
+// Maps a log for reading. Returns NULL if it isn't a log of this version.
+struct bs_commit_log_reader *bs_commit_log_reader_new(const char *path);
+void bs_commit_log_reader_destroy(struct bs_commit_log_reader **);
+// Returns the next record, whose payload follows it, or NULL at the end of the log.
+const struct bs_commit_log_record *bs_commit_log_reader_next(struct bs_commit_log_reader *);
+
+// writeback.c
+#ifndef DRM_CLIENT_CAP_WRITEBACK_CONNECTORS
+#define DRM_CLIENT_CAP_WRITEBACK_CONNECTORS 5
+#endif
+#ifndef DRM_MODE_CONNECTOR_WRITEBACK
+#define DRM_MODE_CONNECTOR_WRITEBACK 18
+#endif
+
+struct bs_writeback;
+
+struct bs_writeback_stats {
+	// Captures whose fence signaled, and those that timed out.
+	uint64_t captures;
+	uint64_t timeouts;
+	// Time spent waiting for the fences.
+	int64_t wait_ns;
+};
+
+// A class that captures what a CRTC composes through the card's writeback connector. Creating it
+// sets DRM_CLIENT_CAP_WRITEBACK_CONNECTORS, which needs DRM_CLIENT_CAP_ATOMIC and makes the
+// connector show up in later resource listings of fd. Returns NULL if the card has none.
+struct bs_writeback *bs_writeback_new(int fd);
+void bs_writeback_destroy(struct bs_writeback **);
+uint32_t bs_writeback_connector_id(struct bs_writeback *);
+// Bitmask of the CRTC indices the connector can be bound to.
+uint32_t bs_writeback_possible_crtcs(struct bs_writeback *);
+bool bs_writeback_supports_format(struct bs_writeback *, uint32_t format);
+// Adds binding the connector to crtc_id, or unbinding it for 0, to the request. Either is a
+// modeset.
+int bs_writeback_attach(struct bs_writeback *, struct bs_commit_log *log, drmModeAtomicReqPtr req,
+			uint32_t crtc_id);
+// Adds capturing the next frame of the bound CRTC into fb_id to the request. The framebuffer has
+// to be the size of the CRTC's mode in one of the connector's formats.
+int bs_writeback_queue(struct bs_writeback *, struct bs_commit_log *log, drmModeAtomicReqPtr req,
+		       uint32_t fb_id);
+// Waits for the capture queued by the last committed request to be written. Returns 0 once it is,
+// -ETIMEDOUT after timeout_ms and -ENOENT if no capture was committed.
+int bs_writeback_wait(struct bs_writeback *, int timeout_ms);
+void bs_writeback_get_stats(struct bs_writeback *, struct bs_writeback_stats *stats);
+
+// crtc_crc.c
+#define BS_CRTC_CRC_MAX_VALUES 10
+
+struct bs_crtc_crc;
+
+struct bs_crtc_crc_entry {
+	// Drivers that can't tell which frame an entry belongs to leave has_frame unset.
+	bool has_frame;
+	uint32_t frame;
+	size_t value_count;
+	uint32_t values[BS_CRTC_CRC_MAX_VALUES];
+};
+
+struct bs_crtc_crc_stats {
+	// Entries read, and how the first value of each compared to its expected CRC. Unchecked
+	// entries came before any expectation or had no frame number.
+	uint64_t entries;
+	uint64_t matched;
+	uint64_t mismatched;
+	uint64_t unchecked;
+	// Time spent reading and parsing entries.
+	int64_t read_ns;
+};
+
+// A class that reads the CRCs a driver computes of every frame a CRTC scans out, through
+// crtc-<index>/crc in the card's debugfs directory. Selects source, e.g. "auto", and starts
+// capturing, which needs the CRTC to be active. Returns NULL if debugfs is unavailable.
+struct bs_crtc_crc *bs_crtc_crc_new(int fd, uint32_t crtc_id, const char *source);
+void bs_crtc_crc_destroy(struct bs_crtc_crc **);
+// The data file, which polls readable once entries arrive.
+int bs_crtc_crc_fd(struct bs_crtc_crc *);
+// Expects frame and every frame after it to have crc, until a later expectation.
+void bs_crtc_crc_expect(struct bs_crtc_crc *, uint32_t frame, uint32_t crc);
+// Leaves frame and the frames after it unchecked, until a later expectation.
+void bs_crtc_crc_expect_unknown(struct bs_crtc_crc *, uint32_t frame);
+// Queues the entries that arrived without waiting for more. Returns how many or -errno.
+int bs_crtc_crc_read(struct bs_crtc_crc *);
+// Compares the queued entries with their expectations.
+void bs_crtc_crc_check(struct bs_crtc_crc *);
+// Like bs_crtc_crc_check() but only up to last_frame. Later entries stay queued, e.g. while the
+// flip that decides their expected CRC may still be pending.
+void bs_crtc_crc_check_until(struct bs_crtc_crc *, uint32_t last_frame);
+void bs_crtc_crc_get_stats(struct bs_crtc_crc *, struct bs_crtc_crc_stats *stats);
+// The CRC vkms reports for an XRGB8888 frame: the kernel's crc32_le, seeded with 0, over every
+// pixel with its alpha byte cleared.
+uint32_t bs_crtc_crc_vkms(const void *pixels, uint32_t stride, uint32_t width, uint32_t height);
+
 // drm_open.c
 // Opens an arbitrary display's card.
 int bs_drm_open_for_display();
 // Opens the main display's card. This falls back to bs_drm_open_for_display().
 int bs_drm_open_main_display();
+// Same as bs_drm_open_main_display(), but also hands out the snapshot taken while ranking the card.
+// The caller owns the snapshot, which is NULL if no card was found.
+int bs_drm_open_main_display_snapshot(struct bs_kms_snapshot **snapshot);
 int bs_drm_open_vgem();
 
+// drm_sysfs.c
+struct bs_drm_sysfs_card {
+	unsigned minor;    // N of /dev/dri/cardN
+	char driver[32];   // Empty if unknown
+	size_t connector_count;
+	// Connectors whose status is connected or unknown
+	size_t connected_count;
+	// Best rank among connected connectors in bs_drm_connectors_main_rank order or bs_rank_skip
+	uint32_t best_connector_rank;
+};
+
+// Lists the cards in /sys/class/drm sorted by minor without opening or querying any of them.
+// Returns the number of cards or -1 if sysfs is unavailable.
+int bs_drm_sysfs_cards(struct bs_drm_sysfs_card *cards, size_t max_cards);
+
 // egl.c
 struct bs_egl;
 struct bs_egl_fb;
@@ -187,18 +747,104 @@ GLuint bs_gl_shader_create(GLenum type, const GLchar *src);
 GLuint bs_gl_program_create_vert_frag_bind(const GLchar *vert_src, const GLchar *frag_src,
 					   struct bs_gl_program_create_binding *bindings);
 
+// present_stats.c
+struct bs_present_stats;
+
+struct bs_present_stats_summary {
+	// Frames whose flip completed.
+	size_t frames;
+	// Flip-to-flip intervals between those frames.
+	size_t intervals;
+	int64_t interval_mean_ns;
+	// Standard deviation of the intervals.
+	int64_t interval_jitter_ns;
+	int64_t interval_max_ns;
+	// Vblanks between consecutive flips beyond the one each flip needed.
+	uint64_t missed_vblanks;
+	// Percentiles of the time from submitting a frame to its flip completing.
+	int64_t latency_p50_ns;
+	int64_t latency_p90_ns;
+	int64_t latency_p99_ns;
+	int64_t latency_max_ns;
+};
+
+// A class that records when frames are submitted and when their flips complete. Flips are matched
+// to submissions in order, so one recorder serves one CRTC.
+struct bs_present_stats *bs_present_stats_new();
+void bs_present_stats_destroy(struct bs_present_stats **self);
+// Records that a frame is about to be submitted for flipping.
+void bs_present_stats_submit(struct bs_present_stats *self);
+// Records a submission that started at the given CLOCK_MONOTONIC time, for callers that only know
+// whether the frame went through after it returned.
+void bs_present_stats_submit_at(struct bs_present_stats *self, int64_t submit_ns);
+// Records a flip completion with the arguments of the drm page flip handler.
+void bs_present_stats_flip(struct bs_present_stats *self, unsigned int sequence,
+			   unsigned int tv_sec, unsigned int tv_usec);
+void bs_present_stats_summarize(struct bs_present_stats *self,
+				struct bs_present_stats_summary *summary);
+// Prints the summary for humans or as a single line JSON object.
+void bs_present_stats_print(struct bs_present_stats *self, const char *name, FILE *out);
+void bs_present_stats_print_json(struct bs_present_stats *self, const char *name, FILE *out);
+
 // app.c
 struct bs_app;
 
+enum bs_app_present_mode {
+	// Every presented framebuffer is shown for at least one refresh, in order.
+	BS_APP_PRESENT_FIFO,
+	// A presented framebuffer replaces any that is still waiting to be shown.
+	BS_APP_PRESENT_MAILBOX,
+};
+
+struct bs_app_commit_stats {
+	// Modesets, page flips or atomic commits the kernel accepted.
+	uint64_t commits;
+	// Nonblocking atomic commits refused with EBUSY because the previous one was still pending.
+	uint64_t busy_count;
+};
+
 struct bs_app *bs_app_new();
 void bs_app_destroy(struct bs_app **app);
 int bs_app_fd(struct bs_app *self);
 size_t bs_app_fb_count(struct bs_app *self);
 void bs_app_set_fb_count(struct bs_app *self, size_t fb_count);
+// Sets the gbm usage flags of the framebuffers, GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING by
+// default. GBM_BO_USE_LINEAR keeps them out of tiled layouts, e.g. for CPU drawing.
+void bs_app_set_fb_flags(struct bs_app *self, uint32_t flags);
+void bs_app_set_present_mode(struct bs_app *self, enum bs_app_present_mode mode);
+// Presents with nonblocking atomic commits instead of legacy page flips. Must be set before
+// bs_app_setup(), which fails if the card lacks atomic support.
+void bs_app_set_atomic(struct bs_app *self, bool atomic);
+// Records the atomic commits to a bs_commit_log at path. Must be set before bs_app_setup() and only
+// applies to atomic apps.
+void bs_app_set_commit_log_path(struct bs_app *self, const char *path);
+// Checks every frame against the CRCs the driver computes from source, e.g. "auto", starting once
+// the first frame lights the CRTC. Frames are only checked if given a CRC by bs_app_set_fb_crc().
+// Must be set before bs_app_setup().
+void bs_app_set_crtc_crc_source(struct bs_app *self, const char *source);
+// Returns the CRC reader, which remains owned by the app, or NULL until it has started.
+struct bs_crtc_crc *bs_app_crtc_crc(struct bs_app *self);
+void bs_app_get_commit_stats(struct bs_app *self, struct bs_app_commit_stats *stats);
+// Returns the app's record of its frames' presentation, which remains owned by the app.
+struct bs_present_stats *bs_app_present_stats(struct bs_app *self);
 struct gbm_bo *bs_app_fb_bo(struct bs_app *self, size_t index);
 uint32_t bs_app_fb_id(struct bs_app *self, size_t index);
+// Sets the CRC expected while an acquired framebuffer is on screen, e.g. from bs_crtc_crc_vkms().
+void bs_app_set_fb_crc(struct bs_app *self, size_t index, uint32_t crc);
 bool bs_app_setup(struct bs_app *self);
+// Immediately sets the CRTC to the framebuffer with a blocking modeset.
 int bs_app_display_fb(struct bs_app *self, size_t index);
+// Returns the index of a framebuffer that is free to draw to, waiting for a page flip to free one
+// if needed, or -1 on failure.
+int bs_app_acquire_fb(struct bs_app *self);
+// Queues an acquired framebuffer to be shown according to the present mode. This never waits for
+// a flip; back-pressure comes from bs_app_acquire_fb().
+bool bs_app_present_fb(struct bs_app *self, size_t index);
+// Like bs_app_present_fb() but scans out only once in_fence_fd signals. Takes ownership of the
+// fence, which may be -1. Atomic commits hand it to the kernel; legacy flips wait for it first.
+bool bs_app_present_fb_fence(struct bs_app *self, size_t index, int in_fence_fd);
+// Waits for and handles the next drm event on the app's card, then submits queued framebuffers.
+bool bs_app_dispatch(struct bs_app *self);
 
 // mmap.c
 struct bs_mapper;
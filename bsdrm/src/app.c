@@ -4,11 +4,53 @@
  * found in the LICENSE file.
  */
 
+#include <poll.h>
+#include <sys/select.h>
+
 #include "bs_drm.h"
 
+enum bs_app_fb_state {
+	BS_APP_FB_FREE,
+	BS_APP_FB_ACQUIRED,
+	BS_APP_FB_QUEUED,
+	BS_APP_FB_FLIPPING,
+	BS_APP_FB_SCANOUT,
+	// Replaced on screen by an atomic commit whose out-fence hasn't signaled yet.
+	BS_APP_FB_RELEASING,
+};
+
 struct bs_app_fb {
+	struct bs_app *app;
 	struct gbm_bo *bo;
 	uint32_t id;
+	enum bs_app_fb_state state;
+	// Orders queued framebuffers for FIFO presentation.
+	uint64_t present_serial;
+	// Producer fence to wait on before scanning out, owned by the app, or -1.
+	int in_fence_fd;
+	// Out-fence of the commit that replaced this framebuffer on screen, or -1.
+	int release_fence_fd;
+	// The CRC the driver should report while the framebuffer is on screen, if known.
+	bool has_crc;
+	uint32_t crc;
+};
+
+struct bs_app_atomic_props {
+	uint32_t crtc_mode_id;
+	uint32_t crtc_active;
+	uint32_t crtc_out_fence_ptr;
+	uint32_t connector_crtc_id;
+	uint32_t plane_fb_id;
+	uint32_t plane_crtc_id;
+	uint32_t plane_src_x;
+	uint32_t plane_src_y;
+	uint32_t plane_src_w;
+	uint32_t plane_src_h;
+	uint32_t plane_crtc_x;
+	uint32_t plane_crtc_y;
+	uint32_t plane_crtc_w;
+	uint32_t plane_crtc_h;
+	uint32_t plane_in_fence_fd;
 };
 
 struct bs_app {
@@ -21,8 +63,33 @@ struct bs_app {
 	drmModeModeInfo mode;
 
 	uint32_t fb_format;
+	uint32_t fb_flags;
 	size_t fb_count;
 	struct bs_app_fb *fbs;
+
+	enum bs_app_present_mode present_mode;
+	// Set once the CRTC has been given a framebuffer, after which frames are page flipped.
+	bool crtc_set;
+	uint64_t present_serial;
+	// Number of framebuffers waiting on a page flip event.
+	size_t flipping_count;
+
+	bool atomic;
+	uint32_t plane_id;
+	uint32_t mode_blob_id;
+	struct bs_app_atomic_props props;
+	// Index of the framebuffer of the latest atomic commit or -1 if there was none.
+	int committed_index;
+	struct bs_app_commit_stats commit_stats;
+	struct bs_present_stats *present_stats;
+	char *commit_log_path;
+	struct bs_commit_log *commit_log;
+
+	// Frames are checked against CRCs from this source once the CRTC is lit, or NULL.
+	char *crtc_crc_source;
+	struct bs_crtc_crc *crtc_crc;
+	// Sequence of the latest flip event.
+	uint32_t flip_sequence;
 };
 
 struct bs_app *bs_app_new()
@@ -31,7 +98,11 @@ struct bs_app *bs_app_new()
 	assert(self);
 	self->fd = -1;
 	self->fb_format = GBM_FORMAT_XRGB8888;
+	self->fb_flags = GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING;
 	self->fb_count = 2;
+	self->present_mode = BS_APP_PRESENT_FIFO;
+	self->committed_index = -1;
+	self->present_stats = bs_present_stats_new();
 	return self;
 }
 
@@ -42,16 +113,35 @@ void bs_app_destroy(struct bs_app **app)
 	assert(self);
 
 	if (self->setup) {
+		// The framebuffers being flipped to can't be removed before the flips land.
+		while (self->flipping_count) {
+			if (!bs_app_dispatch(self))
+				break;
+		}
+
 		if (self->fbs) {
 			for (size_t fb_index = 0; fb_index < self->fb_count; fb_index++) {
 				struct bs_app_fb *fb = &self->fbs[fb_index];
 				gbm_bo_destroy(fb->bo);
 				if (fb->id)
 					drmModeRmFB(self->fd, fb->id);
+				if (fb->in_fence_fd >= 0)
+					close(fb->in_fence_fd);
+				if (fb->release_fence_fd >= 0)
+					close(fb->release_fence_fd);
 			}
 			free(self->fbs);
 		}
 
+		if (self->mode_blob_id)
+			drmModeDestroyPropertyBlob(self->fd, self->mode_blob_id);
+
+		if (self->commit_log)
+			bs_commit_log_destroy(&self->commit_log);
+
+		if (self->crtc_crc)
+			bs_crtc_crc_destroy(&self->crtc_crc);
+
 		if (self->gbm) {
 			gbm_device_destroy(self->gbm);
 			self->gbm = NULL;
@@ -63,6 +153,9 @@ void bs_app_destroy(struct bs_app **app)
 		}
 	}
 
+	bs_present_stats_destroy(&self->present_stats);
+	free(self->commit_log_path);
+	free(self->crtc_crc_source);
 	free(self);
 	*app = NULL;
 }
@@ -87,6 +180,61 @@ void bs_app_set_fb_count(struct bs_app *self, size_t fb_count)
 	self->fb_count = fb_count;
 }
 
+void bs_app_set_fb_flags(struct bs_app *self, uint32_t flags)
+{
+	assert(self);
+	assert(!self->setup);
+	self->fb_flags = flags;
+}
+
+void bs_app_set_present_mode(struct bs_app *self, enum bs_app_present_mode mode)
+{
+	assert(self);
+	self->present_mode = mode;
+}
+
+void bs_app_set_atomic(struct bs_app *self, bool atomic)
+{
+	assert(self);
+	assert(!self->setup);
+	self->atomic = atomic;
+}
+
+void bs_app_set_commit_log_path(struct bs_app *self, const char *path)
+{
+	assert(self);
+	assert(!self->setup);
+	free(self->commit_log_path);
+	self->commit_log_path = path ? strdup(path) : NULL;
+}
+
+void bs_app_set_crtc_crc_source(struct bs_app *self, const char *source)
+{
+	assert(self);
+	assert(!self->setup);
+	free(self->crtc_crc_source);
+	self->crtc_crc_source = source ? strdup(source) : NULL;
+}
+
+struct bs_crtc_crc *bs_app_crtc_crc(struct bs_app *self)
+{
+	assert(self);
+	return self->crtc_crc;
+}
+
+void bs_app_get_commit_stats(struct bs_app *self, struct bs_app_commit_stats *stats)
+{
+	assert(self);
+	assert(stats);
+	*stats = self->commit_stats;
+}
+
+struct bs_present_stats *bs_app_present_stats(struct bs_app *self)
+{
+	assert(self);
+	return self->present_stats;
+}
+
 struct gbm_bo *bs_app_fb_bo(struct bs_app *self, size_t index)
 {
 	assert(self);
@@ -103,13 +251,107 @@ uint32_t bs_app_fb_id(struct bs_app *self, size_t index)
 	return self->fbs[index].id;
 }
 
+void bs_app_set_fb_crc(struct bs_app *self, size_t index, uint32_t crc)
+{
+	assert(self);
+	assert(self->fbs);
+	assert(index < self->fb_count);
+	assert(self->fbs[index].state == BS_APP_FB_ACQUIRED);
+	self->fbs[index].has_crc = true;
+	self->fbs[index].crc = crc;
+}
+
+static uint32_t app_property_id(int fd, uint32_t object_id, uint32_t object_type,
+				const char *name)
+{
+	drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(fd, object_id, object_type);
+	if (!props)
+		return 0;
+
+	uint32_t prop_id = 0;
+	for (uint32_t prop_index = 0; prop_index < props->count_props && !prop_id; prop_index++) {
+		drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[prop_index]);
+		if (!prop)
+			continue;
+		if (!strcmp(prop->name, name))
+			prop_id = prop->prop_id;
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+	if (!prop_id)
+		bs_debug_error("object %u has no %s property", object_id, name);
+	return prop_id;
+}
+
+static bool app_setup_atomic(struct bs_app *self)
+{
+	if (drmSetClientCap(self->fd, DRM_CLIENT_CAP_ATOMIC, 1)) {
+		bs_debug_error("failed to enable DRM_CLIENT_CAP_ATOMIC");
+		return false;
+	}
+
+	if (!self->plane_id) {
+		bs_debug_error("failed to find primary plane of crtc %u", self->crtc_id);
+		return false;
+	}
+
+	int fd = self->fd;
+	struct bs_app_atomic_props *props = &self->props;
+	const struct {
+		uint32_t *prop_id;
+		uint32_t object_id;
+		uint32_t object_type;
+		const char *name;
+	} lookups[] = {
+		{ &props->crtc_mode_id, self->crtc_id, DRM_MODE_OBJECT_CRTC, "MODE_ID" },
+		{ &props->crtc_active, self->crtc_id, DRM_MODE_OBJECT_CRTC, "ACTIVE" },
+		{ &props->crtc_out_fence_ptr, self->crtc_id, DRM_MODE_OBJECT_CRTC,
+		  "OUT_FENCE_PTR" },
+		{ &props->connector_crtc_id, self->connector_id, DRM_MODE_OBJECT_CONNECTOR,
+		  "CRTC_ID" },
+		{ &props->plane_fb_id, self->plane_id, DRM_MODE_OBJECT_PLANE, "FB_ID" },
+		{ &props->plane_crtc_id, self->plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_ID" },
+		{ &props->plane_src_x, self->plane_id, DRM_MODE_OBJECT_PLANE, "SRC_X" },
+		{ &props->plane_src_y, self->plane_id, DRM_MODE_OBJECT_PLANE, "SRC_Y" },
+		{ &props->plane_src_w, self->plane_id, DRM_MODE_OBJECT_PLANE, "SRC_W" },
+		{ &props->plane_src_h, self->plane_id, DRM_MODE_OBJECT_PLANE, "SRC_H" },
+		{ &props->plane_crtc_x, self->plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_X" },
+		{ &props->plane_crtc_y, self->plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_Y" },
+		{ &props->plane_crtc_w, self->plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_W" },
+		{ &props->plane_crtc_h, self->plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_H" },
+		{ &props->plane_in_fence_fd, self->plane_id, DRM_MODE_OBJECT_PLANE,
+		  "IN_FENCE_FD" },
+	};
+	for (size_t i = 0; i < BS_ARRAY_LEN(lookups); i++) {
+		*lookups[i].prop_id = app_property_id(fd, lookups[i].object_id,
+						      lookups[i].object_type, lookups[i].name);
+		if (!*lookups[i].prop_id)
+			return false;
+	}
+
+	if (drmModeCreatePropertyBlob(fd, &self->mode, sizeof(self->mode), &self->mode_blob_id)) {
+		bs_debug_error("failed to create mode blob");
+		return false;
+	}
+
+	if (self->commit_log_path) {
+		self->commit_log = bs_commit_log_new(fd, self->commit_log_path);
+		if (!self->commit_log)
+			return false;
+	}
+
+	return true;
+}
+
 bool bs_app_setup(struct bs_app *self)
 {
 	assert(self);
 	assert(!self->setup);
 	assert(self->fb_count > 0);
 
-	self->fd = bs_drm_open_main_display();
+	struct bs_kms_snapshot *snapshot = NULL;
+	self->fd = bs_drm_open_main_display_snapshot(&snapshot);
 	if (self->fd < 0) {
 		bs_debug_error("failed to open card for display");
 		return false;
@@ -122,28 +364,48 @@ bool bs_app_setup(struct bs_app *self)
 	}
 
 	struct bs_drm_pipe pipe = { 0 };
-	if (!bs_drm_pipe_make(self->fd, &pipe)) {
+	struct bs_drm_pipe_plumber *plumber = bs_drm_pipe_plumber_new();
+	bs_drm_pipe_plumber_fd(plumber, self->fd);
+	bs_drm_pipe_plumber_snapshot(plumber, snapshot);
+	bool made_pipe = bs_drm_pipe_plumber_make(plumber, &pipe);
+	bs_drm_pipe_plumber_destroy(&plumber);
+	if (!made_pipe) {
 		bs_debug_error("failed to make pipe");
 		goto destroy_device;
 	}
 	self->crtc_id = pipe.crtc_id;
 	self->connector_id = pipe.connector_id;
 
-	drmModeConnector *connector = drmModeGetConnector(self->fd, pipe.connector_id);
+	drmModeConnector *connector = bs_kms_snapshot_find_connector(snapshot, pipe.connector_id);
 	if (!connector) {
 		bs_debug_error("failed to get connector %u", pipe.connector_id);
 		goto destroy_device;
 	}
 
 	self->mode = connector->modes[0];
-	drmModeFreeConnector(connector);
+	bs_kms_snapshot_destroy(&snapshot);
+
+	bool linear = self->fb_flags & GBM_BO_USE_LINEAR;
+	// Primary planes are only listed with this cap, which changes nothing for legacy users.
+	if ((self->atomic || !linear) &&
+	    !drmSetClientCap(self->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1))
+		self->plane_id = bs_drm_primary_plane(self->fd, self->crtc_id);
+
+	if (self->atomic && !app_setup_atomic(self))
+		goto destroy_device;
 
 	self->fbs = calloc(self->fb_count, sizeof(self->fbs[0]));
 	assert(self->fbs);
 	for (size_t fb_index = 0; fb_index < self->fb_count; fb_index++) {
 		struct bs_app_fb *fb = &self->fbs[fb_index];
-		fb->bo = gbm_bo_create(self->gbm, self->mode.hdisplay, self->mode.vdisplay,
-				       self->fb_format, GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
+		fb->app = self;
+		fb->in_fence_fd = -1;
+		fb->release_fence_fd = -1;
+		// Unless they have to be linear, the framebuffers can take whatever layout scans
+		// out best.
+		fb->bo = bs_drm_bo_create_for_plane(self->gbm, linear ? 0 : self->plane_id,
+						    self->mode.hdisplay, self->mode.vdisplay,
+						    self->fb_format, self->fb_flags);
 		if (fb->bo == NULL) {
 			bs_debug_error("failed to allocate framebuffer %zu of %zu", fb_index + 1,
 				       self->fb_count);
@@ -172,10 +434,16 @@ destroy_fbs:
 	self->fbs = NULL;
 
 destroy_device:
+	if (self->mode_blob_id) {
+		drmModeDestroyPropertyBlob(self->fd, self->mode_blob_id);
+		self->mode_blob_id = 0;
+	}
 	gbm_device_destroy(self->gbm);
 	self->gbm = NULL;
 
 close_fd:
+	if (snapshot)
+		bs_kms_snapshot_destroy(&snapshot);
 	close(self->fd);
 	self->fd = -1;
 	return false;
@@ -187,6 +455,383 @@ int bs_app_display_fb(struct bs_app *self, size_t index)
 	assert(self->fd >= 0);
 	assert(self->fbs);
 	assert(index < self->fb_count);
-	return drmModeSetCrtc(self->fd, self->crtc_id, self->fbs[index].id, 0 /* x */, 0 /* y */,
-			      &self->connector_id, 1 /* connector count */, &self->mode);
+	int ret = drmModeSetCrtc(self->fd, self->crtc_id, self->fbs[index].id, 0 /* x */,
+				 0 /* y */, &self->connector_id, 1 /* connector count */,
+				 &self->mode);
+	if (!ret)
+		self->crtc_set = true;
+	return ret;
+}
+
+// Capturing CRCs needs an active CRTC, so it starts after the first frame's modeset. Without
+// debugfs the frames go unchecked.
+static void app_start_crtc_crc(struct bs_app *self)
+{
+	if (!self->crtc_crc_source || self->crtc_crc)
+		return;
+
+	self->crtc_crc = bs_crtc_crc_new(self->fd, self->crtc_id, self->crtc_crc_source);
+	if (!self->crtc_crc) {
+		bs_debug_warning("frames won't be checked against CRCs");
+		free(self->crtc_crc_source);
+		self->crtc_crc_source = NULL;
+	}
+}
+
+static void app_free_fb(struct bs_app_fb *fb)
+{
+	if (fb->in_fence_fd >= 0) {
+		close(fb->in_fence_fd);
+		fb->in_fence_fd = -1;
+	}
+	fb->state = BS_APP_FB_FREE;
+}
+
+static int app_next_queued(struct bs_app *self)
+{
+	int next_index = -1;
+	for (size_t fb_index = 0; fb_index < self->fb_count; fb_index++) {
+		struct bs_app_fb *fb = &self->fbs[fb_index];
+		if (fb->state == BS_APP_FB_QUEUED &&
+		    (next_index < 0 || fb->present_serial < self->fbs[next_index].present_serial))
+			next_index = fb_index;
+	}
+	return next_index;
+}
+
+// The legacy API has no in-fences, so the CPU waits for the producer before flipping.
+static void app_wait_in_fence(struct bs_app_fb *fb)
+{
+	if (fb->in_fence_fd < 0)
+		return;
+
+	struct pollfd pfd = { .fd = fb->in_fence_fd, .events = POLLIN };
+	while (poll(&pfd, 1, -1) < 0 && errno == EINTR)
+		;
+	close(fb->in_fence_fd);
+	fb->in_fence_fd = -1;
+}
+
+// Keeps at most one flip pending as the legacy API requires.
+static bool app_submit_legacy(struct bs_app *self)
+{
+	while (!self->flipping_count) {
+		int next_index = app_next_queued(self);
+		if (next_index < 0)
+			return true;
+
+		struct bs_app_fb *fb = &self->fbs[next_index];
+		app_wait_in_fence(fb);
+		if (!self->crtc_set) {
+			// The first frame needs a modeset, which is done by the time it returns.
+			int ret = bs_app_display_fb(self, next_index);
+			if (ret) {
+				bs_debug_error("failed to set crtc: %d", ret);
+				app_free_fb(fb);
+				return false;
+			}
+			for (size_t fb_index = 0; fb_index < self->fb_count; fb_index++) {
+				if (self->fbs[fb_index].state == BS_APP_FB_SCANOUT)
+					app_free_fb(&self->fbs[fb_index]);
+			}
+			fb->state = BS_APP_FB_SCANOUT;
+			self->commit_stats.commits++;
+			app_start_crtc_crc(self);
+			continue;
+		}
+
+		int ret = drmModePageFlip(self->fd, self->crtc_id, fb->id, DRM_MODE_PAGE_FLIP_EVENT,
+					  fb);
+		if (ret) {
+			bs_debug_error("failed to page flip: %d", ret);
+			app_free_fb(fb);
+			return false;
+		}
+		fb->state = BS_APP_FB_FLIPPING;
+		self->flipping_count++;
+		self->commit_stats.commits++;
+		bs_present_stats_submit(self->present_stats);
+	}
+
+	return true;
+}
+
+static void app_add_property(struct bs_app *self, drmModeAtomicReqPtr req, uint32_t object_id,
+			     uint32_t prop_id, uint64_t value)
+{
+	int ret = bs_commit_log_add_property(self->commit_log, req, object_id, prop_id, value);
+	assert(ret >= 0);
+}
+
+// Commits every queued framebuffer without ever blocking. The kernel refuses a commit with EBUSY
+// while the previous one is still pending, in which case the framebuffer stays queued until the
+// next flip event.
+static bool app_submit_atomic(struct bs_app *self)
+{
+	for (;;) {
+		int next_index = app_next_queued(self);
+		if (next_index < 0)
+			return true;
+
+		struct bs_app_fb *fb = &self->fbs[next_index];
+		struct bs_app_atomic_props *props = &self->props;
+		drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+		assert(req);
+		uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+		if (!self->crtc_set) {
+			flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+			app_add_property(self, req, self->crtc_id, props->crtc_mode_id,
+					 self->mode_blob_id);
+			app_add_property(self, req, self->crtc_id, props->crtc_active, 1);
+			app_add_property(self, req, self->connector_id, props->connector_crtc_id,
+					 self->crtc_id);
+			app_add_property(self, req, self->plane_id, props->plane_crtc_id,
+					 self->crtc_id);
+			app_add_property(self, req, self->plane_id, props->plane_src_x, 0);
+			app_add_property(self, req, self->plane_id, props->plane_src_y, 0);
+			app_add_property(self, req, self->plane_id, props->plane_src_w,
+					 (uint64_t)self->mode.hdisplay << 16);
+			app_add_property(self, req, self->plane_id, props->plane_src_h,
+					 (uint64_t)self->mode.vdisplay << 16);
+			app_add_property(self, req, self->plane_id, props->plane_crtc_x, 0);
+			app_add_property(self, req, self->plane_id, props->plane_crtc_y, 0);
+			app_add_property(self, req, self->plane_id, props->plane_crtc_w,
+					 self->mode.hdisplay);
+			app_add_property(self, req, self->plane_id, props->plane_crtc_h,
+					 self->mode.vdisplay);
+		}
+		app_add_property(self, req, self->plane_id, props->plane_fb_id, fb->id);
+		app_add_property(self, req, self->plane_id, props->plane_in_fence_fd,
+				 (uint64_t)(int64_t)fb->in_fence_fd);
+		int32_t out_fence_fd = -1;
+		app_add_property(self, req, self->crtc_id, props->crtc_out_fence_ptr,
+				 (uint64_t)(uintptr_t)&out_fence_fd);
+
+		int ret = bs_commit_log_commit(self->commit_log, self->fd, req, flags, fb);
+		drmModeAtomicFree(req);
+		if (ret == -EBUSY) {
+			self->commit_stats.busy_count++;
+			return true;
+		}
+		if (ret) {
+			bs_debug_error("failed to commit: %d", ret);
+			app_free_fb(fb);
+			return false;
+		}
+
+		self->commit_stats.commits++;
+		bs_present_stats_submit(self->present_stats);
+		self->crtc_set = true;
+		app_start_crtc_crc(self);
+		if (fb->in_fence_fd >= 0) {
+			close(fb->in_fence_fd);
+			fb->in_fence_fd = -1;
+		}
+		fb->state = BS_APP_FB_FLIPPING;
+		self->flipping_count++;
+
+		// The framebuffer this one replaces is free once the commit's out-fence signals.
+		if (self->committed_index >= 0 && self->committed_index != next_index) {
+			struct bs_app_fb *replaced = &self->fbs[self->committed_index];
+			assert(replaced->release_fence_fd < 0);
+			replaced->release_fence_fd = out_fence_fd;
+			if (replaced->state == BS_APP_FB_SCANOUT)
+				replaced->state = BS_APP_FB_RELEASING;
+		} else if (out_fence_fd >= 0) {
+			close(out_fence_fd);
+		}
+		self->committed_index = next_index;
+	}
+}
+
+static bool app_submit(struct bs_app *self)
+{
+	return self->atomic ? app_submit_atomic(self) : app_submit_legacy(self);
+}
+
+static void app_page_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
+				  unsigned int tv_usec, void *user_data)
+{
+	struct bs_app_fb *fb = user_data;
+	struct bs_app *self = fb->app;
+	assert(fb->state == BS_APP_FB_FLIPPING);
+	assert(self->flipping_count > 0);
+	self->flipping_count--;
+	self->flip_sequence = sequence;
+	bs_present_stats_flip(self->present_stats, sequence, tv_sec, tv_usec);
+	if (self->crtc_crc) {
+		if (fb->has_crc)
+			bs_crtc_crc_expect(self->crtc_crc, sequence, fb->crc);
+		else
+			bs_crtc_crc_expect_unknown(self->crtc_crc, sequence);
+	}
+
+	if (self->atomic) {
+		// A later commit may already have replaced it.
+		fb->state =
+		    fb->release_fence_fd >= 0 ? BS_APP_FB_RELEASING : BS_APP_FB_SCANOUT;
+		return;
+	}
+
+	for (size_t fb_index = 0; fb_index < self->fb_count; fb_index++) {
+		if (self->fbs[fb_index].state == BS_APP_FB_SCANOUT)
+			app_free_fb(&self->fbs[fb_index]);
+	}
+	fb->state = BS_APP_FB_SCANOUT;
+}
+
+// Frees every releasing framebuffer whose out-fence has signaled. A framebuffer whose flip event
+// hasn't been handled yet keeps its fence until then, or it would be taken to still be on screen.
+static void app_reap_release_fences(struct bs_app *self)
+{
+	for (size_t fb_index = 0; fb_index < self->fb_count; fb_index++) {
+		struct bs_app_fb *fb = &self->fbs[fb_index];
+		if (fb->release_fence_fd < 0 || fb->state == BS_APP_FB_FLIPPING)
+			continue;
+
+		struct pollfd pfd = { .fd = fb->release_fence_fd, .events = POLLIN };
+		if (poll(&pfd, 1, 0) != 1)
+			continue;
+
+		close(fb->release_fence_fd);
+		fb->release_fence_fd = -1;
+		if (fb->state == BS_APP_FB_RELEASING)
+			app_free_fb(fb);
+	}
+}
+
+// Entries past the latest flip event wait while a flip is pending, as it may land on their frame.
+static bool app_check_crtc_crc(struct bs_app *self)
+{
+	int ret = bs_crtc_crc_read(self->crtc_crc);
+	if (ret < 0) {
+		bs_debug_error("failed to read CRCs: %s", strerror(-ret));
+		return false;
+	}
+
+	if (self->flipping_count)
+		bs_crtc_crc_check_until(self->crtc_crc, self->flip_sequence);
+	else
+		bs_crtc_crc_check(self->crtc_crc);
+	return true;
+}
+
+bool bs_app_dispatch(struct bs_app *self)
+{
+	assert(self);
+	assert(self->setup);
+
+	fd_set fds;
+	FD_ZERO(&fds);
+	FD_SET(self->fd, &fds);
+	int max_fd = self->fd;
+	for (size_t fb_index = 0; fb_index < self->fb_count; fb_index++) {
+		int fence_fd = self->fbs[fb_index].release_fence_fd;
+		if (fence_fd < 0 || self->fbs[fb_index].state == BS_APP_FB_FLIPPING)
+			continue;
+		FD_SET(fence_fd, &fds);
+		if (fence_fd > max_fd)
+			max_fd = fence_fd;
+	}
+	if (self->crtc_crc) {
+		int crc_fd = bs_crtc_crc_fd(self->crtc_crc);
+		FD_SET(crc_fd, &fds);
+		if (crc_fd > max_fd)
+			max_fd = crc_fd;
+	}
+
+	int ret = select(max_fd + 1, &fds, NULL, NULL, NULL);
+	if (ret < 0) {
+		if (errno == EINTR)
+			return true;
+		bs_debug_error("select err: %s", strerror(errno));
+		return false;
+	}
+
+	if (FD_ISSET(self->fd, &fds)) {
+		drmEventContext evctx = {
+			.version = DRM_EVENT_CONTEXT_VERSION,
+			.page_flip_handler = app_page_flip_handler,
+		};
+		ret = drmHandleEvent(self->fd, &evctx);
+		if (ret) {
+			bs_debug_error("failed to handle drm events: %d", ret);
+			return false;
+		}
+	}
+
+	if (self->crtc_crc && !app_check_crtc_crc(self))
+		return false;
+
+	app_reap_release_fences(self);
+	return app_submit(self);
+}
+
+// Handles drm events that have already arrived without waiting for more.
+static bool app_dispatch_pending(struct bs_app *self)
+{
+	struct pollfd pfd = { .fd = self->fd, .events = POLLIN };
+	if (poll(&pfd, 1, 0) != 1)
+		return true;
+	return bs_app_dispatch(self);
+}
+
+int bs_app_acquire_fb(struct bs_app *self)
+{
+	assert(self);
+	assert(self->setup);
+
+	// Keeps presentation moving in mailbox mode, where a free framebuffer is usually at hand.
+	if (!app_dispatch_pending(self))
+		return -1;
+
+	for (;;) {
+		app_reap_release_fences(self);
+		bool releasing = false;
+		for (size_t fb_index = 0; fb_index < self->fb_count; fb_index++) {
+			struct bs_app_fb *fb = &self->fbs[fb_index];
+			if (fb->state == BS_APP_FB_FREE) {
+				fb->state = BS_APP_FB_ACQUIRED;
+				fb->has_crc = false;
+				return fb_index;
+			}
+			releasing |= fb->state == BS_APP_FB_RELEASING;
+		}
+
+		// Only a flip completing or an out-fence signaling frees a framebuffer.
+		if (!self->flipping_count && !releasing) {
+			bs_debug_error("all %zu framebuffers are acquired or on screen",
+				       self->fb_count);
+			return -1;
+		}
+
+		if (!bs_app_dispatch(self))
+			return -1;
+	}
+}
+
+bool bs_app_present_fb_fence(struct bs_app *self, size_t index, int in_fence_fd)
+{
+	assert(self);
+	assert(self->setup);
+	assert(index < self->fb_count);
+	assert(self->fbs[index].state == BS_APP_FB_ACQUIRED);
+
+	if (self->present_mode == BS_APP_PRESENT_MAILBOX) {
+		for (size_t fb_index = 0; fb_index < self->fb_count; fb_index++) {
+			if (self->fbs[fb_index].state == BS_APP_FB_QUEUED)
+				app_free_fb(&self->fbs[fb_index]);
+		}
+	}
+
+	struct bs_app_fb *fb = &self->fbs[index];
+	fb->state = BS_APP_FB_QUEUED;
+	fb->present_serial = self->present_serial++;
+	fb->in_fence_fd = in_fence_fd;
+	return app_submit(self);
+}
+
+bool bs_app_present_fb(struct bs_app *self, size_t index)
+{
+	return bs_app_present_fb_fence(self, index, -1);
 }
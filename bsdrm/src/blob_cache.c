@@ -0,0 +1,140 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "bs_drm.h"
+
+struct blob_entry {
+	uint64_t hash;
+	size_t length;
+	void *data;
+	uint32_t id;
+	uint32_t refs;
+	// Value of the cache's use counter when the blob was last handed out.
+	uint64_t last_use;
+};
+
+struct bs_blob_cache {
+	int fd;
+	size_t capacity;
+	struct blob_entry *entries;
+	size_t count;
+	uint64_t use_counter;
+	struct bs_blob_cache_stats stats;
+};
+
+struct bs_blob_cache *bs_blob_cache_new(int fd, size_t capacity)
+{
+	assert(fd >= 0);
+	assert(capacity > 0);
+
+	struct bs_blob_cache *self = calloc(1, sizeof(struct bs_blob_cache));
+	assert(self);
+	self->fd = fd;
+	self->capacity = capacity;
+	return self;
+}
+
+static void blob_cache_free_entry(struct bs_blob_cache *self, struct blob_entry *entry)
+{
+	drmModeDestroyPropertyBlob(self->fd, entry->id);
+	free(entry->data);
+}
+
+void bs_blob_cache_destroy(struct bs_blob_cache **self)
+{
+	assert(self);
+	assert(*self);
+	for (size_t i = 0; i < (*self)->count; i++)
+		blob_cache_free_entry(*self, &(*self)->entries[i]);
+	free((*self)->entries);
+	free(*self);
+	*self = NULL;
+}
+
+// Destroys the least recently used blob nobody holds. Held blobs can take the cache over capacity.
+static void blob_cache_evict(struct bs_blob_cache *self)
+{
+	struct blob_entry *victim = NULL;
+	for (size_t i = 0; i < self->count; i++) {
+		struct blob_entry *entry = &self->entries[i];
+		if (!entry->refs && (!victim || entry->last_use < victim->last_use))
+			victim = entry;
+	}
+
+	if (!victim)
+		return;
+
+	blob_cache_free_entry(self, victim);
+	*victim = self->entries[--self->count];
+	self->stats.evictions++;
+}
+
+uint32_t bs_blob_cache_get(struct bs_blob_cache *self, const void *data, size_t length)
+{
+	assert(self);
+	assert(data);
+	assert(length > 0);
+
+	uint64_t hash = bs_hash_bytes(BS_HASH_INIT, data, length);
+	for (size_t i = 0; i < self->count; i++) {
+		struct blob_entry *entry = &self->entries[i];
+		if (entry->hash == hash && entry->length == length &&
+		    !memcmp(entry->data, data, length)) {
+			entry->refs++;
+			entry->last_use = ++self->use_counter;
+			self->stats.hits++;
+			return entry->id;
+		}
+	}
+
+	if (self->count >= self->capacity)
+		blob_cache_evict(self);
+
+	uint32_t id = 0;
+	int64_t start_ns = bs_debug_gettime_ns();
+	int ret = drmModeCreatePropertyBlob(self->fd, data, length, &id);
+	self->stats.create_ns += bs_debug_gettime_ns() - start_ns;
+	if (ret) {
+		bs_debug_error("failed to create blob of %zu bytes: %d", length, ret);
+		return 0;
+	}
+
+	self->entries = realloc(self->entries, (self->count + 1) * sizeof(*self->entries));
+	assert(self->entries);
+	struct blob_entry *entry = &self->entries[self->count++];
+	entry->hash = hash;
+	entry->length = length;
+	entry->data = malloc(length);
+	assert(entry->data);
+	memcpy(entry->data, data, length);
+	entry->id = id;
+	entry->refs = 1;
+	entry->last_use = ++self->use_counter;
+	self->stats.misses++;
+	return id;
+}
+
+void bs_blob_cache_put(struct bs_blob_cache *self, uint32_t id)
+{
+	assert(self);
+	for (size_t i = 0; i < self->count; i++) {
+		struct blob_entry *entry = &self->entries[i];
+		if (entry->id == id) {
+			assert(entry->refs > 0);
+			entry->refs--;
+			return;
+		}
+	}
+
+	assert(!"blob is not from this cache");
+}
+
+void bs_blob_cache_get_stats(struct bs_blob_cache *self, struct bs_blob_cache_stats *stats)
+{
+	assert(self);
+	assert(stats);
+	*stats = self->stats;
+}
@@ -0,0 +1,237 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "bs_drm.h"
+
+struct bo_pool_entry {
+	struct gbm_bo *bo;
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint32_t flags;
+	uint64_t modifier;
+	size_t size;
+	bool in_use;
+	// Order in which idle entries were released, used to trim the oldest first.
+	uint64_t release_serial;
+};
+
+struct bs_bo_pool {
+	struct gbm_device *gbm;
+	size_t budget;
+	size_t entry_count;
+	size_t entry_capacity;
+	struct bo_pool_entry *entries;
+	uint64_t release_serial;
+	size_t idle_bytes;
+	struct bs_bo_pool_stats stats;
+};
+
+struct bs_bo_pool *bs_bo_pool_new(struct gbm_device *gbm, size_t budget)
+{
+	assert(gbm);
+	struct bs_bo_pool *self = calloc(1, sizeof(struct bs_bo_pool));
+	assert(self);
+	self->gbm = gbm;
+	self->budget = budget;
+	return self;
+}
+
+void bs_bo_pool_destroy(struct bs_bo_pool **self)
+{
+	assert(self);
+	assert(*self);
+	struct bs_bo_pool *pool = *self;
+	for (size_t i = 0; i < pool->entry_count; i++) {
+		if (pool->entries[i].in_use)
+			bs_debug_warning("destroying buffer object still acquired from pool");
+		gbm_bo_destroy(pool->entries[i].bo);
+	}
+	free(pool->entries);
+	free(pool);
+	*self = NULL;
+}
+
+static size_t bo_size(struct gbm_bo *bo)
+{
+	size_t size = 0;
+	size_t plane_count = gbm_bo_get_num_planes(bo);
+	for (size_t p = 0; p < plane_count; p++) {
+		size_t plane_end = gbm_bo_get_plane_offset(bo, p) + gbm_bo_get_plane_size(bo, p);
+		if (plane_end > size)
+			size = plane_end;
+	}
+	return size;
+}
+
+static void bo_pool_remove_entry(struct bs_bo_pool *self, size_t index)
+{
+	struct bo_pool_entry *entry = &self->entries[index];
+	assert(!entry->in_use);
+	gbm_bo_destroy(entry->bo);
+	self->idle_bytes -= entry->size;
+	self->stats.resident_bytes -= entry->size;
+	self->entries[index] = self->entries[--self->entry_count];
+}
+
+// Destroys the least recently released idle buffer objects until the idle ones fit the budget.
+static void bo_pool_trim(struct bs_bo_pool *self)
+{
+	while (self->idle_bytes > self->budget) {
+		size_t oldest = self->entry_count;
+		for (size_t i = 0; i < self->entry_count; i++) {
+			if (self->entries[i].in_use)
+				continue;
+			if (oldest == self->entry_count ||
+			    self->entries[i].release_serial < self->entries[oldest].release_serial)
+				oldest = i;
+		}
+		assert(oldest < self->entry_count);
+		bo_pool_remove_entry(self, oldest);
+	}
+}
+
+static bool entry_matches(const struct bo_pool_entry *entry, uint32_t width, uint32_t height,
+			  uint32_t format, uint32_t flags, const uint64_t *modifiers,
+			  size_t modifier_count)
+{
+	if (entry->in_use || entry->width != width || entry->height != height ||
+	    entry->format != format || entry->flags != flags)
+		return false;
+
+	if (!modifier_count)
+		return entry->modifier == DRM_FORMAT_MOD_INVALID;
+
+	for (size_t i = 0; i < modifier_count; i++) {
+		if (entry->modifier == modifiers[i])
+			return true;
+	}
+	return false;
+}
+
+// Buffer objects created from a modifier list are keyed on the modifier gbm picked from it, while
+// ones created without modifiers are keyed on DRM_FORMAT_MOD_INVALID.
+static struct gbm_bo *bo_pool_acquire(struct bs_bo_pool *self, uint32_t width, uint32_t height,
+				      uint32_t format, uint32_t flags, const uint64_t *modifiers,
+				      size_t modifier_count)
+{
+	for (size_t i = 0; i < self->entry_count; i++) {
+		struct bo_pool_entry *entry = &self->entries[i];
+		if (!entry_matches(entry, width, height, format, flags, modifiers, modifier_count))
+			continue;
+
+		entry->in_use = true;
+		self->idle_bytes -= entry->size;
+		self->stats.reuses++;
+		return entry->bo;
+	}
+
+	// gbm_bo_create_with_modifiers() takes no usage flags, so cursors, which have to be linear
+	// anyway, are created linear with their flags instead.
+	bool linear_cursor = false;
+	if (modifier_count && (flags & GBM_BO_USE_CURSOR)) {
+		for (size_t i = 0; i < modifier_count; i++)
+			linear_cursor |= modifiers[i] == DRM_FORMAT_MOD_LINEAR;
+		if (!linear_cursor) {
+			bs_debug_error("cursor buffer objects need the linear modifier");
+			return NULL;
+		}
+	}
+
+	int64_t start_ns = bs_debug_gettime_ns();
+	struct gbm_bo *bo;
+	if (linear_cursor)
+		bo = gbm_bo_create(self->gbm, width, height, format, flags | GBM_BO_USE_LINEAR);
+	else if (modifier_count)
+		bo = gbm_bo_create_with_modifiers(self->gbm, width, height, format, modifiers,
+						  modifier_count);
+	else
+		bo = gbm_bo_create(self->gbm, width, height, format, flags);
+	if (!bo) {
+		bs_debug_error("failed to create %ux%u buffer object for pool", width, height);
+		return NULL;
+	}
+	self->stats.allocation_ns += bs_debug_gettime_ns() - start_ns;
+	self->stats.allocations++;
+
+	if (self->entry_count == self->entry_capacity) {
+		self->entry_capacity = self->entry_capacity ? self->entry_capacity * 2 : 8;
+		self->entries =
+		    realloc(self->entries, self->entry_capacity * sizeof(struct bo_pool_entry));
+		assert(self->entries);
+	}
+
+	struct bo_pool_entry *entry = &self->entries[self->entry_count++];
+	memset(entry, 0, sizeof(*entry));
+	entry->bo = bo;
+	entry->width = width;
+	entry->height = height;
+	entry->format = format;
+	entry->flags = flags;
+	if (linear_cursor)
+		entry->modifier = DRM_FORMAT_MOD_LINEAR;
+	else if (modifier_count)
+		entry->modifier = gbm_bo_get_format_modifier(bo);
+	else
+		entry->modifier = DRM_FORMAT_MOD_INVALID;
+	entry->size = bo_size(bo);
+	entry->in_use = true;
+
+	self->stats.resident_bytes += entry->size;
+	if (self->stats.resident_bytes > self->stats.peak_resident_bytes)
+		self->stats.peak_resident_bytes = self->stats.resident_bytes;
+
+	return bo;
+}
+
+struct gbm_bo *bs_bo_pool_acquire(struct bs_bo_pool *self, uint32_t width, uint32_t height,
+				  uint32_t format, uint32_t flags)
+{
+	assert(self);
+	return bo_pool_acquire(self, width, height, format, flags, NULL, 0);
+}
+
+struct gbm_bo *bs_bo_pool_acquire_modifiers(struct bs_bo_pool *self, uint32_t width,
+					    uint32_t height, uint32_t format, uint32_t flags,
+					    const uint64_t *modifiers, size_t modifier_count)
+{
+	assert(self);
+	assert(modifiers);
+	assert(modifier_count > 0);
+	return bo_pool_acquire(self, width, height, format, flags, modifiers, modifier_count);
+}
+
+void bs_bo_pool_release(struct bs_bo_pool *self, struct gbm_bo *bo)
+{
+	assert(self);
+	assert(bo);
+
+	for (size_t i = 0; i < self->entry_count; i++) {
+		struct bo_pool_entry *entry = &self->entries[i];
+		if (entry->bo != bo)
+			continue;
+
+		assert(entry->in_use);
+		entry->in_use = false;
+		entry->release_serial = self->release_serial++;
+		self->idle_bytes += entry->size;
+		bo_pool_trim(self);
+		return;
+	}
+
+	bs_debug_error("buffer object was not acquired from this pool");
+}
+
+void bs_bo_pool_get_stats(struct bs_bo_pool *self, struct bs_bo_pool_stats *stats)
+{
+	assert(self);
+	assert(stats);
+	*stats = self->stats;
+	// Every reuse is assumed to have cost as much as an average allocation.
+	if (self->stats.allocations)
+		stats->saved_ns = self->stats.allocation_ns / (int64_t)self->stats.allocations *
+				  (int64_t)self->stats.reuses;
+}
@@ -0,0 +1,235 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "bs_drm.h"
+
+// Channels after the CTM are quantized to this many bits to index the gamma table. That is finer
+// than any gamma LUT drivers expose, so results stay within one step of the per-pixel reference.
+#define GAMMA_INDEX_BITS 12
+#define GAMMA_INDEX_MAX ((1 << GAMMA_INDEX_BITS) - 1)
+
+// Four pixels at a time, one channel per vector, which maps onto SSE and NEON alike.
+#define LANES 4
+typedef float float_lanes __attribute__((vector_size(LANES * sizeof(float))));
+typedef int32_t int_lanes __attribute__((vector_size(LANES * sizeof(int32_t))));
+
+struct bs_color_pipeline {
+	struct drm_color_lut *degamma;
+	size_t degamma_size;
+	double ctm[9];
+	bool has_ctm;
+	struct drm_color_lut *gamma;
+	size_t gamma_size;
+
+	// Without a CTM every channel maps on its own, so the whole pipeline folds into these.
+	uint8_t channel_table[3][256];
+	// With a CTM, the degamma output of every 8-bit value and the gamma output of every
+	// quantized CTM result.
+	float linear[3][256];
+	uint8_t gamma_table[3][GAMMA_INDEX_MAX + 1];
+};
+
+static struct drm_color_lut *copy_lut(const struct drm_color_lut *lut, size_t size)
+{
+	if (!lut || !size)
+		return NULL;
+	struct drm_color_lut *copy = calloc(size, sizeof(*copy));
+	assert(copy);
+	memcpy(copy, lut, size * sizeof(*copy));
+	return copy;
+}
+
+static uint16_t lut_channel(const struct drm_color_lut *entry, int channel)
+{
+	switch (channel) {
+		case 0:
+			return entry->red;
+		case 1:
+			return entry->green;
+		default:
+			return entry->blue;
+	}
+}
+
+// Looks up x in [0, 1], interpolating linearly between entries. No LUT is the identity.
+static double lut_lookup(const struct drm_color_lut *lut, size_t size, int channel, double x)
+{
+	if (!lut)
+		return x;
+	if (size == 1)
+		return lut_channel(&lut[0], channel) / 65535.0;
+
+	double pos = x * (size - 1);
+	size_t i = (size_t)pos;
+	if (i >= size - 1)
+		return lut_channel(&lut[size - 1], channel) / 65535.0;
+	double frac = pos - i;
+	double lo = lut_channel(&lut[i], channel);
+	double hi = lut_channel(&lut[i + 1], channel);
+	return (lo + (hi - lo) * frac) / 65535.0;
+}
+
+static double clamp_unit(double x)
+{
+	return x < 0.0 ? 0.0 : (x > 1.0 ? 1.0 : x);
+}
+
+static uint8_t unit_to_byte(double x)
+{
+	return (uint8_t)(clamp_unit(x) * 255.0 + 0.5);
+}
+
+// The kernel's CTM entries are S31.32 sign-magnitude, not two's complement.
+static double ctm_to_double(int64_t value)
+{
+	uint64_t bits = (uint64_t)value;
+	double magnitude = (double)(bits & ~(1ull << 63)) / 4294967296.0;
+	return (bits >> 63) ? -magnitude : magnitude;
+}
+
+struct bs_color_pipeline *bs_color_pipeline_new(const struct drm_color_lut *degamma,
+						size_t degamma_size, const int64_t *ctm,
+						const struct drm_color_lut *gamma,
+						size_t gamma_size)
+{
+	struct bs_color_pipeline *self = calloc(1, sizeof(struct bs_color_pipeline));
+	assert(self);
+
+	self->degamma = copy_lut(degamma, degamma_size);
+	self->degamma_size = degamma_size;
+	self->gamma = copy_lut(gamma, gamma_size);
+	self->gamma_size = gamma_size;
+	self->has_ctm = ctm != NULL;
+	for (int i = 0; i < 9; i++)
+		self->ctm[i] = ctm ? ctm_to_double(ctm[i]) : (i % 4 == 0);
+
+	for (int c = 0; c < 3; c++) {
+		for (int v = 0; v < 256; v++) {
+			double linear = lut_lookup(self->degamma, self->degamma_size, c, v / 255.0);
+			self->linear[c][v] = (float)linear;
+			self->channel_table[c][v] = unit_to_byte(
+			    lut_lookup(self->gamma, self->gamma_size, c, clamp_unit(linear)));
+		}
+		for (int i = 0; i <= GAMMA_INDEX_MAX; i++)
+			self->gamma_table[c][i] = unit_to_byte(lut_lookup(
+			    self->gamma, self->gamma_size, c, (double)i / GAMMA_INDEX_MAX));
+	}
+
+	return self;
+}
+
+void bs_color_pipeline_destroy(struct bs_color_pipeline **self)
+{
+	assert(self);
+	assert(*self);
+	free((*self)->degamma);
+	free((*self)->gamma);
+	free(*self);
+	*self = NULL;
+}
+
+uint32_t bs_color_pipeline_apply_pixel(const struct bs_color_pipeline *self, uint32_t pixel)
+{
+	assert(self);
+
+	double in[3];
+	for (int c = 0; c < 3; c++) {
+		uint8_t v = (pixel >> (16 - 8 * c)) & 0xff;
+		in[c] = lut_lookup(self->degamma, self->degamma_size, c, v / 255.0);
+	}
+
+	uint32_t out = pixel & 0xff000000;
+	for (int c = 0; c < 3; c++) {
+		double x = self->ctm[3 * c] * in[0] + self->ctm[3 * c + 1] * in[1] +
+			   self->ctm[3 * c + 2] * in[2];
+		double y = lut_lookup(self->gamma, self->gamma_size, c, clamp_unit(x));
+		out |= (uint32_t)unit_to_byte(y) << (16 - 8 * c);
+	}
+	return out;
+}
+
+static void apply_row_tables(const struct bs_color_pipeline *self, const uint32_t *src,
+			     uint32_t *dst, uint32_t width)
+{
+	for (uint32_t x = 0; x < width; x++) {
+		uint32_t p = src[x];
+		dst[x] = (p & 0xff000000) | self->channel_table[0][(p >> 16) & 0xff] << 16 |
+			 self->channel_table[1][(p >> 8) & 0xff] << 8 |
+			 self->channel_table[2][p & 0xff];
+	}
+}
+
+static int_lanes to_int_lanes(float_lanes x)
+{
+#if defined(__clang__) || __GNUC__ >= 9
+	return __builtin_convertvector(x, int_lanes);
+#else
+	int_lanes i;
+	for (int l = 0; l < LANES; l++)
+		i[l] = (int32_t)x[l];
+	return i;
+#endif
+}
+
+static int_lanes ctm_index(float_lanes r, float_lanes g, float_lanes b, const float *row)
+{
+	float_lanes x = r * row[0] + g * row[1] + b * row[2];
+	// Clamps to [0, 1] before converting, as out of range floats don't convert to an int.
+	// Comparisons give all ones in the lanes where they hold, which also sends NaN to 0.
+	int_lanes bits = (int_lanes)x & (x > 0.0f);
+	int_lanes over = (float_lanes)bits > 1.0f;
+	const float_lanes one = { 1.0f, 1.0f, 1.0f, 1.0f };
+	x = (float_lanes)((bits & ~over) | ((int_lanes)one & over));
+	return to_int_lanes(x * (float)GAMMA_INDEX_MAX + 0.5f);
+}
+
+static void apply_row_ctm(const struct bs_color_pipeline *self, const float *ctm,
+			  const uint32_t *src, uint32_t *dst, uint32_t width)
+{
+	uint32_t x = 0;
+	for (; x + LANES <= width; x += LANES) {
+		float_lanes r, g, b;
+		for (int l = 0; l < LANES; l++) {
+			uint32_t p = src[x + l];
+			r[l] = self->linear[0][(p >> 16) & 0xff];
+			g[l] = self->linear[1][(p >> 8) & 0xff];
+			b[l] = self->linear[2][p & 0xff];
+		}
+
+		int_lanes ri = ctm_index(r, g, b, &ctm[0]);
+		int_lanes gi = ctm_index(r, g, b, &ctm[3]);
+		int_lanes bi = ctm_index(r, g, b, &ctm[6]);
+		for (int l = 0; l < LANES; l++)
+			dst[x + l] = (src[x + l] & 0xff000000) |
+				     self->gamma_table[0][ri[l]] << 16 |
+				     self->gamma_table[1][gi[l]] << 8 | self->gamma_table[2][bi[l]];
+	}
+
+	for (; x < width; x++)
+		dst[x] = bs_color_pipeline_apply_pixel(self, src[x]);
+}
+
+void bs_color_pipeline_apply(const struct bs_color_pipeline *self, const void *src,
+			     uint32_t src_stride, void *dst, uint32_t dst_stride, uint32_t width,
+			     uint32_t height)
+{
+	assert(self);
+	assert(src);
+	assert(dst);
+
+	float ctm[9];
+	for (int i = 0; i < 9; i++)
+		ctm[i] = (float)self->ctm[i];
+
+	for (uint32_t y = 0; y < height; y++) {
+		const uint32_t *src_row = (const uint32_t *)((const uint8_t *)src + y * src_stride);
+		uint32_t *dst_row = (uint32_t *)((uint8_t *)dst + y * dst_stride);
+		if (self->has_ctm)
+			apply_row_ctm(self, ctm, src_row, dst_row, width);
+		else
+			apply_row_tables(self, src_row, dst_row, width);
+	}
+}
@@ -0,0 +1,366 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <sys/stat.h>
+
+#include "bs_drm.h"
+
+#define COMMIT_LOG_MAGIC 0x4c434253  // "BSCL"
+#define COMMIT_LOG_VERSION 1
+// Records start on 8 byte boundaries so that readers can use them straight from the mapping.
+#define RECORD_ALIGN 8
+
+struct commit_log_header {
+	uint32_t magic;
+	uint32_t version;
+};
+
+struct logged_property {
+	uint32_t prop_id;
+	uint32_t flags;
+	bool fb;
+};
+
+// What was last written for a blob or framebuffer id, which the kernel may hand out again.
+struct logged_object {
+	uint32_t id;
+	uint64_t hash;
+};
+
+struct bs_commit_log {
+	int fd;
+	FILE *file;
+	int64_t start_ns;
+
+	// The properties added to the request so far, in order.
+	struct bs_commit_log_item *items;
+	size_t item_count;
+	size_t item_capacity;
+
+	struct logged_property *props;
+	size_t prop_count;
+	struct logged_object *blobs;
+	size_t blob_count;
+	struct logged_object *fbs;
+	size_t fb_count;
+
+	struct bs_commit_log_stats stats;
+};
+
+static void commit_log_write(struct bs_commit_log *self, uint32_t type, const void *payload,
+			     uint32_t size, const void *extra, uint32_t extra_size)
+{
+	static const uint8_t padding[RECORD_ALIGN] = { 0 };
+	struct bs_commit_log_record record = { type, size + extra_size };
+	uint32_t padded = BS_ALIGN(record.size, RECORD_ALIGN);
+	bool written = fwrite(&record, sizeof(record), 1, self->file) == 1 &&
+		       fwrite(payload, size, 1, self->file) == 1 &&
+		       (!extra_size || fwrite(extra, extra_size, 1, self->file) == 1) &&
+		       (padded == record.size ||
+			fwrite(padding, padded - record.size, 1, self->file) == 1);
+	if (!written)
+		self->stats.write_errors++;
+	self->stats.bytes += sizeof(record) + padded;
+}
+
+static void commit_log_write_objects(struct bs_commit_log *self)
+{
+	drmModeRes *res = drmModeGetResources(self->fd);
+	drmModePlaneRes *plane_res = drmModeGetPlaneResources(self->fd);
+	struct bs_commit_log_objects objects = { { 0 } };
+	if (res) {
+		objects.counts[BS_COMMIT_LOG_CRTCS] = res->count_crtcs;
+		objects.counts[BS_COMMIT_LOG_CONNECTORS] = res->count_connectors;
+	}
+	if (plane_res)
+		objects.counts[BS_COMMIT_LOG_PLANES] = plane_res->count_planes;
+
+	uint32_t count = objects.counts[BS_COMMIT_LOG_CRTCS] +
+			 objects.counts[BS_COMMIT_LOG_CONNECTORS] +
+			 objects.counts[BS_COMMIT_LOG_PLANES];
+	uint32_t *ids = calloc(count + 1, sizeof(uint32_t));
+	assert(ids);
+	uint32_t *next = ids;
+	for (uint32_t i = 0; i < objects.counts[BS_COMMIT_LOG_CRTCS]; i++)
+		*next++ = res->crtcs[i];
+	for (uint32_t i = 0; i < objects.counts[BS_COMMIT_LOG_CONNECTORS]; i++)
+		*next++ = res->connectors[i];
+	for (uint32_t i = 0; i < objects.counts[BS_COMMIT_LOG_PLANES]; i++)
+		*next++ = plane_res->planes[i];
+
+	commit_log_write(self, BS_COMMIT_LOG_RECORD_OBJECTS, &objects, sizeof(objects), ids,
+			 count * sizeof(uint32_t));
+	free(ids);
+	if (plane_res)
+		drmModeFreePlaneResources(plane_res);
+	if (res)
+		drmModeFreeResources(res);
+}
+
+struct bs_commit_log *bs_commit_log_new(int fd, const char *path)
+{
+	assert(fd >= 0);
+	assert(path);
+
+	FILE *file = fopen(path, "wb");
+	if (!file) {
+		bs_debug_error("failed to create commit log %s: %d", path, errno);
+		return NULL;
+	}
+
+	struct bs_commit_log *self = calloc(1, sizeof(struct bs_commit_log));
+	assert(self);
+	self->fd = fd;
+	self->file = file;
+	self->start_ns = bs_debug_gettime_ns();
+
+	struct commit_log_header header = { COMMIT_LOG_MAGIC, COMMIT_LOG_VERSION };
+	if (fwrite(&header, sizeof(header), 1, file) != 1)
+		self->stats.write_errors++;
+	self->stats.bytes += sizeof(header);
+	commit_log_write_objects(self);
+	return self;
+}
+
+void bs_commit_log_destroy(struct bs_commit_log **self)
+{
+	assert(self);
+	assert(*self);
+	if (fclose((*self)->file))
+		bs_debug_error("failed to finish commit log: %d", errno);
+	free((*self)->items);
+	free((*self)->props);
+	free((*self)->blobs);
+	free((*self)->fbs);
+	free(*self);
+	*self = NULL;
+}
+
+int bs_commit_log_add_property(struct bs_commit_log *self, drmModeAtomicReqPtr req,
+			       uint32_t object_id, uint32_t prop_id, uint64_t value)
+{
+	int ret = drmModeAtomicAddProperty(req, object_id, prop_id, value);
+	if (!self || ret < 0)
+		return ret;
+
+	// The request keeps its properties across commits, unless it was freshly allocated or
+	// rewound since, which a cursor behind the logged items shows.
+	size_t cursor = drmModeAtomicGetCursor(req);
+	if (cursor && self->item_count >= (size_t)cursor)
+		self->item_count = cursor - 1;
+
+	if (self->item_count == self->item_capacity) {
+		self->item_capacity = self->item_capacity ? self->item_capacity * 2 : 64;
+		self->items = realloc(self->items, self->item_capacity * sizeof(*self->items));
+		assert(self->items);
+	}
+
+	struct bs_commit_log_item *item = &self->items[self->item_count++];
+	item->object_id = object_id;
+	item->prop_id = prop_id;
+	item->value = value;
+	return ret;
+}
+
+void bs_commit_log_set_cursor(struct bs_commit_log *self, drmModeAtomicReqPtr req, int cursor)
+{
+	drmModeAtomicSetCursor(req, cursor);
+	if (self && (size_t)cursor < self->item_count)
+		self->item_count = cursor;
+}
+
+static struct logged_property *commit_log_property(struct bs_commit_log *self, uint32_t prop_id)
+{
+	for (size_t i = 0; i < self->prop_count; i++) {
+		if (self->props[i].prop_id == prop_id)
+			return &self->props[i];
+	}
+
+	drmModePropertyPtr prop = drmModeGetProperty(self->fd, prop_id);
+	if (!prop)
+		return NULL;
+
+	struct bs_commit_log_property record = { 0 };
+	record.prop_id = prop_id;
+	record.flags = prop->flags;
+	strncpy(record.name, prop->name, sizeof(record.name) - 1);
+	commit_log_write(self, BS_COMMIT_LOG_RECORD_PROPERTY, &record, sizeof(record), NULL, 0);
+
+	self->props = realloc(self->props, (self->prop_count + 1) * sizeof(*self->props));
+	assert(self->props);
+	struct logged_property *logged = &self->props[self->prop_count++];
+	logged->prop_id = prop_id;
+	logged->flags = prop->flags;
+	logged->fb = drm_property_type_is(prop, DRM_MODE_PROP_OBJECT) &&
+		     !strcmp(prop->name, "FB_ID");
+	drmModeFreeProperty(prop);
+	return logged;
+}
+
+// Returns true if the id is new or its contents hash differently than when last written.
+static bool commit_log_object_changed(struct logged_object **objects, size_t *count, uint32_t id,
+				      uint64_t hash)
+{
+	for (size_t i = 0; i < *count; i++) {
+		if ((*objects)[i].id == id) {
+			if ((*objects)[i].hash == hash)
+				return false;
+			(*objects)[i].hash = hash;
+			return true;
+		}
+	}
+
+	*objects = realloc(*objects, (*count + 1) * sizeof(**objects));
+	assert(*objects);
+	(*objects)[*count].id = id;
+	(*objects)[*count].hash = hash;
+	(*count)++;
+	return true;
+}
+
+static void commit_log_blob(struct bs_commit_log *self, uint32_t blob_id)
+{
+	drmModePropertyBlobPtr blob = drmModeGetPropertyBlob(self->fd, blob_id);
+	if (!blob)
+		return;
+
+	uint64_t hash = bs_hash_bytes(BS_HASH_INIT, blob->data, blob->length);
+	if (commit_log_object_changed(&self->blobs, &self->blob_count, blob_id, hash)) {
+		struct bs_commit_log_blob record = { blob_id, blob->length };
+		commit_log_write(self, BS_COMMIT_LOG_RECORD_BLOB, &record, sizeof(record),
+				 blob->data, blob->length);
+	}
+	drmModeFreePropertyBlob(blob);
+}
+
+static void commit_log_fb(struct bs_commit_log *self, uint32_t fb_id)
+{
+	drmModeFBPtr fb = drmModeGetFB(self->fd, fb_id);
+	if (!fb)
+		return;
+
+	struct bs_commit_log_fb record = { fb_id, fb->width, fb->height, fb->bpp, fb->depth };
+	uint64_t hash = bs_hash_bytes(BS_HASH_INIT, &record, sizeof(record));
+	if (commit_log_object_changed(&self->fbs, &self->fb_count, fb_id, hash))
+		commit_log_write(self, BS_COMMIT_LOG_RECORD_FB, &record, sizeof(record), NULL, 0);
+	drmModeFreeFB(fb);
+}
+
+int bs_commit_log_commit(struct bs_commit_log *self, int fd, drmModeAtomicReqPtr req,
+			 uint32_t flags, void *user_data)
+{
+	if (!self)
+		return drmModeAtomicCommit(fd, req, flags, user_data);
+
+	// Whatever the request refers to has to be in the log before the commit, and while it
+	// still exists.
+	int64_t log_start_ns = bs_debug_gettime_ns();
+	size_t cursor = drmModeAtomicGetCursor(req);
+	if (self->item_count > cursor)
+		self->item_count = cursor;
+	for (size_t i = 0; i < self->item_count; i++) {
+		const struct bs_commit_log_item *item = &self->items[i];
+		struct logged_property *prop = commit_log_property(self, item->prop_id);
+		if (!prop || !item->value)
+			continue;
+		if (prop->flags & DRM_MODE_PROP_BLOB)
+			commit_log_blob(self, item->value);
+		else if (prop->fb)
+			commit_log_fb(self, item->value);
+	}
+
+	int64_t start_ns = bs_debug_gettime_ns();
+	int ret = drmModeAtomicCommit(fd, req, flags, user_data);
+	int64_t end_ns = bs_debug_gettime_ns();
+
+	struct bs_commit_log_commit record = { 0 };
+	record.time_ns = start_ns - self->start_ns;
+	record.duration_ns = end_ns - start_ns;
+	record.flags = flags;
+	record.ret = ret;
+	record.count = self->item_count;
+	commit_log_write(self, BS_COMMIT_LOG_RECORD_COMMIT, &record, sizeof(record), self->items,
+			 self->item_count * sizeof(*self->items));
+	self->stats.commits++;
+	self->stats.overhead_ns += start_ns - log_start_ns + bs_debug_gettime_ns() - end_ns;
+
+	// The items stay, as libdrm keeps the request's properties for the next commit.
+	return ret;
+}
+
+void bs_commit_log_get_stats(struct bs_commit_log *self, struct bs_commit_log_stats *stats)
+{
+	assert(self);
+	assert(stats);
+	*stats = self->stats;
+}
+
+struct bs_commit_log_reader {
+	uint8_t *map;
+	size_t size;
+	size_t offset;
+};
+
+struct bs_commit_log_reader *bs_commit_log_reader_new(const char *path)
+{
+	assert(path);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		bs_debug_error("failed to open commit log %s: %d", path, errno);
+		return NULL;
+	}
+
+	struct stat st;
+	void *map = MAP_FAILED;
+	if (!fstat(fd, &st) && st.st_size >= (off_t)sizeof(struct commit_log_header))
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		bs_debug_error("failed to map commit log %s", path);
+		return NULL;
+	}
+
+	const struct commit_log_header *header = map;
+	if (header->magic != COMMIT_LOG_MAGIC || header->version != COMMIT_LOG_VERSION) {
+		bs_debug_error("%s is not a version %d commit log", path, COMMIT_LOG_VERSION);
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	struct bs_commit_log_reader *self = calloc(1, sizeof(struct bs_commit_log_reader));
+	assert(self);
+	self->map = map;
+	self->size = st.st_size;
+	self->offset = sizeof(*header);
+	return self;
+}
+
+void bs_commit_log_reader_destroy(struct bs_commit_log_reader **self)
+{
+	assert(self);
+	assert(*self);
+	munmap((*self)->map, (*self)->size);
+	free(*self);
+	*self = NULL;
+}
+
+const struct bs_commit_log_record *bs_commit_log_reader_next(struct bs_commit_log_reader *self)
+{
+	assert(self);
+	size_t remaining = self->size - self->offset;
+	if (remaining < sizeof(struct bs_commit_log_record))
+		return NULL;
+
+	const struct bs_commit_log_record *record = (const void *)(self->map + self->offset);
+	size_t padded = BS_ALIGN((size_t)record->size, RECORD_ALIGN);
+	if (padded > remaining - sizeof(*record)) {
+		bs_debug_warning("commit log is truncated");
+		return NULL;
+	}
+
+	self->offset += sizeof(*record) + padded;
+	return record;
+}
@@ -0,0 +1,700 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <pthread.h>
+
+#include "bs_drm.h"
+
+// Tiles are wide so each row of one is a long run of a single layer's pixels, and short so a
+// frame has enough of them to keep every thread busy.
+#define TILE_WIDTH 256
+#define TILE_HEIGHT 32
+#define OPAQUE_BLACK 0xff000000
+
+struct compositor_layer {
+	struct bs_compositor_layer layer;
+	// Destination rectangle clipped to the frame, exclusive of x1 and y1.
+	uint32_t x0;
+	uint32_t y0;
+	uint32_t x1;
+	uint32_t y1;
+	uint8_t plane_alpha;
+	// Hides everything below it, so tiles it covers start with it.
+	bool opaque;
+	// Source column of every destination column in the clipped rectangle, kept between frames.
+	uint32_t *columns;
+	size_t column_capacity;
+	// The layer filtered to its destination size, which then stands in for its source.
+	uint32_t *scaled;
+	size_t scaled_capacity;
+	// Source rectangles of the other (all opaque) formats, unpacked to XRGB8888 for filtering.
+	uint32_t *unpacked;
+	size_t unpacked_capacity;
+	// The layer's source pixels in scanout orientation, when it is rotated or reflected.
+	uint32_t *rotated;
+	size_t rotated_capacity;
+};
+
+struct bs_compositor {
+	pthread_t *threads;
+	uint32_t num_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t start_cond;
+	pthread_cond_t done_cond;
+	// Bumped for every frame the workers should help with.
+	uint64_t generation;
+	// Workers still on the current frame.
+	uint32_t running;
+	bool quit;
+
+	// The frame being composed, bottom layer first, and the caller's layers in that order.
+	struct compositor_layer *layers;
+	struct bs_compositor_layer *sorted;
+	size_t layer_count;
+	size_t layer_capacity;
+	uint8_t *dst;
+	uint32_t dst_stride;
+	uint32_t width;
+	uint32_t height;
+	uint32_t tiles_x;
+	uint32_t tile_count;
+	uint32_t next_tile;
+	uint64_t occluded;
+
+	struct bs_compositor_stats stats;
+};
+
+static bool format_has_alpha(uint32_t format)
+{
+	return format == DRM_FORMAT_ARGB8888 || format == DRM_FORMAT_ABGR8888;
+}
+
+static bool format_supported(uint32_t format)
+{
+	switch (format) {
+		case DRM_FORMAT_XRGB8888:
+		case DRM_FORMAT_ARGB8888:
+		case DRM_FORMAT_XBGR8888:
+		case DRM_FORMAT_ABGR8888:
+		case DRM_FORMAT_RGB565:
+		case DRM_FORMAT_NV12:
+			return true;
+		default:
+			return false;
+	}
+}
+
+static uint8_t clamp_byte(int32_t v)
+{
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+// BT.601 limited range, the inverse of what bs_draw writes.
+static uint32_t yuv_to_argb(int32_t y, int32_t u, int32_t v)
+{
+	int32_t c = 298 * (y - 16) + 128;
+	int32_t d = u - 128;
+	int32_t e = v - 128;
+	return OPAQUE_BLACK | clamp_byte((c + 409 * e) >> 8) << 16 |
+	       clamp_byte((c - 100 * d - 208 * e) >> 8) << 8 | clamp_byte((c + 516 * d) >> 8);
+}
+
+static uint32_t swap_red_blue(uint32_t p)
+{
+	return (p & 0xff00ff00) | (p & 0xff) << 16 | ((p >> 16) & 0xff);
+}
+
+// Converts the layer's source pixels for a destination span to ARGB8888.
+static void fetch_span(const struct compositor_layer *l, uint32_t sy, const uint32_t *columns,
+		       uint32_t count, uint32_t *out)
+{
+	const struct bs_compositor_layer *layer = &l->layer;
+	const uint8_t *row = (const uint8_t *)layer->data[0] + (size_t)sy * layer->strides[0];
+	const uint32_t *row32 = (const uint32_t *)row;
+	const uint16_t *row16 = (const uint16_t *)row;
+	switch (layer->format) {
+		case DRM_FORMAT_XRGB8888:
+			for (uint32_t i = 0; i < count; i++)
+				out[i] = row32[columns[i]] | OPAQUE_BLACK;
+			break;
+		case DRM_FORMAT_ARGB8888:
+			for (uint32_t i = 0; i < count; i++)
+				out[i] = row32[columns[i]];
+			break;
+		case DRM_FORMAT_XBGR8888:
+			for (uint32_t i = 0; i < count; i++)
+				out[i] = swap_red_blue(row32[columns[i]]) | OPAQUE_BLACK;
+			break;
+		case DRM_FORMAT_ABGR8888:
+			for (uint32_t i = 0; i < count; i++)
+				out[i] = swap_red_blue(row32[columns[i]]);
+			break;
+		case DRM_FORMAT_RGB565:
+			for (uint32_t i = 0; i < count; i++) {
+				uint16_t p = row16[columns[i]];
+				uint32_t r = (p >> 11) & 0x1f;
+				uint32_t g = (p >> 5) & 0x3f;
+				uint32_t b = p & 0x1f;
+				out[i] = OPAQUE_BLACK | ((r << 3) | (r >> 2)) << 16 |
+					 ((g << 2) | (g >> 4)) << 8 | ((b << 3) | (b >> 2));
+			}
+			break;
+		case DRM_FORMAT_NV12: {
+			const uint8_t *uv =
+			    (const uint8_t *)layer->data[1] + (size_t)(sy / 2) * layer->strides[1];
+			for (uint32_t i = 0; i < count; i++) {
+				uint32_t c = columns[i];
+				out[i] = yuv_to_argb(row[c], uv[c & ~1u], uv[(c & ~1u) + 1]);
+			}
+			break;
+		}
+	}
+}
+
+// Blending works on four pixels at a time, each split into its 0x00rr00bb and 0x00aa00gg halves
+// so that every channel gets a 16-bit lane to be multiplied in, as SSE2 and NEON both can.
+#define LANES 4
+typedef uint32_t pixel_lanes __attribute__((vector_size(LANES * sizeof(uint32_t))));
+typedef uint16_t channel_lanes __attribute__((vector_size(LANES * sizeof(uint32_t))));
+
+// x * w / 255 for every channel, rounded like the kernel's blending helpers.
+static channel_lanes scale_channels(channel_lanes x, channel_lanes w)
+{
+	channel_lanes t = x * w + 128;
+	return (t + (t >> 8)) >> 8;
+}
+
+static channel_lanes add_channels_saturate(channel_lanes a, channel_lanes b)
+{
+	channel_lanes sum = a + b;
+	return (sum | -(sum >> 8)) & 0xff;
+}
+
+// Blends per the kernel's "pixel blend mode" documentation.
+static pixel_lanes blend_lanes(const struct compositor_layer *l, pixel_lanes fg, pixel_lanes bg)
+{
+	channel_lanes pa = (channel_lanes){ 0 } + l->plane_alpha;
+	pixel_lanes a = fg >> 24;
+	channel_lanes alpha = scale_channels((channel_lanes)(a | a << 16), pa);
+	channel_lanes fg_weight, bg_weight;
+	switch (l->layer.blend_mode) {
+		case BS_COMPOSITOR_BLEND_NONE:
+			fg_weight = pa;
+			bg_weight = 255 - pa;
+			break;
+		case BS_COMPOSITOR_BLEND_PREMULTIPLIED:
+			fg_weight = pa;
+			bg_weight = 255 - alpha;
+			break;
+		default:
+			fg_weight = alpha;
+			bg_weight = 255 - alpha;
+			break;
+	}
+
+	channel_lanes rb =
+	    add_channels_saturate(scale_channels((channel_lanes)(fg & 0x00ff00ff), fg_weight),
+				  scale_channels((channel_lanes)(bg & 0x00ff00ff), bg_weight));
+	channel_lanes g =
+	    add_channels_saturate(scale_channels((channel_lanes)((fg >> 8) & 0xff), fg_weight),
+				  scale_channels((channel_lanes)((bg >> 8) & 0xff), bg_weight));
+	return OPAQUE_BLACK | (pixel_lanes)g << 8 | (pixel_lanes)rb;
+}
+
+static void blend_span(const struct compositor_layer *l, const uint32_t *src, uint32_t *dst,
+		       uint32_t count)
+{
+	pixel_lanes fg, bg, out;
+	uint32_t i = 0;
+	for (; i + LANES <= count; i += LANES) {
+		memcpy(&fg, &src[i], sizeof(fg));
+		memcpy(&bg, &dst[i], sizeof(bg));
+		out = blend_lanes(l, fg, bg);
+		memcpy(&dst[i], &out, sizeof(out));
+	}
+
+	if (i < count) {
+		fg = bg = (pixel_lanes){ 0 };
+		memcpy(&fg, &src[i], (count - i) * sizeof(uint32_t));
+		memcpy(&bg, &dst[i], (count - i) * sizeof(uint32_t));
+		out = blend_lanes(l, fg, bg);
+		memcpy(&dst[i], &out, (count - i) * sizeof(uint32_t));
+	}
+}
+
+static void compose_tile(struct bs_compositor *self, uint32_t tile, uint32_t *scratch)
+{
+	uint32_t x0 = (tile % self->tiles_x) * TILE_WIDTH;
+	uint32_t y0 = (tile / self->tiles_x) * TILE_HEIGHT;
+	uint32_t x1 = x0 + TILE_WIDTH < self->width ? x0 + TILE_WIDTH : self->width;
+	uint32_t y1 = y0 + TILE_HEIGHT < self->height ? y0 + TILE_HEIGHT : self->height;
+
+	// Layers below the topmost opaque one covering the whole tile can't show through.
+	size_t first = 0;
+	bool covered = false;
+	for (size_t i = self->layer_count; i-- > 0;) {
+		const struct compositor_layer *l = &self->layers[i];
+		if (l->opaque && l->x0 <= x0 && l->y0 <= y0 && l->x1 >= x1 && l->y1 >= y1) {
+			first = i;
+			covered = true;
+			break;
+		}
+	}
+	if (first)
+		__atomic_fetch_add(&self->occluded, first, __ATOMIC_RELAXED);
+
+	if (!covered) {
+		for (uint32_t y = y0; y < y1; y++) {
+			uint32_t *dst = (uint32_t *)(self->dst + (size_t)y * self->dst_stride);
+			for (uint32_t x = x0; x < x1; x++)
+				dst[x] = OPAQUE_BLACK;
+		}
+	}
+
+	for (size_t i = first; i < self->layer_count; i++) {
+		const struct compositor_layer *l = &self->layers[i];
+		const struct bs_compositor_layer *layer = &l->layer;
+		uint32_t lx0 = l->x0 > x0 ? l->x0 : x0;
+		uint32_t lx1 = l->x1 < x1 ? l->x1 : x1;
+		uint32_t ly0 = l->y0 > y0 ? l->y0 : y0;
+		uint32_t ly1 = l->y1 < y1 ? l->y1 : y1;
+		if (lx0 >= lx1 || ly0 >= ly1)
+			continue;
+
+		for (uint32_t y = ly0; y < ly1; y++) {
+			// Sample at the destination pixel's center, in the 16.16 source space.
+			uint64_t row = 2 * (uint64_t)((int64_t)y - layer->crtc_y) + 1;
+			uint32_t sy =
+			    (layer->src_y + row * layer->src_h / (2 * layer->crtc_h)) >> 16;
+			uint32_t *dst = (uint32_t *)(self->dst + (size_t)y * self->dst_stride);
+			const uint32_t *columns = &l->columns[lx0 - l->x0];
+			if (l->opaque) {
+				// Blend mode "None" leaves alpha unused, and the CRTC has none.
+				fetch_span(l, sy, columns, lx1 - lx0, &dst[lx0]);
+				if (format_has_alpha(layer->format)) {
+					for (uint32_t x = lx0; x < lx1; x++)
+						dst[x] |= OPAQUE_BLACK;
+				}
+			} else {
+				fetch_span(l, sy, columns, lx1 - lx0, scratch);
+				blend_span(l, scratch, &dst[lx0], lx1 - lx0);
+			}
+		}
+	}
+}
+
+static void compositor_run_tiles(struct bs_compositor *self, uint32_t *scratch)
+{
+	for (;;) {
+		uint32_t tile = __atomic_fetch_add(&self->next_tile, 1, __ATOMIC_RELAXED);
+		if (tile >= self->tile_count)
+			return;
+		compose_tile(self, tile, scratch);
+	}
+}
+
+static void *compositor_worker(void *arg)
+{
+	struct bs_compositor *self = arg;
+	uint32_t scratch[TILE_WIDTH];
+	uint64_t generation = 0;
+
+	pthread_mutex_lock(&self->lock);
+	for (;;) {
+		while (!self->quit && generation == self->generation)
+			pthread_cond_wait(&self->start_cond, &self->lock);
+		if (self->quit)
+			break;
+		generation = self->generation;
+		pthread_mutex_unlock(&self->lock);
+
+		compositor_run_tiles(self, scratch);
+
+		pthread_mutex_lock(&self->lock);
+		if (--self->running == 0)
+			pthread_cond_signal(&self->done_cond);
+	}
+	pthread_mutex_unlock(&self->lock);
+	return NULL;
+}
+
+struct bs_compositor *bs_compositor_new(uint32_t num_threads)
+{
+	struct bs_compositor *self = calloc(1, sizeof(struct bs_compositor));
+	assert(self);
+
+	if (!num_threads) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		num_threads = cpus > 0 ? cpus : 1;
+	}
+	self->num_threads = num_threads;
+	pthread_mutex_init(&self->lock, NULL);
+	pthread_cond_init(&self->start_cond, NULL);
+	pthread_cond_init(&self->done_cond, NULL);
+
+	// The caller's thread composes too, so it needs one less worker.
+	self->threads = calloc(num_threads, sizeof(pthread_t));
+	assert(self->threads);
+	for (uint32_t i = 0; i + 1 < num_threads; i++) {
+		int ret = pthread_create(&self->threads[i], NULL, compositor_worker, self);
+		assert(!ret);
+	}
+
+	return self;
+}
+
+void bs_compositor_destroy(struct bs_compositor **self)
+{
+	assert(self);
+	assert(*self);
+	struct bs_compositor *compositor = *self;
+
+	pthread_mutex_lock(&compositor->lock);
+	compositor->quit = true;
+	pthread_cond_broadcast(&compositor->start_cond);
+	pthread_mutex_unlock(&compositor->lock);
+	for (uint32_t i = 0; i + 1 < compositor->num_threads; i++)
+		pthread_join(compositor->threads[i], NULL);
+
+	for (size_t i = 0; i < compositor->layer_capacity; i++) {
+		free(compositor->layers[i].columns);
+		free(compositor->layers[i].scaled);
+		free(compositor->layers[i].unpacked);
+		free(compositor->layers[i].rotated);
+	}
+	free(compositor->layers);
+	free(compositor->sorted);
+	free(compositor->threads);
+	pthread_cond_destroy(&compositor->done_cond);
+	pthread_cond_destroy(&compositor->start_cond);
+	pthread_mutex_destroy(&compositor->lock);
+	free(compositor);
+	*self = NULL;
+}
+
+static void compositor_reserve_layers(struct bs_compositor *self, size_t count)
+{
+	if (count <= self->layer_capacity)
+		return;
+	self->layers = realloc(self->layers, count * sizeof(*self->layers));
+	self->sorted = realloc(self->sorted, count * sizeof(*self->sorted));
+	assert(self->layers && self->sorted);
+	memset(&self->layers[self->layer_capacity], 0,
+	       (count - self->layer_capacity) * sizeof(*self->layers));
+	self->layer_capacity = count;
+}
+
+static bool format_is_32bit_rgb(uint32_t format)
+{
+	return format != DRM_FORMAT_RGB565 && format != DRM_FORMAT_NV12;
+}
+
+// Bytes per pixel of the first plane.
+static uint32_t format_cpp(uint32_t format)
+{
+	switch (format) {
+		case DRM_FORMAT_RGB565:
+			return 2;
+		case DRM_FORMAT_NV12:
+			return 1;
+		default:
+			return 4;
+	}
+}
+
+// One angle, optionally with reflections.
+static bool rotation_supported(uint32_t rotation)
+{
+	if (!rotation)
+		return true;
+	uint32_t angle = rotation & DRM_MODE_ROTATE_MASK;
+	uint32_t known = DRM_MODE_ROTATE_MASK | DRM_MODE_REFLECT_X | DRM_MODE_REFLECT_Y;
+	return !(rotation & ~known) && angle && !(angle & (angle - 1));
+}
+
+static uint32_t *reserve_pixels(uint32_t **buffer, size_t *capacity, size_t pixels)
+{
+	if (pixels > *capacity) {
+		free(*buffer);
+		*buffer = calloc(pixels, sizeof(uint32_t));
+		assert(*buffer);
+		*capacity = pixels;
+	}
+	return *buffer;
+}
+
+// Converts the source pixels the layer's rectangle touches to ARGB8888, and points src at them.
+static void compositor_unpack_layer(struct compositor_layer *l, struct bs_scale_source *src)
+{
+	const struct bs_compositor_layer *layer = &l->layer;
+	uint32_t x0 = layer->src_x >> 16;
+	uint32_t y0 = layer->src_y >> 16;
+	uint32_t w = src->width - x0;
+	uint32_t h = src->height - y0;
+	uint32_t *columns = reserve_pixels(&l->columns, &l->column_capacity, w);
+	uint32_t *unpacked = reserve_pixels(&l->unpacked, &l->unpacked_capacity, (size_t)w * h);
+	for (uint32_t x = 0; x < w; x++)
+		columns[x] = x0 + x;
+	for (uint32_t y = 0; y < h; y++)
+		fetch_span(l, y0 + y, columns, w, &unpacked[(size_t)y * w]);
+
+	src->data = unpacked;
+	src->stride = w * sizeof(uint32_t);
+	src->width = w;
+	src->height = h;
+	src->x -= x0 << 16;
+	src->y -= y0 << 16;
+}
+
+// Moves the 16.16 rectangle at (x, y) of a width x height image to where it lands once the image
+// is reflected, then rotated counter-clockwise, as the kernel applies rotation.
+static void rotate_rect(uint32_t rotation, uint32_t width, uint32_t height, uint32_t *x,
+			uint32_t *y, uint32_t *w, uint32_t *h)
+{
+	uint32_t rx = *x, ry = *y, rw = *w, rh = *h;
+	if (rotation & DRM_MODE_REFLECT_X)
+		rx = width - rx - rw;
+	if (rotation & DRM_MODE_REFLECT_Y)
+		ry = height - ry - rh;
+
+	switch (rotation & DRM_MODE_ROTATE_MASK) {
+		case DRM_MODE_ROTATE_90:
+			*x = ry;
+			*y = width - rx - rw;
+			*w = rh;
+			*h = rw;
+			break;
+		case DRM_MODE_ROTATE_180:
+			*x = width - rx - rw;
+			*y = height - ry - rh;
+			*w = rw;
+			*h = rh;
+			break;
+		case DRM_MODE_ROTATE_270:
+			*x = height - ry - rh;
+			*y = rx;
+			*w = rh;
+			*h = rw;
+			break;
+		default:
+			*x = rx;
+			*y = ry;
+			*w = rw;
+			*h = rh;
+			break;
+	}
+}
+
+// Rotates the pixels under the layer's source rectangle into scanout orientation, after which the
+// layer composes unrotated.
+static void compositor_rotate_layer(struct bs_compositor *self, struct compositor_layer *l)
+{
+	struct bs_compositor_layer *layer = &l->layer;
+	if (!layer->rotation || layer->rotation == DRM_MODE_ROTATE_0)
+		return;
+
+	int64_t start_ns = bs_debug_gettime_ns();
+	// NV12 is cut on chroma sample boundaries so both planes keep their 2:1 relation.
+	bool nv12 = layer->format == DRM_FORMAT_NV12;
+	uint32_t align = nv12 ? 2 : 1;
+	uint32_t x0 = (layer->src_x >> 16) & ~(align - 1);
+	uint32_t y0 = (layer->src_y >> 16) & ~(align - 1);
+	uint32_t x1 = (layer->src_x + layer->src_w + 0xffff) >> 16;
+	uint32_t y1 = (layer->src_y + layer->src_h + 0xffff) >> 16;
+	uint32_t width = BS_ALIGN(x1, align) - x0;
+	uint32_t height = BS_ALIGN(y1, align) - y0;
+	uint32_t rotated_width, rotated_height;
+	bs_rotate_size(layer->rotation, width, height, &rotated_width, &rotated_height);
+
+	uint32_t cpp = format_cpp(layer->format);
+	size_t luma_size = (size_t)rotated_width * rotated_height * cpp;
+	size_t size = luma_size + (nv12 ? luma_size / 2 : 0);
+	size_t pixels = (size + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+	uint8_t *rotated = (uint8_t *)reserve_pixels(&l->rotated, &l->rotated_capacity, pixels);
+	const uint8_t *src = (const uint8_t *)layer->data[0] + (size_t)y0 * layer->strides[0];
+	bool ok = bs_rotate_plane(src + (size_t)x0 * cpp, layer->strides[0], width, height, cpp,
+				  layer->rotation, rotated, rotated_width * cpp);
+	if (nv12) {
+		// CbCr pairs move together, as 2-byte elements of a half size plane.
+		const uint8_t *uv = layer->data[1];
+		uv += (size_t)(y0 / 2) * layer->strides[1];
+		ok &= bs_rotate_plane(uv + x0, layer->strides[1], width / 2, height / 2, 2,
+				      layer->rotation, rotated + luma_size, rotated_width);
+	}
+	assert(ok);
+
+	layer->src_x -= x0 << 16;
+	layer->src_y -= y0 << 16;
+	rotate_rect(layer->rotation, width << 16, height << 16, &layer->src_x, &layer->src_y,
+		    &layer->src_w, &layer->src_h);
+	layer->data[0] = rotated;
+	layer->strides[0] = rotated_width * cpp;
+	layer->data[1] = rotated + luma_size;
+	layer->strides[1] = rotated_width;
+	layer->rotation = DRM_MODE_ROTATE_0;
+	self->stats.rotated++;
+	self->stats.rotate_ns += bs_debug_gettime_ns() - start_ns;
+}
+
+// Filters a scaled layer to its destination size, after which it composes unscaled.
+static void compositor_prefilter_layer(struct bs_compositor *self, struct compositor_layer *l)
+{
+	struct bs_compositor_layer *layer = &l->layer;
+	if (layer->src_w == layer->crtc_w << 16 && layer->src_h == layer->crtc_h << 16)
+		return;
+
+	int64_t start_ns = bs_debug_gettime_ns();
+	size_t pixels = (size_t)layer->crtc_w * layer->crtc_h;
+	reserve_pixels(&l->scaled, &l->scaled_capacity, pixels);
+
+	// Filtering clamps to the rectangle's own pixels, so its extent stands in for the image's.
+	struct bs_scale_source src = {
+		.data = layer->data[0],
+		.stride = layer->strides[0],
+		.width = (layer->src_x + layer->src_w + 0xffff) >> 16,
+		.height = (layer->src_y + layer->src_h + 0xffff) >> 16,
+		.x = layer->src_x,
+		.y = layer->src_y,
+		.w = layer->src_w,
+		.h = layer->src_h,
+	};
+	if (!format_is_32bit_rgb(layer->format)) {
+		compositor_unpack_layer(l, &src);
+		layer->format = DRM_FORMAT_ARGB8888;
+	}
+	bs_scale(&src, BS_SCALE_BILINEAR, l->scaled, layer->crtc_w * sizeof(uint32_t),
+		 layer->crtc_w, layer->crtc_h);
+
+	layer->data[0] = l->scaled;
+	layer->strides[0] = layer->crtc_w * sizeof(uint32_t);
+	layer->src_x = 0;
+	layer->src_y = 0;
+	layer->src_w = layer->crtc_w << 16;
+	layer->src_h = layer->crtc_h << 16;
+	self->stats.scaled++;
+	self->stats.scaled_pixels += pixels;
+	self->stats.scale_ns += bs_debug_gettime_ns() - start_ns;
+}
+
+// Clips the layer to the frame and works out its source columns. Returns false if none of it is
+// visible.
+static bool compositor_prepare_layer(struct bs_compositor *self, struct compositor_layer *l)
+{
+	const struct bs_compositor_layer *layer = &l->layer;
+	if (!layer->crtc_w || !layer->crtc_h || !layer->src_w || !layer->src_h)
+		return false;
+
+	int64_t x0 = layer->crtc_x > 0 ? layer->crtc_x : 0;
+	int64_t y0 = layer->crtc_y > 0 ? layer->crtc_y : 0;
+	int64_t x1 = (int64_t)layer->crtc_x + layer->crtc_w;
+	int64_t y1 = (int64_t)layer->crtc_y + layer->crtc_h;
+	if (x1 > self->width)
+		x1 = self->width;
+	if (y1 > self->height)
+		y1 = self->height;
+	if (x0 >= x1 || y0 >= y1)
+		return false;
+	l->x0 = x0;
+	l->y0 = y0;
+	l->x1 = x1;
+	l->y1 = y1;
+
+	compositor_rotate_layer(self, l);
+	if (layer->filter == BS_SCALE_BILINEAR)
+		compositor_prefilter_layer(self, l);
+
+	l->plane_alpha = (layer->alpha * 255u + 32767) / 65535;
+	l->opaque = l->plane_alpha == 255 && (!format_has_alpha(layer->format) ||
+					       layer->blend_mode == BS_COMPOSITOR_BLEND_NONE);
+
+	size_t width = l->x1 - l->x0;
+	reserve_pixels(&l->columns, &l->column_capacity, width);
+	for (uint32_t x = l->x0; x < l->x1; x++) {
+		uint64_t column = 2 * (uint64_t)((int64_t)x - layer->crtc_x) + 1;
+		l->columns[x - l->x0] =
+		    (layer->src_x + column * layer->src_w / (2 * layer->crtc_w)) >> 16;
+	}
+	return true;
+}
+
+bool bs_compositor_compose(struct bs_compositor *self, const struct bs_compositor_layer *layers,
+			   size_t count, void *dst, uint32_t dst_stride, uint32_t width,
+			   uint32_t height)
+{
+	assert(self);
+	assert(dst);
+	assert(!count || layers);
+
+	for (size_t i = 0; i < count; i++) {
+		if (!format_supported(layers[i].format) || !rotation_supported(layers[i].rotation))
+			return false;
+	}
+
+	int64_t start_ns = bs_debug_gettime_ns();
+	self->dst = dst;
+	self->dst_stride = dst_stride;
+	self->width = width;
+	self->height = height;
+
+	// Stable insertion by zpos, so layers sharing one keep the caller's order.
+	compositor_reserve_layers(self, count);
+	for (size_t i = 0; i < count; i++) {
+		size_t pos = i;
+		while (pos > 0 && self->sorted[pos - 1].zpos > layers[i].zpos) {
+			self->sorted[pos] = self->sorted[pos - 1];
+			pos--;
+		}
+		self->sorted[pos] = layers[i];
+	}
+
+	self->layer_count = 0;
+	for (size_t i = 0; i < count; i++) {
+		struct compositor_layer *l = &self->layers[self->layer_count];
+		l->layer = self->sorted[i];
+		if (compositor_prepare_layer(self, l))
+			self->layer_count++;
+	}
+
+	self->tiles_x = (width + TILE_WIDTH - 1) / TILE_WIDTH;
+	self->tile_count = self->tiles_x * ((height + TILE_HEIGHT - 1) / TILE_HEIGHT);
+	self->next_tile = 0;
+	self->occluded = 0;
+
+	pthread_mutex_lock(&self->lock);
+	self->generation++;
+	self->running = self->num_threads - 1;
+	pthread_cond_broadcast(&self->start_cond);
+	pthread_mutex_unlock(&self->lock);
+
+	uint32_t scratch[TILE_WIDTH];
+	compositor_run_tiles(self, scratch);
+
+	pthread_mutex_lock(&self->lock);
+	while (self->running)
+		pthread_cond_wait(&self->done_cond, &self->lock);
+	pthread_mutex_unlock(&self->lock);
+
+	int64_t compose_ns = bs_debug_gettime_ns() - start_ns;
+	self->stats.frames++;
+	self->stats.occluded += self->occluded;
+	self->stats.compose_ns += compose_ns;
+	if (compose_ns > self->stats.max_compose_ns)
+		self->stats.max_compose_ns = compose_ns;
+	return true;
+}
+
+uint32_t bs_compositor_get_num_threads(struct bs_compositor *self)
+{
+	assert(self);
+	return self->num_threads;
+}
+
+void bs_compositor_get_stats(struct bs_compositor *self, struct bs_compositor_stats *stats)
+{
+	assert(self);
+	assert(stats);
+	*stats = self->stats;
+}
@@ -0,0 +1,368 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "bs_drm.h"
+
+#define DEBUGFS_DRI_PATH "/sys/kernel/debug/dri"
+// Render nodes start at 128 and control nodes at 64, and neither has CRTCs.
+#define DRM_PRIMARY_MINOR_MAX 64
+// A data line is a 10 character frame number, " 0x%08x" per CRC value and a newline.
+#define CRC_LINE_MAX (10 + 11 * BS_CRTC_CRC_MAX_VALUES + 1)
+#define CRC_EXPECT_MAX 16
+#define CRC_PENDING_MAX 256
+
+struct crc_expect {
+	uint32_t frame;
+	// Frames whose content isn't known are left unchecked.
+	bool known;
+	uint32_t crc;
+};
+
+struct bs_crtc_crc {
+	int data_fd;
+	// Expectations in the order of their frames.
+	struct crc_expect expects[CRC_EXPECT_MAX];
+	size_t expect_count;
+	// Entries that were read but not checked yet, oldest first.
+	struct bs_crtc_crc_entry pending[CRC_PENDING_MAX];
+	size_t pending_count;
+	bool warned;
+	struct bs_crtc_crc_stats stats;
+};
+
+// Slicing-by-4 tables of the kernel's crc32_le, which is the reflected 0xedb88320 polynomial with
+// neither the seed nor the result inverted.
+static uint32_t crc_tables[4][256];
+static pthread_once_t crc_tables_once = PTHREAD_ONCE_INIT;
+
+static void crc_tables_init(void)
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (crc & 1 ? 0xedb88320 : 0);
+		crc_tables[0][i] = crc;
+	}
+	for (int t = 1; t < 4; t++) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t prev = crc_tables[t - 1][i];
+			crc_tables[t][i] = (prev >> 8) ^ crc_tables[0][prev & 0xff];
+		}
+	}
+}
+
+uint32_t bs_crtc_crc_vkms(const void *pixels, uint32_t stride, uint32_t width, uint32_t height)
+{
+	assert(pixels);
+	pthread_once(&crc_tables_once, crc_tables_init);
+
+	uint32_t crc = 0;
+	for (uint32_t y = 0; y < height; y++) {
+		const uint8_t *row = (const uint8_t *)pixels + (size_t)y * stride;
+		for (uint32_t x = 0; x < width; x++) {
+			uint32_t pixel;
+			memcpy(&pixel, row + (size_t)x * 4, sizeof(pixel));
+			// The output is XRGB, so the alpha byte is cleared before hashing.
+			crc ^= pixel & 0x00ffffff;
+			crc = crc_tables[3][crc & 0xff] ^ crc_tables[2][(crc >> 8) & 0xff] ^
+			      crc_tables[1][(crc >> 16) & 0xff] ^ crc_tables[0][crc >> 24];
+		}
+	}
+	return crc;
+}
+
+static int find_crtc_index(int fd, uint32_t crtc_id)
+{
+	drmModeRes *res = drmModeGetResources(fd);
+	if (!res)
+		return -1;
+
+	int crtc_index = -1;
+	for (int i = 0; i < res->count_crtcs; i++) {
+		if (res->crtcs[i] == crtc_id)
+			crtc_index = i;
+	}
+	drmModeFreeResources(res);
+	return crtc_index;
+}
+
+// Falls back to the debugfs directory of the only primary node whose driver name matches, for card
+// fds that aren't character devices.
+static int find_minor_by_driver(int fd)
+{
+	drmVersionPtr version = drmGetVersion(fd);
+	if (!version)
+		return -1;
+
+	int found = -1;
+	size_t match_count = 0;
+	size_t len = strlen(version->name);
+	for (int minor = 0; minor < DRM_PRIMARY_MINOR_MAX; minor++) {
+		char path[64];
+		snprintf(path, sizeof(path), DEBUGFS_DRI_PATH "/%d/name", minor);
+		int name_fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (name_fd < 0)
+			continue;
+
+		// The name file starts with the driver name followed by a space.
+		char name[64] = { 0 };
+		ssize_t name_len = read(name_fd, name, sizeof(name) - 1);
+		close(name_fd);
+		if (name_len > (ssize_t)len && !strncmp(name, version->name, len) &&
+		    (name[len] == ' ' || name[len] == '\n')) {
+			found = minor;
+			match_count++;
+		}
+	}
+	drmFreeVersion(version);
+	return match_count == 1 ? found : -1;
+}
+
+static int find_minor(int fd)
+{
+	struct stat st;
+	if (!fstat(fd, &st) && S_ISCHR(st.st_mode))
+		return minor(st.st_rdev);
+	return find_minor_by_driver(fd);
+}
+
+static bool write_source(const char *path, const char *source)
+{
+	int fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	size_t len = strlen(source);
+	bool written = write(fd, source, len) == (ssize_t)len;
+	close(fd);
+	return written;
+}
+
+struct bs_crtc_crc *bs_crtc_crc_new(int fd, uint32_t crtc_id, const char *source)
+{
+	assert(fd >= 0);
+	assert(source);
+
+	int crtc_index = find_crtc_index(fd, crtc_id);
+	if (crtc_index < 0) {
+		bs_debug_error("CRTC %u does not exist", crtc_id);
+		return NULL;
+	}
+
+	int minor = find_minor(fd);
+	if (minor < 0) {
+		bs_debug_error("failed to find the debugfs directory of the card");
+		return NULL;
+	}
+
+	char path[96];
+	snprintf(path, sizeof(path), DEBUGFS_DRI_PATH "/%d/crtc-%d/crc/control", minor,
+		 crtc_index);
+	if (!write_source(path, source)) {
+		bs_debug_error("failed to set CRC source %s in %s: %s", source, path,
+			       strerror(errno));
+		return NULL;
+	}
+
+	// Capture starts once the data file is opened, which fails unless the CRTC is active.
+	snprintf(path, sizeof(path), DEBUGFS_DRI_PATH "/%d/crtc-%d/crc/data", minor, crtc_index);
+	int data_fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (data_fd < 0) {
+		bs_debug_error("failed to open %s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	struct bs_crtc_crc *self = calloc(1, sizeof(struct bs_crtc_crc));
+	assert(self);
+	self->data_fd = data_fd;
+	return self;
+}
+
+void bs_crtc_crc_destroy(struct bs_crtc_crc **self)
+{
+	assert(self);
+	assert(*self);
+	close((*self)->data_fd);
+	free(*self);
+	*self = NULL;
+}
+
+int bs_crtc_crc_fd(struct bs_crtc_crc *self)
+{
+	assert(self);
+	return self->data_fd;
+}
+
+// Compares frame numbers that may have wrapped around.
+static bool frame_before(uint32_t a, uint32_t b)
+{
+	return (int32_t)(a - b) < 0;
+}
+
+static void crc_expect_add(struct bs_crtc_crc *self, uint32_t frame, bool known, uint32_t crc)
+{
+	// Flips complete in order, so a frame that does not come later replaces the newer ones.
+	while (self->expect_count &&
+	       !frame_before(self->expects[self->expect_count - 1].frame, frame))
+		self->expect_count--;
+
+	if (self->expect_count == CRC_EXPECT_MAX) {
+		memmove(&self->expects[0], &self->expects[1],
+			(CRC_EXPECT_MAX - 1) * sizeof(self->expects[0]));
+		self->expect_count--;
+	}
+	self->expects[self->expect_count].frame = frame;
+	self->expects[self->expect_count].known = known;
+	self->expects[self->expect_count].crc = crc;
+	self->expect_count++;
+}
+
+void bs_crtc_crc_expect(struct bs_crtc_crc *self, uint32_t frame, uint32_t crc)
+{
+	assert(self);
+	crc_expect_add(self, frame, true, crc);
+}
+
+void bs_crtc_crc_expect_unknown(struct bs_crtc_crc *self, uint32_t frame)
+{
+	assert(self);
+	crc_expect_add(self, frame, false, 0);
+}
+
+static bool parse_entry(const char *line, struct bs_crtc_crc_entry *entry)
+{
+	memset(entry, 0, sizeof(*entry));
+	int end = 0;
+	if (!strncmp(line, "XXXXXXXXXX", 10)) {
+		end = 10;
+	} else if (sscanf(line, "%x%n", &entry->frame, &end) == 1) {
+		entry->has_frame = true;
+	} else {
+		return false;
+	}
+
+	const char *p = line + end;
+	while (entry->value_count < BS_CRTC_CRC_MAX_VALUES) {
+		int len = 0;
+		if (sscanf(p, " %x%n", &entry->values[entry->value_count], &len) != 1)
+			break;
+		entry->value_count++;
+		p += len;
+	}
+	return entry->value_count > 0;
+}
+
+int bs_crtc_crc_read(struct bs_crtc_crc *self)
+{
+	assert(self);
+	int64_t start_ns = bs_debug_gettime_ns();
+	int count = 0;
+	for (;;) {
+		// Every read returns one whole line.
+		char line[CRC_LINE_MAX + 1];
+		ssize_t len = read(self->data_fd, line, CRC_LINE_MAX);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && errno != EAGAIN) {
+			count = -errno;
+			break;
+		}
+		if (len <= 0)
+			break;
+		line[len] = '\0';
+
+		struct bs_crtc_crc_entry entry;
+		if (!parse_entry(line, &entry)) {
+			bs_debug_warning("unexpected CRC line: %s", line);
+			continue;
+		}
+
+		self->stats.entries++;
+		if (self->pending_count == CRC_PENDING_MAX) {
+			memmove(&self->pending[0], &self->pending[1],
+				(CRC_PENDING_MAX - 1) * sizeof(self->pending[0]));
+			self->pending_count--;
+			self->stats.unchecked++;
+		}
+		self->pending[self->pending_count++] = entry;
+		count++;
+	}
+	self->stats.read_ns += bs_debug_gettime_ns() - start_ns;
+	return count;
+}
+
+// Returns the expectation in effect at frame or NULL if there is none yet.
+static const struct crc_expect *find_expect(struct bs_crtc_crc *self, uint32_t frame)
+{
+	const struct crc_expect *found = NULL;
+	size_t found_index = 0;
+	for (size_t i = 0; i < self->expect_count; i++) {
+		if (frame_before(frame, self->expects[i].frame))
+			break;
+		found = &self->expects[i];
+		found_index = i;
+	}
+
+	// Earlier expectations are of no use for the frames that follow.
+	if (found_index > 0) {
+		memmove(&self->expects[0], &self->expects[found_index],
+			(self->expect_count - found_index) * sizeof(self->expects[0]));
+		self->expect_count -= found_index;
+		found = &self->expects[0];
+	}
+	return found;
+}
+
+static void crc_check(struct bs_crtc_crc *self, bool all, uint32_t last_frame)
+{
+	size_t checked = 0;
+	for (; checked < self->pending_count; checked++) {
+		const struct bs_crtc_crc_entry *entry = &self->pending[checked];
+		if (!all && entry->has_frame && frame_before(last_frame, entry->frame))
+			break;
+
+		const struct crc_expect *expect =
+		    entry->has_frame ? find_expect(self, entry->frame) : NULL;
+		if (!expect || !expect->known) {
+			self->stats.unchecked++;
+		} else if (entry->values[0] == expect->crc) {
+			self->stats.matched++;
+		} else {
+			if (!self->warned)
+				bs_debug_warning("frame %u has CRC 0x%08x instead of 0x%08x",
+						 entry->frame, entry->values[0], expect->crc);
+			self->warned = true;
+			self->stats.mismatched++;
+		}
+	}
+
+	memmove(&self->pending[0], &self->pending[checked],
+		(self->pending_count - checked) * sizeof(self->pending[0]));
+	self->pending_count -= checked;
+}
+
+void bs_crtc_crc_check(struct bs_crtc_crc *self)
+{
+	assert(self);
+	crc_check(self, true, 0);
+}
+
+void bs_crtc_crc_check_until(struct bs_crtc_crc *self, uint32_t last_frame)
+{
+	assert(self);
+	crc_check(self, false, last_frame);
+}
+
+void bs_crtc_crc_get_stats(struct bs_crtc_crc *self, struct bs_crtc_crc_stats *stats)
+{
+	assert(self);
+	assert(stats);
+	*stats = self->stats;
+}
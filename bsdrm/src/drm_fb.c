@@ -17,12 +17,16 @@ struct bs_drm_fb_builder {
 	uint32_t handles[MAX_PLANE_COUNT];
 	uint32_t strides[MAX_PLANE_COUNT];
 	uint32_t offsets[MAX_PLANE_COUNT];
+	// DRM_FORMAT_MOD_INVALID leaves the layout up to the driver.
+	uint64_t modifiers[MAX_PLANE_COUNT];
 };
 
 void bs_drm_fb_builder_init(struct bs_drm_fb_builder *self)
 {
 	assert(self);
 	self->fd = -1;
+	for (size_t plane_index = 0; plane_index < MAX_PLANE_COUNT; plane_index++)
+		self->modifiers[plane_index] = DRM_FORMAT_MOD_INVALID;
 }
 
 struct bs_drm_fb_builder *bs_drm_fb_builder_new()
@@ -61,10 +65,14 @@ void bs_drm_fb_builder_gbm_bo(struct bs_drm_fb_builder *self, struct gbm_bo *bo)
 		self->plane_count = MAX_PLANE_COUNT;
 	}
 
+	// gbm has one modifier for the whole buffer object, which is also what the kernel expects
+	// of every plane.
+	uint64_t modifier = gbm_bo_get_format_modifier(bo);
 	for (size_t plane_index = 0; plane_index < self->plane_count; plane_index++) {
 		self->handles[plane_index] = gbm_bo_get_plane_handle(bo, plane_index).u32;
 		self->strides[plane_index] = gbm_bo_get_plane_stride(bo, plane_index);
 		self->offsets[plane_index] = gbm_bo_get_plane_offset(bo, plane_index);
+		self->modifiers[plane_index] = modifier;
 	}
 }
 
@@ -74,6 +82,13 @@ void bs_drm_fb_builder_format(struct bs_drm_fb_builder *self, uint32_t format)
 	self->format = format;
 }
 
+void bs_drm_fb_builder_modifier(struct bs_drm_fb_builder *self, uint64_t modifier)
+{
+	assert(self);
+	for (size_t plane_index = 0; plane_index < MAX_PLANE_COUNT; plane_index++)
+		self->modifiers[plane_index] = modifier;
+}
+
 uint32_t bs_drm_fb_builder_create_fb(struct bs_drm_fb_builder *self)
 {
 	assert(self);
@@ -104,15 +119,33 @@ uint32_t bs_drm_fb_builder_create_fb(struct bs_drm_fb_builder *self)
 		self->handles[plane_index] = 0;
 		self->strides[plane_index] = 0;
 		self->offsets[plane_index] = 0;
+		self->modifiers[plane_index] = 0;
 	}
 
 	uint32_t fb_id;
+	uint64_t modifier = self->modifiers[0];
+	uint64_t has_modifiers = 0;
+	if (modifier != DRM_FORMAT_MOD_INVALID &&
+	    drmGetCap(self->fd, DRM_CAP_ADDFB2_MODIFIERS, &has_modifiers))
+		has_modifiers = 0;
 
-	int ret = drmModeAddFB2(self->fd, self->width, self->height, self->format, self->handles,
-				self->strides, self->offsets, &fb_id, 0);
+	// Drivers without modifier support infer the layout from the buffer itself.
+	if (!has_modifiers) {
+		int ret = drmModeAddFB2(self->fd, self->width, self->height, self->format,
+					self->handles, self->strides, self->offsets, &fb_id, 0);
+		if (ret) {
+			bs_debug_error("failed to create drm fb: drmModeAddFB2 returned %d", ret);
+			return 0;
+		}
+		return fb_id;
+	}
 
+	int ret = drmModeAddFB2WithModifiers(self->fd, self->width, self->height, self->format,
+					     self->handles, self->strides, self->offsets,
+					     self->modifiers, &fb_id, DRM_MODE_FB_MODIFIERS);
 	if (ret) {
-		bs_debug_error("failed to create drm fb: drmModeAddFB2 returned %d", ret);
+		bs_debug_error("failed to create drm fb: drmModeAddFB2WithModifiers returned %d",
+			       ret);
 		return 0;
 	}
 
@@ -135,3 +168,89 @@ uint32_t bs_drm_fb_create_gbm(struct gbm_bo *bo)
 
 	return fb_id;
 }
+
+struct fb_cache_entry {
+	uint32_t format;
+	uint64_t modifier;
+	uint32_t fb_id;
+};
+
+// Lives in the buffer object's user data and removes its framebuffers when the buffer object is
+// destroyed.
+struct fb_cache {
+	int fd;
+	size_t entry_count;
+	struct fb_cache_entry *entries;
+};
+
+static struct bs_drm_fb_cache_stats fb_cache_stats;
+
+static void fb_cache_destroy(struct gbm_bo *bo, void *data)
+{
+	struct fb_cache *cache = data;
+	for (size_t entry_index = 0; entry_index < cache->entry_count; entry_index++) {
+		int ret = drmModeRmFB(cache->fd, cache->entries[entry_index].fb_id);
+		if (ret)
+			bs_debug_error("failed to remove cached drm fb %u: drmModeRmFB returned %d",
+				       cache->entries[entry_index].fb_id, ret);
+	}
+	free(cache->entries);
+	free(cache);
+}
+
+uint32_t bs_drm_fb_create_gbm_format_cached(struct gbm_bo *bo, uint32_t format)
+{
+	assert(bo);
+
+	struct fb_cache *cache = gbm_bo_get_user_data(bo);
+	uint64_t modifier = gbm_bo_get_format_modifier(bo);
+	if (cache) {
+		for (size_t entry_index = 0; entry_index < cache->entry_count; entry_index++) {
+			struct fb_cache_entry *entry = &cache->entries[entry_index];
+			if (entry->format == format && entry->modifier == modifier) {
+				fb_cache_stats.hits++;
+				return entry->fb_id;
+			}
+		}
+	}
+
+	fb_cache_stats.misses++;
+	struct bs_drm_fb_builder builder;
+	bs_drm_fb_builder_init(&builder);
+	bs_drm_fb_builder_gbm_bo(&builder, bo);
+	bs_drm_fb_builder_format(&builder, format);
+	uint32_t fb_id = bs_drm_fb_builder_create_fb(&builder);
+	if (!fb_id) {
+		bs_debug_error("failed to create cached framebuffer from buffer object");
+		return 0;
+	}
+
+	if (!cache) {
+		cache = calloc(1, sizeof(struct fb_cache));
+		assert(cache);
+		cache->fd = builder.fd;
+		gbm_bo_set_user_data(bo, cache, fb_cache_destroy);
+	}
+
+	cache->entries =
+	    realloc(cache->entries, (cache->entry_count + 1) * sizeof(struct fb_cache_entry));
+	assert(cache->entries);
+	struct fb_cache_entry *entry = &cache->entries[cache->entry_count++];
+	entry->format = format;
+	entry->modifier = modifier;
+	entry->fb_id = fb_id;
+
+	return fb_id;
+}
+
+uint32_t bs_drm_fb_create_gbm_cached(struct gbm_bo *bo)
+{
+	assert(bo);
+	return bs_drm_fb_create_gbm_format_cached(bo, gbm_bo_get_format(bo));
+}
+
+void bs_drm_fb_cache_get_stats(struct bs_drm_fb_cache_stats *stats)
+{
+	assert(stats);
+	*stats = fb_cache_stats;
+}
@@ -0,0 +1,149 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "bs_drm.h"
+
+static bool plane_property_value(int fd, uint32_t plane_id, const char *name, uint64_t *value)
+{
+	drmModeObjectPropertiesPtr props =
+	    drmModeObjectGetProperties(fd, plane_id, DRM_MODE_OBJECT_PLANE);
+	if (!props)
+		return false;
+
+	bool found = false;
+	for (uint32_t prop_index = 0; prop_index < props->count_props && !found; prop_index++) {
+		drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[prop_index]);
+		if (!prop)
+			continue;
+		if (!strcmp(prop->name, name)) {
+			*value = props->prop_values[prop_index];
+			found = true;
+		}
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+	return found;
+}
+
+size_t bs_drm_plane_modifiers(int fd, uint32_t plane_id, uint32_t format, uint64_t *modifiers,
+			      size_t max_count)
+{
+	assert(fd >= 0);
+	assert(modifiers || max_count == 0);
+
+	uint64_t blob_id;
+	if (!plane_property_value(fd, plane_id, "IN_FORMATS", &blob_id) || !blob_id)
+		return 0;
+
+	drmModePropertyBlobPtr blob = drmModeGetPropertyBlob(fd, blob_id);
+	if (!blob)
+		return 0;
+
+	size_t count = 0;
+	const struct drm_format_modifier_blob *header = blob->data;
+	if (blob->length < sizeof(*header)) {
+		bs_debug_error("IN_FORMATS blob of plane %u is malformed", plane_id);
+		goto free_blob;
+	}
+
+	size_t formats_size = header->count_formats * sizeof(uint32_t);
+	size_t modifiers_size = header->count_modifiers * sizeof(struct drm_format_modifier);
+	if (header->formats_offset + formats_size > blob->length ||
+	    header->modifiers_offset + modifiers_size > blob->length) {
+		bs_debug_error("IN_FORMATS blob of plane %u is malformed", plane_id);
+		goto free_blob;
+	}
+
+	const uint32_t *formats = (const uint32_t *)((const uint8_t *)blob->data +
+						     header->formats_offset);
+	const struct drm_format_modifier *format_modifiers =
+	    (const struct drm_format_modifier *)((const uint8_t *)blob->data +
+						 header->modifiers_offset);
+
+	uint32_t format_index;
+	for (format_index = 0; format_index < header->count_formats; format_index++) {
+		if (formats[format_index] == format)
+			break;
+	}
+	if (format_index == header->count_formats)
+		goto free_blob;
+
+	// Each entry covers a window of 64 formats starting at its offset.
+	for (uint32_t i = 0; i < header->count_modifiers && count < max_count; i++) {
+		const struct drm_format_modifier *entry = &format_modifiers[i];
+		if (format_index < entry->offset || format_index >= entry->offset + 64)
+			continue;
+		if (entry->formats & (1ull << (format_index - entry->offset)))
+			modifiers[count++] = entry->modifier;
+	}
+
+free_blob:
+	drmModeFreePropertyBlob(blob);
+	return count;
+}
+
+uint32_t bs_drm_primary_plane(int fd, uint32_t crtc_id)
+{
+	assert(fd >= 0);
+
+	drmModeRes *res = drmModeGetResources(fd);
+	drmModePlaneRes *plane_res = drmModeGetPlaneResources(fd);
+	uint32_t primary_plane_id = 0;
+	if (!res || !plane_res)
+		goto out;
+
+	int crtc_index;
+	for (crtc_index = 0; crtc_index < res->count_crtcs; crtc_index++) {
+		if (res->crtcs[crtc_index] == crtc_id)
+			break;
+	}
+	if (crtc_index == res->count_crtcs)
+		goto out;
+
+	for (uint32_t plane_index = 0; plane_index < plane_res->count_planes && !primary_plane_id;
+	     plane_index++) {
+		drmModePlane *plane = drmModeGetPlane(fd, plane_res->planes[plane_index]);
+		if (!plane)
+			continue;
+
+		uint64_t type;
+		if ((plane->possible_crtcs & (1u << crtc_index)) &&
+		    plane_property_value(fd, plane->plane_id, "type", &type) &&
+		    type == DRM_PLANE_TYPE_PRIMARY)
+			primary_plane_id = plane->plane_id;
+		drmModeFreePlane(plane);
+	}
+
+out:
+	drmModeFreePlaneResources(plane_res);
+	drmModeFreeResources(res);
+	return primary_plane_id;
+}
+
+struct gbm_bo *bs_drm_bo_create_for_plane(struct gbm_device *gbm, uint32_t plane_id,
+					  uint32_t width, uint32_t height, uint32_t format,
+					  uint32_t flags)
+{
+	assert(gbm);
+
+	uint64_t modifiers[BS_DRM_MAX_MODIFIERS];
+	size_t modifier_count = 0;
+	if (plane_id)
+		modifier_count = bs_drm_plane_modifiers(gbm_device_get_fd(gbm), plane_id, format,
+							modifiers, BS_ARRAY_LEN(modifiers));
+
+	if (modifier_count) {
+		struct gbm_bo *bo = gbm_bo_create_with_modifiers(gbm, width, height, format,
+								 modifiers, modifier_count);
+		if (bo)
+			return bo;
+		bs_debug_warning("failed to create buffer object with any of plane %u's modifiers",
+				 plane_id);
+	}
+
+	return gbm_bo_create(gbm, width, height, format, flags);
+}
@@ -4,8 +4,18 @@
  * found in the LICENSE file.
  */
 
+#include <pthread.h>
+
 #include "bs_drm.h"
 
+static bool snapshot_has_connection(struct bs_kms_snapshot *snapshot, drmModeConnector *connector)
+{
+	return connector && connector->connection == DRM_MODE_CONNECTED &&
+	       connector->count_modes > 0 &&
+	       bs_kms_snapshot_connector_crtc_mask(snapshot, connector) != 0;
+}
+
+// Only needs resources and connectors, so it stays cheaper than a full snapshot.
 static bool display_filter(int fd)
 {
 	bool has_connection = false;
@@ -34,78 +44,242 @@ out:
 	return has_connection;
 }
 
-int bs_drm_open_for_display()
+static uint32_t display_rank_connector_type(uint32_t connector_type)
 {
-	return bs_open_filtered("/dev/dri/card%u", 0, DRM_MAX_MINOR, display_filter);
+	switch (connector_type) {
+		case DRM_MODE_CONNECTOR_LVDS:
+			return 0x01;
+		case DRM_MODE_CONNECTOR_eDP:
+			return 0x02;
+		case DRM_MODE_CONNECTOR_DSI:
+			return 0x03;
+	}
+	return 0xFF;
 }
 
-static bool connector_has_crtc(int fd, drmModeRes *res, drmModeConnector *connector)
+static uint32_t display_rank(struct bs_kms_snapshot *snapshot)
 {
-	for (int encoder_index = 0; encoder_index < connector->count_encoders; encoder_index++) {
-		drmModeEncoder *encoder = drmModeGetEncoder(fd, connector->encoders[encoder_index]);
-		if (encoder == NULL)
+	uint32_t best_rank = bs_rank_skip;
+	for (size_t connector_index = 0;
+	     connector_index < bs_kms_snapshot_connector_count(snapshot); connector_index++) {
+		drmModeConnector *connector = bs_kms_snapshot_connector(snapshot, connector_index);
+		if (!snapshot_has_connection(snapshot, connector))
 			continue;
 
-		uint32_t possible_crtcs = encoder->possible_crtcs;
-		drmModeFreeEncoder(encoder);
+		uint32_t rank = display_rank_connector_type(connector->connector_type);
+		if (best_rank > rank)
+			best_rank = rank;
+	}
+
+	return best_rank;
+}
+
+struct display_probe {
+	unsigned minor;
+	// Best rank of the connectors sysfs reports connected, which the snapshot can't beat.
+	uint32_t sysfs_rank;
+	pthread_t thread;
+	bool threaded;
+	int fd;
+	struct bs_kms_snapshot *snapshot;
+	uint32_t rank;
+};
 
-		for (int crtc_index = 0; crtc_index < res->count_crtcs; crtc_index++)
-			if ((possible_crtcs & (1 << crtc_index)) != 0)
-				return true;
+static void *display_probe_run(void *arg)
+{
+	struct display_probe *probe = arg;
+	char path[32];
+	snprintf(path, sizeof(path), "/dev/dri/card%u", probe->minor);
+
+	probe->fd = open(path, O_RDWR);
+	if (probe->fd < 0)
+		return NULL;
+
+	probe->snapshot = bs_kms_snapshot_new(probe->fd);
+	if (probe->snapshot)
+		probe->rank = display_rank(probe->snapshot);
+	return NULL;
+}
+
+static int compare_probes(const void *a, const void *b)
+{
+	const struct display_probe *probe_a = a;
+	const struct display_probe *probe_b = b;
+	if (probe_a->sysfs_rank != probe_b->sysfs_rank)
+		return probe_a->sysfs_rank < probe_b->sysfs_rank ? -1 : 1;
+	return (int)probe_a->minor - (int)probe_b->minor;
+}
+
+// Fills probes with the cards sysfs reports as having something connected, best sysfs rank
+// first. Returns -1 if sysfs is unavailable or lists no cards.
+static int sysfs_display_probes(struct display_probe probes[DRM_MAX_MINOR])
+{
+	struct bs_drm_sysfs_card cards[DRM_MAX_MINOR];
+	int card_count = bs_drm_sysfs_cards(cards, DRM_MAX_MINOR);
+	if (card_count <= 0)
+		return -1;
+
+	int probe_count = 0;
+	for (int card_index = 0; card_index < card_count; card_index++) {
+		if (cards[card_index].connected_count == 0 ||
+		    cards[card_index].minor >= DRM_MAX_MINOR)
+			continue;
+
+		struct display_probe *probe = &probes[probe_count++];
+		memset(probe, 0, sizeof(*probe));
+		probe->minor = cards[card_index].minor;
+		probe->sysfs_rank = cards[card_index].best_connector_rank;
+		probe->fd = -1;
+		probe->rank = bs_rank_skip;
 	}
 
-	return false;
+	qsort(probes, probe_count, sizeof(probes[0]), compare_probes);
+	return probe_count;
 }
 
-static uint32_t display_rank_connector_type(uint32_t connector_type)
+// Opens and snapshots the probes in parallel.
+static void run_display_probes(struct display_probe *probes, size_t probe_count)
 {
-	switch (connector_type) {
-		case DRM_MODE_CONNECTOR_LVDS:
-			return 0x01;
-		case DRM_MODE_CONNECTOR_eDP:
-			return 0x02;
-		case DRM_MODE_CONNECTOR_DSI:
-			return 0x03;
+	for (size_t i = 0; i < probe_count; i++) {
+		probes[i].threaded =
+		    pthread_create(&probes[i].thread, NULL, display_probe_run, &probes[i]) == 0;
+		if (!probes[i].threaded)
+			display_probe_run(&probes[i]);
+	}
+
+	for (size_t i = 0; i < probe_count; i++) {
+		if (probes[i].threaded)
+			pthread_join(probes[i].thread, NULL);
 	}
-	return 0xFF;
 }
 
-static uint32_t display_rank(int fd)
+// Probes the cards one sysfs rank at a time, stopping once no remaining card can beat the best
+// display found, and returns the fd of the card with the lowest rank, the lowest minor on a tie.
+// Everything but the chosen card is released. Returns -1 if no card has a usable display.
+static int open_probed_display(struct display_probe *probes, size_t probe_count,
+			       struct bs_kms_snapshot **snapshot)
 {
-	drmModeRes *res = drmModeGetResources(fd);
-	if (!res)
-		return bs_rank_skip;
+	int best_index = -1;
+	size_t start = 0;
+	while (start < probe_count) {
+		if (best_index >= 0 && probes[best_index].rank <= probes[start].sysfs_rank)
+			break;
 
-	uint32_t best_rank = bs_rank_skip;
-	if (res->count_crtcs == 0)
-		goto out;
+		size_t end = start + 1;
+		while (end < probe_count && probes[end].sysfs_rank == probes[start].sysfs_rank)
+			end++;
+		run_display_probes(&probes[start], end - start);
 
-	for (int connector_index = 0; connector_index < res->count_connectors; connector_index++) {
-		drmModeConnector *connector =
-		    drmModeGetConnector(fd, res->connectors[connector_index]);
-		if (connector == NULL)
+		for (size_t i = start; i < end; i++) {
+			if (probes[i].rank == bs_rank_skip)
+				continue;
+			if (best_index < 0 || probes[i].rank < probes[best_index].rank ||
+			    (probes[i].rank == probes[best_index].rank &&
+			     probes[i].minor < probes[best_index].minor))
+				best_index = i;
+		}
+		start = end;
+	}
+
+	for (size_t i = 0; i < start; i++) {
+		if ((int)i == best_index)
 			continue;
+		if (probes[i].snapshot)
+			bs_kms_snapshot_destroy(&probes[i].snapshot);
+		if (probes[i].fd >= 0)
+			close(probes[i].fd);
+	}
+	if (best_index < 0)
+		return -1;
+
+	if (snapshot)
+		*snapshot = probes[best_index].snapshot;
+	else
+		bs_kms_snapshot_destroy(&probes[best_index].snapshot);
+	return probes[best_index].fd;
+}
+
+int bs_drm_open_for_display()
+{
+	// Only when sysfs can't list the cards does every minor have to be tried.
+	struct bs_drm_sysfs_card cards[DRM_MAX_MINOR];
+	int card_count = bs_drm_sysfs_cards(cards, DRM_MAX_MINOR);
+	if (card_count <= 0)
+		return bs_open_filtered("/dev/dri/card%u", 0, DRM_MAX_MINOR, display_filter);
 
-		bool has_connection = connector->connection == DRM_MODE_CONNECTED &&
-				      connector->count_modes > 0 &&
-				      connector_has_crtc(fd, res, connector);
-		if (!has_connection)
+	for (int card_index = 0; card_index < card_count; card_index++) {
+		unsigned minor = cards[card_index].minor;
+		if (cards[card_index].connected_count == 0 || minor >= DRM_MAX_MINOR)
 			continue;
 
-		uint32_t rank = display_rank_connector_type(connector->connector_type);
-		if (best_rank > rank)
-			best_rank = rank;
-		drmModeFreeConnector(connector);
+		int fd = bs_open_filtered("/dev/dri/card%u", minor, minor + 1, display_filter);
+		if (fd >= 0)
+			return fd;
 	}
 
-out:
-	drmModeFreeResources(res);
-	return best_rank;
+	return -1;
+}
+
+struct main_display_user {
+	uint32_t rank;
+	int fd;
+	struct bs_kms_snapshot *snapshot;
+};
+
+static bool main_display_body(void *user, int fd)
+{
+	struct main_display_user *data = user;
+
+	// The snapshot has to refer to the fd handed out to the caller, so rank a duplicate.
+	int dup_fd = dup(fd);
+	if (dup_fd < 0)
+		return false;
+
+	struct bs_kms_snapshot *snapshot = bs_kms_snapshot_new(dup_fd);
+	uint32_t rank = snapshot ? display_rank(snapshot) : bs_rank_skip;
+	if (data->rank <= rank) {
+		if (snapshot)
+			bs_kms_snapshot_destroy(&snapshot);
+		close(dup_fd);
+		return false;
+	}
+
+	if (data->snapshot)
+		bs_kms_snapshot_destroy(&data->snapshot);
+	if (data->fd >= 0)
+		close(data->fd);
+	data->rank = rank;
+	data->fd = dup_fd;
+	data->snapshot = snapshot;
+
+	return rank == 0;
+}
+
+int bs_drm_open_main_display_snapshot(struct bs_kms_snapshot **snapshot)
+{
+	if (snapshot)
+		*snapshot = NULL;
+
+	// Only when sysfs can't list the cards does every minor have to be tried.
+	struct display_probe probes[DRM_MAX_MINOR];
+	int probe_count = sysfs_display_probes(probes);
+	if (probe_count >= 0)
+		return open_probed_display(probes, probe_count, snapshot);
+
+	struct main_display_user data = { bs_rank_skip, -1, NULL };
+	bs_open_enumerate("/dev/dri/card%u", 0, DRM_MAX_MINOR, main_display_body, &data);
+
+	if (snapshot)
+		*snapshot = data.snapshot;
+	else if (data.snapshot)
+		bs_kms_snapshot_destroy(&data.snapshot);
+
+	return data.fd;
 }
 
 int bs_drm_open_main_display()
 {
-	return bs_open_ranked("/dev/dri/card%u", 0, DRM_MAX_MINOR, display_rank);
+	return bs_drm_open_main_display_snapshot(NULL);
 }
 
 static bool vgem_filter(int fd)
@@ -121,5 +295,19 @@ static bool vgem_filter(int fd)
 
 int bs_drm_open_vgem()
 {
+	// vgem has no display, so sysfs can only narrow down the cards by driver name. The driver
+	// is still confirmed through the card in case sysfs names it differently.
+	struct bs_drm_sysfs_card cards[DRM_MAX_MINOR];
+	int card_count = bs_drm_sysfs_cards(cards, DRM_MAX_MINOR);
+	for (int card_index = 0; card_index < card_count; card_index++) {
+		if (strcmp(cards[card_index].driver, "vgem"))
+			continue;
+
+		unsigned minor = cards[card_index].minor;
+		int fd = bs_open_filtered("/dev/dri/card%u", minor, minor + 1, vgem_filter);
+		if (fd >= 0)
+			return fd;
+	}
+
 	return bs_open_filtered("/dev/dri/card%u", 0, DRM_MAX_MINOR, vgem_filter);
 }
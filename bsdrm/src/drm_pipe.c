@@ -8,22 +8,23 @@
 
 struct bs_drm_pipe_plumber {
 	int fd;
+	struct bs_kms_snapshot *snapshot;
 	const uint32_t *connector_ranks;
 	uint32_t crtc_mask;
 	drmModeConnector **connector_ptr;
 };
 
-struct fd_connector {
-	int fd;
-	drmModeRes *res;
+struct snapshot_connector {
+	struct bs_kms_snapshot *snapshot;
 	drmModeConnector *connector;
 };
 
 struct pipe_internal {
-	struct fd_connector *connector;
+	struct snapshot_connector *connector;
 	size_t next_connector_index;
 	uint32_t connector_rank;
 	uint32_t encoder_id;
+	uint32_t possible_crtcs;
 	int next_encoder_index;
 	uint32_t crtc_id;
 	int next_crtc_index;
@@ -31,7 +32,7 @@ struct pipe_internal {
 
 struct pipe_ctx {
 	size_t connector_count;
-	struct fd_connector *connectors;
+	struct snapshot_connector *connectors;
 
 	uint32_t crtc_mask;
 	const uint32_t *connector_ranks;
@@ -50,13 +51,15 @@ static bool pipe_piece_connector(void *c, void *p)
 	for (connector_index = pipe->next_connector_index == 0 ? ctx->first_connector_index
 							       : pipe->next_connector_index;
 	     connector_index < ctx->connector_count; connector_index++) {
-		struct fd_connector *fd_connector = &ctx->connectors[connector_index];
-		drmModeConnector *connector = fd_connector->connector;
+		struct snapshot_connector *snapshot_connector = &ctx->connectors[connector_index];
+		drmModeConnector *connector = snapshot_connector->connector;
 		if (connector == NULL)
 			continue;
 
-		use_connector =
-		    connector->connection == DRM_MODE_CONNECTED && connector->count_modes > 0;
+		// Writeback connectors report modes but have no display to light up.
+		use_connector = connector->connection == DRM_MODE_CONNECTED &&
+				connector->count_modes > 0 &&
+				connector->connector_type != DRM_MODE_CONNECTOR_WRITEBACK;
 		if (use_connector && ctx->connector_ranks) {
 			uint32_t rank =
 			    bs_drm_connectors_rank(ctx->connector_ranks, connector->connector_type);
@@ -66,7 +69,7 @@ static bool pipe_piece_connector(void *c, void *p)
 		}
 
 		if (use_connector) {
-			pipe->connector = fd_connector;
+			pipe->connector = snapshot_connector;
 			break;
 		}
 	}
@@ -79,7 +82,7 @@ static bool pipe_piece_encoder(void *c, void *p)
 {
 	(void)c;
 	struct pipe_internal *pipe = p;
-	int fd = pipe->connector->fd;
+	struct bs_kms_snapshot *snapshot = pipe->connector->snapshot;
 
 	drmModeConnector *connector = pipe->connector->connector;
 	if (connector == NULL)
@@ -88,13 +91,13 @@ static bool pipe_piece_encoder(void *c, void *p)
 	int encoder_index = 0;
 	for (encoder_index = pipe->next_encoder_index; encoder_index < connector->count_encoders;
 	     encoder_index++) {
-		drmModeEncoder *encoder = drmModeGetEncoder(fd, connector->encoders[encoder_index]);
+		drmModeEncoder *encoder =
+		    bs_kms_snapshot_find_encoder(snapshot, connector->encoders[encoder_index]);
 		if (encoder == NULL)
 			continue;
 
-		drmModeFreeEncoder(encoder);
-
-		pipe->encoder_id = connector->encoders[encoder_index];
+		pipe->encoder_id = encoder->encoder_id;
+		pipe->possible_crtcs = encoder->possible_crtcs;
 
 		break;
 	}
@@ -107,15 +110,9 @@ static bool pipe_piece_crtc(void *c, void *p)
 {
 	struct pipe_ctx *ctx = c;
 	struct pipe_internal *pipe = p;
-	int fd = pipe->connector->fd;
-	drmModeRes *res = pipe->connector->res;
-
-	drmModeEncoder *encoder = drmModeGetEncoder(fd, pipe->encoder_id);
-	if (encoder == NULL)
-		return false;
+	drmModeRes *res = bs_kms_snapshot_resources(pipe->connector->snapshot);
 
-	uint32_t possible_crtcs = encoder->possible_crtcs & ctx->crtc_mask;
-	drmModeFreeEncoder(encoder);
+	uint32_t possible_crtcs = pipe->possible_crtcs & ctx->crtc_mask;
 
 	bool use_crtc = false;
 	int crtc_index;
@@ -179,58 +176,97 @@ void bs_drm_pipe_plumber_connector_ptr(struct bs_drm_pipe_plumber *self, drmMode
 	self->connector_ptr = ptr;
 }
 
-bool bs_drm_pipe_plumber_make(struct bs_drm_pipe_plumber *self, struct bs_drm_pipe *pipe)
+void bs_drm_pipe_plumber_snapshot(struct bs_drm_pipe_plumber *self,
+				  struct bs_kms_snapshot *snapshot)
 {
 	assert(self);
-	assert(pipe);
+	self->snapshot = snapshot;
+}
+
+// Fills snapshots with the snapshots of every card the plumber should consider and returns how many
+// there are. Snapshots not owned by the user have to be released with plumber_put_snapshots.
+static size_t plumber_get_snapshots(struct bs_drm_pipe_plumber *self,
+				    struct bs_kms_snapshot *snapshots[DRM_MAX_MINOR])
+{
+	if (self->snapshot) {
+		snapshots[0] = self->snapshot;
+		return 1;
+	}
 
-	size_t connector_count = 0;
-	size_t fd_count = 0;
-	int fds[DRM_MAX_MINOR];
-	drmModeRes *fd_res[DRM_MAX_MINOR];
 	if (self->fd >= 0) {
-		fds[0] = self->fd;
-		fd_res[0] = drmModeGetResources(fds[0]);
-		if (!fd_res[0])
-			return false;
-		connector_count += fd_res[0]->count_connectors;
-		fd_count++;
-	} else {
-		for (int fd_index = 0; fd_index < DRM_MAX_MINOR; fd_index++) {
-			char *file_path = NULL;
-			int ret = asprintf(&file_path, "/dev/dri/card%d", fd_index);
-			assert(ret != -1);
-			assert(file_path);
-
-			int fd = open(file_path, O_RDWR);
-			free(file_path);
-			if (fd < 0)
-				continue;
+		snapshots[0] = bs_kms_snapshot_new(self->fd);
+		return snapshots[0] ? 1 : 0;
+	}
 
-			drmModeRes *res = drmModeGetResources(fd);
-			if (!res) {
-				close(fd);
-				continue;
-			}
-			fds[fd_count] = fd;
-			fd_res[fd_count] = res;
-			connector_count += res->count_connectors;
-			fd_count++;
+	size_t snapshot_count = 0;
+	for (int fd_index = 0; fd_index < DRM_MAX_MINOR; fd_index++) {
+		char *file_path = NULL;
+		int ret = asprintf(&file_path, "/dev/dri/card%d", fd_index);
+		assert(ret != -1);
+		assert(file_path);
+
+		int fd = open(file_path, O_RDWR);
+		free(file_path);
+		if (fd < 0)
+			continue;
+
+		struct bs_kms_snapshot *snapshot = bs_kms_snapshot_new(fd);
+		if (!snapshot) {
+			close(fd);
+			continue;
 		}
+		snapshots[snapshot_count++] = snapshot;
+	}
+
+	return snapshot_count;
+}
+
+// Destroys the snapshots created by plumber_get_snapshots and closes the cards they opened, except
+// for the cards of the kept pipes.
+static void plumber_put_snapshots(struct bs_drm_pipe_plumber *self,
+				  struct bs_kms_snapshot *snapshots[DRM_MAX_MINOR],
+				  size_t snapshot_count, const struct bs_drm_pipe *kept_pipes,
+				  size_t kept_pipe_count)
+{
+	if (self->snapshot)
+		return;
+
+	for (size_t snapshot_index = 0; snapshot_index < snapshot_count; snapshot_index++) {
+		int fd = bs_kms_snapshot_fd(snapshots[snapshot_index]);
+		bs_kms_snapshot_destroy(&snapshots[snapshot_index]);
+
+		bool keep = self->fd == fd;
+		for (size_t pipe_index = 0; pipe_index < kept_pipe_count; pipe_index++)
+			keep |= kept_pipes[pipe_index].fd == fd;
+		if (!keep)
+			close(fd);
 	}
+}
+
+bool bs_drm_pipe_plumber_make(struct bs_drm_pipe_plumber *self, struct bs_drm_pipe *pipe)
+{
+	assert(self);
+	assert(pipe);
+
+	struct bs_kms_snapshot *snapshots[DRM_MAX_MINOR];
+	size_t snapshot_count = plumber_get_snapshots(self, snapshots);
+
+	size_t connector_count = 0;
+	for (size_t snapshot_index = 0; snapshot_index < snapshot_count; snapshot_index++)
+		connector_count += bs_kms_snapshot_connector_count(snapshots[snapshot_index]);
 
-	struct fd_connector *connectors = calloc(connector_count, sizeof(struct fd_connector));
+	struct snapshot_connector *connectors =
+	    calloc(connector_count + 1, sizeof(struct snapshot_connector));
 	assert(connectors);
 	size_t connector_index = 0;
-	for (size_t fd_index = 0; fd_index < fd_count; fd_index++) {
-		int fd = fds[fd_index];
-		drmModeRes *res = fd_res[fd_index];
-		for (int fd_conn_index = 0; fd_conn_index < res->count_connectors;
-		     fd_conn_index++) {
-			connectors[connector_index].fd = fd;
-			connectors[connector_index].res = res;
+	for (size_t snapshot_index = 0; snapshot_index < snapshot_count; snapshot_index++) {
+		struct bs_kms_snapshot *snapshot = snapshots[snapshot_index];
+		for (size_t snapshot_conn_index = 0;
+		     snapshot_conn_index < bs_kms_snapshot_connector_count(snapshot);
+		     snapshot_conn_index++) {
+			connectors[connector_index].snapshot = snapshot;
 			connectors[connector_index].connector =
-			    drmModeGetConnector(fd, res->connectors[fd_conn_index]);
+			    bs_kms_snapshot_connector(snapshot, snapshot_conn_index);
 			connector_index++;
 		}
 	}
@@ -258,28 +294,193 @@ bool bs_drm_pipe_plumber_make(struct bs_drm_pipe_plumber *self, struct bs_drm_pi
 	}
 
 	if (success) {
-		struct fd_connector *fd_connector = pipe_internal.connector;
-		pipe->fd = fd_connector->fd;
-		pipe->connector_id = fd_connector->connector->connector_id;
+		struct snapshot_connector *snapshot_connector = pipe_internal.connector;
+		pipe->fd = bs_kms_snapshot_fd(snapshot_connector->snapshot);
+		pipe->connector_id = snapshot_connector->connector->connector_id;
 		pipe->encoder_id = pipe_internal.encoder_id;
 		pipe->crtc_id = pipe_internal.crtc_id;
-		if (self->connector_ptr) {
-			*self->connector_ptr = fd_connector->connector;
-			fd_connector->connector = NULL;
-		}
+		if (self->connector_ptr)
+			*self->connector_ptr =
+			    bs_kms_snapshot_copy_connector(snapshot_connector->connector);
 	}
 
-	for (size_t connector_index = 0; connector_index < connector_count; connector_index++)
-		drmModeFreeConnector(connectors[connector_index].connector);
 	free(connectors);
+	plumber_put_snapshots(self, snapshots, snapshot_count, pipe, success ? 1 : 0);
 
-	for (size_t fd_index = 0; fd_index < fd_count; fd_index++) {
-		int fd = fds[fd_index];
-		if (self->fd != fd && !(success && pipe->fd == fd))
-			close(fd);
-		drmModeFreeResources(fd_res[fd_index]);
+	return success;
+}
+
+struct match_connector {
+	struct bs_kms_snapshot *snapshot;
+	drmModeConnector *connector;
+	uint32_t rank;
+	size_t index;
+	// CRTCs the connector can use, as bits above crtc_base in the combined CRTC numbering of
+	// all cards.
+	uint32_t crtc_mask;
+	size_t crtc_base;
+};
+
+struct match_ctx {
+	struct match_connector *connectors;
+	// Index into connectors of the connector each CRTC is matched to, or SIZE_MAX.
+	size_t *crtc_owner;
+	bool *crtc_visited;
+};
+
+static int match_connector_compare(const void *a, const void *b)
+{
+	const struct match_connector *ca = a;
+	const struct match_connector *cb = b;
+	if (ca->rank != cb->rank)
+		return ca->rank < cb->rank ? -1 : 1;
+	return ca->index < cb->index ? -1 : ca->index > cb->index;
+}
+
+// Looks for an augmenting path from the given connector, as in Kuhn's algorithm. On success, the
+// connector and every connector along the path are matched to new CRTCs.
+static bool match_augment(struct match_ctx *ctx, size_t connector_index)
+{
+	struct match_connector *connector = &ctx->connectors[connector_index];
+	for (size_t bit = 0; bit < 32; bit++) {
+		if (!(connector->crtc_mask & (1u << bit)))
+			continue;
+
+		size_t crtc = connector->crtc_base + bit;
+		if (ctx->crtc_visited[crtc])
+			continue;
+		ctx->crtc_visited[crtc] = true;
+
+		if (ctx->crtc_owner[crtc] == SIZE_MAX ||
+		    match_augment(ctx, ctx->crtc_owner[crtc])) {
+			ctx->crtc_owner[crtc] = connector_index;
+			return true;
+		}
+	}
+	return false;
+}
+
+static uint32_t match_encoder(struct match_connector *connector, size_t crtc_bit)
+{
+	for (int encoder_index = 0; encoder_index < connector->connector->count_encoders;
+	     encoder_index++) {
+		drmModeEncoder *encoder = bs_kms_snapshot_find_encoder(
+		    connector->snapshot, connector->connector->encoders[encoder_index]);
+		if (encoder && (encoder->possible_crtcs & (1u << crtc_bit)))
+			return encoder->encoder_id;
+	}
+	return 0;
+}
+
+bool bs_drm_pipe_plumber_make_many(struct bs_drm_pipe_plumber *self, struct bs_drm_pipe *pipes,
+				   size_t pipe_count, enum bs_drm_pipe_plumber_error *error)
+{
+	assert(self);
+	assert(pipes || pipe_count == 0);
+
+	struct bs_kms_snapshot *snapshots[DRM_MAX_MINOR];
+	size_t snapshot_count = plumber_get_snapshots(self, snapshots);
+
+	size_t connector_count = 0;
+	size_t crtc_count = 0;
+	for (size_t snapshot_index = 0; snapshot_index < snapshot_count; snapshot_index++) {
+		connector_count += bs_kms_snapshot_connector_count(snapshots[snapshot_index]);
+		crtc_count += bs_kms_snapshot_crtc_count(snapshots[snapshot_index]);
+	}
+
+	struct match_connector *connectors =
+	    calloc(connector_count + 1, sizeof(struct match_connector));
+	size_t *crtc_owner = calloc(crtc_count + 1, sizeof(size_t));
+	bool *crtc_visited = calloc(crtc_count + 1, sizeof(bool));
+	assert(connectors && crtc_owner && crtc_visited);
+
+	// Only connectors that could light up are candidates.
+	size_t candidate_count = 0;
+	size_t crtc_base = 0;
+	for (size_t snapshot_index = 0; snapshot_index < snapshot_count; snapshot_index++) {
+		struct bs_kms_snapshot *snapshot = snapshots[snapshot_index];
+		size_t snapshot_crtc_count = bs_kms_snapshot_crtc_count(snapshot);
+		uint32_t snapshot_crtcs =
+		    snapshot_crtc_count >= 32 ? UINT32_MAX : (1u << snapshot_crtc_count) - 1;
+		for (size_t i = 0; i < bs_kms_snapshot_connector_count(snapshot); i++) {
+			drmModeConnector *connector = bs_kms_snapshot_connector(snapshot, i);
+			if (!connector || connector->connection != DRM_MODE_CONNECTED ||
+			    connector->count_modes == 0 ||
+			    connector->connector_type == DRM_MODE_CONNECTOR_WRITEBACK)
+				continue;
+
+			uint32_t rank = 0;
+			if (self->connector_ranks) {
+				rank = bs_drm_connectors_rank(self->connector_ranks,
+							      connector->connector_type);
+				if (rank == bs_rank_skip)
+					continue;
+			}
+
+			struct match_connector *candidate = &connectors[candidate_count];
+			candidate->snapshot = snapshot;
+			candidate->connector = connector;
+			candidate->rank = rank;
+			candidate->index = candidate_count++;
+			uint32_t crtc_mask =
+			    bs_kms_snapshot_connector_crtc_mask(snapshot, connector);
+			candidate->crtc_mask = crtc_mask & self->crtc_mask & snapshot_crtcs;
+			candidate->crtc_base = crtc_base;
+		}
+		crtc_base += snapshot_crtc_count;
 	}
 
+	// Connectors that can be driven together form a transversal matroid, so adding them
+	// greedily in rank order and keeping those that still leave a full matching gives the best
+	// ranked set.
+	qsort(connectors, candidate_count, sizeof(connectors[0]), match_connector_compare);
+	for (size_t crtc = 0; crtc < crtc_count; crtc++)
+		crtc_owner[crtc] = SIZE_MAX;
+
+	struct match_ctx ctx = { connectors, crtc_owner, crtc_visited };
+	size_t matched_count = 0;
+	for (size_t i = 0; i < candidate_count && matched_count < pipe_count; i++) {
+		memset(crtc_visited, 0, crtc_count * sizeof(bool));
+		if (match_augment(&ctx, i))
+			matched_count++;
+	}
+
+	bool success = matched_count == pipe_count;
+	if (error) {
+		if (success)
+			*error = BS_DRM_PIPE_PLUMBER_OK;
+		else if (candidate_count < pipe_count)
+			*error = BS_DRM_PIPE_PLUMBER_TOO_FEW_CONNECTORS;
+		else
+			*error = BS_DRM_PIPE_PLUMBER_TOO_FEW_CRTCS;
+	}
+
+	if (success) {
+		// Pipes come out in the order the connectors were picked, so the best ranked first.
+		size_t pipe_index = 0;
+		for (size_t i = 0; i < candidate_count; i++) {
+			struct match_connector *connector = &connectors[i];
+			for (size_t crtc = 0; crtc < crtc_count; crtc++) {
+				if (crtc_owner[crtc] != i)
+					continue;
+
+				size_t crtc_bit = crtc - connector->crtc_base;
+				drmModeRes *res = bs_kms_snapshot_resources(connector->snapshot);
+				struct bs_drm_pipe *pipe = &pipes[pipe_index++];
+				pipe->fd = bs_kms_snapshot_fd(connector->snapshot);
+				pipe->connector_id = connector->connector->connector_id;
+				pipe->encoder_id = match_encoder(connector, crtc_bit);
+				pipe->crtc_id = res->crtcs[crtc_bit];
+			}
+		}
+		assert(pipe_index == pipe_count);
+	}
+
+	free(crtc_visited);
+	free(crtc_owner);
+	free(connectors);
+	plumber_put_snapshots(self, snapshots, snapshot_count, pipes, success ? pipe_count : 0);
+
 	return success;
 }
 
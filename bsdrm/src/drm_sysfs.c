@@ -0,0 +1,155 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <dirent.h>
+#include <limits.h>
+
+#include "bs_drm.h"
+
+#define SYSFS_DRM_PATH "/sys/class/drm"
+
+static bool read_sysfs_line(const char *path, char *buf, size_t buf_size)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	ssize_t len = read(fd, buf, buf_size - 1);
+	close(fd);
+	if (len < 0)
+		return false;
+
+	buf[len] = '\0';
+	char *newline = strchr(buf, '\n');
+	if (newline)
+		*newline = '\0';
+	return true;
+}
+
+// Reads the name of the driver bound to the card's device. Devices without a bound driver, like
+// vgem's platform device, are named after the device itself.
+static void read_sysfs_driver(unsigned minor, char *driver, size_t driver_size)
+{
+	char path[PATH_MAX];
+	char target[PATH_MAX];
+
+	driver[0] = '\0';
+	snprintf(path, sizeof(path), SYSFS_DRM_PATH "/card%u/device/driver", minor);
+	ssize_t len = readlink(path, target, sizeof(target) - 1);
+	if (len < 0) {
+		snprintf(path, sizeof(path), SYSFS_DRM_PATH "/card%u/device", minor);
+		len = readlink(path, target, sizeof(target) - 1);
+	}
+	if (len < 0)
+		return;
+
+	target[len] = '\0';
+	const char *name = strrchr(target, '/');
+	name = name ? name + 1 : target;
+	// A truncated name would match the wrong driver, so names that don't fit are dropped.
+	size_t name_len = strlen(name);
+	if (name_len >= driver_size)
+		return;
+	memcpy(driver, name, name_len + 1);
+}
+
+// Same ordering as bs_drm_connectors_main_rank, but keyed on the connector names the kernel uses in
+// sysfs.
+static uint32_t sysfs_connector_rank(const char *connector_name)
+{
+	static const struct {
+		const char *prefix;
+		uint32_t rank;
+	} ranks[] = {
+		{ "LVDS-", 0x01 }, { "eDP-", 0x02 }, { "DSI-", 0x03 },
+	};
+
+	for (size_t i = 0; i < BS_ARRAY_LEN(ranks); i++)
+		if (!strncmp(connector_name, ranks[i].prefix, strlen(ranks[i].prefix)))
+			return ranks[i].rank;
+	return 0xFF;
+}
+
+static struct bs_drm_sysfs_card *find_card(struct bs_drm_sysfs_card *cards, size_t card_count,
+					   unsigned minor)
+{
+	for (size_t i = 0; i < card_count; i++)
+		if (cards[i].minor == minor)
+			return &cards[i];
+	return NULL;
+}
+
+static void add_sysfs_connector(struct bs_drm_sysfs_card *card, const char *dir_name,
+				const char *connector_name)
+{
+	char path[PATH_MAX];
+	char status[32];
+
+	card->connector_count++;
+	snprintf(path, sizeof(path), SYSFS_DRM_PATH "/%s/status", dir_name);
+	if (!read_sysfs_line(path, status, sizeof(status)))
+		return;
+
+	// "unknown" is treated as possibly connected so that only cards we know to be useless are
+	// skipped.
+	if (strcmp(status, "connected") && strcmp(status, "unknown"))
+		return;
+
+	card->connected_count++;
+	uint32_t rank = sysfs_connector_rank(connector_name);
+	if (card->best_connector_rank > rank)
+		card->best_connector_rank = rank;
+}
+
+static int compare_cards(const void *a, const void *b)
+{
+	const struct bs_drm_sysfs_card *card_a = a;
+	const struct bs_drm_sysfs_card *card_b = b;
+	return (int)card_a->minor - (int)card_b->minor;
+}
+
+int bs_drm_sysfs_cards(struct bs_drm_sysfs_card *cards, size_t max_cards)
+{
+	assert(cards || max_cards == 0);
+
+	DIR *dir = opendir(SYSFS_DRM_PATH);
+	if (!dir)
+		return -1;
+
+	// Card directories are listed in no particular order relative to their connectors, so the
+	// cards are collected first.
+	size_t card_count = 0;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		unsigned minor;
+		int name_len = 0;
+		if (sscanf(entry->d_name, "card%u%n", &minor, &name_len) != 1 ||
+		    entry->d_name[name_len] != '\0' || card_count >= max_cards)
+			continue;
+
+		struct bs_drm_sysfs_card *card = &cards[card_count++];
+		memset(card, 0, sizeof(*card));
+		card->minor = minor;
+		card->best_connector_rank = bs_rank_skip;
+		read_sysfs_driver(minor, card->driver, sizeof(card->driver));
+	}
+
+	rewinddir(dir);
+	while ((entry = readdir(dir)) != NULL) {
+		unsigned minor;
+		int name_len = 0;
+		if (sscanf(entry->d_name, "card%u-%n", &minor, &name_len) != 1 || name_len == 0)
+			continue;
+
+		struct bs_drm_sysfs_card *card = find_card(cards, card_count, minor);
+		if (card)
+			add_sysfs_connector(card, entry->d_name, entry->d_name + name_len);
+	}
+	closedir(dir);
+
+	qsort(cards, card_count, sizeof(cards[0]), compare_cards);
+	return (int)card_count;
+}
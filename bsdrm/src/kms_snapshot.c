@@ -0,0 +1,237 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "bs_drm.h"
+
+struct bs_kms_snapshot {
+	int fd;
+	drmModeRes *res;
+	// Each of these arrays is parallel to the matching id array in res. Objects that failed to
+	// be fetched are left NULL.
+	drmModeConnector **connectors;
+	drmModeEncoder **encoders;
+	drmModeCrtc **crtcs;
+	drmModePlaneRes *plane_res;
+	// Parallel to plane_res->planes.
+	drmModePlane **planes;
+};
+
+static void bs_kms_snapshot_release(struct bs_kms_snapshot *self)
+{
+	if (self->res) {
+		for (int i = 0; i < self->res->count_connectors; i++)
+			drmModeFreeConnector(self->connectors[i]);
+		for (int i = 0; i < self->res->count_encoders; i++)
+			drmModeFreeEncoder(self->encoders[i]);
+		for (int i = 0; i < self->res->count_crtcs; i++)
+			drmModeFreeCrtc(self->crtcs[i]);
+		drmModeFreeResources(self->res);
+		self->res = NULL;
+	}
+	free(self->connectors);
+	free(self->encoders);
+	free(self->crtcs);
+	self->connectors = NULL;
+	self->encoders = NULL;
+	self->crtcs = NULL;
+
+	if (self->plane_res) {
+		for (uint32_t i = 0; i < self->plane_res->count_planes; i++)
+			drmModeFreePlane(self->planes[i]);
+		drmModeFreePlaneResources(self->plane_res);
+		self->plane_res = NULL;
+	}
+	free(self->planes);
+	self->planes = NULL;
+}
+
+static bool bs_kms_snapshot_capture(struct bs_kms_snapshot *self)
+{
+	self->res = drmModeGetResources(self->fd);
+	if (!self->res)
+		return false;
+
+	drmModeRes *res = self->res;
+	self->connectors = calloc(res->count_connectors + 1, sizeof(self->connectors[0]));
+	self->encoders = calloc(res->count_encoders + 1, sizeof(self->encoders[0]));
+	self->crtcs = calloc(res->count_crtcs + 1, sizeof(self->crtcs[0]));
+	assert(self->connectors);
+	assert(self->encoders);
+	assert(self->crtcs);
+
+	for (int i = 0; i < res->count_connectors; i++)
+		self->connectors[i] = drmModeGetConnector(self->fd, res->connectors[i]);
+	for (int i = 0; i < res->count_encoders; i++)
+		self->encoders[i] = drmModeGetEncoder(self->fd, res->encoders[i]);
+	for (int i = 0; i < res->count_crtcs; i++)
+		self->crtcs[i] = drmModeGetCrtc(self->fd, res->crtcs[i]);
+
+	// Plane resources are optional. Drivers without planes still have usable pipes.
+	self->plane_res = drmModeGetPlaneResources(self->fd);
+	if (self->plane_res) {
+		self->planes = calloc(self->plane_res->count_planes + 1, sizeof(self->planes[0]));
+		assert(self->planes);
+		for (uint32_t i = 0; i < self->plane_res->count_planes; i++)
+			self->planes[i] = drmModeGetPlane(self->fd, self->plane_res->planes[i]);
+	}
+
+	return true;
+}
+
+struct bs_kms_snapshot *bs_kms_snapshot_new(int fd)
+{
+	assert(fd >= 0);
+	struct bs_kms_snapshot *self = calloc(1, sizeof(struct bs_kms_snapshot));
+	assert(self);
+	self->fd = fd;
+	if (!bs_kms_snapshot_capture(self)) {
+		bs_kms_snapshot_release(self);
+		free(self);
+		return NULL;
+	}
+	return self;
+}
+
+void bs_kms_snapshot_destroy(struct bs_kms_snapshot **snapshot)
+{
+	assert(snapshot);
+	struct bs_kms_snapshot *self = *snapshot;
+	assert(self);
+	bs_kms_snapshot_release(self);
+	free(self);
+	*snapshot = NULL;
+}
+
+int bs_kms_snapshot_fd(struct bs_kms_snapshot *self)
+{
+	assert(self);
+	return self->fd;
+}
+
+drmModeRes *bs_kms_snapshot_resources(struct bs_kms_snapshot *self)
+{
+	assert(self);
+	assert(self->res);
+	return self->res;
+}
+
+size_t bs_kms_snapshot_connector_count(struct bs_kms_snapshot *self)
+{
+	assert(self);
+	return self->res ? self->res->count_connectors : 0;
+}
+
+drmModeConnector *bs_kms_snapshot_connector(struct bs_kms_snapshot *self, size_t index)
+{
+	assert(self);
+	assert(index < bs_kms_snapshot_connector_count(self));
+	return self->connectors[index];
+}
+
+drmModeConnector *bs_kms_snapshot_find_connector(struct bs_kms_snapshot *self,
+						 uint32_t connector_id)
+{
+	assert(self);
+	for (size_t i = 0; i < bs_kms_snapshot_connector_count(self); i++)
+		if (self->connectors[i] && self->connectors[i]->connector_id == connector_id)
+			return self->connectors[i];
+	return NULL;
+}
+
+static void *copy_array(const void *array, size_t count, size_t size)
+{
+	if (!array || !count)
+		return NULL;
+	void *copy = calloc(count, size);
+	assert(copy);
+	memcpy(copy, array, count * size);
+	return copy;
+}
+
+drmModeConnector *bs_kms_snapshot_copy_connector(const drmModeConnector *connector)
+{
+	assert(connector);
+	// drmModeFreeConnector releases every array with free, like libdrm allocates them.
+	drmModeConnector *copy = calloc(1, sizeof(*copy));
+	assert(copy);
+	*copy = *connector;
+	copy->modes = copy_array(connector->modes, connector->count_modes,
+				 sizeof(connector->modes[0]));
+	copy->props =
+	    copy_array(connector->props, connector->count_props, sizeof(connector->props[0]));
+	copy->prop_values = copy_array(connector->prop_values, connector->count_props,
+				       sizeof(connector->prop_values[0]));
+	copy->encoders = copy_array(connector->encoders, connector->count_encoders,
+				    sizeof(connector->encoders[0]));
+	return copy;
+}
+
+drmModeEncoder *bs_kms_snapshot_find_encoder(struct bs_kms_snapshot *self, uint32_t encoder_id)
+{
+	assert(self);
+	if (!self->res)
+		return NULL;
+
+	for (int i = 0; i < self->res->count_encoders; i++)
+		if (self->encoders[i] && self->encoders[i]->encoder_id == encoder_id)
+			return self->encoders[i];
+	return NULL;
+}
+
+size_t bs_kms_snapshot_crtc_count(struct bs_kms_snapshot *self)
+{
+	assert(self);
+	return self->res ? self->res->count_crtcs : 0;
+}
+
+drmModeCrtc *bs_kms_snapshot_crtc(struct bs_kms_snapshot *self, size_t index)
+{
+	assert(self);
+	assert(index < bs_kms_snapshot_crtc_count(self));
+	return self->crtcs[index];
+}
+
+int bs_kms_snapshot_find_crtc_index(struct bs_kms_snapshot *self, uint32_t crtc_id)
+{
+	assert(self);
+	for (size_t i = 0; i < bs_kms_snapshot_crtc_count(self); i++)
+		if (self->res->crtcs[i] == crtc_id)
+			return (int)i;
+	return -1;
+}
+
+size_t bs_kms_snapshot_plane_count(struct bs_kms_snapshot *self)
+{
+	assert(self);
+	return self->plane_res ? self->plane_res->count_planes : 0;
+}
+
+drmModePlane *bs_kms_snapshot_plane(struct bs_kms_snapshot *self, size_t index)
+{
+	assert(self);
+	assert(index < bs_kms_snapshot_plane_count(self));
+	return self->planes[index];
+}
+
+uint32_t bs_kms_snapshot_connector_crtc_mask(struct bs_kms_snapshot *self,
+					     drmModeConnector *connector)
+{
+	assert(self);
+	assert(connector);
+	uint32_t crtc_mask = 0;
+	for (int encoder_index = 0; encoder_index < connector->count_encoders; encoder_index++) {
+		drmModeEncoder *encoder =
+		    bs_kms_snapshot_find_encoder(self, connector->encoders[encoder_index]);
+		if (encoder)
+			crtc_mask |= encoder->possible_crtcs;
+	}
+
+	// Bits beyond the CRTC count don't refer to anything.
+	size_t crtc_count = bs_kms_snapshot_crtc_count(self);
+	if (crtc_count < 32)
+		crtc_mask &= (1u << crtc_count) - 1;
+	return crtc_mask;
+}
@@ -8,14 +8,29 @@ CFLAGS += -std=gnu99 -I$(SRC)/bsdrm/include
 
 CC_STATIC_LIBRARY(libbsdrm.pic.a): \
   bsdrm/src/app.o \
+  bsdrm/src/blob_cache.o \
+  bsdrm/src/bo_pool.o \
+  bsdrm/src/color.o \
+  bsdrm/src/commit_log.o \
+  bsdrm/src/compositor.o \
+  bsdrm/src/crtc_crc.o \
   bsdrm/src/debug.o \
   bsdrm/src/draw.o \
   bsdrm/src/drm_connectors.o \
   bsdrm/src/drm_fb.o \
+  bsdrm/src/drm_modifiers.o \
   bsdrm/src/drm_open.o \
   bsdrm/src/drm_pipe.o \
+  bsdrm/src/drm_sysfs.o \
   bsdrm/src/egl.o \
   bsdrm/src/gl.o \
+  bsdrm/src/hash.o \
+  bsdrm/src/kms_snapshot.o \
   bsdrm/src/mmap.o \
   bsdrm/src/open.o \
-  bsdrm/src/pipe.o
+  bsdrm/src/pipe.o \
+  bsdrm/src/plane_caps.o \
+  bsdrm/src/present_stats.o \
+  bsdrm/src/rotate.o \
+  bsdrm/src/scale.o \
+  bsdrm/src/writeback.o
@@ -0,0 +1,551 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "bs_drm.h"
+
+#define PLANE_CAPS_MAGIC 0x43504253  // "BSPC"
+#define PLANE_CAPS_VERSION 2
+
+// Scanout of the probe buffers is never seen, so they only need to be big enough to scale.
+#define PROBE_SIZE 256
+#define PROBE_CURSOR_SIZE 64
+#define SCALE_ONE 0x10000
+
+// The cache file is this header followed by the capabilities sorted by plane, format and modifier.
+struct plane_caps_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t key;
+	uint32_t count;
+	uint32_t reserved;
+};
+
+struct bs_plane_caps {
+	const struct bs_plane_cap *caps;
+	size_t count;
+	// Either the mapped cache file or the capabilities probed by this run.
+	void *map;
+	size_t map_size;
+	struct bs_plane_cap *probed;
+	struct bs_plane_caps_stats stats;
+};
+
+enum probe_prop {
+	PROBE_CONNECTOR_CRTC_ID,
+	PROBE_CRTC_MODE_ID,
+	PROBE_CRTC_ACTIVE,
+	PROBE_PLANE_TYPE,
+	PROBE_PLANE_CRTC_ID,
+	PROBE_PLANE_FB_ID,
+	PROBE_PLANE_CRTC_X,
+	PROBE_PLANE_CRTC_Y,
+	PROBE_PLANE_CRTC_W,
+	PROBE_PLANE_CRTC_H,
+	PROBE_PLANE_SRC_X,
+	PROBE_PLANE_SRC_Y,
+	PROBE_PLANE_SRC_W,
+	PROBE_PLANE_SRC_H,
+	PROBE_PROP_COUNT,
+};
+
+struct plane_prober {
+	int fd;
+	struct gbm_device *gbm;
+	struct bs_plane_cap *caps;
+	size_t count;
+	size_t capacity;
+	uint64_t checks;
+
+	// The pipe the plane under test is shown on.
+	uint32_t connector_id;
+	uint32_t crtc_id;
+	uint32_t mode_blob_id;
+	uint32_t mode_width;
+	uint32_t mode_height;
+	uint32_t plane_id;
+	uint32_t prop_ids[PROBE_PROP_COUNT];
+	uint64_t plane_type;
+	// Other planes are probed over the CRTC's primary plane, as drivers may refuse to light up
+	// a CRTC without it. Only the plane entries of primary_prop_ids are used.
+	uint32_t primary_id;
+	uint32_t primary_prop_ids[PROBE_PROP_COUNT];
+	struct gbm_bo *primary_bo;
+	uint32_t primary_fb_id;
+};
+
+// Identifies the driver build and the display setup, either of which can change the answers.
+static uint64_t plane_caps_key(struct bs_kms_snapshot *snapshot)
+{
+	int fd = bs_kms_snapshot_fd(snapshot);
+	uint64_t hash = BS_HASH_INIT;
+	drmVersionPtr version = drmGetVersion(fd);
+	if (version) {
+		hash = bs_hash_bytes(hash, version->name, version->name_len);
+		hash = bs_hash_bytes(hash, version->date, version->date_len);
+		hash = bs_hash_bytes(hash, &version->version_major, sizeof(version->version_major));
+		hash = bs_hash_bytes(hash, &version->version_minor, sizeof(version->version_minor));
+		hash = bs_hash_bytes(hash, &version->version_patchlevel,
+				     sizeof(version->version_patchlevel));
+		drmFreeVersion(version);
+	}
+
+	for (size_t i = 0; i < bs_kms_snapshot_connector_count(snapshot); i++) {
+		drmModeConnector *connector = bs_kms_snapshot_connector(snapshot, i);
+		if (!connector)
+			continue;
+		hash = bs_hash_bytes(hash, &connector->connector_id,
+				     sizeof(connector->connector_id));
+		hash = bs_hash_bytes(hash, &connector->connector_type,
+				     sizeof(connector->connector_type));
+		hash = bs_hash_bytes(hash, &connector->connection, sizeof(connector->connection));
+		// The probes use the first mode, and fitting the destination depends on the rest.
+		for (int m = 0; m < connector->count_modes; m++) {
+			const drmModeModeInfo *mode = &connector->modes[m];
+			hash = bs_hash_bytes(hash, &mode->clock, sizeof(mode->clock));
+			hash = bs_hash_bytes(hash, &mode->hdisplay, sizeof(mode->hdisplay));
+			hash = bs_hash_bytes(hash, &mode->vdisplay, sizeof(mode->vdisplay));
+			hash = bs_hash_bytes(hash, &mode->vrefresh, sizeof(mode->vrefresh));
+			hash = bs_hash_bytes(hash, &mode->flags, sizeof(mode->flags));
+		}
+	}
+
+	for (size_t i = 0; i < bs_kms_snapshot_plane_count(snapshot); i++) {
+		drmModePlane *plane = bs_kms_snapshot_plane(snapshot, i);
+		if (!plane)
+			continue;
+		hash = bs_hash_bytes(hash, &plane->plane_id, sizeof(plane->plane_id));
+		hash = bs_hash_bytes(hash, &plane->possible_crtcs, sizeof(plane->possible_crtcs));
+	}
+
+	return hash;
+}
+
+static void plane_caps_path(const char *cache_dir, uint64_t key, char *path, size_t size)
+{
+	if (!cache_dir)
+		cache_dir = getenv("BSDRM_CACHE_DIR");
+	if (!cache_dir || !cache_dir[0])
+		cache_dir = getenv("XDG_CACHE_HOME");
+	if (!cache_dir || !cache_dir[0])
+		cache_dir = "/tmp";
+	snprintf(path, size, "%s/bsdrm-plane-caps-%016llx", cache_dir, (unsigned long long)key);
+}
+
+static bool plane_caps_load(struct bs_plane_caps *self, const char *path, uint64_t key)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	void *map = MAP_FAILED;
+	if (!fstat(fd, &st) && st.st_size >= (off_t)sizeof(struct plane_caps_header))
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+
+	const struct plane_caps_header *header = map;
+	if (header->magic != PLANE_CAPS_MAGIC || header->version != PLANE_CAPS_VERSION ||
+	    header->key != key ||
+	    st.st_size != sizeof(*header) + header->count * sizeof(struct bs_plane_cap)) {
+		bs_debug_warning("ignoring stale or malformed plane capability cache %s", path);
+		munmap(map, st.st_size);
+		return false;
+	}
+
+	self->map = map;
+	self->map_size = st.st_size;
+	self->caps = (const struct bs_plane_cap *)(header + 1);
+	self->count = header->count;
+	return true;
+}
+
+// Writes to a temporary file first so that readers never map a partial cache. mkstemp() creates
+// it exclusively, so a link planted in a shared directory like /tmp can't redirect the write.
+static void plane_caps_save(struct bs_plane_caps *self, const char *path, uint64_t key)
+{
+	// Room for the path and the random suffix.
+	char tmp_path[PATH_MAX + 8];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+	int fd = mkstemp(tmp_path);
+	if (fd < 0) {
+		bs_debug_warning("failed to create plane capability cache %s: %d", tmp_path, errno);
+		return;
+	}
+	FILE *file = fdopen(fd, "wb");
+	if (!file) {
+		bs_debug_warning("failed to open plane capability cache %s: %d", tmp_path, errno);
+		close(fd);
+		unlink(tmp_path);
+		return;
+	}
+
+	struct plane_caps_header header = { 0 };
+	header.magic = PLANE_CAPS_MAGIC;
+	header.version = PLANE_CAPS_VERSION;
+	header.key = key;
+	header.count = self->count;
+	bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+		       fwrite(self->caps, sizeof(struct bs_plane_cap), self->count, file) ==
+			   self->count;
+	if (fclose(file) || !written || rename(tmp_path, path)) {
+		bs_debug_warning("failed to write plane capability cache %s", path);
+		unlink(tmp_path);
+	}
+}
+
+static bool get_property_ids(int fd, uint32_t object_id, uint32_t object_type,
+			     const char *const *names, uint32_t *ids, uint64_t *values,
+			     size_t count)
+{
+	drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(fd, object_id, object_type);
+	if (!props)
+		return false;
+
+	size_t found = 0;
+	for (uint32_t i = 0; i < props->count_props; i++) {
+		drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[i]);
+		if (!prop)
+			continue;
+		for (size_t j = 0; j < count; j++) {
+			if (!strcmp(prop->name, names[j])) {
+				ids[j] = prop->prop_id;
+				if (values)
+					values[j] = props->prop_values[i];
+				found++;
+			}
+		}
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+	return found == count;
+}
+
+static void prober_clear_plane(struct plane_prober *prober)
+{
+	drmModeDestroyPropertyBlob(prober->fd, prober->mode_blob_id);
+	if (prober->primary_fb_id)
+		drmModeRmFB(prober->fd, prober->primary_fb_id);
+	if (prober->primary_bo)
+		gbm_bo_destroy(prober->primary_bo);
+	prober->primary_id = 0;
+	prober->primary_fb_id = 0;
+	prober->primary_bo = NULL;
+}
+
+// Sets up a full screen buffer on the primary plane of the prober's CRTC.
+static bool prober_set_primary(struct plane_prober *prober, const char *const *plane_names,
+			       size_t name_count)
+{
+	prober->primary_id = bs_drm_primary_plane(prober->fd, prober->crtc_id);
+	if (!prober->primary_id ||
+	    !get_property_ids(prober->fd, prober->primary_id, DRM_MODE_OBJECT_PLANE, plane_names,
+			      &prober->primary_prop_ids[PROBE_PLANE_TYPE], NULL, name_count))
+		return false;
+
+	prober->primary_bo = gbm_bo_create(prober->gbm, prober->mode_width, prober->mode_height,
+					   GBM_FORMAT_XRGB8888, GBM_BO_USE_SCANOUT);
+	if (!prober->primary_bo)
+		return false;
+	prober->primary_fb_id = bs_drm_fb_create_gbm(prober->primary_bo);
+	return prober->primary_fb_id != 0;
+}
+
+// Finds a connector and CRTC to show the plane on and looks up the properties the probes set.
+static bool prober_set_plane(struct plane_prober *prober, struct bs_kms_snapshot *snapshot,
+			     drmModePlane *plane)
+{
+	struct bs_drm_pipe pipe = { 0 };
+	drmModeConnector *connector = NULL;
+	struct bs_drm_pipe_plumber *plumber = bs_drm_pipe_plumber_new();
+	bs_drm_pipe_plumber_snapshot(plumber, snapshot);
+	bs_drm_pipe_plumber_crtc_mask(plumber, plane->possible_crtcs);
+	bs_drm_pipe_plumber_connector_ptr(plumber, &connector);
+	bool made = bs_drm_pipe_plumber_make(plumber, &pipe);
+	bs_drm_pipe_plumber_destroy(&plumber);
+	if (!made)
+		return false;
+	if (!connector || !connector->count_modes) {
+		drmModeFreeConnector(connector);
+		return false;
+	}
+
+	static const char *const connector_names[] = { "CRTC_ID" };
+	static const char *const crtc_names[] = { "MODE_ID", "ACTIVE" };
+	static const char *const plane_names[] = { "type",   "CRTC_ID", "FB_ID", "CRTC_X",
+						   "CRTC_Y", "CRTC_W",  "CRTC_H", "SRC_X",
+						   "SRC_Y",  "SRC_W",   "SRC_H" };
+	uint64_t plane_values[BS_ARRAY_LEN(plane_names)];
+	if (!get_property_ids(prober->fd, pipe.connector_id, DRM_MODE_OBJECT_CONNECTOR,
+			      connector_names, &prober->prop_ids[PROBE_CONNECTOR_CRTC_ID], NULL,
+			      BS_ARRAY_LEN(connector_names)) ||
+	    !get_property_ids(prober->fd, pipe.crtc_id, DRM_MODE_OBJECT_CRTC, crtc_names,
+			      &prober->prop_ids[PROBE_CRTC_MODE_ID], NULL,
+			      BS_ARRAY_LEN(crtc_names)) ||
+	    !get_property_ids(prober->fd, plane->plane_id, DRM_MODE_OBJECT_PLANE, plane_names,
+			      &prober->prop_ids[PROBE_PLANE_TYPE], plane_values,
+			      BS_ARRAY_LEN(plane_names)) ||
+	    drmModeCreatePropertyBlob(prober->fd, &connector->modes[0], sizeof(drmModeModeInfo),
+				      &prober->mode_blob_id)) {
+		drmModeFreeConnector(connector);
+		return false;
+	}
+
+	prober->connector_id = pipe.connector_id;
+	prober->crtc_id = pipe.crtc_id;
+	prober->mode_width = connector->modes[0].hdisplay;
+	prober->mode_height = connector->modes[0].vdisplay;
+	prober->plane_id = plane->plane_id;
+	prober->plane_type = plane_values[0];
+	drmModeFreeConnector(connector);
+
+	// Failures without the primary plane would say nothing about the plane, so rather than
+	// caching them the plane is left unprobed.
+	if (prober->plane_type != DRM_PLANE_TYPE_PRIMARY &&
+	    !prober_set_primary(prober, plane_names, BS_ARRAY_LEN(plane_names))) {
+		bs_debug_warning("not probing plane %u without a primary plane", plane->plane_id);
+		prober_clear_plane(prober);
+		return false;
+	}
+	return true;
+}
+
+static void prober_add_plane(drmModeAtomicReqPtr req, uint32_t plane_id, const uint32_t *ids,
+			     uint32_t crtc_id, uint32_t fb_id, uint32_t src_w, uint32_t src_h,
+			     uint32_t dst_w, uint32_t dst_h)
+{
+	drmModeAtomicAddProperty(req, plane_id, ids[PROBE_PLANE_CRTC_ID], crtc_id);
+	drmModeAtomicAddProperty(req, plane_id, ids[PROBE_PLANE_FB_ID], fb_id);
+	drmModeAtomicAddProperty(req, plane_id, ids[PROBE_PLANE_CRTC_X], 0);
+	drmModeAtomicAddProperty(req, plane_id, ids[PROBE_PLANE_CRTC_Y], 0);
+	drmModeAtomicAddProperty(req, plane_id, ids[PROBE_PLANE_CRTC_W], dst_w);
+	drmModeAtomicAddProperty(req, plane_id, ids[PROBE_PLANE_CRTC_H], dst_h);
+	drmModeAtomicAddProperty(req, plane_id, ids[PROBE_PLANE_SRC_X], 0);
+	drmModeAtomicAddProperty(req, plane_id, ids[PROBE_PLANE_SRC_Y], 0);
+	drmModeAtomicAddProperty(req, plane_id, ids[PROBE_PLANE_SRC_W], (uint64_t)src_w << 16);
+	drmModeAtomicAddProperty(req, plane_id, ids[PROBE_PLANE_SRC_H], (uint64_t)src_h << 16);
+}
+
+static bool prober_test(struct plane_prober *prober, uint32_t fb_id, uint32_t src_size,
+			uint32_t dst_size)
+{
+	if (dst_size > prober->mode_width || dst_size > prober->mode_height)
+		return false;
+
+	const uint32_t *ids = prober->prop_ids;
+	drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+	drmModeAtomicAddProperty(req, prober->connector_id, ids[PROBE_CONNECTOR_CRTC_ID],
+				 prober->crtc_id);
+	drmModeAtomicAddProperty(req, prober->crtc_id, ids[PROBE_CRTC_MODE_ID],
+				 prober->mode_blob_id);
+	drmModeAtomicAddProperty(req, prober->crtc_id, ids[PROBE_CRTC_ACTIVE], 1);
+	if (prober->primary_id)
+		prober_add_plane(req, prober->primary_id, prober->primary_prop_ids, prober->crtc_id,
+				 prober->primary_fb_id, prober->mode_width, prober->mode_height,
+				 prober->mode_width, prober->mode_height);
+	prober_add_plane(req, prober->plane_id, ids, prober->crtc_id, fb_id, src_size, src_size,
+			 dst_size, dst_size);
+	uint32_t flags = DRM_MODE_ATOMIC_TEST_ONLY | DRM_MODE_ATOMIC_ALLOW_MODESET;
+	int ret = drmModeAtomicCommit(prober->fd, req, flags, NULL);
+	drmModeAtomicFree(req);
+	prober->checks++;
+	return !ret;
+}
+
+static void prober_probe(struct plane_prober *prober, uint32_t format, uint64_t modifier)
+{
+	if (prober->count == prober->capacity) {
+		prober->capacity = prober->capacity ? prober->capacity * 2 : 64;
+		prober->caps = realloc(prober->caps, prober->capacity * sizeof(*prober->caps));
+		assert(prober->caps);
+	}
+
+	struct bs_plane_cap *cap = &prober->caps[prober->count++];
+	memset(cap, 0, sizeof(*cap));
+	cap->plane_id = prober->plane_id;
+	cap->format = format;
+	cap->modifier = modifier;
+
+	bool cursor = prober->plane_type == DRM_PLANE_TYPE_CURSOR;
+	uint32_t size = cursor ? PROBE_CURSOR_SIZE : PROBE_SIZE;
+	struct gbm_bo *bo;
+	if (modifier == DRM_FORMAT_MOD_INVALID)
+		bo = gbm_bo_create(prober->gbm, size, size, format,
+				   cursor ? GBM_BO_USE_CURSOR : GBM_BO_USE_SCANOUT);
+	else
+		bo = gbm_bo_create_with_modifiers(prober->gbm, size, size, format, &modifier, 1);
+
+	// What gbm can't allocate can't be scanned out by this process either.
+	if (!bo)
+		return;
+
+	uint32_t fb_id = bs_drm_fb_create_gbm(bo);
+	if (fb_id && prober_test(prober, fb_id, size, size)) {
+		cap->min_scale = SCALE_ONE;
+		cap->max_scale = SCALE_ONE;
+		// Cursors are never scaled, so don't bother asking.
+		for (uint32_t shift = 1; !cursor && shift <= 2; shift++) {
+			if (!prober_test(prober, fb_id, size, size >> shift))
+				break;
+			cap->min_scale = SCALE_ONE >> shift;
+		}
+		for (uint32_t shift = 1; !cursor && shift <= 2; shift++) {
+			if (!prober_test(prober, fb_id, size, size << shift))
+				break;
+			cap->max_scale = SCALE_ONE << shift;
+		}
+	}
+
+	if (fb_id)
+		drmModeRmFB(prober->fd, fb_id);
+	gbm_bo_destroy(bo);
+}
+
+static int compare_caps(const void *a, const void *b)
+{
+	const struct bs_plane_cap *x = a;
+	const struct bs_plane_cap *y = b;
+	if (x->plane_id != y->plane_id)
+		return x->plane_id < y->plane_id ? -1 : 1;
+	if (x->format != y->format)
+		return x->format < y->format ? -1 : 1;
+	if (x->modifier != y->modifier)
+		return x->modifier < y->modifier ? -1 : 1;
+	return 0;
+}
+
+static void plane_caps_probe(struct bs_plane_caps *self, struct bs_kms_snapshot *snapshot,
+			     struct gbm_device *gbm)
+{
+	struct plane_prober prober = { 0 };
+	prober.fd = bs_kms_snapshot_fd(snapshot);
+	prober.gbm = gbm;
+
+	for (size_t i = 0; i < bs_kms_snapshot_plane_count(snapshot); i++) {
+		drmModePlane *plane = bs_kms_snapshot_plane(snapshot, i);
+		if (!plane || !prober_set_plane(&prober, snapshot, plane))
+			continue;
+
+		for (uint32_t f = 0; f < plane->count_formats; f++) {
+			uint32_t format = plane->formats[f];
+			uint64_t modifiers[BS_DRM_MAX_MODIFIERS];
+			size_t modifier_count = bs_drm_plane_modifiers(
+			    prober.fd, plane->plane_id, format, modifiers, BS_ARRAY_LEN(modifiers));
+			for (size_t m = 0; m < modifier_count; m++) {
+				if (modifiers[m] != DRM_FORMAT_MOD_INVALID)
+					prober_probe(&prober, format, modifiers[m]);
+			}
+
+			// Buffers allocated without modifiers leave the layout up to the driver.
+			prober_probe(&prober, format, DRM_FORMAT_MOD_INVALID);
+		}
+
+		prober_clear_plane(&prober);
+	}
+
+	qsort(prober.caps, prober.count, sizeof(*prober.caps), compare_caps);
+	self->probed = prober.caps;
+	self->caps = prober.caps;
+	self->count = prober.count;
+	self->stats.checks = prober.checks;
+}
+
+struct bs_plane_caps *bs_plane_caps_new(struct bs_kms_snapshot *snapshot, struct gbm_device *gbm,
+					const char *cache_dir)
+{
+	assert(snapshot);
+	assert(gbm);
+
+	struct bs_plane_caps *self = calloc(1, sizeof(struct bs_plane_caps));
+	assert(self);
+
+	int64_t start_ns = bs_debug_gettime_ns();
+	uint64_t key = plane_caps_key(snapshot);
+	char path[PATH_MAX];
+	plane_caps_path(cache_dir, key, path, sizeof(path));
+	self->stats.cached = plane_caps_load(self, path, key);
+	if (!self->stats.cached) {
+		plane_caps_probe(self, snapshot, gbm);
+		plane_caps_save(self, path, key);
+	}
+
+	self->stats.load_ns = bs_debug_gettime_ns() - start_ns;
+	return self;
+}
+
+void bs_plane_caps_destroy(struct bs_plane_caps **self)
+{
+	assert(self);
+	assert(*self);
+	if ((*self)->map)
+		munmap((*self)->map, (*self)->map_size);
+	free((*self)->probed);
+	free(*self);
+	*self = NULL;
+}
+
+size_t bs_plane_caps_count(struct bs_plane_caps *self)
+{
+	assert(self);
+	return self->count;
+}
+
+const struct bs_plane_cap *bs_plane_caps_get(struct bs_plane_caps *self, size_t index)
+{
+	assert(self);
+	assert(index < self->count);
+	return &self->caps[index];
+}
+
+const struct bs_plane_cap *bs_plane_caps_find(struct bs_plane_caps *self, uint32_t plane_id,
+					      uint32_t format, uint64_t modifier)
+{
+	assert(self);
+	struct bs_plane_cap key = { 0 };
+	key.plane_id = plane_id;
+	key.format = format;
+	key.modifier = modifier;
+	return bsearch(&key, self->caps, self->count, sizeof(key), compare_caps);
+}
+
+static bool cap_allows_scale(const struct bs_plane_cap *cap, uint32_t scale_x, uint32_t scale_y)
+{
+	return scale_x >= cap->min_scale && scale_x <= cap->max_scale &&
+	       scale_y >= cap->min_scale && scale_y <= cap->max_scale;
+}
+
+bool bs_plane_caps_supports(struct bs_plane_caps *self, uint32_t plane_id, uint32_t format,
+			    uint64_t modifier, uint32_t scale_x, uint32_t scale_y)
+{
+	const struct bs_plane_cap *cap = bs_plane_caps_find(self, plane_id, format, modifier);
+	return cap && cap_allows_scale(cap, scale_x, scale_y);
+}
+
+bool bs_plane_caps_supports_any(struct bs_plane_caps *self, uint32_t plane_id, uint32_t format,
+				uint32_t scale_x, uint32_t scale_y)
+{
+	assert(self);
+	for (size_t i = 0; i < self->count; i++) {
+		const struct bs_plane_cap *cap = &self->caps[i];
+		if (cap->plane_id == plane_id && cap->format == format &&
+		    cap_allows_scale(cap, scale_x, scale_y))
+			return true;
+	}
+
+	return false;
+}
+
+void bs_plane_caps_get_stats(struct bs_plane_caps *self, struct bs_plane_caps_stats *stats)
+{
+	assert(self);
+	assert(stats);
+	*stats = self->stats;
+}
@@ -0,0 +1,213 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "bs_drm.h"
+
+struct present_frame {
+	// CLOCK_MONOTONIC time the frame was submitted or -1 if it was never submitted.
+	int64_t submit_ns;
+	// Flip-complete timestamp from the drm event, also CLOCK_MONOTONIC.
+	int64_t flip_ns;
+	uint32_t sequence;
+	bool flipped;
+};
+
+struct bs_present_stats {
+	size_t frame_count;
+	size_t frame_capacity;
+	struct present_frame *frames;
+	// Index of the oldest submitted frame still waiting on its flip.
+	size_t next_flip;
+};
+
+struct bs_present_stats *bs_present_stats_new()
+{
+	struct bs_present_stats *self = calloc(1, sizeof(struct bs_present_stats));
+	assert(self);
+	return self;
+}
+
+void bs_present_stats_destroy(struct bs_present_stats **self)
+{
+	assert(self);
+	assert(*self);
+	free((*self)->frames);
+	free(*self);
+	*self = NULL;
+}
+
+static struct present_frame *present_stats_append(struct bs_present_stats *self)
+{
+	if (self->frame_count == self->frame_capacity) {
+		self->frame_capacity = self->frame_capacity ? self->frame_capacity * 2 : 256;
+		self->frames =
+		    realloc(self->frames, self->frame_capacity * sizeof(struct present_frame));
+		assert(self->frames);
+	}
+	struct present_frame *frame = &self->frames[self->frame_count++];
+	memset(frame, 0, sizeof(*frame));
+	return frame;
+}
+
+void bs_present_stats_submit(struct bs_present_stats *self)
+{
+	assert(self);
+	present_stats_append(self)->submit_ns = bs_debug_gettime_ns();
+}
+
+void bs_present_stats_submit_at(struct bs_present_stats *self, int64_t submit_ns)
+{
+	assert(self);
+	present_stats_append(self)->submit_ns = submit_ns;
+}
+
+void bs_present_stats_flip(struct bs_present_stats *self, unsigned int sequence,
+			   unsigned int tv_sec, unsigned int tv_usec)
+{
+	assert(self);
+
+	// Flips complete in submission order. One without a submission, e.g. after a modeset the
+	// caller didn't record, still counts towards the intervals.
+	struct present_frame *frame;
+	if (self->next_flip < self->frame_count) {
+		frame = &self->frames[self->next_flip];
+	} else {
+		frame = present_stats_append(self);
+		frame->submit_ns = -1;
+	}
+	self->next_flip = frame - self->frames + 1;
+
+	frame->flip_ns = (int64_t)tv_sec * 1000000000 + (int64_t)tv_usec * 1000;
+	frame->sequence = sequence;
+	frame->flipped = true;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a;
+	int64_t y = *(const int64_t *)b;
+	return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted values.
+static int64_t percentile(const int64_t *sorted, size_t count, unsigned int percent)
+{
+	if (!count)
+		return 0;
+	size_t rank = (count * percent + 99) / 100;
+	return sorted[rank ? rank - 1 : 0];
+}
+
+// Avoids pulling libm into every libbsdrm user for a single square root.
+static double sqrt_newton(double x)
+{
+	if (x <= 0.0)
+		return 0.0;
+	double root = x;
+	for (int i = 0; i < 64; i++) {
+		double next = (root + x / root) / 2.0;
+		if (next == root)
+			break;
+		root = next;
+	}
+	return root;
+}
+
+void bs_present_stats_summarize(struct bs_present_stats *self,
+				struct bs_present_stats_summary *summary)
+{
+	assert(self);
+	assert(summary);
+	memset(summary, 0, sizeof(*summary));
+
+	int64_t *latencies = calloc(self->frame_count + 1, sizeof(int64_t));
+	assert(latencies);
+	size_t latency_count = 0;
+
+	const struct present_frame *prev = NULL;
+	int64_t interval_sum = 0;
+	double interval_square_sum = 0.0;
+	for (size_t i = 0; i < self->frame_count; i++) {
+		const struct present_frame *frame = &self->frames[i];
+		if (!frame->flipped)
+			continue;
+		summary->frames++;
+		if (frame->submit_ns >= 0)
+			latencies[latency_count++] = frame->flip_ns - frame->submit_ns;
+
+		if (prev) {
+			int64_t interval = frame->flip_ns - prev->flip_ns;
+			interval_sum += interval;
+			interval_square_sum += (double)interval * interval;
+			summary->intervals++;
+			if (interval > summary->interval_max_ns)
+				summary->interval_max_ns = interval;
+
+			// Each vblank between two flips is one the frame should have made.
+			uint32_t vblanks = frame->sequence - prev->sequence;
+			if (vblanks > 1)
+				summary->missed_vblanks += vblanks - 1;
+		}
+		prev = frame;
+	}
+
+	if (summary->intervals) {
+		double mean = (double)interval_sum / summary->intervals;
+		double variance = interval_square_sum / summary->intervals - mean * mean;
+		summary->interval_mean_ns = (int64_t)mean;
+		summary->interval_jitter_ns = (int64_t)sqrt_newton(variance);
+	}
+
+	qsort(latencies, latency_count, sizeof(int64_t), compare_int64);
+	summary->latency_p50_ns = percentile(latencies, latency_count, 50);
+	summary->latency_p90_ns = percentile(latencies, latency_count, 90);
+	summary->latency_p99_ns = percentile(latencies, latency_count, 99);
+	summary->latency_max_ns = latency_count ? latencies[latency_count - 1] : 0;
+	free(latencies);
+}
+
+static double ns_to_ms(int64_t ns)
+{
+	return ns / 1000000.0;
+}
+
+void bs_present_stats_print(struct bs_present_stats *self, const char *name, FILE *out)
+{
+	assert(self);
+	assert(name);
+	assert(out);
+
+	struct bs_present_stats_summary s;
+	bs_present_stats_summarize(self, &s);
+	fprintf(out, "%s: %zu frames, %llu missed vblanks\n", name, s.frames,
+		(unsigned long long)s.missed_vblanks);
+	fprintf(out, "  frame interval: mean %.3f ms, jitter %.3f ms, max %.3f ms\n",
+		ns_to_ms(s.interval_mean_ns), ns_to_ms(s.interval_jitter_ns),
+		ns_to_ms(s.interval_max_ns));
+	fprintf(out, "  submit to scanout: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+		ns_to_ms(s.latency_p50_ns), ns_to_ms(s.latency_p90_ns), ns_to_ms(s.latency_p99_ns),
+		ns_to_ms(s.latency_max_ns));
+}
+
+void bs_present_stats_print_json(struct bs_present_stats *self, const char *name, FILE *out)
+{
+	assert(self);
+	assert(name);
+	assert(out);
+
+	struct bs_present_stats_summary s;
+	bs_present_stats_summarize(self, &s);
+	fprintf(out,
+		"{\"name\": \"%s\", \"frames\": %zu, \"missed_vblanks\": %llu, "
+		"\"interval_mean_ns\": %lld, \"interval_jitter_ns\": %lld, "
+		"\"interval_max_ns\": %lld, \"latency_p50_ns\": %lld, \"latency_p90_ns\": %lld, "
+		"\"latency_p99_ns\": %lld, \"latency_max_ns\": %lld}\n",
+		name, s.frames, (unsigned long long)s.missed_vblanks,
+		(long long)s.interval_mean_ns, (long long)s.interval_jitter_ns,
+		(long long)s.interval_max_ns, (long long)s.latency_p50_ns,
+		(long long)s.latency_p90_ns, (long long)s.latency_p99_ns,
+		(long long)s.latency_max_ns);
+}
@@ -0,0 +1,248 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "bs_drm.h"
+
+// One 16-byte vector holds 16 / cpp elements, and that many rows of them make one square block
+// that is transposed in registers. Blocks are visited a tile at a time, so the source rows a tile
+// reads stay in cache while its destination rows are written.
+#define VECTOR_BYTES 16
+#define TILE_SIZE 64
+typedef uint8_t byte_lanes __attribute__((vector_size(VECTOR_BYTES)));
+typedef uint16_t short_lanes __attribute__((vector_size(VECTOR_BYTES)));
+typedef uint32_t pixel_lanes __attribute__((vector_size(VECTOR_BYTES)));
+
+// Every rotation value reads the source as (a, b), optionally mirrored on either axis, where
+// (a, b) is the destination's (x, y), or (y, x) when transposed.
+struct rotate_walk {
+	bool transpose;
+	bool flip_x;
+	bool flip_y;
+};
+
+static bool rotate_walk_init(uint32_t rotation, struct rotate_walk *walk)
+{
+	memset(walk, 0, sizeof(*walk));
+	switch (rotation & DRM_MODE_ROTATE_MASK) {
+		case DRM_MODE_ROTATE_0:
+			break;
+		case DRM_MODE_ROTATE_90:
+			walk->transpose = true;
+			walk->flip_x = true;
+			break;
+		case DRM_MODE_ROTATE_180:
+			walk->flip_x = true;
+			walk->flip_y = true;
+			break;
+		case DRM_MODE_ROTATE_270:
+			walk->transpose = true;
+			walk->flip_y = true;
+			break;
+		default:
+			return false;
+	}
+
+	// The kernel mirrors the source before rotating it.
+	if (rotation & DRM_MODE_REFLECT_X)
+		walk->flip_x = !walk->flip_x;
+	if (rotation & DRM_MODE_REFLECT_Y)
+		walk->flip_y = !walk->flip_y;
+	return true;
+}
+
+// Picks elements of a and b by their index in the two vectors' concatenation. GCC takes the
+// indices as a vector and clang as constant arguments.
+#if defined(__clang__)
+#define SHUFFLE(a, b, ...) __builtin_shufflevector(a, b, __VA_ARGS__)
+#else
+#define SHUFFLE(a, b, ...) __builtin_shuffle(a, b, (__typeof__(a)){ __VA_ARGS__ })
+#endif
+
+// Each stage interleaves row i with row i + n / 2. After log2(n) stages, row i holds what was
+// column i.
+#define TRANSPOSE_STAGES(lanes_type, rows, n, lo, hi)                                       \
+	for (int stage = 1; stage < (n); stage *= 2) {                                      \
+		lanes_type interleaved[(n)];                                                \
+		for (int i = 0; i < (n) / 2; i++) {                                         \
+			interleaved[2 * i] = SHUFFLE(rows[i], rows[i + (n) / 2], lo);       \
+			interleaved[2 * i + 1] = SHUFFLE(rows[i], rows[i + (n) / 2], hi);   \
+		}                                                                           \
+		memcpy(rows, interleaved, sizeof(interleaved));                             \
+	}
+
+#define BYTES_LO 0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23
+#define BYTES_HI 8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31
+#define SHORTS_LO 0, 8, 1, 9, 2, 10, 3, 11
+#define SHORTS_HI 4, 12, 5, 13, 6, 14, 7, 15
+#define PIXELS_LO 0, 4, 1, 5
+#define PIXELS_HI 2, 6, 3, 7
+
+static void transpose_bytes(byte_lanes *rows)
+{
+	TRANSPOSE_STAGES(byte_lanes, rows, 16, BYTES_LO, BYTES_HI);
+}
+
+static void transpose_shorts(short_lanes *rows)
+{
+	TRANSPOSE_STAGES(short_lanes, rows, 8, SHORTS_LO, SHORTS_HI);
+}
+
+static void transpose_pixels(pixel_lanes *rows)
+{
+	TRANSPOSE_STAGES(pixel_lanes, rows, 4, PIXELS_LO, PIXELS_HI);
+}
+
+static void transpose_block(byte_lanes *rows, uint32_t cpp)
+{
+	switch (cpp) {
+		case 1:
+			transpose_bytes(rows);
+			break;
+		case 2:
+			transpose_shorts((short_lanes *)rows);
+			break;
+		default:
+			transpose_pixels((pixel_lanes *)rows);
+			break;
+	}
+}
+
+// Reverses the order of the vector's elements.
+static byte_lanes reverse_elements(byte_lanes v, uint32_t cpp)
+{
+	switch (cpp) {
+		case 1:
+			return SHUFFLE(v, v, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+		case 2: {
+			short_lanes shorts = (short_lanes)v;
+			return (byte_lanes)SHUFFLE(shorts, shorts, 7, 6, 5, 4, 3, 2, 1, 0);
+		}
+		default: {
+			pixel_lanes pixels = (pixel_lanes)v;
+			return (byte_lanes)SHUFFLE(pixels, pixels, 3, 2, 1, 0);
+		}
+	}
+}
+
+static const uint8_t *element(const void *base, uint32_t stride, uint32_t cpp, uint32_t x,
+			      uint32_t y)
+{
+	return (const uint8_t *)base + (size_t)y * stride + (size_t)x * cpp;
+}
+
+static uint32_t flip(uint32_t i, uint32_t size, bool flipped)
+{
+	return flipped ? size - 1 - i : i;
+}
+
+static void rotate_rows(const void *src, uint32_t src_stride, uint32_t width, uint32_t height,
+			uint32_t cpp, const struct rotate_walk *walk, void *dst,
+			uint32_t dst_stride)
+{
+	uint32_t n = VECTOR_BYTES / cpp;
+	for (uint32_t y = 0; y < height; y++) {
+		const uint8_t *src_row =
+		    element(src, src_stride, cpp, 0, flip(y, height, walk->flip_y));
+		uint8_t *dst_row = (uint8_t *)dst + (size_t)y * dst_stride;
+		if (!walk->flip_x) {
+			memcpy(dst_row, src_row, (size_t)width * cpp);
+			continue;
+		}
+
+		uint32_t x = 0;
+		for (; x + n <= width; x += n) {
+			byte_lanes v;
+			memcpy(&v, src_row + (size_t)(width - x - n) * cpp, sizeof(v));
+			v = reverse_elements(v, cpp);
+			memcpy(dst_row + (size_t)x * cpp, &v, sizeof(v));
+		}
+		for (; x < width; x++)
+			memcpy(dst_row + (size_t)x * cpp, src_row + (size_t)(width - 1 - x) * cpp,
+			       cpp);
+	}
+}
+
+// Writes the n x n destination block at (x, y), which is the transpose of the source block
+// starting at column flip(y + n - 1) or y, down the rows of destination columns x to x + n - 1.
+static void transpose_vector_block(const void *src, uint32_t src_stride, uint32_t width,
+				   uint32_t height, uint32_t cpp, const struct rotate_walk *walk,
+				   uint32_t x, uint32_t y, void *dst, uint32_t dst_stride)
+{
+	uint32_t n = VECTOR_BYTES / cpp;
+	uint32_t column = walk->flip_x ? width - y - n : y;
+	byte_lanes rows[VECTOR_BYTES];
+	for (uint32_t i = 0; i < n; i++) {
+		uint32_t row = flip(x + i, height, walk->flip_y);
+		memcpy(&rows[i], element(src, src_stride, cpp, column, row), sizeof(rows[i]));
+	}
+
+	transpose_block(rows, cpp);
+	for (uint32_t i = 0; i < n; i++)
+		memcpy((uint8_t *)element(dst, dst_stride, cpp, x, y + i),
+		       &rows[walk->flip_x ? n - 1 - i : i], sizeof(rows[i]));
+}
+
+static void rotate_columns(const void *src, uint32_t src_stride, uint32_t width, uint32_t height,
+			   uint32_t cpp, const struct rotate_walk *walk, void *dst,
+			   uint32_t dst_stride)
+{
+	// The destination is height elements wide and width rows tall.
+	uint32_t n = VECTOR_BYTES / cpp;
+	uint32_t vector_w = height - height % n;
+	uint32_t vector_h = width - width % n;
+	for (uint32_t tile_y = 0; tile_y < vector_h; tile_y += TILE_SIZE) {
+		uint32_t tile_y1 = tile_y + TILE_SIZE < vector_h ? tile_y + TILE_SIZE : vector_h;
+		for (uint32_t tile_x = 0; tile_x < vector_w; tile_x += TILE_SIZE) {
+			uint32_t tile_x1 =
+			    tile_x + TILE_SIZE < vector_w ? tile_x + TILE_SIZE : vector_w;
+			for (uint32_t y = tile_y; y < tile_y1; y += n) {
+				for (uint32_t x = tile_x; x < tile_x1; x += n)
+					transpose_vector_block(src, src_stride, width, height, cpp,
+							       walk, x, y, dst, dst_stride);
+			}
+		}
+	}
+
+	// The right and bottom edges that do not fill a block.
+	for (uint32_t y = 0; y < width; y++) {
+		uint32_t x = y < vector_h ? vector_w : 0;
+		for (; x < height; x++)
+			memcpy((uint8_t *)element(dst, dst_stride, cpp, x, y),
+			       element(src, src_stride, cpp, flip(y, width, walk->flip_x),
+				       flip(x, height, walk->flip_y)),
+			       cpp);
+	}
+}
+
+bool bs_rotate_plane(const void *src, uint32_t src_stride, uint32_t width, uint32_t height,
+		     uint32_t cpp, uint32_t rotation, void *dst, uint32_t dst_stride)
+{
+	assert(src);
+	assert(dst);
+	assert(src != dst);
+
+	struct rotate_walk walk;
+	if ((cpp != 1 && cpp != 2 && cpp != 4) || !rotate_walk_init(rotation, &walk)) {
+		bs_debug_error("unsupported rotation 0x%x of %u byte elements", rotation, cpp);
+		return false;
+	}
+
+	if (walk.transpose)
+		rotate_columns(src, src_stride, width, height, cpp, &walk, dst, dst_stride);
+	else
+		rotate_rows(src, src_stride, width, height, cpp, &walk, dst, dst_stride);
+	return true;
+}
+
+void bs_rotate_size(uint32_t rotation, uint32_t width, uint32_t height, uint32_t *rotated_width,
+		    uint32_t *rotated_height)
+{
+	assert(rotated_width);
+	assert(rotated_height);
+	bool transpose = rotation & (DRM_MODE_ROTATE_90 | DRM_MODE_ROTATE_270);
+	*rotated_width = transpose ? height : width;
+	*rotated_height = transpose ? width : height;
+}
@@ -0,0 +1,226 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "bs_drm.h"
+
+// Four pixels at a time, each split into its 0x00rr00bb and 0x00aa00gg halves so every channel
+// gets a 16-bit lane to be weighted in, as SSE2 and NEON both can.
+#define LANES 4
+typedef uint32_t pixel_lanes __attribute__((vector_size(LANES * sizeof(uint32_t))));
+typedef uint16_t channel_lanes __attribute__((vector_size(LANES * sizeof(uint32_t))));
+typedef uint8_t byte_lanes __attribute__((vector_size(LANES * sizeof(uint32_t))));
+
+// Where a destination column or row samples the source: between index and next, weight / 256 of
+// the way to next.
+struct scale_tap {
+	uint32_t index;
+	uint32_t next;
+	uint32_t weight;
+};
+
+static const uint32_t *image_row(const void *data, uint32_t stride, uint32_t y)
+{
+	return (const uint32_t *)((const uint8_t *)data + (size_t)y * stride);
+}
+
+// Maps the center of destination pixel i of count into the 16.16 source span, clamped to its edge
+// pixels.
+static void compute_tap(struct scale_tap *tap, uint32_t i, uint32_t count, uint32_t start,
+			uint32_t length, uint32_t limit, bool bilinear)
+{
+	uint32_t first = start >> 16;
+	uint32_t last = (uint32_t)(((uint64_t)start + length - 1) >> 16);
+	if (last >= limit)
+		last = limit - 1;
+	if (first > last)
+		first = last;
+
+	int64_t pos = start + ((2 * (uint64_t)i + 1) * length) / (2 * (uint64_t)count);
+	if (bilinear)
+		pos -= 0x8000;
+	if (pos < (int64_t)first << 16)
+		pos = (int64_t)first << 16;
+	if (pos > (int64_t)last << 16)
+		pos = (int64_t)last << 16;
+
+	tap->index = pos >> 16;
+	tap->next = tap->index < last ? tap->index + 1 : last;
+	tap->weight = bilinear ? (pos >> 8) & 0xff : 0;
+}
+
+// (x * inv + y * w) / 256 for every channel, rounded, where inv is 256 - w.
+static channel_lanes lerp_channels(channel_lanes x, channel_lanes y, channel_lanes w,
+				   channel_lanes inv)
+{
+	return (x * inv + y * w + 128) >> 8;
+}
+
+static pixel_lanes lerp_lanes(pixel_lanes a, pixel_lanes b, channel_lanes w)
+{
+	channel_lanes inv = 256 - w;
+	channel_lanes rb = lerp_channels((channel_lanes)(a & 0x00ff00ff),
+					 (channel_lanes)(b & 0x00ff00ff), w, inv);
+	channel_lanes ag = lerp_channels((channel_lanes)((a >> 8) & 0x00ff00ff),
+					 (channel_lanes)((b >> 8) & 0x00ff00ff), w, inv);
+	return (pixel_lanes)rb | (pixel_lanes)ag << 8;
+}
+
+static channel_lanes weight_lanes(uint32_t w0, uint32_t w1, uint32_t w2, uint32_t w3)
+{
+	pixel_lanes w = { w0, w1, w2, w3 };
+	return (channel_lanes)(w | w << 16);
+}
+
+// Blends two source rows into out over the columns [first, last].
+static void lerp_rows(const uint32_t *row0, const uint32_t *row1, uint32_t weight, uint32_t first,
+		      uint32_t last, uint32_t *out)
+{
+	if (!weight || row0 == row1) {
+		memcpy(&out[first], &row0[first], (last - first + 1) * sizeof(uint32_t));
+		return;
+	}
+
+	channel_lanes w = weight_lanes(weight, weight, weight, weight);
+	uint32_t x = first;
+	for (; x + LANES <= last + 1; x += LANES) {
+		pixel_lanes a, b;
+		memcpy(&a, &row0[x], sizeof(a));
+		memcpy(&b, &row1[x], sizeof(b));
+		pixel_lanes mixed = lerp_lanes(a, b, w);
+		memcpy(&out[x], &mixed, sizeof(mixed));
+	}
+	for (; x <= last; x++) {
+		pixel_lanes a = { row0[x] }, b = { row1[x] };
+		out[x] = lerp_lanes(a, b, w)[0];
+	}
+}
+
+static void lerp_columns(const uint32_t *row, const struct scale_tap *taps, uint32_t width,
+			 uint32_t *out)
+{
+	uint32_t x = 0;
+	for (; x + LANES <= width; x += LANES) {
+		const struct scale_tap *t = &taps[x];
+		pixel_lanes a = { row[t[0].index], row[t[1].index], row[t[2].index],
+				  row[t[3].index] };
+		pixel_lanes b = { row[t[0].next], row[t[1].next], row[t[2].next], row[t[3].next] };
+		channel_lanes w = weight_lanes(t[0].weight, t[1].weight, t[2].weight, t[3].weight);
+		pixel_lanes mixed = lerp_lanes(a, b, w);
+		memcpy(&out[x], &mixed, sizeof(mixed));
+	}
+	for (; x < width; x++) {
+		const struct scale_tap *t = &taps[x];
+		pixel_lanes a = { row[t->index] }, b = { row[t->next] };
+		out[x] = lerp_lanes(a, b, weight_lanes(t->weight, 0, 0, 0))[0];
+	}
+}
+
+void bs_scale(const struct bs_scale_source *src, enum bs_scale_filter filter, void *dst,
+	      uint32_t dst_stride, uint32_t dst_width, uint32_t dst_height)
+{
+	assert(src);
+	assert(src->data);
+	assert(src->width && src->height);
+	assert(dst);
+
+	if (!dst_width || !dst_height)
+		return;
+
+	bool bilinear = filter == BS_SCALE_BILINEAR;
+	struct scale_tap *columns = calloc(dst_width, sizeof(*columns));
+	assert(columns);
+	for (uint32_t x = 0; x < dst_width; x++)
+		compute_tap(&columns[x], x, dst_width, src->x, src->w, src->width, bilinear);
+
+	// Bilinear blends the two source rows first, over the columns the taps reach.
+	uint32_t first = columns[0].index;
+	uint32_t last = columns[dst_width - 1].next;
+	uint32_t *blended = bilinear ? calloc(last + 1, sizeof(uint32_t)) : NULL;
+	assert(!bilinear || blended);
+
+	for (uint32_t y = 0; y < dst_height; y++) {
+		struct scale_tap row;
+		compute_tap(&row, y, dst_height, src->y, src->h, src->height, bilinear);
+		const uint32_t *row0 = image_row(src->data, src->stride, row.index);
+		uint32_t *out = (uint32_t *)((uint8_t *)dst + (size_t)y * dst_stride);
+
+		if (!bilinear) {
+			for (uint32_t x = 0; x < dst_width; x++)
+				out[x] = row0[columns[x].index];
+			continue;
+		}
+
+		const uint32_t *row1 = image_row(src->data, src->stride, row.next);
+		lerp_rows(row0, row1, row.weight, first, last, blended);
+		lerp_columns(blended, columns, dst_width, out);
+	}
+
+	free(blended);
+	free(columns);
+}
+
+static void diff_pixel(uint32_t a, uint32_t b, uint32_t x, uint32_t y, uint8_t tolerance,
+		       struct bs_image_diff *diff)
+{
+	bool over = false;
+	for (int shift = 0; shift < 24; shift += 8) {
+		int d = (int)((a >> shift) & 0xff) - (int)((b >> shift) & 0xff);
+		uint8_t magnitude = d < 0 ? -d : d;
+		if (magnitude > diff->max_channel_diff)
+			diff->max_channel_diff = magnitude;
+		over |= magnitude > tolerance;
+	}
+
+	if (over && !diff->pixels++) {
+		diff->first_x = x;
+		diff->first_y = y;
+	}
+}
+
+bool bs_image_compare(const void *a, uint32_t a_stride, const void *b, uint32_t b_stride,
+		      uint32_t width, uint32_t height, uint8_t tolerance,
+		      struct bs_image_diff *diff)
+{
+	assert(a);
+	assert(b);
+	assert(diff);
+	memset(diff, 0, sizeof(*diff));
+
+	// The X byte of XRGB8888 is masked off, so it never differs.
+	const pixel_lanes rgb = { 0x00ffffff, 0x00ffffff, 0x00ffffff, 0x00ffffff };
+	byte_lanes max_diff = { 0 };
+	for (uint32_t y = 0; y < height; y++) {
+		const uint32_t *row_a = image_row(a, a_stride, y);
+		const uint32_t *row_b = image_row(b, b_stride, y);
+		uint32_t x = 0;
+		for (; x + LANES <= width; x += LANES) {
+			pixel_lanes pa, pb;
+			memcpy(&pa, &row_a[x], sizeof(pa));
+			memcpy(&pb, &row_b[x], sizeof(pb));
+			byte_lanes ba = (byte_lanes)(pa & rgb);
+			byte_lanes bb = (byte_lanes)(pb & rgb);
+			byte_lanes a_greater = (byte_lanes)(ba > bb);
+			byte_lanes d = ((ba - bb) & a_greater) | ((bb - ba) & ~a_greater);
+			byte_lanes d_greater = (byte_lanes)(d > max_diff);
+			max_diff = (d & d_greater) | (max_diff & ~d_greater);
+
+			// Only groups with a channel over the tolerance are checked pixel by pixel.
+			pixel_lanes over = (pixel_lanes)(d > tolerance);
+			if (over[0] | over[1] | over[2] | over[3]) {
+				for (uint32_t i = x; i < x + LANES; i++)
+					diff_pixel(row_a[i], row_b[i], i, y, tolerance, diff);
+			}
+		}
+		for (; x < width; x++)
+			diff_pixel(row_a[x], row_b[x], x, y, tolerance, diff);
+	}
+
+	for (int i = 0; i < LANES * 4; i++) {
+		if (max_diff[i] > diff->max_channel_diff)
+			diff->max_channel_diff = max_diff[i];
+	}
+	return !diff->pixels;
+}
@@ -0,0 +1,244 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <poll.h>
+
+#include "bs_drm.h"
+
+enum writeback_prop {
+	WRITEBACK_CRTC_ID,
+	WRITEBACK_FB_ID,
+	WRITEBACK_OUT_FENCE_PTR,
+	WRITEBACK_PIXEL_FORMATS,
+	WRITEBACK_PROP_COUNT,
+};
+
+static const char *const writeback_prop_names[WRITEBACK_PROP_COUNT] = {
+	"CRTC_ID",
+	"WRITEBACK_FB_ID",
+	"WRITEBACK_OUT_FENCE_PTR",
+	"WRITEBACK_PIXEL_FORMATS",
+};
+
+struct bs_writeback {
+	int fd;
+	uint32_t connector_id;
+	uint32_t possible_crtcs;
+	uint32_t prop_ids[WRITEBACK_PROP_COUNT];
+	uint32_t *formats;
+	size_t format_count;
+	// Where the kernel writes the fence of the queued capture.
+	int32_t out_fence;
+	bool queued;
+	struct bs_writeback_stats stats;
+};
+
+static uint32_t find_writeback_connector(int fd, uint32_t *possible_crtcs)
+{
+	drmModeRes *res = drmModeGetResources(fd);
+	if (!res)
+		return 0;
+
+	uint32_t connector_id = 0;
+	for (int i = 0; i < res->count_connectors && !connector_id; i++) {
+		drmModeConnector *connector = drmModeGetConnectorCurrent(fd, res->connectors[i]);
+		if (!connector)
+			continue;
+
+		if (connector->connector_type != DRM_MODE_CONNECTOR_WRITEBACK) {
+			drmModeFreeConnector(connector);
+			continue;
+		}
+
+		connector_id = connector->connector_id;
+		for (int j = 0; j < connector->count_encoders; j++) {
+			drmModeEncoder *encoder = drmModeGetEncoder(fd, connector->encoders[j]);
+			if (!encoder)
+				continue;
+			*possible_crtcs |= encoder->possible_crtcs;
+			drmModeFreeEncoder(encoder);
+		}
+		drmModeFreeConnector(connector);
+	}
+
+	drmModeFreeResources(res);
+	return connector_id;
+}
+
+static bool writeback_read_props(struct bs_writeback *self, uint64_t *formats_blob_id)
+{
+	drmModeObjectPropertiesPtr props =
+	    drmModeObjectGetProperties(self->fd, self->connector_id, DRM_MODE_OBJECT_CONNECTOR);
+	if (!props)
+		return false;
+
+	for (uint32_t i = 0; i < props->count_props; i++) {
+		drmModePropertyPtr prop = drmModeGetProperty(self->fd, props->props[i]);
+		if (!prop)
+			continue;
+		for (size_t j = 0; j < WRITEBACK_PROP_COUNT; j++) {
+			if (strcmp(prop->name, writeback_prop_names[j]))
+				continue;
+			self->prop_ids[j] = prop->prop_id;
+			if (j == WRITEBACK_PIXEL_FORMATS)
+				*formats_blob_id = props->prop_values[i];
+		}
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(props);
+
+	for (size_t j = 0; j < WRITEBACK_PROP_COUNT; j++) {
+		if (!self->prop_ids[j]) {
+			bs_debug_error("writeback connector %u has no %s property",
+				       self->connector_id, writeback_prop_names[j]);
+			return false;
+		}
+	}
+	return true;
+}
+
+struct bs_writeback *bs_writeback_new(int fd)
+{
+	assert(fd >= 0);
+
+	if (drmSetClientCap(fd, DRM_CLIENT_CAP_WRITEBACK_CONNECTORS, 1))
+		return NULL;
+
+	uint32_t possible_crtcs = 0;
+	uint32_t connector_id = find_writeback_connector(fd, &possible_crtcs);
+	if (!connector_id)
+		return NULL;
+
+	struct bs_writeback *self = calloc(1, sizeof(struct bs_writeback));
+	assert(self);
+	self->fd = fd;
+	self->connector_id = connector_id;
+	self->possible_crtcs = possible_crtcs;
+	self->out_fence = -1;
+
+	uint64_t formats_blob_id = 0;
+	if (!writeback_read_props(self, &formats_blob_id)) {
+		bs_writeback_destroy(&self);
+		return NULL;
+	}
+
+	drmModePropertyBlobPtr blob = drmModeGetPropertyBlob(fd, formats_blob_id);
+	if (blob && blob->length >= sizeof(uint32_t)) {
+		self->format_count = blob->length / sizeof(uint32_t);
+		self->formats = calloc(self->format_count, sizeof(uint32_t));
+		assert(self->formats);
+		memcpy(self->formats, blob->data, self->format_count * sizeof(uint32_t));
+	}
+	if (blob)
+		drmModeFreePropertyBlob(blob);
+	return self;
+}
+
+void bs_writeback_destroy(struct bs_writeback **self)
+{
+	assert(self);
+	assert(*self);
+	if ((*self)->out_fence >= 0)
+		close((*self)->out_fence);
+	free((*self)->formats);
+	free(*self);
+	*self = NULL;
+}
+
+uint32_t bs_writeback_connector_id(struct bs_writeback *self)
+{
+	assert(self);
+	return self->connector_id;
+}
+
+uint32_t bs_writeback_possible_crtcs(struct bs_writeback *self)
+{
+	assert(self);
+	return self->possible_crtcs;
+}
+
+bool bs_writeback_supports_format(struct bs_writeback *self, uint32_t format)
+{
+	assert(self);
+	for (size_t i = 0; i < self->format_count; i++) {
+		if (self->formats[i] == format)
+			return true;
+	}
+	return false;
+}
+
+int bs_writeback_attach(struct bs_writeback *self, struct bs_commit_log *log,
+			drmModeAtomicReqPtr req, uint32_t crtc_id)
+{
+	assert(self);
+	assert(req);
+	return bs_commit_log_add_property(log, req, self->connector_id,
+					  self->prop_ids[WRITEBACK_CRTC_ID], crtc_id);
+}
+
+int bs_writeback_queue(struct bs_writeback *self, struct bs_commit_log *log,
+		       drmModeAtomicReqPtr req, uint32_t fb_id)
+{
+	assert(self);
+	assert(req);
+	assert(fb_id);
+
+	// A capture that was never waited for is dropped.
+	if (self->out_fence >= 0)
+		close(self->out_fence);
+	self->out_fence = -1;
+
+	int ret = bs_commit_log_add_property(log, req, self->connector_id,
+					     self->prop_ids[WRITEBACK_FB_ID], fb_id);
+	if (ret < 0)
+		return ret;
+	ret = bs_commit_log_add_property(log, req, self->connector_id,
+					 self->prop_ids[WRITEBACK_OUT_FENCE_PTR],
+					 (uint64_t)(uintptr_t)&self->out_fence);
+	if (ret < 0)
+		return ret;
+
+	self->queued = true;
+	return 0;
+}
+
+int bs_writeback_wait(struct bs_writeback *self, int timeout_ms)
+{
+	assert(self);
+	bool queued = self->queued;
+	self->queued = false;
+	if (!queued || self->out_fence < 0)
+		return -ENOENT;
+
+	int64_t start_ns = bs_debug_gettime_ns();
+	struct pollfd pfd = { .fd = self->out_fence, .events = POLLIN };
+	int ret;
+	do {
+		ret = poll(&pfd, 1, timeout_ms);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		ret = -errno;
+	self->stats.wait_ns += bs_debug_gettime_ns() - start_ns;
+
+	close(self->out_fence);
+	self->out_fence = -1;
+	if (ret < 0)
+		return ret;
+	if (!ret) {
+		self->stats.timeouts++;
+		return -ETIMEDOUT;
+	}
+
+	self->stats.captures++;
+	return 0;
+}
+
+void bs_writeback_get_stats(struct bs_writeback *self, struct bs_writeback_stats *stats)
+{
+	assert(self);
+	assert(stats);
+	*stats = self->stats;
+}
@@ -0,0 +1,723 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "fakekms.h"
+
+// Commits made by the fake itself, like disabling planes for RMFB, neither wait nor fail with
+// EBUSY.
+#define FAKE_COMMIT_INTERNAL (1u << 31)
+
+struct fake_change {
+	size_t value_index;
+	uint64_t value;
+};
+
+// A state is a list of property changes on top of whatever the card state is when it gets
+// committed. Keeping the changes separate lets a commit that had to wait for fences or a pending
+// flip re-apply them to the state other threads left behind.
+struct fake_state {
+	struct fake_card *card;
+	struct fake_file *file;
+	size_t change_count;
+	size_t change_capacity;
+	struct fake_change *changes;
+
+	// Built by state_prepare().
+	uint64_t *values;
+	uint32_t crtc_mask;
+	uint32_t modeset_mask;
+};
+
+struct fake_state *fake_state_new(struct fake_card *card, struct fake_file *file)
+{
+	struct fake_state *state = calloc(1, sizeof(struct fake_state));
+	assert(state);
+	state->card = card;
+	state->file = file;
+	state->values = malloc(card->value_count * sizeof(state->values[0]));
+	assert(state->values);
+	return state;
+}
+
+void fake_state_destroy(struct fake_state **state)
+{
+	assert(state);
+	assert(*state);
+	free((*state)->changes);
+	free((*state)->values);
+	free(*state);
+	*state = NULL;
+}
+
+static void state_change(struct fake_state *state, size_t value_index, uint64_t value)
+{
+	if (state->change_count == state->change_capacity) {
+		state->change_capacity = state->change_capacity ? state->change_capacity * 2 : 32;
+		state->changes =
+		    realloc(state->changes, state->change_capacity * sizeof(state->changes[0]));
+		assert(state->changes);
+	}
+	state->changes[state->change_count].value_index = value_index;
+	state->changes[state->change_count].value = value;
+	state->change_count++;
+}
+
+static bool enum_has_value(const struct fake_property *prop, uint64_t value)
+{
+	for (size_t i = 0; i < prop->enum_count; i++)
+		if (prop->enums[i].value == value)
+			return true;
+	return false;
+}
+
+static int prop_value_check(struct fake_card *card, const struct fake_property *prop,
+			    uint64_t value)
+{
+	uint32_t extended = prop->flags & DRM_MODE_PROP_EXTENDED_TYPE;
+	if (extended == DRM_MODE_PROP_SIGNED_RANGE) {
+		if ((int64_t)value < (int64_t)prop->values[0] ||
+		    (int64_t)value > (int64_t)prop->values[1])
+			return -EINVAL;
+	} else if (extended == DRM_MODE_PROP_OBJECT) {
+		if (value && !fake_card_object(card, value, prop->values[0]))
+			return -EINVAL;
+	} else if (prop->flags & DRM_MODE_PROP_RANGE) {
+		if (value < prop->values[0] || value > prop->values[1])
+			return -EINVAL;
+	} else if (prop->flags & DRM_MODE_PROP_ENUM) {
+		if (!enum_has_value(prop, value))
+			return -EINVAL;
+	} else if (prop->flags & DRM_MODE_PROP_BITMASK) {
+		uint64_t mask = 0;
+		for (size_t i = 0; i < prop->enum_count; i++)
+			mask |= 1ull << prop->enums[i].value;
+		if (value & ~mask)
+			return -EINVAL;
+	} else if (prop->flags & DRM_MODE_PROP_BLOB) {
+		if (value && !fake_card_blob(card, value))
+			return -EINVAL;
+	}
+	return 0;
+}
+
+int fake_state_set(struct fake_state *state, uint32_t object_id, uint32_t prop_id, uint64_t value)
+{
+	struct fake_card *card = state->card;
+	struct fake_object *object = fake_card_object(card, object_id, DRM_MODE_OBJECT_ANY);
+	if (!object || (state->file && !fake_card_object_visible(state->file, object))) {
+		fake_debug("object %u doesn't exist", object_id);
+		return -ENOENT;
+	}
+
+	struct fake_property *prop = fake_card_property(card, prop_id);
+	if (!prop) {
+		fake_debug("property %u doesn't exist", prop_id);
+		return -ENOENT;
+	}
+
+	struct fake_property **props;
+	size_t value_offset;
+	size_t prop_count = fake_card_object_props(card, object, &props, &value_offset);
+	size_t prop_index;
+	for (prop_index = 0; prop_index < prop_count; prop_index++)
+		if (props[prop_index] == prop)
+			break;
+
+	if (prop_index == prop_count || !fake_card_object_has_prop(object, prop_index)) {
+		fake_debug("object %u has no property %s", object_id, prop->name);
+		return -EINVAL;
+	}
+
+	if (prop->flags & DRM_MODE_PROP_IMMUTABLE) {
+		fake_debug("property %s of object %u is immutable", prop->name, object_id);
+		return -EINVAL;
+	}
+
+	int ret = prop_value_check(card, prop, value);
+	if (ret) {
+		fake_debug("value %llu is invalid for property %s of object %u",
+			   (unsigned long long)value, prop->name, object_id);
+		return ret;
+	}
+
+	state_change(state, value_offset + prop_index, value);
+	return 0;
+}
+
+void fake_state_set_crtc(struct fake_state *state, struct fake_crtc *crtc, enum fake_crtc_prop prop,
+			 uint64_t value)
+{
+	state_change(state, crtc->value_offset + prop, value);
+}
+
+void fake_state_set_plane(struct fake_state *state, struct fake_plane *plane,
+			  enum fake_plane_prop prop, uint64_t value)
+{
+	state_change(state, plane->value_offset + prop, value);
+}
+
+void fake_state_set_connector(struct fake_state *state, struct fake_connector *connector,
+			      enum fake_connector_prop prop, uint64_t value)
+{
+	state_change(state, connector->value_offset + prop, value);
+}
+
+uint64_t fake_card_value(struct fake_card *card, size_t value_offset, size_t prop)
+{
+	return card->values[value_offset + prop];
+}
+
+static const struct drm_mode_modeinfo *mode_blob(struct fake_card *card, uint64_t blob_id)
+{
+	struct fake_blob *blob = blob_id ? fake_card_blob(card, blob_id) : NULL;
+	if (!blob || blob->length != sizeof(struct drm_mode_modeinfo))
+		return NULL;
+	return blob->data;
+}
+
+const struct drm_mode_modeinfo *fake_card_crtc_mode(struct fake_card *card, struct fake_crtc *crtc)
+{
+	return mode_blob(card, fake_card_value(card, crtc->value_offset, FAKE_CRTC_MODE_ID));
+}
+
+static void state_touch_crtc(struct fake_state *state, uint64_t crtc_id)
+{
+	struct fake_crtc *crtc = crtc_id ? fake_card_crtc(state->card, crtc_id) : NULL;
+	if (crtc)
+		state->crtc_mask |= 1u << crtc->index;
+}
+
+// Applies the changes to the current card state and works out which CRTCs they affect. Changes
+// to a plane or connector affect both the CRTC it was on and the one it ends up on.
+static void state_prepare(struct fake_state *state)
+{
+	struct fake_card *card = state->card;
+	memcpy(state->values, card->values, card->value_count * sizeof(state->values[0]));
+	for (size_t i = 0; i < state->change_count; i++)
+		state->values[state->changes[i].value_index] = state->changes[i].value;
+
+	state->crtc_mask = 0;
+	state->modeset_mask = 0;
+	for (size_t i = 0; i < state->change_count; i++) {
+		size_t index = state->changes[i].value_index;
+		for (size_t c = 0; c < card->crtc_count; c++) {
+			size_t offset = card->crtcs[c].value_offset;
+			if (index >= offset && index < offset + FAKE_CRTC_PROP_COUNT)
+				state->crtc_mask |= 1u << c;
+		}
+		for (size_t p = 0; p < card->plane_count; p++) {
+			size_t offset = card->planes[p].value_offset;
+			if (index < offset || index >= offset + FAKE_PLANE_PROP_COUNT)
+				continue;
+			state_touch_crtc(state, card->values[offset + FAKE_PLANE_CRTC_ID]);
+			state_touch_crtc(state, state->values[offset + FAKE_PLANE_CRTC_ID]);
+		}
+		for (size_t n = 0; n < card->connector_count; n++) {
+			size_t offset = card->connectors[n].value_offset;
+			if (index < offset || index >= offset + FAKE_CONNECTOR_PROP_COUNT)
+				continue;
+			state_touch_crtc(state, card->values[offset + FAKE_CONNECTOR_CRTC_ID]);
+			state_touch_crtc(state, state->values[offset + FAKE_CONNECTOR_CRTC_ID]);
+		}
+	}
+}
+
+static uint64_t plane_bytes_per_frame(const struct fake_format *format, uint32_t width,
+				      uint32_t height)
+{
+	uint64_t bytes = 0;
+	for (size_t p = 0; p < format->plane_count; p++)
+		bytes += (uint64_t)fake_format_plane_width(format, p, width) *
+			 fake_format_plane_height(format, p, height) * format->cpp[p];
+	return bytes;
+}
+
+// A capture needs an active CRTC and a framebuffer of a format the connector writes, the size of
+// the mode.
+static int check_writeback(struct fake_state *state, struct fake_connector *connector)
+{
+	struct fake_card *card = state->card;
+	const uint64_t *values = state->values + connector->value_offset;
+	struct fake_fb *fb = fake_card_fb(card, values[FAKE_CONNECTOR_WRITEBACK_FB_ID]);
+	if (!fb) {
+		if (!values[FAKE_CONNECTOR_WRITEBACK_OUT_FENCE_PTR])
+			return 0;
+		fake_debug("writeback connector %u has an out fence but no framebuffer",
+			   connector->base.id);
+		return -EINVAL;
+	}
+
+	struct fake_crtc *crtc = fake_card_crtc(card, values[FAKE_CONNECTOR_CRTC_ID]);
+	if (!crtc || !state->values[crtc->value_offset + FAKE_CRTC_ACTIVE]) {
+		fake_debug("writeback connector %u captures without an active CRTC",
+			   connector->base.id);
+		return -EINVAL;
+	}
+
+	bool has_format = false;
+	for (size_t i = 0; i < connector->format_count; i++)
+		has_format |= connector->formats[i] == fb->format;
+	if (!has_format || fb->modifier != DRM_FORMAT_MOD_LINEAR) {
+		fake_debug("writeback connector %u can't write the format of framebuffer %u",
+			   connector->base.id, fb->base.id);
+		return -EINVAL;
+	}
+
+	const struct drm_mode_modeinfo *mode =
+	    mode_blob(card, state->values[crtc->value_offset + FAKE_CRTC_MODE_ID]);
+	if (!mode || fb->width != mode->hdisplay || fb->height != mode->vdisplay) {
+		fake_debug("framebuffer %u isn't the size of the mode of CRTC %u", fb->base.id,
+			   crtc->base.id);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int check_connectors(struct fake_state *state, uint32_t *connector_counts)
+{
+	struct fake_card *card = state->card;
+	for (size_t i = 0; i < card->connector_count; i++) {
+		struct fake_connector *connector = &card->connectors[i];
+		uint64_t old_crtc_id =
+		    fake_card_value(card, connector->value_offset, FAKE_CONNECTOR_CRTC_ID);
+		uint64_t crtc_id = state->values[connector->value_offset + FAKE_CONNECTOR_CRTC_ID];
+
+		if (old_crtc_id != crtc_id) {
+			struct fake_crtc *old_crtc = fake_card_crtc(card, old_crtc_id);
+			if (old_crtc)
+				state->modeset_mask |= 1u << old_crtc->index;
+		}
+
+		if (connector->writeback) {
+			int ret = check_writeback(state, connector);
+			if (ret)
+				return ret;
+		}
+
+		if (!crtc_id)
+			continue;
+
+		// Another thread may have removed objects since the changes were validated.
+		struct fake_crtc *crtc = fake_card_crtc(card, crtc_id);
+		if (!crtc)
+			return -EINVAL;
+
+		if (!(connector->encoder->possible_crtcs & (1u << crtc->index))) {
+			fake_debug("connector %u can't be driven by CRTC %u", connector->base.id,
+				   crtc->base.id);
+			return -EINVAL;
+		}
+
+		connector_counts[crtc->index]++;
+		if (old_crtc_id != crtc_id)
+			state->modeset_mask |= 1u << crtc->index;
+	}
+	return 0;
+}
+
+static int check_crtcs(struct fake_state *state, const uint32_t *connector_counts)
+{
+	struct fake_card *card = state->card;
+	for (size_t i = 0; i < card->crtc_count; i++) {
+		struct fake_crtc *crtc = &card->crtcs[i];
+		const uint64_t *values = state->values + crtc->value_offset;
+		uint64_t mode_id = values[FAKE_CRTC_MODE_ID];
+		const struct drm_mode_modeinfo *mode = mode_blob(card, mode_id);
+		if (mode_id && (!mode || !mode->hdisplay || !mode->vdisplay || !mode->clock ||
+				!mode->htotal || !mode->vtotal)) {
+			fake_debug("MODE_ID %llu of CRTC %u is not a valid mode",
+				   (unsigned long long)mode_id, crtc->base.id);
+			return -EINVAL;
+		}
+
+		if (values[FAKE_CRTC_ACTIVE] && !mode) {
+			fake_debug("CRTC %u is active without a mode", crtc->base.id);
+			return -EINVAL;
+		}
+
+		if (!!mode != (connector_counts[i] > 0)) {
+			fake_debug("CRTC %u has %s mode but %u connectors", crtc->base.id,
+				   mode ? "a" : "no", connector_counts[i]);
+			return -EINVAL;
+		}
+
+		struct fake_blob *ctm = fake_card_blob(card, values[FAKE_CRTC_CTM]);
+		if (ctm && ctm->length != sizeof(struct drm_color_ctm)) {
+			fake_debug("CTM of CRTC %u has size %u", crtc->base.id, ctm->length);
+			return -EINVAL;
+		}
+
+		struct fake_blob *gamma = fake_card_blob(card, values[FAKE_CRTC_GAMMA_LUT]);
+		if (gamma && gamma->length != crtc->gamma_size * sizeof(struct drm_color_lut)) {
+			fake_debug("GAMMA_LUT of CRTC %u has size %u", crtc->base.id,
+				   gamma->length);
+			return -EINVAL;
+		}
+
+		const uint64_t *old_values = card->values + crtc->value_offset;
+		const struct drm_mode_modeinfo *old_mode =
+		    mode_blob(card, old_values[FAKE_CRTC_MODE_ID]);
+		if (old_values[FAKE_CRTC_ACTIVE] != values[FAKE_CRTC_ACTIVE] ||
+		    !old_mode != !mode || (mode && memcmp(old_mode, mode, sizeof(*mode))))
+			state->modeset_mask |= 1u << i;
+	}
+	return 0;
+}
+
+static int check_planes(struct fake_state *state, uint64_t *bandwidth)
+{
+	struct fake_card *card = state->card;
+	const struct fake_config *config = card->config;
+	uint32_t plane_counts[FAKE_MAX_CRTCS] = { 0 };
+
+	for (size_t i = 0; i < card->plane_count; i++) {
+		struct fake_plane *plane = &card->planes[i];
+		const uint64_t *values = state->values + plane->value_offset;
+		uint64_t fb_id = values[FAKE_PLANE_FB_ID];
+		uint64_t crtc_id = values[FAKE_PLANE_CRTC_ID];
+		if (!fb_id != !crtc_id) {
+			fake_debug("plane %u needs both FB_ID and CRTC_ID or neither",
+				   plane->base.id);
+			return -EINVAL;
+		}
+
+		if (!fb_id)
+			continue;
+
+		struct fake_crtc *crtc = fake_card_crtc(card, crtc_id);
+		struct fake_fb *fb = fake_card_fb(card, fb_id);
+		if (!crtc || !fb)
+			return -EINVAL;
+
+		if (!(plane->possible_crtcs & (1u << crtc->index))) {
+			fake_debug("plane %u can't be used on CRTC %u", plane->base.id,
+				   crtc->base.id);
+			return -EINVAL;
+		}
+
+		if (!state->values[crtc->value_offset + FAKE_CRTC_ACTIVE]) {
+			fake_debug("plane %u is on inactive CRTC %u", plane->base.id,
+				   crtc->base.id);
+			return -EINVAL;
+		}
+
+		if (!fake_card_plane_has_format(plane, fb->format) ||
+		    fb->modifier != DRM_FORMAT_MOD_LINEAR) {
+			fake_debug("plane %u doesn't support the format of framebuffer %u",
+				   plane->base.id, fb->base.id);
+			return -EINVAL;
+		}
+
+		uint64_t fb_width = (uint64_t)fb->width << 16;
+		uint64_t fb_height = (uint64_t)fb->height << 16;
+		if (values[FAKE_PLANE_SRC_W] > fb_width ||
+		    values[FAKE_PLANE_SRC_X] > fb_width - values[FAKE_PLANE_SRC_W] ||
+		    values[FAKE_PLANE_SRC_H] > fb_height ||
+		    values[FAKE_PLANE_SRC_Y] > fb_height - values[FAKE_PLANE_SRC_H]) {
+			fake_debug("source rectangle of plane %u is outside framebuffer %u",
+				   plane->base.id, fb->base.id);
+			return -ENOSPC;
+		}
+
+		uint64_t rotation = values[FAKE_PLANE_ROTATION] & 0xf;
+		if (!rotation || (rotation & (rotation - 1))) {
+			fake_debug("plane %u needs exactly one rotation", plane->base.id);
+			return -EINVAL;
+		}
+
+		uint32_t crtc_w = values[FAKE_PLANE_CRTC_W];
+		uint32_t crtc_h = values[FAKE_PLANE_CRTC_H];
+		if (!crtc_w || !crtc_h)
+			continue;
+
+		bool scaled = values[FAKE_PLANE_SRC_W] != (uint64_t)crtc_w << 16 ||
+			      values[FAKE_PLANE_SRC_H] != (uint64_t)crtc_h << 16;
+		if (scaled && (plane->type != DRM_PLANE_TYPE_OVERLAY || !config->overlay_scaling)) {
+			fake_debug("plane %u can't scale", plane->base.id);
+			return -ERANGE;
+		}
+
+		if (plane->type == DRM_PLANE_TYPE_CURSOR &&
+		    (crtc_w > config->cursor_size || crtc_h > config->cursor_size)) {
+			fake_debug("cursor plane %u is larger than %ux%u", plane->base.id,
+				   config->cursor_size, config->cursor_size);
+			return -EINVAL;
+		}
+
+		uint32_t plane_count = ++plane_counts[crtc->index];
+		if (config->planes_per_crtc && plane_count > config->planes_per_crtc) {
+			fake_debug("CRTC %u can't scan out more than %u planes", crtc->base.id,
+				   config->planes_per_crtc);
+			return -ENOSPC;
+		}
+
+		const struct drm_mode_modeinfo *mode =
+		    mode_blob(card, state->values[crtc->value_offset + FAKE_CRTC_MODE_ID]);
+		*bandwidth += plane_bytes_per_frame(fake_format_find(fb->format), crtc_w, crtc_h) *
+			      mode->vrefresh;
+	}
+	return 0;
+}
+
+static int state_check(struct fake_state *state, uint32_t flags)
+{
+	struct fake_card *card = state->card;
+	uint32_t connector_counts[FAKE_MAX_CRTCS] = { 0 };
+	int ret = check_connectors(state, connector_counts);
+	if (ret)
+		return ret;
+
+	ret = check_crtcs(state, connector_counts);
+	if (ret)
+		return ret;
+
+	if (state->modeset_mask && !(flags & DRM_MODE_ATOMIC_ALLOW_MODESET)) {
+		fake_debug("commit needs a modeset but DRM_MODE_ATOMIC_ALLOW_MODESET is not set");
+		return -EINVAL;
+	}
+
+	uint64_t bandwidth = 0;
+	ret = check_planes(state, &bandwidth);
+	if (ret)
+		return ret;
+
+	if (card->config->bandwidth && bandwidth > card->config->bandwidth) {
+		fake_debug("commit needs %llu bytes per second, the limit is %llu",
+			   (unsigned long long)bandwidth,
+			   (unsigned long long)card->config->bandwidth);
+		return -ENOSPC;
+	}
+
+	for (size_t i = 0; i < card->crtc_count; i++) {
+		struct fake_crtc *crtc = &card->crtcs[i];
+		if (!(state->crtc_mask & (1u << i)))
+			continue;
+
+		if ((flags & DRM_MODE_PAGE_FLIP_EVENT) &&
+		    !state->values[crtc->value_offset + FAKE_CRTC_ACTIVE]) {
+			fake_debug("flip event requested for inactive CRTC %u", crtc->base.id);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+// Returns the latest pending flip of the CRTCs in the state, or 0 if none are pending.
+static uint64_t state_pending_flip(struct fake_state *state, uint64_t now)
+{
+	uint64_t pending = 0;
+	for (size_t i = 0; i < state->card->crtc_count; i++) {
+		struct fake_crtc *crtc = &state->card->crtcs[i];
+		if ((state->crtc_mask & (1u << i)) && crtc->flip_pending_ns > now &&
+		    crtc->flip_pending_ns > pending)
+			pending = crtc->flip_pending_ns;
+	}
+	return pending;
+}
+
+// Waits for every IN_FENCE_FD in the state without holding the lock. Returns true if it had to
+// wait, in which case the state has to be prepared again.
+static bool state_wait_fences(struct fake_state *state)
+{
+	struct fake_card *card = state->card;
+	bool waited = false;
+	for (size_t i = 0; i < card->plane_count; i++) {
+		size_t offset = card->planes[i].value_offset + FAKE_PLANE_IN_FENCE_FD;
+		int fence = (int)state->values[offset];
+		if (fence < 0)
+			continue;
+
+		struct pollfd pfd = { .fd = fence, .events = POLLIN };
+		if (poll(&pfd, 1, 0) == 1)
+			continue;
+
+		pthread_mutex_unlock(&fake_kms.lock);
+		while (poll(&pfd, 1, -1) < 0 && errno == EINTR)
+			;
+		pthread_mutex_lock(&fake_kms.lock);
+		waited = true;
+	}
+	return waited;
+}
+
+static void state_swap(struct fake_state *state)
+{
+	struct fake_card *card = state->card;
+	for (size_t i = 0; i < card->value_count; i++) {
+		uint64_t old_value = card->values[i];
+		uint64_t value = state->values[i];
+		if (old_value == value)
+			continue;
+
+		if (card->value_kinds[i] == FAKE_VALUE_BLOB) {
+			if (value)
+				fake_card_blob(card, value)->refcount++;
+			if (old_value)
+				fake_card_blob_unref(card, fake_card_blob(card, old_value));
+		} else if (card->value_kinds[i] == FAKE_VALUE_FB) {
+			if (value)
+				fake_card_fb(card, value)->refcount++;
+			if (old_value)
+				fake_card_fb_unref(card, fake_card_fb(card, old_value));
+		}
+	}
+
+	uint64_t *values = card->values;
+	card->values = state->values;
+	state->values = values;
+}
+
+int fake_state_commit(struct fake_state *state, uint32_t flags, uint64_t user_data)
+{
+	struct fake_card *card = state->card;
+	bool internal = flags & FAKE_COMMIT_INTERNAL;
+	bool test_only = flags & DRM_MODE_ATOMIC_TEST_ONLY;
+	if (test_only && (flags & DRM_MODE_PAGE_FLIP_EVENT)) {
+		fake_debug("DRM_MODE_ATOMIC_TEST_ONLY can't be combined with an event");
+		return -EINVAL;
+	}
+
+	uint64_t now;
+	for (;;) {
+		state_prepare(state);
+		int ret = state_check(state, flags);
+		if (ret || test_only)
+			return ret;
+
+		now = fake_event_now();
+		uint64_t pending = internal ? 0 : state_pending_flip(state, now);
+		if (pending && (flags & DRM_MODE_ATOMIC_NONBLOCK)) {
+			fake_debug("a flip is still pending on a CRTC in this commit");
+			return -EBUSY;
+		}
+
+		if (pending)
+			fake_event_sleep_until(pending);
+		else if (internal || !state_wait_fences(state))
+			break;
+	}
+
+	// Pointers to the out fences are taken before the swap resets them.
+	int32_t *out_fences[FAKE_MAX_CRTCS] = { NULL };
+	for (size_t i = 0; i < card->crtc_count; i++) {
+		uint64_t *values = state->values + card->crtcs[i].value_offset;
+		out_fences[i] = (int32_t *)(uintptr_t)values[FAKE_CRTC_OUT_FENCE_PTR];
+		values[FAKE_CRTC_OUT_FENCE_PTR] = 0;
+	}
+	for (size_t i = 0; i < card->plane_count; i++)
+		state->values[card->planes[i].value_offset + FAKE_PLANE_IN_FENCE_FD] = (uint64_t)-1;
+
+	// So is the writeback job, which only applies to this commit. Its framebuffer stays alive
+	// until the capture since the lock is held throughout.
+	struct fake_fb *capture = NULL;
+	struct fake_crtc *capture_crtc = NULL;
+	int32_t *capture_fence = NULL;
+	if (card->writeback) {
+		uint64_t *values = state->values + card->writeback->value_offset;
+		capture = fake_card_fb(card, values[FAKE_CONNECTOR_WRITEBACK_FB_ID]);
+		capture_crtc = fake_card_crtc(card, values[FAKE_CONNECTOR_CRTC_ID]);
+		capture_fence =
+		    (int32_t *)(uintptr_t)values[FAKE_CONNECTOR_WRITEBACK_OUT_FENCE_PTR];
+		values[FAKE_CONNECTOR_WRITEBACK_FB_ID] = 0;
+		values[FAKE_CONNECTOR_WRITEBACK_OUT_FENCE_PTR] = 0;
+	}
+
+	// CRCs of the vblanks that already passed are of the old state.
+	fake_debugfs_crc_flush(card, now);
+	state_swap(state);
+
+	uint64_t last_flip = now;
+	for (size_t i = 0; i < card->crtc_count; i++) {
+		struct fake_crtc *crtc = &card->crtcs[i];
+		bool active = fake_card_value(card, crtc->value_offset, FAKE_CRTC_ACTIVE);
+		if (state->modeset_mask & (1u << i)) {
+			const struct drm_mode_modeinfo *mode = fake_card_crtc_mode(card, crtc);
+			crtc->epoch_ns = now;
+			crtc->period_ns =
+			    active ? (uint64_t)mode->htotal * mode->vtotal * 1000000 / mode->clock
+				   : 0;
+			crtc->flip_pending_ns = 0;
+		}
+
+		if (!(state->crtc_mask & (1u << i)))
+			continue;
+
+		uint32_t sequence = 0;
+		uint64_t flip = now;
+		if (active) {
+			flip = fake_event_next_vblank(crtc, now, &sequence);
+			crtc->flip_pending_ns = flip;
+		}
+
+		if (flip > last_flip)
+			last_flip = flip;
+		if (out_fences[i])
+			*out_fences[i] = fake_event_fence_new(flip);
+		// The new frame is captured as it is composed, by the time it flips.
+		if (capture && capture_crtc == crtc) {
+			fake_writeback_capture(card, crtc, capture);
+			if (capture_fence)
+				*capture_fence = fake_event_fence_new(flip);
+		}
+		if ((flags & DRM_MODE_PAGE_FLIP_EVENT) && state->file)
+			fake_event_queue(state->file, DRM_EVENT_FLIP_COMPLETE, flip, sequence,
+					 crtc->base.id, user_data);
+	}
+
+	// Blocking commits return once the new state is on screen.
+	if (!internal && !(flags & DRM_MODE_ATOMIC_NONBLOCK)) {
+		fake_event_sleep_until(last_flip);
+		fake_event_dispatch();
+	}
+
+	return 0;
+}
+
+// Disables every plane that scans out fb. Like the kernel, removing the framebuffer of a primary
+// plane turns off its CRTC as well.
+int fake_atomic_remove_fb(struct fake_card *card, struct fake_fb *fb)
+{
+	struct fake_state *state = fake_state_new(card, NULL);
+	for (size_t i = 0; i < card->plane_count; i++) {
+		struct fake_plane *plane = &card->planes[i];
+		if (fake_card_value(card, plane->value_offset, FAKE_PLANE_FB_ID) != fb->base.id)
+			continue;
+
+		struct fake_crtc *crtc = fake_card_crtc(
+		    card, fake_card_value(card, plane->value_offset, FAKE_PLANE_CRTC_ID));
+		fake_state_set_plane(state, plane, FAKE_PLANE_FB_ID, 0);
+		fake_state_set_plane(state, plane, FAKE_PLANE_CRTC_ID, 0);
+		if (plane->type != DRM_PLANE_TYPE_PRIMARY || !crtc)
+			continue;
+
+		fake_state_set_crtc(state, crtc, FAKE_CRTC_ACTIVE, 0);
+		fake_state_set_crtc(state, crtc, FAKE_CRTC_MODE_ID, 0);
+		for (size_t p = 0; p < card->plane_count; p++) {
+			struct fake_plane *other = &card->planes[p];
+			if (fake_card_value(card, other->value_offset, FAKE_PLANE_CRTC_ID) !=
+			    crtc->base.id)
+				continue;
+			fake_state_set_plane(state, other, FAKE_PLANE_FB_ID, 0);
+			fake_state_set_plane(state, other, FAKE_PLANE_CRTC_ID, 0);
+		}
+		for (size_t n = 0; n < card->connector_count; n++) {
+			struct fake_connector *connector = &card->connectors[n];
+			uint64_t crtc_id = fake_card_value(card, connector->value_offset,
+							   FAKE_CONNECTOR_CRTC_ID);
+			if (crtc_id == crtc->base.id)
+				fake_state_set_connector(state, connector, FAKE_CONNECTOR_CRTC_ID,
+							 0);
+		}
+	}
+
+	int ret = 0;
+	if (state->change_count)
+		ret = fake_state_commit(state, DRM_MODE_ATOMIC_ALLOW_MODESET | FAKE_COMMIT_INTERNAL,
+					0);
+	fake_state_destroy(&state);
+	return ret;
+}
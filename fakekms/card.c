@@ -0,0 +1,810 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "fakekms.h"
+
+#define FAKE_GAMMA_SIZE 256
+#define FAKE_MAP_OFFSET_BASE 0x10000000ull
+
+static const struct drm_mode_property_enum dpms_enums[] = {
+	{ DRM_MODE_DPMS_ON, "On" },
+	{ DRM_MODE_DPMS_STANDBY, "Standby" },
+	{ DRM_MODE_DPMS_SUSPEND, "Suspend" },
+	{ DRM_MODE_DPMS_OFF, "Off" },
+};
+
+static const struct drm_mode_property_enum plane_type_enums[] = {
+	{ DRM_PLANE_TYPE_OVERLAY, "Overlay" },
+	{ DRM_PLANE_TYPE_PRIMARY, "Primary" },
+	{ DRM_PLANE_TYPE_CURSOR, "Cursor" },
+};
+
+// Bitmask enum values are bit positions, not masks.
+static const struct drm_mode_property_enum rotation_enums[] = {
+	{ 0, "rotate-0" }, { 2, "rotate-180" }, { 4, "reflect-x" }, { 5, "reflect-y" },
+};
+
+static const uint32_t primary_formats[] = {
+	DRM_FORMAT_XRGB8888, DRM_FORMAT_ARGB8888, DRM_FORMAT_XBGR8888,
+	DRM_FORMAT_ABGR8888, DRM_FORMAT_RGB565,   DRM_FORMAT_XRGB2101010,
+};
+
+static const uint32_t overlay_formats[] = {
+	DRM_FORMAT_XRGB8888, DRM_FORMAT_ARGB8888, DRM_FORMAT_XBGR8888,
+	DRM_FORMAT_ABGR8888, DRM_FORMAT_RGB565,   DRM_FORMAT_NV12,
+	DRM_FORMAT_YVU420,   DRM_FORMAT_YUV420,   DRM_FORMAT_YUYV,
+};
+
+static const uint32_t cursor_formats[] = {
+	DRM_FORMAT_ARGB8888,
+};
+
+static const uint32_t writeback_formats[] = {
+	DRM_FORMAT_XRGB8888,
+	DRM_FORMAT_ARGB8888,
+};
+
+static void card_object_add(struct fake_card *card, struct fake_object *object, uint32_t type)
+{
+	if (card->next_id >= card->object_capacity) {
+		uint32_t capacity = card->object_capacity ? card->object_capacity * 2 : 64;
+		card->objects = realloc(card->objects, capacity * sizeof(card->objects[0]));
+		assert(card->objects);
+		memset(card->objects + card->object_capacity, 0,
+		       (capacity - card->object_capacity) * sizeof(card->objects[0]));
+		card->object_capacity = capacity;
+	}
+
+	object->id = card->next_id++;
+	object->type = type;
+	card->objects[object->id] = object;
+}
+
+static void card_object_remove(struct fake_card *card, struct fake_object *object)
+{
+	assert(object->id < card->object_capacity);
+	assert(card->objects[object->id] == object);
+	card->objects[object->id] = NULL;
+}
+
+static struct fake_property *card_property_new(struct fake_card *card, const char *name,
+					       uint32_t flags, enum fake_value_kind kind)
+{
+	struct fake_property *prop = calloc(1, sizeof(struct fake_property));
+	assert(prop);
+	snprintf(prop->name, sizeof(prop->name), "%s", name);
+	prop->flags = flags;
+	prop->kind = kind;
+	card_object_add(card, &prop->base, DRM_MODE_OBJECT_PROPERTY);
+	return prop;
+}
+
+static struct fake_property *card_range_new(struct fake_card *card, const char *name,
+					    uint32_t flags, uint64_t min, uint64_t max)
+{
+	struct fake_property *prop = card_property_new(card, name, flags, FAKE_VALUE_PLAIN);
+	prop->value_count = 2;
+	prop->values[0] = min;
+	prop->values[1] = max;
+	return prop;
+}
+
+static struct fake_property *card_object_prop_new(struct fake_card *card, const char *name,
+						  uint32_t object_type, enum fake_value_kind kind)
+{
+	struct fake_property *prop = card_property_new(
+	    card, name, DRM_MODE_PROP_OBJECT | DRM_MODE_PROP_ATOMIC, kind);
+	prop->value_count = 1;
+	prop->values[0] = object_type;
+	return prop;
+}
+
+static struct fake_property *card_enum_new(struct fake_card *card, const char *name,
+					   uint32_t flags,
+					   const struct drm_mode_property_enum *enums,
+					   size_t enum_count)
+{
+	struct fake_property *prop = card_property_new(card, name, flags, FAKE_VALUE_PLAIN);
+	prop->enums = enums;
+	prop->enum_count = enum_count;
+	prop->value_count = enum_count;
+	return prop;
+}
+
+static void card_props_init(struct fake_card *card)
+{
+	const uint32_t atomic = DRM_MODE_PROP_ATOMIC;
+	struct fake_property *crtc_id =
+	    card_object_prop_new(card, "CRTC_ID", DRM_MODE_OBJECT_CRTC, FAKE_VALUE_PLAIN);
+
+	card->connector_props[FAKE_CONNECTOR_EDID] = card_property_new(
+	    card, "EDID", DRM_MODE_PROP_BLOB | DRM_MODE_PROP_IMMUTABLE, FAKE_VALUE_BLOB);
+	card->connector_props[FAKE_CONNECTOR_DPMS] = card_enum_new(
+	    card, "DPMS", DRM_MODE_PROP_ENUM, dpms_enums, FAKE_ARRAY_LEN(dpms_enums));
+	card->connector_props[FAKE_CONNECTOR_CRTC_ID] = crtc_id;
+	card->connector_props[FAKE_CONNECTOR_WRITEBACK_FB_ID] =
+	    card_object_prop_new(card, "WRITEBACK_FB_ID", DRM_MODE_OBJECT_FB, FAKE_VALUE_FB);
+	card->connector_props[FAKE_CONNECTOR_WRITEBACK_OUT_FENCE_PTR] = card_range_new(
+	    card, "WRITEBACK_OUT_FENCE_PTR", DRM_MODE_PROP_RANGE | atomic, 0, UINT64_MAX);
+	card->connector_props[FAKE_CONNECTOR_WRITEBACK_PIXEL_FORMATS] =
+	    card_property_new(card, "WRITEBACK_PIXEL_FORMATS",
+			      DRM_MODE_PROP_BLOB | DRM_MODE_PROP_IMMUTABLE, FAKE_VALUE_BLOB);
+
+	card->crtc_props[FAKE_CRTC_ACTIVE] =
+	    card_range_new(card, "ACTIVE", DRM_MODE_PROP_RANGE | atomic, 0, 1);
+	card->crtc_props[FAKE_CRTC_MODE_ID] =
+	    card_property_new(card, "MODE_ID", DRM_MODE_PROP_BLOB | atomic, FAKE_VALUE_BLOB);
+	card->crtc_props[FAKE_CRTC_OUT_FENCE_PTR] =
+	    card_range_new(card, "OUT_FENCE_PTR", DRM_MODE_PROP_RANGE | atomic, 0, UINT64_MAX);
+	card->crtc_props[FAKE_CRTC_CTM] =
+	    card_property_new(card, "CTM", DRM_MODE_PROP_BLOB, FAKE_VALUE_BLOB);
+	card->crtc_props[FAKE_CRTC_GAMMA_LUT] =
+	    card_property_new(card, "GAMMA_LUT", DRM_MODE_PROP_BLOB, FAKE_VALUE_BLOB);
+	card->crtc_props[FAKE_CRTC_GAMMA_LUT_SIZE] = card_range_new(
+	    card, "GAMMA_LUT_SIZE", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_IMMUTABLE, 0, UINT_MAX);
+
+	card->plane_props[FAKE_PLANE_TYPE] =
+	    card_enum_new(card, "type", DRM_MODE_PROP_ENUM | DRM_MODE_PROP_IMMUTABLE,
+			  plane_type_enums, FAKE_ARRAY_LEN(plane_type_enums));
+	card->plane_props[FAKE_PLANE_FB_ID] =
+	    card_object_prop_new(card, "FB_ID", DRM_MODE_OBJECT_FB, FAKE_VALUE_FB);
+	card->plane_props[FAKE_PLANE_CRTC_ID] = crtc_id;
+
+	static const char *const src_names[] = { "SRC_X", "SRC_Y", "SRC_W", "SRC_H" };
+	for (size_t i = 0; i < FAKE_ARRAY_LEN(src_names); i++)
+		card->plane_props[FAKE_PLANE_SRC_X + i] =
+		    card_range_new(card, src_names[i], DRM_MODE_PROP_RANGE | atomic, 0, UINT_MAX);
+
+	card->plane_props[FAKE_PLANE_CRTC_X] = card_range_new(
+	    card, "CRTC_X", DRM_MODE_PROP_SIGNED_RANGE | atomic, (uint64_t)INT_MIN, INT_MAX);
+	card->plane_props[FAKE_PLANE_CRTC_Y] = card_range_new(
+	    card, "CRTC_Y", DRM_MODE_PROP_SIGNED_RANGE | atomic, (uint64_t)INT_MIN, INT_MAX);
+	card->plane_props[FAKE_PLANE_CRTC_W] =
+	    card_range_new(card, "CRTC_W", DRM_MODE_PROP_RANGE | atomic, 0, INT_MAX);
+	card->plane_props[FAKE_PLANE_CRTC_H] =
+	    card_range_new(card, "CRTC_H", DRM_MODE_PROP_RANGE | atomic, 0, INT_MAX);
+	card->plane_props[FAKE_PLANE_IN_FENCE_FD] = card_range_new(
+	    card, "IN_FENCE_FD", DRM_MODE_PROP_SIGNED_RANGE | atomic, (uint64_t)-1, INT_MAX);
+	card->plane_props[FAKE_PLANE_ROTATION] =
+	    card_enum_new(card, "rotation", DRM_MODE_PROP_BITMASK, rotation_enums,
+			  FAKE_ARRAY_LEN(rotation_enums));
+	card->plane_props[FAKE_PLANE_IN_FORMATS] = card_property_new(
+	    card, "IN_FORMATS", DRM_MODE_PROP_BLOB | DRM_MODE_PROP_IMMUTABLE, FAKE_VALUE_BLOB);
+}
+
+static void mode_init(struct drm_mode_modeinfo *mode, uint32_t width, uint32_t height,
+		      uint32_t refresh, bool preferred)
+{
+	// Reduced blanking timings, which is all a fake panel needs.
+	memset(mode, 0, sizeof(*mode));
+	mode->hdisplay = width;
+	mode->hsync_start = width + 48;
+	mode->hsync_end = width + 80;
+	mode->htotal = width + 160;
+	mode->vdisplay = height;
+	mode->vsync_start = height + 3;
+	mode->vsync_end = height + 8;
+	mode->vtotal = height + 30;
+	mode->vrefresh = refresh;
+	mode->clock = (uint64_t)mode->htotal * mode->vtotal * refresh / 1000;
+	mode->type = DRM_MODE_TYPE_DRIVER | (preferred ? DRM_MODE_TYPE_PREFERRED : 0);
+	snprintf(mode->name, sizeof(mode->name), "%ux%u", width, height);
+}
+
+static struct fake_blob *edid_blob_new(struct fake_card *card, size_t connector_index)
+{
+	uint8_t edid[128] = { 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00 };
+	// Manufacturer "FAK" and the connector index as the serial number.
+	edid[8] = 0x18;
+	edid[9] = 0x2b;
+	edid[12] = connector_index & 0xff;
+	edid[13] = (connector_index >> 8) & 0xff;
+	edid[18] = 1;
+	edid[19] = 4;
+
+	uint8_t sum = 0;
+	for (size_t i = 0; i < sizeof(edid) - 1; i++)
+		sum += edid[i];
+	edid[sizeof(edid) - 1] = -sum;
+	return fake_card_blob_new(card, NULL, edid, sizeof(edid));
+}
+
+static struct fake_blob *in_formats_blob_new(struct fake_card *card, const uint32_t *formats,
+					     size_t format_count)
+{
+	assert(format_count <= 64);
+	struct drm_format_modifier_blob header = { 0 };
+	header.version = FORMAT_BLOB_CURRENT;
+	header.count_formats = format_count;
+	header.formats_offset = sizeof(header);
+	header.count_modifiers = 1;
+	header.modifiers_offset =
+	    FAKE_ALIGN(header.formats_offset + format_count * sizeof(uint32_t), 8);
+
+	struct drm_format_modifier modifier = { 0 };
+	modifier.formats = format_count == 64 ? UINT64_MAX : (1ull << format_count) - 1;
+	modifier.modifier = DRM_FORMAT_MOD_LINEAR;
+
+	uint32_t length = header.modifiers_offset + sizeof(modifier);
+	uint8_t *data = calloc(1, length);
+	assert(data);
+	memcpy(data, &header, sizeof(header));
+	memcpy(data + header.formats_offset, formats, format_count * sizeof(uint32_t));
+	memcpy(data + header.modifiers_offset, &modifier, sizeof(modifier));
+	struct fake_blob *blob = fake_card_blob_new(card, NULL, data, length);
+	free(data);
+	return blob;
+}
+
+static void card_planes_init(struct fake_card *card)
+{
+	const struct fake_config *config = card->config;
+	uint32_t all_crtcs =
+	    card->crtc_count == 32 ? UINT32_MAX : (1u << card->crtc_count) - 1;
+	size_t cursors = config->cursors_per_crtc ? 1 : 0;
+
+	card->plane_count = card->crtc_count * (1 + config->overlays_per_crtc + cursors);
+	card->planes = calloc(card->plane_count, sizeof(card->planes[0]));
+	assert(card->planes);
+
+	struct fake_blob *blobs[3] = {
+		in_formats_blob_new(card, overlay_formats, FAKE_ARRAY_LEN(overlay_formats)),
+		in_formats_blob_new(card, primary_formats, FAKE_ARRAY_LEN(primary_formats)),
+		in_formats_blob_new(card, cursor_formats, FAKE_ARRAY_LEN(cursor_formats)),
+	};
+
+	size_t plane_index = 0;
+	for (size_t crtc_index = 0; crtc_index < card->crtc_count; crtc_index++) {
+		size_t overlays = config->overlays_per_crtc;
+		for (size_t i = 0; i < 1 + overlays + cursors; i++) {
+			struct fake_plane *plane = &card->planes[plane_index];
+			plane->index = plane_index++;
+			plane->value_offset = card->value_count;
+			card->value_count += FAKE_PLANE_PROP_COUNT;
+			plane->possible_crtcs = 1u << crtc_index;
+
+			if (i == 0) {
+				plane->type = DRM_PLANE_TYPE_PRIMARY;
+				plane->formats = primary_formats;
+				plane->format_count = FAKE_ARRAY_LEN(primary_formats);
+				card->crtcs[crtc_index].primary = plane;
+			} else if (i <= overlays) {
+				plane->type = DRM_PLANE_TYPE_OVERLAY;
+				plane->formats = overlay_formats;
+				plane->format_count = FAKE_ARRAY_LEN(overlay_formats);
+				if (config->shared_crtcs)
+					plane->possible_crtcs = all_crtcs;
+			} else {
+				plane->type = DRM_PLANE_TYPE_CURSOR;
+				plane->formats = cursor_formats;
+				plane->format_count = FAKE_ARRAY_LEN(cursor_formats);
+			}
+			card_object_add(card, &plane->base, DRM_MODE_OBJECT_PLANE);
+		}
+	}
+
+	card->values = calloc(card->value_count, sizeof(card->values[0]));
+	assert(card->values);
+	for (size_t i = 0; i < card->plane_count; i++) {
+		struct fake_plane *plane = &card->planes[i];
+		uint64_t *values = card->values + plane->value_offset;
+		struct fake_blob *in_formats = blobs[plane->type];
+		values[FAKE_PLANE_TYPE] = plane->type;
+		values[FAKE_PLANE_IN_FENCE_FD] = (uint64_t)-1;
+		values[FAKE_PLANE_ROTATION] = DRM_MODE_ROTATE_0;
+		values[FAKE_PLANE_IN_FORMATS] = in_formats->base.id;
+		in_formats->refcount++;
+	}
+}
+
+void fake_card_init(struct fake_card *card, unsigned minor, const struct fake_config *config)
+{
+	memset(card, 0, sizeof(*card));
+	card->minor = minor;
+	card->config = config;
+	card->next_id = 1;
+	card_props_init(card);
+
+	card->crtc_count = config->crtc_count;
+	card->crtcs = calloc(card->crtc_count, sizeof(card->crtcs[0]));
+	assert(card->crtcs);
+	for (size_t i = 0; i < card->crtc_count; i++) {
+		struct fake_crtc *crtc = &card->crtcs[i];
+		crtc->index = i;
+		crtc->value_offset = card->value_count;
+		card->value_count += FAKE_CRTC_PROP_COUNT;
+		crtc->gamma_size = FAKE_GAMMA_SIZE;
+		crtc->crc_control_fd = -1;
+		crtc->crc_data_fd = -1;
+		crtc->gamma = calloc(3 * crtc->gamma_size, sizeof(crtc->gamma[0]));
+		assert(crtc->gamma);
+		for (uint32_t j = 0; j < 3 * crtc->gamma_size; j++)
+			crtc->gamma[j] = (j % crtc->gamma_size) * 0xffff / (crtc->gamma_size - 1);
+		card_object_add(card, &crtc->base, DRM_MODE_OBJECT_CRTC);
+	}
+
+	// The writeback connector comes last, with a virtual encoder of its own.
+	card->connector_count = config->connector_count + config->writeback;
+	card->encoder_count = card->connector_count;
+	card->connectors = calloc(card->connector_count + 1, sizeof(card->connectors[0]));
+	card->encoders = calloc(card->encoder_count + 1, sizeof(card->encoders[0]));
+	assert(card->connectors);
+	assert(card->encoders);
+	uint32_t all_crtcs = card->crtc_count == 32 ? UINT32_MAX : (1u << card->crtc_count) - 1;
+	for (size_t i = 0; i < card->encoder_count; i++) {
+		struct fake_encoder *encoder = &card->encoders[i];
+		encoder->index = i;
+		encoder->encoder_type = DRM_MODE_ENCODER_TMDS;
+		encoder->possible_crtcs =
+		    config->shared_crtcs ? all_crtcs : 1u << (i % card->crtc_count);
+		if (i == config->connector_count) {
+			encoder->encoder_type = DRM_MODE_ENCODER_VIRTUAL;
+			encoder->possible_crtcs = all_crtcs;
+		}
+		card_object_add(card, &encoder->base, DRM_MODE_OBJECT_ENCODER);
+	}
+
+	uint32_t type_ids[4] = { 0 };
+	for (size_t i = 0; i < card->connector_count; i++) {
+		struct fake_connector *connector = &card->connectors[i];
+		connector->index = i;
+		connector->value_offset = card->value_count;
+		card->value_count += FAKE_CONNECTOR_PROP_COUNT;
+		connector->encoder = &card->encoders[i];
+
+		size_t type_slot;
+		if (i == config->connector_count) {
+			connector->connector_type = DRM_MODE_CONNECTOR_WRITEBACK;
+			connector->writeback = true;
+			connector->formats = writeback_formats;
+			connector->format_count = FAKE_ARRAY_LEN(writeback_formats);
+			card->writeback = connector;
+			type_slot = 3;
+		} else if (i == 0 && config->internal_panel) {
+			connector->connector_type = DRM_MODE_CONNECTOR_eDP;
+			type_slot = 0;
+		} else if (i % 2) {
+			connector->connector_type = DRM_MODE_CONNECTOR_HDMIA;
+			type_slot = 1;
+		} else {
+			connector->connector_type = DRM_MODE_CONNECTOR_DisplayPort;
+			type_slot = 2;
+		}
+		connector->connector_type_id = ++type_ids[type_slot];
+		// Writeback connectors are always connected, with modes but no physical size.
+		connector->connected = i < config->connected_count || connector->writeback;
+		connector->mm_width = connector->writeback ? 0 : config->width / 4;
+		connector->mm_height = connector->writeback ? 0 : config->height / 4;
+
+		if (connector->connected) {
+			connector->mode_count = config->mode_count;
+			connector->modes =
+			    calloc(connector->mode_count, sizeof(connector->modes[0]));
+			assert(connector->modes);
+			for (size_t m = 0; m < connector->mode_count; m++) {
+				// Each additional mode is three quarters the size of the last.
+				uint32_t width = config->width, height = config->height;
+				for (size_t s = 0; s < m; s++) {
+					width = FAKE_ALIGN(width * 3 / 4, 8);
+					height = FAKE_ALIGN(height * 3 / 4, 2);
+				}
+				mode_init(&connector->modes[m], width, height, config->refresh,
+					  m == 0);
+			}
+		}
+		card_object_add(card, &connector->base, DRM_MODE_OBJECT_CONNECTOR);
+	}
+
+	card_planes_init(card);
+
+	for (size_t i = 0; i < card->crtc_count; i++) {
+		uint64_t *values = card->values + card->crtcs[i].value_offset;
+		values[FAKE_CRTC_GAMMA_LUT_SIZE] = card->crtcs[i].gamma_size;
+	}
+
+	for (size_t i = 0; i < card->connector_count; i++) {
+		struct fake_connector *connector = &card->connectors[i];
+		uint64_t *values = card->values + connector->value_offset;
+		values[FAKE_CONNECTOR_DPMS] = DRM_MODE_DPMS_ON;
+		if (connector->writeback) {
+			struct fake_blob *formats = fake_card_blob_new(
+			    card, NULL, connector->formats,
+			    connector->format_count * sizeof(connector->formats[0]));
+			values[FAKE_CONNECTOR_WRITEBACK_PIXEL_FORMATS] = formats->base.id;
+			formats->refcount++;
+		} else if (connector->connected) {
+			struct fake_blob *edid = edid_blob_new(card, i);
+			values[FAKE_CONNECTOR_EDID] = edid->base.id;
+			edid->refcount++;
+		}
+	}
+
+	card->value_kinds = calloc(card->value_count, sizeof(card->value_kinds[0]));
+	assert(card->value_kinds);
+	for (size_t i = 0; i < card->connector_count; i++)
+		for (size_t p = 0; p < FAKE_CONNECTOR_PROP_COUNT; p++)
+			card->value_kinds[card->connectors[i].value_offset + p] =
+			    card->connector_props[p]->kind;
+	for (size_t i = 0; i < card->crtc_count; i++)
+		for (size_t p = 0; p < FAKE_CRTC_PROP_COUNT; p++)
+			card->value_kinds[card->crtcs[i].value_offset + p] =
+			    card->crtc_props[p]->kind;
+	for (size_t i = 0; i < card->plane_count; i++)
+		for (size_t p = 0; p < FAKE_PLANE_PROP_COUNT; p++)
+			card->value_kinds[card->planes[i].value_offset + p] =
+			    card->plane_props[p]->kind;
+}
+
+struct fake_object *fake_card_object(struct fake_card *card, uint32_t id, uint32_t type)
+{
+	if (id == 0 || id >= card->object_capacity || !card->objects[id])
+		return NULL;
+	struct fake_object *object = card->objects[id];
+	if (type != DRM_MODE_OBJECT_ANY && object->type != type)
+		return NULL;
+	return object;
+}
+
+struct fake_property *fake_card_property(struct fake_card *card, uint32_t id)
+{
+	return (struct fake_property *)fake_card_object(card, id, DRM_MODE_OBJECT_PROPERTY);
+}
+
+size_t fake_card_object_props(struct fake_card *card, struct fake_object *object,
+			      struct fake_property ***props, size_t *value_offset)
+{
+	switch (object->type) {
+		case DRM_MODE_OBJECT_CONNECTOR:
+			*props = card->connector_props;
+			*value_offset = ((struct fake_connector *)object)->value_offset;
+			return FAKE_CONNECTOR_PROP_COUNT;
+		case DRM_MODE_OBJECT_CRTC:
+			*props = card->crtc_props;
+			*value_offset = ((struct fake_crtc *)object)->value_offset;
+			return FAKE_CRTC_PROP_COUNT;
+		case DRM_MODE_OBJECT_PLANE:
+			*props = card->plane_props;
+			*value_offset = ((struct fake_plane *)object)->value_offset;
+			return FAKE_PLANE_PROP_COUNT;
+		default:
+			*props = NULL;
+			*value_offset = 0;
+			return 0;
+	}
+}
+
+// Connectors share one list of properties, of which only writeback connectors have the writeback
+// ones.
+bool fake_card_object_has_prop(struct fake_object *object, size_t prop_index)
+{
+	if (object->type != DRM_MODE_OBJECT_CONNECTOR)
+		return true;
+
+	bool writeback = ((struct fake_connector *)object)->writeback;
+	switch (prop_index) {
+		case FAKE_CONNECTOR_WRITEBACK_FB_ID:
+		case FAKE_CONNECTOR_WRITEBACK_OUT_FENCE_PTR:
+		case FAKE_CONNECTOR_WRITEBACK_PIXEL_FORMATS:
+			return writeback;
+		default:
+			return true;
+	}
+}
+
+// Like the kernel, writeback connectors are hidden from files that didn't ask for them.
+bool fake_card_object_visible(struct fake_file *file, struct fake_object *object)
+{
+	if (object->type != DRM_MODE_OBJECT_CONNECTOR)
+		return true;
+	return file->writeback_connectors || !((struct fake_connector *)object)->writeback;
+}
+
+struct fake_connector *fake_card_connector(struct fake_card *card, uint32_t id)
+{
+	return (struct fake_connector *)fake_card_object(card, id, DRM_MODE_OBJECT_CONNECTOR);
+}
+
+struct fake_crtc *fake_card_crtc(struct fake_card *card, uint32_t id)
+{
+	return (struct fake_crtc *)fake_card_object(card, id, DRM_MODE_OBJECT_CRTC);
+}
+
+struct fake_plane *fake_card_plane(struct fake_card *card, uint32_t id)
+{
+	return (struct fake_plane *)fake_card_object(card, id, DRM_MODE_OBJECT_PLANE);
+}
+
+struct fake_blob *fake_card_blob(struct fake_card *card, uint32_t id)
+{
+	return (struct fake_blob *)fake_card_object(card, id, DRM_MODE_OBJECT_BLOB);
+}
+
+struct fake_fb *fake_card_fb(struct fake_card *card, uint32_t id)
+{
+	return (struct fake_fb *)fake_card_object(card, id, DRM_MODE_OBJECT_FB);
+}
+
+struct fake_blob *fake_card_blob_new(struct fake_card *card, struct fake_file *owner,
+				     const void *data, uint32_t length)
+{
+	struct fake_blob *blob = calloc(1, sizeof(struct fake_blob));
+	assert(blob);
+	blob->data = malloc(length);
+	assert(blob->data);
+	memcpy(blob->data, data, length);
+	blob->length = length;
+	blob->owner = owner;
+	blob->refcount = 1;
+	card_object_add(card, &blob->base, DRM_MODE_OBJECT_BLOB);
+	return blob;
+}
+
+void fake_card_blob_unref(struct fake_card *card, struct fake_blob *blob)
+{
+	assert(blob->refcount > 0);
+	if (--blob->refcount)
+		return;
+	card_object_remove(card, &blob->base);
+	free(blob->data);
+	free(blob);
+}
+
+struct fake_fb *fake_card_fb_new(struct fake_card *card, struct fake_file *owner)
+{
+	struct fake_fb *fb = calloc(1, sizeof(struct fake_fb));
+	assert(fb);
+	fb->owner = owner;
+	fb->refcount = 1;
+	card_object_add(card, &fb->base, DRM_MODE_OBJECT_FB);
+	return fb;
+}
+
+void fake_card_fb_unref(struct fake_card *card, struct fake_fb *fb)
+{
+	assert(fb->refcount > 0);
+	if (--fb->refcount)
+		return;
+	card_object_remove(card, &fb->base);
+	for (size_t i = 0; i < fb->plane_count; i++)
+		fake_buffer_unref(fb->buffers[i]);
+	free(fb);
+}
+
+bool fake_card_plane_has_format(struct fake_plane *plane, uint32_t format)
+{
+	for (size_t i = 0; i < plane->format_count; i++)
+		if (plane->formats[i] == format)
+			return true;
+	return false;
+}
+
+static struct fake_buffer *buffer_add(int memfd, uint64_t size)
+{
+	struct stat st;
+	if (fstat(memfd, &st)) {
+		close(memfd);
+		return NULL;
+	}
+
+	struct fake_buffer *buffer = calloc(1, sizeof(struct fake_buffer));
+	assert(buffer);
+	buffer->ino = st.st_ino;
+	buffer->memfd = memfd;
+	buffer->size = size;
+	buffer->refcount = 1;
+
+	if (!fake_kms.next_map_offset)
+		fake_kms.next_map_offset = FAKE_MAP_OFFSET_BASE;
+	buffer->map_offset = fake_kms.next_map_offset;
+	fake_kms.next_map_offset += FAKE_ALIGN(size, (uint64_t)sysconf(_SC_PAGESIZE));
+
+	buffer->next = fake_kms.buffers;
+	fake_kms.buffers = buffer;
+	return buffer;
+}
+
+struct fake_buffer *fake_buffer_new(uint64_t size)
+{
+	int memfd = memfd_create("fakekms", MFD_CLOEXEC);
+	if (memfd < 0)
+		return NULL;
+
+	if (ftruncate(memfd, size)) {
+		close(memfd);
+		return NULL;
+	}
+
+	return buffer_add(memfd, size);
+}
+
+struct fake_buffer *fake_buffer_import(int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st))
+		return NULL;
+
+	struct fake_buffer *buffer = fake_buffer_find_ino(st.st_ino);
+	if (buffer) {
+		buffer->refcount++;
+		return buffer;
+	}
+
+	// Anything that can be mapped will do, which lets tests import their own memfds.
+	if (!S_ISREG(st.st_mode)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	int memfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (memfd < 0)
+		return NULL;
+	return buffer_add(memfd, st.st_size);
+}
+
+struct fake_buffer *fake_buffer_find_ino(ino_t ino)
+{
+	for (struct fake_buffer *buffer = fake_kms.buffers; buffer; buffer = buffer->next)
+		if (buffer->ino == ino)
+			return buffer;
+	return NULL;
+}
+
+void fake_buffer_unref(struct fake_buffer *buffer)
+{
+	assert(buffer->refcount > 0);
+	if (--buffer->refcount)
+		return;
+
+	struct fake_buffer **link = &fake_kms.buffers;
+	while (*link != buffer)
+		link = &(*link)->next;
+	*link = buffer->next;
+
+	close(buffer->memfd);
+	free(buffer);
+}
+
+struct fake_file *fake_file_open(unsigned minor, int flags, int *fd)
+{
+	if (minor >= fake_kms.config.card_count) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	fake_file_sweep();
+
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC))
+		return NULL;
+	if (!(flags & O_CLOEXEC))
+		fcntl(fds[0], F_SETFD, 0);
+	if (flags & O_NONBLOCK)
+		fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+	struct stat st;
+	if (fstat(fds[0], &st)) {
+		close(fds[0]);
+		close(fds[1]);
+		return NULL;
+	}
+
+	struct fake_file *file = calloc(1, sizeof(struct fake_file));
+	assert(file);
+	file->card = &fake_kms.cards[minor];
+	file->ino = st.st_ino;
+	file->signal_fd = fds[1];
+	file->next = fake_kms.files;
+	fake_kms.files = file;
+
+	*fd = fds[0];
+	return file;
+}
+
+struct fake_file *fake_file_find(int fd)
+{
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) || !S_ISFIFO(st.st_mode))
+		return NULL;
+	return fake_file_find_ino(st.st_ino);
+}
+
+struct fake_file *fake_file_find_ino(ino_t ino)
+{
+	for (struct fake_file *file = fake_kms.files; file; file = file->next)
+		if (file->ino == ino)
+			return file;
+	return NULL;
+}
+
+static void file_release(struct fake_file *file)
+{
+	struct fake_card *card = file->card;
+	fake_event_file_release(file);
+
+	// Closing a file removes its framebuffers and blobs like RMFB and DESTROYPROPBLOB would.
+	for (uint32_t id = 1; id < card->next_id; id++) {
+		struct fake_object *object = card->objects[id];
+		if (!object)
+			continue;
+
+		if (object->type == DRM_MODE_OBJECT_FB) {
+			struct fake_fb *fb = (struct fake_fb *)object;
+			if (fb->owner != file)
+				continue;
+			fake_atomic_remove_fb(card, fb);
+			fb->owner = NULL;
+			fake_card_fb_unref(card, fb);
+		} else if (object->type == DRM_MODE_OBJECT_BLOB) {
+			struct fake_blob *blob = (struct fake_blob *)object;
+			if (blob->owner != file)
+				continue;
+			blob->owner = NULL;
+			fake_card_blob_unref(card, blob);
+		}
+	}
+
+	for (size_t i = 0; i < file->handle_capacity; i++)
+		if (file->handles[i])
+			fake_buffer_unref(file->handles[i]);
+	free(file->handles);
+	close(file->signal_fd);
+	free(file);
+}
+
+// There is no hook for the last close() of a card fd, but once every read end of the pipe is
+// closed the write end polls with POLLERR.
+void fake_file_sweep(void)
+{
+	struct fake_file **link = &fake_kms.files;
+	while (*link) {
+		struct fake_file *file = *link;
+		struct pollfd pfd = { .fd = file->signal_fd, .events = 0 };
+		if (poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLERR)) {
+			*link = file->next;
+			file_release(file);
+		} else {
+			link = &file->next;
+		}
+	}
+}
+
+uint32_t fake_file_add_handle(struct fake_file *file, struct fake_buffer *buffer)
+{
+	size_t index;
+	for (index = 0; index < file->handle_capacity; index++)
+		if (!file->handles[index])
+			break;
+
+	if (index == file->handle_capacity) {
+		size_t capacity = file->handle_capacity ? file->handle_capacity * 2 : 16;
+		file->handles = realloc(file->handles, capacity * sizeof(file->handles[0]));
+		assert(file->handles);
+		memset(file->handles + file->handle_capacity, 0,
+		       (capacity - file->handle_capacity) * sizeof(file->handles[0]));
+		file->handle_capacity = capacity;
+	}
+
+	file->handles[index] = buffer;
+	return index + 1;
+}
+
+struct fake_buffer *fake_file_handle(struct fake_file *file, uint32_t handle)
+{
+	if (handle == 0 || handle > file->handle_capacity)
+		return NULL;
+	return file->handles[handle - 1];
+}
+
+int fake_file_close_handle(struct fake_file *file, uint32_t handle)
+{
+	struct fake_buffer *buffer = fake_file_handle(file, handle);
+	if (!buffer)
+		return -EINVAL;
+	file->handles[handle - 1] = NULL;
+	fake_buffer_unref(buffer);
+	return 0;
+}
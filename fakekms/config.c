@@ -0,0 +1,137 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "fakekms.h"
+
+static const struct fake_config default_config = {
+	.card_count = 1,
+	.crtc_count = 2,
+	.connector_count = 2,
+	// Clamped to connector_count, so every connector is connected unless configured otherwise.
+	.connected_count = UINT_MAX,
+	.overlays_per_crtc = 1,
+	.cursors_per_crtc = 1,
+	.mode_count = 3,
+	.width = 1920,
+	.height = 1080,
+	.refresh = 60,
+	.cursor_size = 64,
+	.bandwidth = 0,
+	.planes_per_crtc = 0,
+	.shared_crtcs = true,
+	.overlay_scaling = true,
+	.internal_panel = true,
+	.writeback = false,
+	.debug = false,
+	.driver = "fakekms",
+};
+
+static bool parse_unsigned(const char *value, unsigned long long *out)
+{
+	char *end;
+	errno = 0;
+	*out = strtoull(value, &end, 0);
+	return errno == 0 && end != value && *end == '\0';
+}
+
+static bool config_set(struct fake_config *config, const char *key, const char *value)
+{
+	static const struct {
+		const char *key;
+		size_t offset;
+		size_t size;
+	} numbers[] = {
+#define NUMBER(key, field) { key, offsetof(struct fake_config, field), sizeof(config->field) }
+		NUMBER("cards", card_count),
+		NUMBER("crtcs", crtc_count),
+		NUMBER("connectors", connector_count),
+		NUMBER("connected", connected_count),
+		NUMBER("overlays", overlays_per_crtc),
+		NUMBER("cursors", cursors_per_crtc),
+		NUMBER("modes", mode_count),
+		NUMBER("width", width),
+		NUMBER("height", height),
+		NUMBER("refresh", refresh),
+		NUMBER("cursor_size", cursor_size),
+		NUMBER("bandwidth", bandwidth),
+		NUMBER("planes_per_crtc", planes_per_crtc),
+#undef NUMBER
+	};
+	static const struct {
+		const char *key;
+		size_t offset;
+	} flags[] = {
+		{ "shared_crtcs", offsetof(struct fake_config, shared_crtcs) },
+		{ "overlay_scaling", offsetof(struct fake_config, overlay_scaling) },
+		{ "internal_panel", offsetof(struct fake_config, internal_panel) },
+		{ "writeback", offsetof(struct fake_config, writeback) },
+		{ "debug", offsetof(struct fake_config, debug) },
+	};
+
+	if (!strcmp(key, "driver")) {
+		snprintf(config->driver, sizeof(config->driver), "%s", value);
+		return true;
+	}
+
+	unsigned long long number;
+	if (!parse_unsigned(value, &number))
+		return false;
+
+	for (size_t i = 0; i < FAKE_ARRAY_LEN(numbers); i++) {
+		if (strcmp(key, numbers[i].key))
+			continue;
+		void *field = (char *)config + numbers[i].offset;
+		if (numbers[i].size == sizeof(uint64_t))
+			*(uint64_t *)field = number;
+		else
+			*(unsigned *)field = number;
+		return true;
+	}
+
+	for (size_t i = 0; i < FAKE_ARRAY_LEN(flags); i++) {
+		if (strcmp(key, flags[i].key))
+			continue;
+		*(bool *)((char *)config + flags[i].offset) = number != 0;
+		return true;
+	}
+
+	return false;
+}
+
+// Reads a comma separated list of key=value pairs, for example
+// "cards=2,crtcs=4,connectors=300,overlays=3,bandwidth=2000000000". Unknown keys are reported and
+// otherwise ignored so that a typo doesn't silently test the default topology.
+void fake_config_init(struct fake_config *config, const char *spec)
+{
+	*config = default_config;
+	if (!spec)
+		return;
+
+	char *copy = strdup(spec);
+	assert(copy);
+	char *save;
+	for (char *pair = strtok_r(copy, ",", &save); pair; pair = strtok_r(NULL, ",", &save)) {
+		char *value = strchr(pair, '=');
+		if (value)
+			*value++ = '\0';
+		if (!value || !config_set(config, pair, value))
+			fprintf(stderr, "fakekms: ignoring invalid config entry \"%s\"\n", pair);
+	}
+	free(copy);
+
+	if (config->card_count > DRM_MAX_MINOR)
+		config->card_count = DRM_MAX_MINOR;
+	if (config->crtc_count > FAKE_MAX_CRTCS)
+		config->crtc_count = FAKE_MAX_CRTCS;
+	if (config->crtc_count == 0)
+		config->crtc_count = 1;
+	if (config->connected_count > config->connector_count)
+		config->connected_count = config->connector_count;
+	if (config->mode_count == 0)
+		config->mode_count = 1;
+	if (config->refresh == 0)
+		config->refresh = 60;
+}
@@ -0,0 +1,216 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#define _GNU_SOURCE
+#include <sys/socket.h>
+
+#include "fakekms.h"
+
+// Like the kernel's, at most this many CRC entries are reported for vblanks nobody was there for.
+#define CRC_BACKLOG_MAX 128
+
+static uint32_t crc_table[256];
+
+// The kernel's crc32_le, which inverts neither the seed nor the result.
+static uint32_t crc32_le(uint32_t crc, const uint8_t *bytes, size_t size)
+{
+	if (!crc_table[1]) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t entry = i;
+			for (int bit = 0; bit < 8; bit++)
+				entry = (entry >> 1) ^ (entry & 1 ? 0xedb88320 : 0);
+			crc_table[i] = entry;
+		}
+	}
+
+	for (size_t i = 0; i < size; i++)
+		crc = crc_table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+// Hashes the composed frame the way vkms does, pixel by pixel with the alpha byte cleared.
+static uint32_t crc_compute(struct fake_card *card, struct fake_crtc *crtc)
+{
+	const struct drm_mode_modeinfo *mode = fake_card_crtc_mode(card, crtc);
+	uint32_t width = mode->hdisplay;
+	uint32_t height = mode->vdisplay;
+	uint32_t *pixels = calloc((size_t)width * height, sizeof(*pixels));
+	assert(pixels);
+	fake_writeback_compose(card, crtc, pixels, width * sizeof(*pixels), width, height);
+
+	uint32_t crc = 0;
+	for (size_t i = 0; i < (size_t)width * height; i++) {
+		const uint8_t bytes[4] = { pixels[i], pixels[i] >> 8, pixels[i] >> 16, 0 };
+		crc = crc32_le(crc, bytes, sizeof(bytes));
+	}
+	free(pixels);
+	return crc;
+}
+
+static bool crc_active(struct fake_card *card, struct fake_crtc *crtc)
+{
+	return crtc->crc_data_fd >= 0 && crtc->period_ns &&
+	       fake_card_value(card, crtc->value_offset, FAKE_CRTC_ACTIVE);
+}
+
+static void crc_close(struct fake_crtc *crtc)
+{
+	close(crtc->crc_data_fd);
+	crtc->crc_data_fd = -1;
+}
+
+// Sends an entry for every vblank up to now that has not been reported yet. All of them show the
+// current state, which is why commits flush the old state's entries before swapping in theirs.
+void fake_debugfs_crc_flush(struct fake_card *card, uint64_t now)
+{
+	for (size_t i = 0; i < card->crtc_count; i++) {
+		struct fake_crtc *crtc = &card->crtcs[i];
+		if (!crc_active(card, crtc))
+			continue;
+
+		uint32_t sequence;
+		uint64_t vblank = fake_event_next_vblank(crtc, crtc->crc_reported_ns, &sequence);
+		if (vblank > now)
+			continue;
+
+		uint64_t count = (now - vblank) / crtc->period_ns + 1;
+		if (count > CRC_BACKLOG_MAX) {
+			sequence += count - CRC_BACKLOG_MAX;
+			vblank += (count - CRC_BACKLOG_MAX) * crtc->period_ns;
+			count = CRC_BACKLOG_MAX;
+		}
+		crtc->crc_reported_ns = vblank + (count - 1) * crtc->period_ns;
+
+		uint32_t crc = crc_compute(card, crtc);
+		for (uint64_t n = 0; n < count; n++) {
+			char line[32];
+			int len = snprintf(line, sizeof(line), "0x%08x 0x%08x\n", sequence++, crc);
+			// Entries that don't fit are lost like in the kernel, and a closed data
+			// file stops the capture.
+			if (send(crtc->crc_data_fd, line, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 &&
+			    errno != EAGAIN) {
+				crc_close(crtc);
+				break;
+			}
+		}
+	}
+}
+
+uint64_t fake_debugfs_crc_dispatch(uint64_t now)
+{
+	uint64_t next = UINT64_MAX;
+	for (unsigned minor = 0; minor < fake_kms.config.card_count; minor++) {
+		struct fake_card *card = &fake_kms.cards[minor];
+		fake_debugfs_crc_flush(card, now);
+		for (size_t i = 0; i < card->crtc_count; i++) {
+			struct fake_crtc *crtc = &card->crtcs[i];
+			if (!crc_active(card, crtc))
+				continue;
+			uint64_t vblank = fake_event_next_vblank(crtc, now, NULL);
+			if (next > vblank)
+				next = vblank;
+		}
+	}
+	return next;
+}
+
+// A memfd that reads like the file at the time it was opened.
+static int open_contents(const char *contents)
+{
+	int fd = memfd_create("fakekms-debugfs", MFD_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	size_t len = strlen(contents);
+	if (write(fd, contents, len) != (ssize_t)len || lseek(fd, 0, SEEK_SET)) {
+		close(fd);
+		return -EIO;
+	}
+	return fd;
+}
+
+// Any source can be written, but like with vkms, capturing only works from "auto".
+static int open_crc_data(struct fake_card *card, struct fake_crtc *crtc, int flags)
+{
+	if (crtc->crc_data_fd >= 0)
+		return -EBUSY;
+
+	char source[16] = { 0 };
+	if (crtc->crc_control_fd >= 0 &&
+	    pread(crtc->crc_control_fd, source, sizeof(source) - 1, 0) < 0)
+		return -errno;
+	source[strcspn(source, "\n")] = '\0';
+	if (source[0] && strcmp(source, "auto")) {
+		fake_debug("invalid CRC source %s", source);
+		return -EINVAL;
+	}
+
+	if (!crtc->period_ns || !fake_card_value(card, crtc->value_offset, FAKE_CRTC_ACTIVE)) {
+		fake_debug("CRTC %u has to be active to capture CRCs", crtc->base.id);
+		return -EIO;
+	}
+
+	// Sequenced packets read back one entry at a time, like the data file.
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds))
+		return -errno;
+	if (flags & O_NONBLOCK)
+		fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+	crtc->crc_data_fd = fds[1];
+	crtc->crc_reported_ns = fake_event_now();
+	fake_event_wake();
+	return fds[0];
+}
+
+static int debugfs_open(const char *path, int flags)
+{
+	unsigned minor, crtc_index;
+	int end = 0;
+	if (sscanf(path, "%u%n", &minor, &end) != 1 || minor >= fake_kms.config.card_count)
+		return -ENOENT;
+	struct fake_card *card = &fake_kms.cards[minor];
+	path += end;
+
+	if (!strcmp(path, "/name")) {
+		char name[96];
+		snprintf(name, sizeof(name), "%s dev=fakekms.%u unique=fakekms.%u\n",
+			 card->config->driver, minor, minor);
+		return open_contents(name);
+	}
+
+	end = 0;
+	if (sscanf(path, "/crtc-%u/crc/%n", &crtc_index, &end) != 1 || !end ||
+	    crtc_index >= card->crtc_count)
+		return -ENOENT;
+	struct fake_crtc *crtc = &card->crtcs[crtc_index];
+	path += end;
+
+	if (!strcmp(path, "control")) {
+		int fd = open_contents("");
+		if (fd < 0)
+			return fd;
+		// The fake keeps a reference to read back the source the client writes.
+		if (crtc->crc_control_fd >= 0)
+			close(crtc->crc_control_fd);
+		crtc->crc_control_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+		return fd;
+	}
+	if (!strcmp(path, "data"))
+		return open_crc_data(card, crtc, flags);
+	return -ENOENT;
+}
+
+int fake_debugfs_open(const char *path, int flags)
+{
+	pthread_mutex_lock(&fake_kms.lock);
+	int fd = debugfs_open(path, flags);
+	pthread_mutex_unlock(&fake_kms.lock);
+	if (fd < 0) {
+		errno = -fd;
+		return -1;
+	}
+	return fd;
+}
@@ -0,0 +1,242 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "fakekms.h"
+
+#define NSEC_PER_SEC 1000000000ull
+
+// A fence is the read end of a pipe. It signals by polling readable once the write end is closed,
+// which is all sync_wait() needs.
+struct fake_fence {
+	struct fake_fence *next;
+	uint64_t deadline_ns;
+	int signal_fd;
+};
+
+static pthread_cond_t event_cond;
+static pthread_t event_thread;
+static bool event_thread_started;
+static struct fake_fence *fences;
+
+uint64_t fake_event_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static struct timespec ns_to_timespec(uint64_t ns)
+{
+	struct timespec ts = { .tv_sec = ns / NSEC_PER_SEC, .tv_nsec = ns % NSEC_PER_SEC };
+	return ts;
+}
+
+uint64_t fake_event_next_vblank(struct fake_crtc *crtc, uint64_t after_ns, uint32_t *sequence)
+{
+	assert(crtc->period_ns);
+	uint64_t count = 1;
+	if (after_ns >= crtc->epoch_ns)
+		count += (after_ns - crtc->epoch_ns) / crtc->period_ns;
+	if (sequence)
+		*sequence = count;
+	return crtc->epoch_ns + count * crtc->period_ns;
+}
+
+// Reports due CRCs, signals every file with a due event and every due fence. Returns the time of
+// the earliest thing still waiting.
+static uint64_t dispatch_locked(void)
+{
+	uint64_t now = fake_event_now();
+	uint64_t next = fake_debugfs_crc_dispatch(now);
+
+	for (struct fake_file *file = fake_kms.files; file; file = file->next) {
+		if (!file->events)
+			continue;
+		if (file->events->deadline_ns > now) {
+			if (next > file->events->deadline_ns)
+				next = file->events->deadline_ns;
+			continue;
+		}
+		if (!file->signaled) {
+			const char byte = 0;
+			if (write(file->signal_fd, &byte, 1) == 1)
+				file->signaled = true;
+		}
+	}
+
+	struct fake_fence **link = &fences;
+	while (*link) {
+		struct fake_fence *fence = *link;
+		if (fence->deadline_ns > now) {
+			if (next > fence->deadline_ns)
+				next = fence->deadline_ns;
+			link = &fence->next;
+			continue;
+		}
+		*link = fence->next;
+		close(fence->signal_fd);
+		free(fence);
+	}
+
+	return next;
+}
+
+static void *event_thread_main(void *arg)
+{
+	pthread_mutex_lock(&fake_kms.lock);
+	for (;;) {
+		uint64_t next = dispatch_locked();
+		if (next == UINT64_MAX) {
+			pthread_cond_wait(&event_cond, &fake_kms.lock);
+		} else {
+			struct timespec ts = ns_to_timespec(next);
+			pthread_cond_timedwait(&event_cond, &fake_kms.lock, &ts);
+		}
+	}
+	return NULL;
+}
+
+void fake_event_wake(void)
+{
+	if (!event_thread_started) {
+		pthread_condattr_t attr;
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&event_cond, &attr);
+		pthread_condattr_destroy(&attr);
+
+		int ret = pthread_create(&event_thread, NULL, event_thread_main, NULL);
+		assert(ret == 0);
+		pthread_detach(event_thread);
+		event_thread_started = true;
+	}
+	pthread_cond_signal(&event_cond);
+}
+
+void fake_event_queue(struct fake_file *file, uint32_t type, uint64_t deadline_ns,
+		      uint32_t sequence, uint32_t crtc_id, uint64_t user_data)
+{
+	struct fake_event *event = calloc(1, sizeof(struct fake_event));
+	assert(event);
+	event->deadline_ns = deadline_ns;
+	event->vblank.base.type = type;
+	event->vblank.base.length = sizeof(event->vblank);
+	event->vblank.user_data = user_data;
+	event->vblank.tv_sec = deadline_ns / NSEC_PER_SEC;
+	event->vblank.tv_usec = (deadline_ns % NSEC_PER_SEC) / 1000;
+	event->vblank.sequence = sequence;
+	event->vblank.crtc_id = crtc_id;
+
+	// Keep the queue sorted so that the head is always the next event to deliver.
+	struct fake_event **link = &file->events;
+	while (*link && (*link)->deadline_ns <= deadline_ns)
+		link = &(*link)->next;
+	event->next = *link;
+	*link = event;
+
+	fake_event_wake();
+}
+
+int fake_event_fence_new(uint64_t deadline_ns)
+{
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC))
+		return -1;
+
+	struct fake_fence *fence = calloc(1, sizeof(struct fake_fence));
+	assert(fence);
+	fence->deadline_ns = deadline_ns;
+	fence->signal_fd = fds[1];
+	fence->next = fences;
+	fences = fence;
+
+	fake_event_wake();
+	return fds[0];
+}
+
+void fake_event_dispatch(void)
+{
+	dispatch_locked();
+}
+
+void fake_event_sleep_until(uint64_t deadline_ns)
+{
+	struct timespec ts = ns_to_timespec(deadline_ns);
+	pthread_mutex_unlock(&fake_kms.lock);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+	pthread_mutex_lock(&fake_kms.lock);
+}
+
+static void file_drain(struct fake_file *file, int fd)
+{
+	int available = 0;
+	if (!fake_real_ioctl(fd, FIONREAD, &available) && available > 0) {
+		char bytes[16];
+		while (available > 0) {
+			size_t chunk = available < (int)sizeof(bytes) ? available : sizeof(bytes);
+			ssize_t len = fake_real_read(fd, bytes, chunk);
+			if (len <= 0)
+				break;
+			available -= len;
+		}
+	}
+	file->signaled = false;
+}
+
+// Behaves like read() on a DRM fd: returns as many due events as fit and blocks until one is due
+// unless the fd is non-blocking.
+ssize_t fake_event_read(struct fake_file *file, int fd, void *buffer, size_t size)
+{
+	for (;;) {
+		uint64_t now = fake_event_now();
+		size_t copied = 0;
+		while (file->events && file->events->deadline_ns <= now &&
+		       copied + sizeof(file->events->vblank) <= size) {
+			struct fake_event *event = file->events;
+			memcpy((char *)buffer + copied, &event->vblank, sizeof(event->vblank));
+			copied += sizeof(event->vblank);
+			file->events = event->next;
+			free(event);
+		}
+
+		bool pending = file->events && file->events->deadline_ns <= now;
+		if (copied) {
+			if (!pending)
+				file_drain(file, fd);
+			return copied;
+		}
+
+		if (pending) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		if (fcntl(fd, F_GETFL) & O_NONBLOCK) {
+			errno = EAGAIN;
+			return -1;
+		}
+
+		if (file->events) {
+			fake_event_sleep_until(file->events->deadline_ns);
+		} else {
+			// Nothing is queued yet, so wait for another thread to commit something.
+			struct pollfd pfd = { .fd = fd, .events = POLLIN };
+			pthread_mutex_unlock(&fake_kms.lock);
+			poll(&pfd, 1, -1);
+			pthread_mutex_lock(&fake_kms.lock);
+		}
+	}
+}
+
+void fake_event_file_release(struct fake_file *file)
+{
+	while (file->events) {
+		struct fake_event *event = file->events;
+		file->events = event->next;
+		free(event);
+	}
+}
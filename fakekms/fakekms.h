@@ -0,0 +1,394 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef __FAKEKMS_H__
+#define __FAKEKMS_H__
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <drm_fourcc.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+// The library is built with hidden visibility like the rest of the tree, so everything that has to
+// interpose on libc, libdrm or gbm is exported explicitly.
+#define FAKE_EXPORT __attribute__((visibility("default")))
+
+#define FAKE_ARRAY_LEN(a) (sizeof(a) / sizeof((a)[0]))
+#define FAKE_ALIGN(a, alignment) (((a) + (alignment)-1) & ~((alignment)-1))
+#define FAKE_DIV_ROUND_UP(a, b) (((a) + (b)-1) / (b))
+
+#define FAKE_MAX_FB_PLANES 4
+// possible_crtcs is a 32 bit mask.
+#define FAKE_MAX_CRTCS 32
+
+// config.c
+struct fake_config {
+	unsigned card_count;
+	unsigned crtc_count;
+	unsigned connector_count;
+	unsigned connected_count;
+	unsigned overlays_per_crtc;
+	unsigned cursors_per_crtc;
+	unsigned mode_count;
+	uint32_t width;
+	uint32_t height;
+	uint32_t refresh;
+	uint32_t cursor_size;
+	// Bytes per second all active planes of a card may scan out, or 0 for no limit.
+	uint64_t bandwidth;
+	// Maximum number of enabled planes on one CRTC, or 0 for no limit.
+	unsigned planes_per_crtc;
+	// Every connector can be driven by every CRTC. Otherwise connector i is wired to CRTC
+	// i % crtc_count only.
+	bool shared_crtcs;
+	bool overlay_scaling;
+	bool internal_panel;
+	// Adds a writeback connector that every CRTC can drive.
+	bool writeback;
+	bool debug;
+	char driver[32];
+};
+
+void fake_config_init(struct fake_config *config, const char *spec);
+
+// format.c
+struct fake_format {
+	uint32_t format;
+	size_t plane_count;
+	uint32_t cpp[FAKE_MAX_FB_PLANES];
+	// Subsampling of every plane after the first.
+	uint32_t hsub;
+	uint32_t vsub;
+};
+
+const struct fake_format *fake_format_find(uint32_t format);
+uint32_t fake_format_plane_width(const struct fake_format *format, size_t plane, uint32_t width);
+uint32_t fake_format_plane_height(const struct fake_format *format, size_t plane, uint32_t height);
+
+// card.c
+enum fake_connector_prop {
+	FAKE_CONNECTOR_EDID,
+	FAKE_CONNECTOR_DPMS,
+	FAKE_CONNECTOR_CRTC_ID,
+	// Only writeback connectors have these.
+	FAKE_CONNECTOR_WRITEBACK_FB_ID,
+	FAKE_CONNECTOR_WRITEBACK_OUT_FENCE_PTR,
+	FAKE_CONNECTOR_WRITEBACK_PIXEL_FORMATS,
+	FAKE_CONNECTOR_PROP_COUNT,
+};
+
+enum fake_crtc_prop {
+	FAKE_CRTC_ACTIVE,
+	FAKE_CRTC_MODE_ID,
+	FAKE_CRTC_OUT_FENCE_PTR,
+	FAKE_CRTC_CTM,
+	FAKE_CRTC_GAMMA_LUT,
+	FAKE_CRTC_GAMMA_LUT_SIZE,
+	FAKE_CRTC_PROP_COUNT,
+};
+
+enum fake_plane_prop {
+	FAKE_PLANE_TYPE,
+	FAKE_PLANE_FB_ID,
+	FAKE_PLANE_CRTC_ID,
+	FAKE_PLANE_SRC_X,
+	FAKE_PLANE_SRC_Y,
+	FAKE_PLANE_SRC_W,
+	FAKE_PLANE_SRC_H,
+	FAKE_PLANE_CRTC_X,
+	FAKE_PLANE_CRTC_Y,
+	FAKE_PLANE_CRTC_W,
+	FAKE_PLANE_CRTC_H,
+	FAKE_PLANE_IN_FENCE_FD,
+	FAKE_PLANE_ROTATION,
+	FAKE_PLANE_IN_FORMATS,
+	FAKE_PLANE_PROP_COUNT,
+};
+
+// What a property value refers to, which decides how commits reference count it.
+enum fake_value_kind {
+	FAKE_VALUE_PLAIN,
+	FAKE_VALUE_BLOB,
+	FAKE_VALUE_FB,
+};
+
+struct fake_object {
+	uint32_t id;
+	uint32_t type;
+};
+
+struct fake_property {
+	struct fake_object base;
+	char name[DRM_PROP_NAME_LEN];
+	uint32_t flags;
+	enum fake_value_kind kind;
+	size_t value_count;
+	uint64_t values[2];
+	size_t enum_count;
+	const struct drm_mode_property_enum *enums;
+};
+
+struct fake_file;
+
+struct fake_blob {
+	struct fake_object base;
+	// NULL for blobs created by the fake itself, which are never destroyed.
+	struct fake_file *owner;
+	unsigned refcount;
+	uint32_t length;
+	void *data;
+};
+
+struct fake_buffer {
+	struct fake_buffer *next;
+	ino_t ino;
+	int memfd;
+	uint64_t size;
+	uint64_t map_offset;
+	unsigned refcount;
+};
+
+struct fake_fb {
+	struct fake_object base;
+	struct fake_file *owner;
+	unsigned refcount;
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint64_t modifier;
+	size_t plane_count;
+	struct fake_buffer *buffers[FAKE_MAX_FB_PLANES];
+	uint32_t handles[FAKE_MAX_FB_PLANES];
+	uint32_t pitches[FAKE_MAX_FB_PLANES];
+	uint32_t offsets[FAKE_MAX_FB_PLANES];
+};
+
+struct fake_encoder {
+	struct fake_object base;
+	size_t index;
+	uint32_t encoder_type;
+	uint32_t possible_crtcs;
+};
+
+struct fake_connector {
+	struct fake_object base;
+	size_t index;
+	size_t value_offset;
+	uint32_t connector_type;
+	uint32_t connector_type_id;
+	bool connected;
+	// Writeback connectors only show up for files with DRM_CLIENT_CAP_WRITEBACK_CONNECTORS and
+	// capture to framebuffers of these formats.
+	bool writeback;
+	size_t format_count;
+	const uint32_t *formats;
+	uint32_t mm_width;
+	uint32_t mm_height;
+	size_t mode_count;
+	struct drm_mode_modeinfo *modes;
+	struct fake_encoder *encoder;
+};
+
+struct fake_plane {
+	struct fake_object base;
+	size_t index;
+	size_t value_offset;
+	uint32_t type;
+	uint32_t possible_crtcs;
+	size_t format_count;
+	const uint32_t *formats;
+};
+
+struct fake_crtc {
+	struct fake_object base;
+	size_t index;
+	size_t value_offset;
+	struct fake_plane *primary;
+	uint32_t gamma_size;
+	uint16_t *gamma;
+	// Vblanks happen every period_ns starting at epoch_ns, which is when the CRTC was last
+	// enabled.
+	uint64_t epoch_ns;
+	uint64_t period_ns;
+	// Time of the last flip that has not happened yet, or 0.
+	uint64_t flip_pending_ns;
+	uint32_t cursor_handle;
+	uint32_t cursor_width;
+	uint32_t cursor_height;
+	int32_t cursor_x;
+	int32_t cursor_y;
+	// The debugfs CRC control file last opened, the socket entries are sent to while the data
+	// file is open, both or -1, and the time of the last vblank reported.
+	int crc_control_fd;
+	int crc_data_fd;
+	uint64_t crc_reported_ns;
+};
+
+struct fake_card {
+	unsigned minor;
+	const struct fake_config *config;
+
+	// Indexed by object id. Blobs and framebuffers come and go, everything else is fixed.
+	struct fake_object **objects;
+	uint32_t object_capacity;
+	uint32_t next_id;
+
+	struct fake_property *connector_props[FAKE_CONNECTOR_PROP_COUNT];
+	struct fake_property *crtc_props[FAKE_CRTC_PROP_COUNT];
+	struct fake_property *plane_props[FAKE_PLANE_PROP_COUNT];
+
+	size_t connector_count;
+	struct fake_connector *connectors;
+	// The last of the connectors if the config asked for one.
+	struct fake_connector *writeback;
+	size_t encoder_count;
+	struct fake_encoder *encoders;
+	size_t crtc_count;
+	struct fake_crtc *crtcs;
+	size_t plane_count;
+	struct fake_plane *planes;
+
+	// Current value of every property of every object, laid out by each object's value_offset.
+	size_t value_count;
+	uint64_t *values;
+	enum fake_value_kind *value_kinds;
+};
+
+struct fake_event {
+	struct fake_event *next;
+	uint64_t deadline_ns;
+	struct drm_event_vblank vblank;
+};
+
+struct fake_file {
+	struct fake_file *next;
+	struct fake_card *card;
+	// The card fd handed out is the read end of a pipe. Its inode identifies the file across
+	// dup() and the write end is used to wake up poll() and select() when events are due.
+	ino_t ino;
+	int signal_fd;
+	bool signaled;
+	bool atomic;
+	bool universal_planes;
+	bool aspect_ratio;
+	bool writeback_connectors;
+	struct fake_buffer **handles;
+	size_t handle_capacity;
+	struct fake_event *events;
+};
+
+struct fake_kms {
+	pthread_mutex_t lock;
+	struct fake_config config;
+	struct fake_card cards[DRM_MAX_MINOR];
+	struct fake_file *files;
+	struct fake_buffer *buffers;
+	uint64_t next_map_offset;
+};
+
+extern struct fake_kms fake_kms;
+
+void fake_debug(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void fake_card_init(struct fake_card *card, unsigned minor, const struct fake_config *config);
+struct fake_object *fake_card_object(struct fake_card *card, uint32_t id, uint32_t type);
+struct fake_property *fake_card_property(struct fake_card *card, uint32_t id);
+size_t fake_card_object_props(struct fake_card *card, struct fake_object *object,
+			      struct fake_property ***props, size_t *value_offset);
+bool fake_card_object_has_prop(struct fake_object *object, size_t prop_index);
+bool fake_card_object_visible(struct fake_file *file, struct fake_object *object);
+struct fake_connector *fake_card_connector(struct fake_card *card, uint32_t id);
+struct fake_crtc *fake_card_crtc(struct fake_card *card, uint32_t id);
+struct fake_plane *fake_card_plane(struct fake_card *card, uint32_t id);
+struct fake_blob *fake_card_blob(struct fake_card *card, uint32_t id);
+struct fake_fb *fake_card_fb(struct fake_card *card, uint32_t id);
+struct fake_blob *fake_card_blob_new(struct fake_card *card, struct fake_file *owner,
+				     const void *data, uint32_t length);
+void fake_card_blob_unref(struct fake_card *card, struct fake_blob *blob);
+struct fake_fb *fake_card_fb_new(struct fake_card *card, struct fake_file *owner);
+void fake_card_fb_unref(struct fake_card *card, struct fake_fb *fb);
+bool fake_card_plane_has_format(struct fake_plane *plane, uint32_t format);
+
+struct fake_buffer *fake_buffer_new(uint64_t size);
+struct fake_buffer *fake_buffer_import(int fd);
+struct fake_buffer *fake_buffer_find_ino(ino_t ino);
+void fake_buffer_unref(struct fake_buffer *buffer);
+
+struct fake_file *fake_file_open(unsigned minor, int flags, int *fd);
+struct fake_file *fake_file_find(int fd);
+struct fake_file *fake_file_find_ino(ino_t ino);
+void fake_file_sweep(void);
+uint32_t fake_file_add_handle(struct fake_file *file, struct fake_buffer *buffer);
+struct fake_buffer *fake_file_handle(struct fake_file *file, uint32_t handle);
+int fake_file_close_handle(struct fake_file *file, uint32_t handle);
+
+// atomic.c
+struct fake_state;
+
+struct fake_state *fake_state_new(struct fake_card *card, struct fake_file *file);
+void fake_state_destroy(struct fake_state **state);
+int fake_state_set(struct fake_state *state, uint32_t object_id, uint32_t prop_id, uint64_t value);
+void fake_state_set_crtc(struct fake_state *state, struct fake_crtc *crtc, enum fake_crtc_prop prop,
+			 uint64_t value);
+void fake_state_set_plane(struct fake_state *state, struct fake_plane *plane,
+			  enum fake_plane_prop prop, uint64_t value);
+void fake_state_set_connector(struct fake_state *state, struct fake_connector *connector,
+			      enum fake_connector_prop prop, uint64_t value);
+int fake_state_commit(struct fake_state *state, uint32_t flags, uint64_t user_data);
+uint64_t fake_card_value(struct fake_card *card, size_t value_offset, size_t prop);
+const struct drm_mode_modeinfo *fake_card_crtc_mode(struct fake_card *card, struct fake_crtc *crtc);
+int fake_atomic_remove_fb(struct fake_card *card, struct fake_fb *fb);
+
+// event.c
+uint64_t fake_event_now(void);
+uint64_t fake_event_next_vblank(struct fake_crtc *crtc, uint64_t after_ns, uint32_t *sequence);
+void fake_event_queue(struct fake_file *file, uint32_t type, uint64_t deadline_ns,
+		      uint32_t sequence, uint32_t crtc_id, uint64_t user_data);
+int fake_event_fence_new(uint64_t deadline_ns);
+void fake_event_wake(void);
+void fake_event_dispatch(void);
+void fake_event_sleep_until(uint64_t deadline_ns);
+ssize_t fake_event_read(struct fake_file *file, int fd, void *buffer, size_t size);
+void fake_event_file_release(struct fake_file *file);
+
+// writeback.c
+void fake_writeback_compose(struct fake_card *card, struct fake_crtc *crtc, void *pixels,
+			    uint32_t pitch, uint32_t width, uint32_t height);
+void fake_writeback_capture(struct fake_card *card, struct fake_crtc *crtc, struct fake_fb *fb);
+
+// debugfs.c
+int fake_debugfs_open(const char *path, int flags);
+void fake_debugfs_crc_flush(struct fake_card *card, uint64_t now);
+uint64_t fake_debugfs_crc_dispatch(uint64_t now);
+
+// ioctl.c
+int fake_ioctl(struct fake_file *file, unsigned long request, void *arg);
+
+// preload.c
+int fake_real_ioctl(int fd, unsigned long request, void *arg);
+ssize_t fake_real_read(int fd, void *buffer, size_t size);
+void *fake_real_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+
+#endif
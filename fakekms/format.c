@@ -0,0 +1,51 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "fakekms.h"
+
+static const struct fake_format formats[] = {
+	{ DRM_FORMAT_RGB565, 1, { 2 }, 1, 1 },
+	{ DRM_FORMAT_BGR565, 1, { 2 }, 1, 1 },
+	{ DRM_FORMAT_RGB888, 1, { 3 }, 1, 1 },
+	{ DRM_FORMAT_BGR888, 1, { 3 }, 1, 1 },
+	{ DRM_FORMAT_XRGB8888, 1, { 4 }, 1, 1 },
+	{ DRM_FORMAT_XBGR8888, 1, { 4 }, 1, 1 },
+	{ DRM_FORMAT_ARGB8888, 1, { 4 }, 1, 1 },
+	{ DRM_FORMAT_ABGR8888, 1, { 4 }, 1, 1 },
+	{ DRM_FORMAT_RGBX8888, 1, { 4 }, 1, 1 },
+	{ DRM_FORMAT_BGRX8888, 1, { 4 }, 1, 1 },
+	{ DRM_FORMAT_RGBA8888, 1, { 4 }, 1, 1 },
+	{ DRM_FORMAT_BGRA8888, 1, { 4 }, 1, 1 },
+	{ DRM_FORMAT_XRGB2101010, 1, { 4 }, 1, 1 },
+	{ DRM_FORMAT_XBGR2101010, 1, { 4 }, 1, 1 },
+	{ DRM_FORMAT_ARGB2101010, 1, { 4 }, 1, 1 },
+	{ DRM_FORMAT_YUYV, 1, { 2 }, 1, 1 },
+	{ DRM_FORMAT_UYVY, 1, { 2 }, 1, 1 },
+	{ DRM_FORMAT_NV12, 2, { 1, 2 }, 2, 2 },
+	{ DRM_FORMAT_NV21, 2, { 1, 2 }, 2, 2 },
+	{ DRM_FORMAT_YUV420, 3, { 1, 1, 1 }, 2, 2 },
+	{ DRM_FORMAT_YVU420, 3, { 1, 1, 1 }, 2, 2 },
+};
+
+const struct fake_format *fake_format_find(uint32_t format)
+{
+	for (size_t i = 0; i < FAKE_ARRAY_LEN(formats); i++)
+		if (formats[i].format == format)
+			return &formats[i];
+	return NULL;
+}
+
+uint32_t fake_format_plane_width(const struct fake_format *format, size_t plane, uint32_t width)
+{
+	assert(format);
+	return plane ? FAKE_DIV_ROUND_UP(width, format->hsub) : width;
+}
+
+uint32_t fake_format_plane_height(const struct fake_format *format, size_t plane, uint32_t height)
+{
+	assert(format);
+	return plane ? FAKE_DIV_ROUND_UP(height, format->vsub) : height;
+}
@@ -0,0 +1,291 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "fakekms.h"
+
+#include <gbm.h>
+
+// A real gbm backend would allocate from a driver that doesn't exist here, so gbm is replaced
+// outright with linear buffers allocated the same way as dumb buffers.
+
+#define FAKE_GBM_STRIDE_ALIGN 64
+
+struct gbm_device {
+	int fd;
+};
+
+struct gbm_bo {
+	struct gbm_device *gbm;
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint64_t modifier;
+	size_t plane_count;
+	uint32_t strides[FAKE_MAX_FB_PLANES];
+	uint32_t offsets[FAKE_MAX_FB_PLANES];
+	uint32_t sizes[FAKE_MAX_FB_PLANES];
+	uint64_t size;
+	uint32_t handle;
+	// A reference of our own to the buffer, which outlives the handle if the card fd is closed
+	// first.
+	int memfd;
+	void *user_data;
+	void (*destroy_user_data)(struct gbm_bo *, void *);
+};
+
+struct fake_map {
+	void *addr;
+	size_t length;
+};
+
+FAKE_EXPORT struct gbm_device *gbm_create_device(int fd)
+{
+	pthread_mutex_lock(&fake_kms.lock);
+	struct fake_file *file = fake_file_find(fd);
+	pthread_mutex_unlock(&fake_kms.lock);
+	if (!file) {
+		fake_debug("gbm device requested for fd %d, which is not a fake card", fd);
+		errno = ENODEV;
+		return NULL;
+	}
+
+	struct gbm_device *gbm = calloc(1, sizeof(struct gbm_device));
+	assert(gbm);
+	gbm->fd = fd;
+	return gbm;
+}
+
+FAKE_EXPORT void gbm_device_destroy(struct gbm_device *gbm)
+{
+	free(gbm);
+}
+
+FAKE_EXPORT int gbm_device_get_fd(struct gbm_device *gbm)
+{
+	return gbm->fd;
+}
+
+FAKE_EXPORT const char *gbm_device_get_backend_name(struct gbm_device *gbm)
+{
+	return "fakekms";
+}
+
+FAKE_EXPORT int gbm_device_is_format_supported(struct gbm_device *gbm, uint32_t format,
+					       uint32_t usage)
+{
+	return fake_format_find(format) != NULL;
+}
+
+FAKE_EXPORT struct gbm_bo *gbm_bo_create(struct gbm_device *gbm, uint32_t width, uint32_t height,
+					 uint32_t format, uint32_t flags)
+{
+	const struct fake_format *fake_format = fake_format_find(format);
+	if (!fake_format || !width || !height) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	struct gbm_bo *bo = calloc(1, sizeof(struct gbm_bo));
+	assert(bo);
+	bo->gbm = gbm;
+	bo->width = width;
+	bo->height = height;
+	bo->format = format;
+	bo->modifier = DRM_FORMAT_MOD_LINEAR;
+	bo->plane_count = fake_format->plane_count;
+	for (size_t p = 0; p < bo->plane_count; p++) {
+		uint32_t plane_width = fake_format_plane_width(fake_format, p, width);
+		uint32_t plane_height = fake_format_plane_height(fake_format, p, height);
+		bo->strides[p] =
+		    FAKE_ALIGN(plane_width * fake_format->cpp[p], FAKE_GBM_STRIDE_ALIGN);
+		bo->offsets[p] = bo->size;
+		bo->sizes[p] = bo->strides[p] * plane_height;
+		bo->size += bo->sizes[p];
+	}
+
+	pthread_mutex_lock(&fake_kms.lock);
+	struct fake_file *file = fake_file_find(gbm->fd);
+	struct fake_buffer *buffer = file ? fake_buffer_new(bo->size) : NULL;
+	if (buffer) {
+		bo->handle = fake_file_add_handle(file, buffer);
+		bo->memfd = fcntl(buffer->memfd, F_DUPFD_CLOEXEC, 0);
+	}
+	pthread_mutex_unlock(&fake_kms.lock);
+
+	if (!buffer || bo->memfd < 0) {
+		free(bo);
+		errno = ENOMEM;
+		return NULL;
+	}
+	return bo;
+}
+
+FAKE_EXPORT struct gbm_bo *gbm_bo_create_with_modifiers(struct gbm_device *gbm, uint32_t width,
+							uint32_t height, uint32_t format,
+							const uint64_t *modifiers,
+							const unsigned int count)
+{
+	for (unsigned int i = 0; i < count; i++)
+		if (modifiers[i] == DRM_FORMAT_MOD_LINEAR || modifiers[i] == DRM_FORMAT_MOD_INVALID)
+			return gbm_bo_create(gbm, width, height, format, GBM_BO_USE_LINEAR);
+
+	errno = EINVAL;
+	return NULL;
+}
+
+FAKE_EXPORT struct gbm_bo *gbm_bo_import(struct gbm_device *gbm, uint32_t type, void *buffer,
+					 uint32_t usage)
+{
+	fake_debug("gbm_bo_import is not supported");
+	errno = ENOSYS;
+	return NULL;
+}
+
+FAKE_EXPORT void gbm_bo_destroy(struct gbm_bo *bo)
+{
+	if (bo->destroy_user_data)
+		bo->destroy_user_data(bo, bo->user_data);
+
+	pthread_mutex_lock(&fake_kms.lock);
+	struct fake_file *file = fake_file_find(bo->gbm->fd);
+	if (file)
+		fake_file_close_handle(file, bo->handle);
+	pthread_mutex_unlock(&fake_kms.lock);
+
+	close(bo->memfd);
+	free(bo);
+}
+
+FAKE_EXPORT void *gbm_bo_map(struct gbm_bo *bo, uint32_t x, uint32_t y, uint32_t width,
+			     uint32_t height, uint32_t flags, uint32_t *stride, void **map_data,
+			     size_t plane)
+{
+	if (plane >= bo->plane_count || !flags) {
+		errno = EINVAL;
+		return MAP_FAILED;
+	}
+
+	int prot = 0;
+	if (flags & GBM_BO_TRANSFER_READ)
+		prot |= PROT_READ;
+	if (flags & GBM_BO_TRANSFER_WRITE)
+		prot |= PROT_WRITE;
+
+	void *addr = mmap(NULL, bo->size, prot, MAP_SHARED, bo->memfd, 0);
+	if (addr == MAP_FAILED)
+		return MAP_FAILED;
+
+	struct fake_map *map = calloc(1, sizeof(struct fake_map));
+	assert(map);
+	map->addr = addr;
+	map->length = bo->size;
+	*map_data = map;
+	*stride = bo->strides[plane];
+
+	const struct fake_format *format = fake_format_find(bo->format);
+	return (uint8_t *)addr + bo->offsets[plane] + y * bo->strides[plane] +
+	       x * format->cpp[plane];
+}
+
+FAKE_EXPORT void gbm_bo_unmap(struct gbm_bo *bo, void *map_data)
+{
+	struct fake_map *map = map_data;
+	munmap(map->addr, map->length);
+	free(map);
+}
+
+FAKE_EXPORT uint32_t gbm_bo_get_width(struct gbm_bo *bo)
+{
+	return bo->width;
+}
+
+FAKE_EXPORT uint32_t gbm_bo_get_height(struct gbm_bo *bo)
+{
+	return bo->height;
+}
+
+FAKE_EXPORT uint32_t gbm_bo_get_stride(struct gbm_bo *bo)
+{
+	return bo->strides[0];
+}
+
+FAKE_EXPORT uint32_t gbm_bo_get_stride_or_tiling(struct gbm_bo *bo)
+{
+	return bo->strides[0];
+}
+
+FAKE_EXPORT uint32_t gbm_bo_get_format(struct gbm_bo *bo)
+{
+	return bo->format;
+}
+
+FAKE_EXPORT uint64_t gbm_bo_get_format_modifier(struct gbm_bo *bo)
+{
+	return bo->modifier;
+}
+
+FAKE_EXPORT struct gbm_device *gbm_bo_get_device(struct gbm_bo *bo)
+{
+	return bo->gbm;
+}
+
+FAKE_EXPORT union gbm_bo_handle gbm_bo_get_handle(struct gbm_bo *bo)
+{
+	union gbm_bo_handle handle = { .u64 = 0 };
+	handle.u32 = bo->handle;
+	return handle;
+}
+
+FAKE_EXPORT int gbm_bo_get_fd(struct gbm_bo *bo)
+{
+	return fcntl(bo->memfd, F_DUPFD_CLOEXEC, 0);
+}
+
+FAKE_EXPORT size_t gbm_bo_get_num_planes(struct gbm_bo *bo)
+{
+	return bo->plane_count;
+}
+
+// Every plane lives in the one buffer.
+FAKE_EXPORT union gbm_bo_handle gbm_bo_get_plane_handle(struct gbm_bo *bo, size_t plane)
+{
+	return gbm_bo_get_handle(bo);
+}
+
+FAKE_EXPORT int gbm_bo_get_plane_fd(struct gbm_bo *bo, size_t plane)
+{
+	return gbm_bo_get_fd(bo);
+}
+
+FAKE_EXPORT uint32_t gbm_bo_get_plane_offset(struct gbm_bo *bo, size_t plane)
+{
+	assert(plane < bo->plane_count);
+	return bo->offsets[plane];
+}
+
+FAKE_EXPORT uint32_t gbm_bo_get_plane_size(struct gbm_bo *bo, size_t plane)
+{
+	assert(plane < bo->plane_count);
+	return bo->sizes[plane];
+}
+
+FAKE_EXPORT uint32_t gbm_bo_get_plane_stride(struct gbm_bo *bo, size_t plane)
+{
+	assert(plane < bo->plane_count);
+	return bo->strides[plane];
+}
+
+FAKE_EXPORT void gbm_bo_set_user_data(struct gbm_bo *bo, void *data,
+				      void (*destroy_user_data)(struct gbm_bo *, void *))
+{
+	bo->user_data = data;
+	bo->destroy_user_data = destroy_user_data;
+}
+
+FAKE_EXPORT void *gbm_bo_get_user_data(struct gbm_bo *bo)
+{
+	return bo->user_data;
+}
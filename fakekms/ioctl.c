@@ -0,0 +1,932 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "fakekms.h"
+
+#define FAKE_MAX_FB_SIZE 8192
+
+#define USER_PTR(p) ((void *)(uintptr_t)(p))
+
+// Like the kernel, arrays are only copied out when the caller made room for all of them, and the
+// count is always updated so the caller can retry with a bigger array.
+static void copy_array(uint64_t user_ptr, uint32_t *user_count, const void *src, size_t count,
+		       size_t elem_size)
+{
+	if (user_ptr && *user_count >= count && count)
+		memcpy(USER_PTR(user_ptr), src, count * elem_size);
+	*user_count = count;
+}
+
+static void copy_string(char *user_str, size_t *user_len, const char *str)
+{
+	size_t len = strlen(str);
+	if (user_str && *user_len)
+		memcpy(user_str, str, *user_len < len ? *user_len : len);
+	*user_len = len;
+}
+
+static bool prop_visible(struct fake_file *file, const struct fake_property *prop)
+{
+	return file->atomic || !(prop->flags & DRM_MODE_PROP_ATOMIC);
+}
+
+static bool plane_visible(struct fake_file *file, const struct fake_plane *plane)
+{
+	return file->universal_planes || plane->type == DRM_PLANE_TYPE_OVERLAY;
+}
+
+static struct fake_crtc *connector_crtc(struct fake_card *card, struct fake_connector *connector)
+{
+	return fake_card_crtc(
+	    card, fake_card_value(card, connector->value_offset, FAKE_CONNECTOR_CRTC_ID));
+}
+
+static uint32_t plane_value(struct fake_card *card, struct fake_plane *plane,
+			    enum fake_plane_prop prop)
+{
+	return fake_card_value(card, plane->value_offset, prop);
+}
+
+static int ioctl_version(struct fake_file *file, struct drm_version *version)
+{
+	version->version_major = 1;
+	version->version_minor = 0;
+	version->version_patchlevel = 0;
+	copy_string(version->name, &version->name_len, file->card->config->driver);
+	copy_string(version->date, &version->date_len, "20180101");
+	copy_string(version->desc, &version->desc_len, "Fake KMS");
+	return 0;
+}
+
+static int ioctl_get_cap(struct fake_file *file, struct drm_get_cap *cap)
+{
+	const struct fake_config *config = file->card->config;
+	switch (cap->capability) {
+		case DRM_CAP_DUMB_BUFFER:
+		case DRM_CAP_VBLANK_HIGH_CRTC:
+		case DRM_CAP_TIMESTAMP_MONOTONIC:
+		case DRM_CAP_ADDFB2_MODIFIERS:
+		case DRM_CAP_CRTC_IN_VBLANK_EVENT:
+			cap->value = 1;
+			return 0;
+		case DRM_CAP_DUMB_PREFERRED_DEPTH:
+			cap->value = 24;
+			return 0;
+		case DRM_CAP_DUMB_PREFER_SHADOW:
+		case DRM_CAP_ASYNC_PAGE_FLIP:
+		case DRM_CAP_PAGE_FLIP_TARGET:
+			cap->value = 0;
+			return 0;
+		case DRM_CAP_PRIME:
+			cap->value = DRM_PRIME_CAP_IMPORT | DRM_PRIME_CAP_EXPORT;
+			return 0;
+		case DRM_CAP_CURSOR_WIDTH:
+		case DRM_CAP_CURSOR_HEIGHT:
+			cap->value = config->cursor_size;
+			return 0;
+		default:
+			return -EINVAL;
+	}
+}
+
+static int ioctl_set_client_cap(struct fake_file *file, struct drm_set_client_cap *cap)
+{
+	if (cap->value > 1)
+		return -EINVAL;
+
+	switch (cap->capability) {
+		case DRM_CLIENT_CAP_STEREO_3D:
+			return 0;
+		case DRM_CLIENT_CAP_UNIVERSAL_PLANES:
+			file->universal_planes = cap->value;
+			return 0;
+		case DRM_CLIENT_CAP_ATOMIC:
+			file->atomic = cap->value;
+			if (cap->value)
+				file->universal_planes = true;
+			return 0;
+		case DRM_CLIENT_CAP_ASPECT_RATIO:
+			file->aspect_ratio = cap->value;
+			return 0;
+		case DRM_CLIENT_CAP_WRITEBACK_CONNECTORS:
+			if (!file->atomic)
+				return -EINVAL;
+			file->writeback_connectors = cap->value;
+			return 0;
+		default:
+			return -EINVAL;
+	}
+}
+
+static int ioctl_wait_vblank(struct fake_file *file, union drm_wait_vblank *vbl)
+{
+	struct fake_card *card = file->card;
+	uint32_t type = vbl->request.type;
+	size_t crtc_index = (type & _DRM_VBLANK_HIGH_CRTC_MASK) >> _DRM_VBLANK_HIGH_CRTC_SHIFT;
+	if (type & _DRM_VBLANK_SECONDARY)
+		crtc_index = 1;
+	if (crtc_index >= card->crtc_count)
+		return -EINVAL;
+
+	struct fake_crtc *crtc = &card->crtcs[crtc_index];
+	if (!fake_card_value(card, crtc->value_offset, FAKE_CRTC_ACTIVE))
+		return -EINVAL;
+
+	uint64_t now = fake_event_now();
+	uint32_t current = (now - crtc->epoch_ns) / crtc->period_ns;
+	uint32_t sequence = vbl->request.sequence;
+	if (type & _DRM_VBLANK_RELATIVE)
+		sequence += current;
+	if ((int32_t)(sequence - current) <= 0)
+		sequence = current;
+
+	uint64_t deadline = crtc->epoch_ns + (uint64_t)sequence * crtc->period_ns;
+	if (type & _DRM_VBLANK_EVENT) {
+		fake_event_queue(file, DRM_EVENT_VBLANK, deadline, sequence, crtc->base.id,
+				 vbl->request.signal);
+		vbl->reply.sequence = sequence;
+		return 0;
+	}
+
+	if (deadline > now)
+		fake_event_sleep_until(deadline);
+	vbl->reply.sequence = sequence;
+	vbl->reply.tval_sec = deadline / 1000000000ull;
+	vbl->reply.tval_usec = (deadline % 1000000000ull) / 1000;
+	return 0;
+}
+
+static int ioctl_get_resources(struct fake_file *file, struct drm_mode_card_res *res)
+{
+	struct fake_card *card = file->card;
+	// Only the caller's own framebuffers are listed.
+	uint32_t fb_count = 0;
+	uint32_t *fb_ids = USER_PTR(res->fb_id_ptr);
+	for (uint32_t id = 1; id < card->next_id; id++) {
+		struct fake_fb *fb = fake_card_fb(card, id);
+		if (!fb || fb->owner != file)
+			continue;
+		if (fb_ids && fb_count < res->count_fbs)
+			fb_ids[fb_count] = id;
+		fb_count++;
+	}
+	res->count_fbs = fb_count;
+
+	uint32_t crtc_ids[FAKE_MAX_CRTCS];
+	for (size_t i = 0; i < card->crtc_count; i++)
+		crtc_ids[i] = card->crtcs[i].base.id;
+	copy_array(res->crtc_id_ptr, &res->count_crtcs, crtc_ids, card->crtc_count,
+		   sizeof(crtc_ids[0]));
+
+	uint32_t *connector_ids = calloc(card->connector_count + 1, sizeof(uint32_t));
+	uint32_t *encoder_ids = calloc(card->encoder_count + 1, sizeof(uint32_t));
+	assert(connector_ids && encoder_ids);
+	size_t connector_count = 0;
+	for (size_t i = 0; i < card->connector_count; i++) {
+		if (fake_card_object_visible(file, &card->connectors[i].base))
+			connector_ids[connector_count++] = card->connectors[i].base.id;
+	}
+	for (size_t i = 0; i < card->encoder_count; i++)
+		encoder_ids[i] = card->encoders[i].base.id;
+	copy_array(res->connector_id_ptr, &res->count_connectors, connector_ids, connector_count,
+		   sizeof(uint32_t));
+	copy_array(res->encoder_id_ptr, &res->count_encoders, encoder_ids, card->encoder_count,
+		   sizeof(uint32_t));
+	free(connector_ids);
+	free(encoder_ids);
+
+	res->min_width = 1;
+	res->min_height = 1;
+	res->max_width = FAKE_MAX_FB_SIZE;
+	res->max_height = FAKE_MAX_FB_SIZE;
+	return 0;
+}
+
+// Fills in the properties of object the caller is allowed to see.
+static size_t object_visible_props(struct fake_file *file, struct fake_object *object,
+				   uint32_t *ids, uint64_t *values)
+{
+	struct fake_card *card = file->card;
+	struct fake_property **props;
+	size_t value_offset;
+	size_t prop_count = fake_card_object_props(card, object, &props, &value_offset);
+	size_t count = 0;
+	for (size_t i = 0; i < prop_count; i++) {
+		if (!prop_visible(file, props[i]) || !fake_card_object_has_prop(object, i))
+			continue;
+		ids[count] = props[i]->base.id;
+		values[count] = card->values[value_offset + i];
+		count++;
+	}
+	return count;
+}
+
+static void copy_props(struct fake_file *file, struct fake_object *object, uint64_t props_ptr,
+		       uint64_t values_ptr, uint32_t *user_count)
+{
+	uint32_t ids[FAKE_PLANE_PROP_COUNT];
+	uint64_t values[FAKE_PLANE_PROP_COUNT];
+	size_t count = object_visible_props(file, object, ids, values);
+	uint32_t values_count = *user_count;
+	copy_array(props_ptr, user_count, ids, count, sizeof(ids[0]));
+	copy_array(values_ptr, &values_count, values, count, sizeof(values[0]));
+}
+
+static int ioctl_get_connector(struct fake_file *file, struct drm_mode_get_connector *conn)
+{
+	struct fake_card *card = file->card;
+	struct fake_connector *connector = fake_card_connector(card, conn->connector_id);
+	if (!connector || !fake_card_object_visible(file, &connector->base))
+		return -ENOENT;
+
+	conn->connector_type = connector->connector_type;
+	conn->connector_type_id = connector->connector_type_id;
+	conn->connection = connector->connected ? DRM_MODE_CONNECTED : DRM_MODE_DISCONNECTED;
+	conn->mm_width = connector->mm_width;
+	conn->mm_height = connector->mm_height;
+	conn->subpixel = DRM_MODE_SUBPIXEL_UNKNOWN;
+	conn->encoder_id = connector_crtc(card, connector) ? connector->encoder->base.id : 0;
+
+	copy_array(conn->modes_ptr, &conn->count_modes, connector->modes, connector->mode_count,
+		   sizeof(connector->modes[0]));
+	copy_array(conn->encoders_ptr, &conn->count_encoders, &connector->encoder->base.id, 1,
+		   sizeof(uint32_t));
+	copy_props(file, &connector->base, conn->props_ptr, conn->prop_values_ptr,
+		   &conn->count_props);
+	return 0;
+}
+
+static int ioctl_get_encoder(struct fake_file *file, struct drm_mode_get_encoder *enc)
+{
+	struct fake_card *card = file->card;
+	struct fake_encoder *encoder =
+	    (struct fake_encoder *)fake_card_object(card, enc->encoder_id, DRM_MODE_OBJECT_ENCODER);
+	if (!encoder)
+		return -ENOENT;
+
+	struct fake_crtc *crtc = connector_crtc(card, &card->connectors[encoder->index]);
+	enc->encoder_type = encoder->encoder_type;
+	enc->crtc_id = crtc ? crtc->base.id : 0;
+	enc->possible_crtcs = encoder->possible_crtcs;
+	enc->possible_clones = 0;
+	return 0;
+}
+
+static int ioctl_get_crtc(struct fake_file *file, struct drm_mode_crtc *crtc_resp)
+{
+	struct fake_card *card = file->card;
+	struct fake_crtc *crtc = fake_card_crtc(card, crtc_resp->crtc_id);
+	if (!crtc)
+		return -ENOENT;
+
+	const struct drm_mode_modeinfo *mode = fake_card_crtc_mode(card, crtc);
+	crtc_resp->gamma_size = crtc->gamma_size;
+	crtc_resp->fb_id = plane_value(card, crtc->primary, FAKE_PLANE_FB_ID);
+	crtc_resp->x = plane_value(card, crtc->primary, FAKE_PLANE_SRC_X) >> 16;
+	crtc_resp->y = plane_value(card, crtc->primary, FAKE_PLANE_SRC_Y) >> 16;
+	crtc_resp->mode_valid = mode != NULL;
+	if (mode)
+		memcpy(&crtc_resp->mode, mode, sizeof(*mode));
+	else
+		memset(&crtc_resp->mode, 0, sizeof(crtc_resp->mode));
+	return 0;
+}
+
+static int ioctl_get_plane_resources(struct fake_file *file, struct drm_mode_get_plane_res *res)
+{
+	struct fake_card *card = file->card;
+	uint32_t *ids = calloc(card->plane_count + 1, sizeof(uint32_t));
+	assert(ids);
+	size_t count = 0;
+	for (size_t i = 0; i < card->plane_count; i++)
+		if (plane_visible(file, &card->planes[i]))
+			ids[count++] = card->planes[i].base.id;
+	copy_array(res->plane_id_ptr, &res->count_planes, ids, count, sizeof(ids[0]));
+	free(ids);
+	return 0;
+}
+
+static int ioctl_get_plane(struct fake_file *file, struct drm_mode_get_plane *plane_resp)
+{
+	struct fake_card *card = file->card;
+	struct fake_plane *plane = fake_card_plane(card, plane_resp->plane_id);
+	if (!plane)
+		return -ENOENT;
+
+	plane_resp->crtc_id = plane_value(card, plane, FAKE_PLANE_CRTC_ID);
+	plane_resp->fb_id = plane_value(card, plane, FAKE_PLANE_FB_ID);
+	plane_resp->possible_crtcs = plane->possible_crtcs;
+	plane_resp->gamma_size = 0;
+	copy_array(plane_resp->format_type_ptr, &plane_resp->count_format_types, plane->formats,
+		   plane->format_count, sizeof(plane->formats[0]));
+	return 0;
+}
+
+static int ioctl_obj_get_properties(struct fake_file *file,
+				    struct drm_mode_obj_get_properties *arg)
+{
+	struct fake_object *object = fake_card_object(file->card, arg->obj_id, arg->obj_type);
+	if (!object)
+		return -ENOENT;
+	if (object->type == DRM_MODE_OBJECT_PLANE &&
+	    !plane_visible(file, (struct fake_plane *)object))
+		return -ENOENT;
+	if (!fake_card_object_visible(file, object))
+		return -ENOENT;
+
+	copy_props(file, object, arg->props_ptr, arg->prop_values_ptr, &arg->count_props);
+	return 0;
+}
+
+static int ioctl_get_property(struct fake_file *file, struct drm_mode_get_property *arg)
+{
+	struct fake_property *prop = fake_card_property(file->card, arg->prop_id);
+	if (!prop || !prop_visible(file, prop))
+		return -ENOENT;
+
+	memcpy(arg->name, prop->name, sizeof(arg->name));
+	arg->flags = prop->flags;
+
+	if (prop->enums) {
+		uint64_t values[8];
+		assert(prop->enum_count <= FAKE_ARRAY_LEN(values));
+		for (size_t i = 0; i < prop->enum_count; i++)
+			values[i] = prop->enums[i].value;
+		copy_array(arg->values_ptr, &arg->count_values, values, prop->enum_count,
+			   sizeof(values[0]));
+		copy_array(arg->enum_blob_ptr, &arg->count_enum_blobs, prop->enums,
+			   prop->enum_count, sizeof(prop->enums[0]));
+	} else {
+		copy_array(arg->values_ptr, &arg->count_values, prop->values, prop->value_count,
+			   sizeof(prop->values[0]));
+		arg->count_enum_blobs = 0;
+	}
+	return 0;
+}
+
+static int ioctl_get_prop_blob(struct fake_file *file, struct drm_mode_get_blob *arg)
+{
+	struct fake_blob *blob = fake_card_blob(file->card, arg->blob_id);
+	if (!blob)
+		return -ENOENT;
+
+	if (arg->length == blob->length && arg->data)
+		memcpy(USER_PTR(arg->data), blob->data, blob->length);
+	arg->length = blob->length;
+	return 0;
+}
+
+static int ioctl_create_prop_blob(struct fake_file *file, struct drm_mode_create_blob *arg)
+{
+	if (!arg->length || !arg->data)
+		return -EINVAL;
+
+	struct fake_blob *blob =
+	    fake_card_blob_new(file->card, file, USER_PTR(arg->data), arg->length);
+	arg->blob_id = blob->base.id;
+	return 0;
+}
+
+static int ioctl_destroy_prop_blob(struct fake_file *file, struct drm_mode_destroy_blob *arg)
+{
+	struct fake_blob *blob = fake_card_blob(file->card, arg->blob_id);
+	if (!blob || !blob->owner)
+		return -ENOENT;
+	if (blob->owner != file)
+		return -EPERM;
+
+	blob->owner = NULL;
+	fake_card_blob_unref(file->card, blob);
+	return 0;
+}
+
+static int add_fb(struct fake_file *file, struct drm_mode_fb_cmd2 *cmd)
+{
+	if (cmd->flags & ~DRM_MODE_FB_MODIFIERS)
+		return -EINVAL;
+
+	const struct fake_format *format = fake_format_find(cmd->pixel_format);
+	if (!format) {
+		fake_debug("framebuffer format %.4s is unsupported", (char *)&cmd->pixel_format);
+		return -EINVAL;
+	}
+
+	if (!cmd->width || !cmd->height || cmd->width > FAKE_MAX_FB_SIZE ||
+	    cmd->height > FAKE_MAX_FB_SIZE)
+		return -EINVAL;
+
+	uint64_t modifier = DRM_FORMAT_MOD_LINEAR;
+	if (cmd->flags & DRM_MODE_FB_MODIFIERS)
+		modifier = cmd->modifier[0];
+
+	struct fake_buffer *buffers[FAKE_MAX_FB_PLANES] = { NULL };
+	for (size_t i = 0; i < format->plane_count; i++) {
+		buffers[i] = fake_file_handle(file, cmd->handles[i]);
+		if (!buffers[i])
+			return -ENOENT;
+
+		if ((cmd->flags & DRM_MODE_FB_MODIFIERS) && cmd->modifier[i] != modifier)
+			return -EINVAL;
+
+		uint64_t width = fake_format_plane_width(format, i, cmd->width);
+		uint64_t height = fake_format_plane_height(format, i, cmd->height);
+		if (cmd->pitches[i] < width * format->cpp[i])
+			return -EINVAL;
+		if ((uint64_t)cmd->offsets[i] + (uint64_t)cmd->pitches[i] * height >
+		    buffers[i]->size)
+			return -EINVAL;
+	}
+
+	// Only linear buffers exist here, so there is nothing else a framebuffer could describe.
+	if (modifier != DRM_FORMAT_MOD_LINEAR)
+		return -EINVAL;
+
+	struct fake_fb *fb = fake_card_fb_new(file->card, file);
+	fb->width = cmd->width;
+	fb->height = cmd->height;
+	fb->format = cmd->pixel_format;
+	fb->modifier = modifier;
+	fb->plane_count = format->plane_count;
+	for (size_t i = 0; i < format->plane_count; i++) {
+		fb->buffers[i] = buffers[i];
+		buffers[i]->refcount++;
+		fb->handles[i] = cmd->handles[i];
+		fb->pitches[i] = cmd->pitches[i];
+		fb->offsets[i] = cmd->offsets[i];
+	}
+	cmd->fb_id = fb->base.id;
+	return 0;
+}
+
+static const struct {
+	uint32_t bpp;
+	uint32_t depth;
+	uint32_t format;
+} legacy_formats[] = {
+	{ 16, 16, DRM_FORMAT_RGB565 },	      { 24, 24, DRM_FORMAT_RGB888 },
+	{ 32, 24, DRM_FORMAT_XRGB8888 },      { 32, 32, DRM_FORMAT_ARGB8888 },
+	{ 32, 30, DRM_FORMAT_XRGB2101010 },
+};
+
+static int ioctl_add_fb(struct fake_file *file, struct drm_mode_fb_cmd *cmd)
+{
+	struct drm_mode_fb_cmd2 cmd2 = { 0 };
+	for (size_t i = 0; i < FAKE_ARRAY_LEN(legacy_formats); i++)
+		if (legacy_formats[i].bpp == cmd->bpp && legacy_formats[i].depth == cmd->depth)
+			cmd2.pixel_format = legacy_formats[i].format;
+	if (!cmd2.pixel_format)
+		return -EINVAL;
+
+	cmd2.width = cmd->width;
+	cmd2.height = cmd->height;
+	cmd2.handles[0] = cmd->handle;
+	cmd2.pitches[0] = cmd->pitch;
+	int ret = add_fb(file, &cmd2);
+	cmd->fb_id = cmd2.fb_id;
+	return ret;
+}
+
+static int ioctl_rm_fb(struct fake_file *file, uint32_t *fb_id)
+{
+	struct fake_fb *fb = fake_card_fb(file->card, *fb_id);
+	if (!fb || fb->owner != file)
+		return -ENOENT;
+
+	fake_atomic_remove_fb(file->card, fb);
+	fb->owner = NULL;
+	fake_card_fb_unref(file->card, fb);
+	return 0;
+}
+
+static int ioctl_get_fb(struct fake_file *file, struct drm_mode_fb_cmd *cmd)
+{
+	struct fake_fb *fb = fake_card_fb(file->card, cmd->fb_id);
+	if (!fb)
+		return -ENOENT;
+
+	cmd->width = fb->width;
+	cmd->height = fb->height;
+	cmd->pitch = fb->pitches[0];
+	cmd->bpp = 0;
+	cmd->depth = 0;
+	for (size_t i = 0; i < FAKE_ARRAY_LEN(legacy_formats); i++) {
+		if (legacy_formats[i].format == fb->format) {
+			cmd->bpp = legacy_formats[i].bpp;
+			cmd->depth = legacy_formats[i].depth;
+		}
+	}
+
+	// The caller gets a handle of its own, the same as the kernel does for a master.
+	fb->buffers[0]->refcount++;
+	cmd->handle = fake_file_add_handle(file, fb->buffers[0]);
+	return 0;
+}
+
+static void state_disable_crtc(struct fake_card *card, struct fake_state *state,
+			       struct fake_crtc *crtc)
+{
+	fake_state_set_crtc(state, crtc, FAKE_CRTC_ACTIVE, 0);
+	fake_state_set_crtc(state, crtc, FAKE_CRTC_MODE_ID, 0);
+	for (size_t i = 0; i < card->plane_count; i++) {
+		struct fake_plane *plane = &card->planes[i];
+		if (plane_value(card, plane, FAKE_PLANE_CRTC_ID) != crtc->base.id)
+			continue;
+		fake_state_set_plane(state, plane, FAKE_PLANE_FB_ID, 0);
+		fake_state_set_plane(state, plane, FAKE_PLANE_CRTC_ID, 0);
+	}
+	for (size_t i = 0; i < card->connector_count; i++)
+		if (connector_crtc(card, &card->connectors[i]) == crtc)
+			fake_state_set_connector(state, &card->connectors[i],
+						 FAKE_CONNECTOR_CRTC_ID, 0);
+}
+
+static void state_set_plane_rect(struct fake_state *state, struct fake_plane *plane, int32_t crtc_x,
+				 int32_t crtc_y, uint32_t crtc_w, uint32_t crtc_h, uint32_t src_x,
+				 uint32_t src_y, uint32_t src_w, uint32_t src_h)
+{
+	fake_state_set_plane(state, plane, FAKE_PLANE_CRTC_X, (uint64_t)(int64_t)crtc_x);
+	fake_state_set_plane(state, plane, FAKE_PLANE_CRTC_Y, (uint64_t)(int64_t)crtc_y);
+	fake_state_set_plane(state, plane, FAKE_PLANE_CRTC_W, crtc_w);
+	fake_state_set_plane(state, plane, FAKE_PLANE_CRTC_H, crtc_h);
+	fake_state_set_plane(state, plane, FAKE_PLANE_SRC_X, src_x);
+	fake_state_set_plane(state, plane, FAKE_PLANE_SRC_Y, src_y);
+	fake_state_set_plane(state, plane, FAKE_PLANE_SRC_W, src_w);
+	fake_state_set_plane(state, plane, FAKE_PLANE_SRC_H, src_h);
+}
+
+static int ioctl_set_crtc(struct fake_file *file, struct drm_mode_crtc *arg)
+{
+	struct fake_card *card = file->card;
+	struct fake_crtc *crtc = fake_card_crtc(card, arg->crtc_id);
+	if (!crtc)
+		return -ENOENT;
+
+	struct fake_state *state = fake_state_new(card, file);
+	struct fake_blob *mode_blob = NULL;
+	int ret = 0;
+
+	if (!arg->mode_valid) {
+		if (arg->fb_id || arg->count_connectors)
+			ret = -EINVAL;
+		else
+			state_disable_crtc(card, state, crtc);
+		goto out;
+	}
+
+	uint32_t fb_id = arg->fb_id;
+	if (fb_id == (uint32_t)-1)
+		fb_id = plane_value(card, crtc->primary, FAKE_PLANE_FB_ID);
+	if (!fake_card_fb(card, fb_id) || !arg->count_connectors) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	const uint32_t *connector_ids = USER_PTR(arg->set_connectors_ptr);
+	for (size_t i = 0; i < card->connector_count; i++) {
+		struct fake_connector *connector = &card->connectors[i];
+		bool listed = false;
+		for (uint32_t c = 0; c < arg->count_connectors; c++)
+			listed |= connector_ids[c] == connector->base.id;
+		if (listed)
+			fake_state_set_connector(state, connector, FAKE_CONNECTOR_CRTC_ID,
+						 crtc->base.id);
+		else if (connector_crtc(card, connector) == crtc)
+			fake_state_set_connector(state, connector, FAKE_CONNECTOR_CRTC_ID, 0);
+	}
+	for (uint32_t c = 0; c < arg->count_connectors; c++) {
+		if (!fake_card_connector(card, connector_ids[c])) {
+			ret = -ENOENT;
+			goto out;
+		}
+	}
+
+	const struct drm_mode_modeinfo *mode = &arg->mode;
+	mode_blob = fake_card_blob_new(card, NULL, mode, sizeof(*mode));
+	fake_state_set_crtc(state, crtc, FAKE_CRTC_ACTIVE, 1);
+	fake_state_set_crtc(state, crtc, FAKE_CRTC_MODE_ID, mode_blob->base.id);
+	fake_state_set_plane(state, crtc->primary, FAKE_PLANE_FB_ID, fb_id);
+	fake_state_set_plane(state, crtc->primary, FAKE_PLANE_CRTC_ID, crtc->base.id);
+	state_set_plane_rect(state, crtc->primary, 0, 0, mode->hdisplay, mode->vdisplay,
+			     arg->x << 16, arg->y << 16, mode->hdisplay << 16,
+			     mode->vdisplay << 16);
+
+out:
+	if (!ret)
+		ret = fake_state_commit(state, DRM_MODE_ATOMIC_ALLOW_MODESET, 0);
+	// The committed state holds its own reference to the mode.
+	if (mode_blob)
+		fake_card_blob_unref(card, mode_blob);
+	fake_state_destroy(&state);
+	return ret;
+}
+
+static int ioctl_page_flip(struct fake_file *file, struct drm_mode_crtc_page_flip *arg)
+{
+	struct fake_card *card = file->card;
+	if (arg->flags & ~DRM_MODE_PAGE_FLIP_FLAGS || arg->reserved)
+		return -EINVAL;
+	// Neither async flips nor flip targets are advertised.
+	if (arg->flags & ~DRM_MODE_PAGE_FLIP_EVENT)
+		return -EINVAL;
+
+	struct fake_crtc *crtc = fake_card_crtc(card, arg->crtc_id);
+	if (!crtc)
+		return -ENOENT;
+	if (!fake_card_value(card, crtc->value_offset, FAKE_CRTC_ACTIVE))
+		return -EINVAL;
+	if (!fake_card_fb(card, arg->fb_id))
+		return -ENOENT;
+
+	struct fake_state *state = fake_state_new(card, file);
+	fake_state_set_plane(state, crtc->primary, FAKE_PLANE_FB_ID, arg->fb_id);
+	int ret = fake_state_commit(state, DRM_MODE_ATOMIC_NONBLOCK | arg->flags, arg->user_data);
+	fake_state_destroy(&state);
+	return ret;
+}
+
+static int ioctl_set_plane(struct fake_file *file, struct drm_mode_set_plane *arg)
+{
+	struct fake_card *card = file->card;
+	struct fake_plane *plane = fake_card_plane(card, arg->plane_id);
+	if (!plane)
+		return -ENOENT;
+
+	struct fake_state *state = fake_state_new(card, file);
+	int ret = 0;
+	if (arg->fb_id) {
+		if (!fake_card_crtc(card, arg->crtc_id)) {
+			ret = -ENOENT;
+		} else if (!fake_card_fb(card, arg->fb_id)) {
+			ret = -ENOENT;
+		} else {
+			fake_state_set_plane(state, plane, FAKE_PLANE_FB_ID, arg->fb_id);
+			fake_state_set_plane(state, plane, FAKE_PLANE_CRTC_ID, arg->crtc_id);
+			state_set_plane_rect(state, plane, arg->crtc_x, arg->crtc_y, arg->crtc_w,
+					     arg->crtc_h, arg->src_x, arg->src_y, arg->src_w,
+					     arg->src_h);
+		}
+	} else {
+		fake_state_set_plane(state, plane, FAKE_PLANE_FB_ID, 0);
+		fake_state_set_plane(state, plane, FAKE_PLANE_CRTC_ID, 0);
+	}
+
+	if (!ret)
+		ret = fake_state_commit(state, 0, 0);
+	fake_state_destroy(&state);
+	return ret;
+}
+
+// The legacy cursor is tracked on the CRTC rather than routed through the cursor plane.
+static int ioctl_cursor(struct fake_file *file, struct drm_mode_cursor2 *arg)
+{
+	struct fake_card *card = file->card;
+	if (!arg->flags || arg->flags & ~(DRM_MODE_CURSOR_BO | DRM_MODE_CURSOR_MOVE))
+		return -EINVAL;
+
+	struct fake_crtc *crtc = fake_card_crtc(card, arg->crtc_id);
+	if (!crtc)
+		return -ENOENT;
+
+	if (arg->flags & DRM_MODE_CURSOR_BO) {
+		if (arg->handle && !fake_file_handle(file, arg->handle))
+			return -ENOENT;
+		if (arg->width > card->config->cursor_size ||
+		    arg->height > card->config->cursor_size)
+			return -EINVAL;
+		crtc->cursor_handle = arg->handle;
+		crtc->cursor_width = arg->width;
+		crtc->cursor_height = arg->height;
+	}
+
+	if (arg->flags & DRM_MODE_CURSOR_MOVE) {
+		crtc->cursor_x = arg->x;
+		crtc->cursor_y = arg->y;
+	}
+	return 0;
+}
+
+static int ioctl_gamma(struct fake_file *file, struct drm_mode_crtc_lut *arg, bool set)
+{
+	struct fake_crtc *crtc = fake_card_crtc(file->card, arg->crtc_id);
+	if (!crtc)
+		return -ENOENT;
+	if (arg->gamma_size != crtc->gamma_size)
+		return -EINVAL;
+
+	uint64_t channels[3] = { arg->red, arg->green, arg->blue };
+	size_t size = crtc->gamma_size * sizeof(crtc->gamma[0]);
+	for (size_t i = 0; i < 3; i++) {
+		uint16_t *gamma = crtc->gamma + i * crtc->gamma_size;
+		if (set)
+			memcpy(gamma, USER_PTR(channels[i]), size);
+		else
+			memcpy(USER_PTR(channels[i]), gamma, size);
+	}
+	return 0;
+}
+
+static int set_property(struct fake_file *file, uint32_t obj_id, uint32_t obj_type,
+			uint32_t prop_id, uint64_t value)
+{
+	struct fake_card *card = file->card;
+	if (!fake_card_object(card, obj_id, obj_type))
+		return -ENOENT;
+
+	struct fake_property *prop = fake_card_property(card, prop_id);
+	if (!prop || !prop_visible(file, prop))
+		return -ENOENT;
+
+	struct fake_state *state = fake_state_new(card, file);
+	int ret = fake_state_set(state, obj_id, prop_id, value);
+	if (!ret)
+		ret = fake_state_commit(state, DRM_MODE_ATOMIC_ALLOW_MODESET, 0);
+	fake_state_destroy(&state);
+	return ret;
+}
+
+static int ioctl_atomic(struct fake_file *file, struct drm_mode_atomic *arg)
+{
+	if (!file->atomic)
+		return -EINVAL;
+	if (arg->flags & ~DRM_MODE_ATOMIC_FLAGS || arg->reserved)
+		return -EINVAL;
+	if (arg->flags & DRM_MODE_PAGE_FLIP_ASYNC)
+		return -EINVAL;
+
+	const uint32_t *objs = USER_PTR(arg->objs_ptr);
+	const uint32_t *count_props = USER_PTR(arg->count_props_ptr);
+	const uint32_t *props = USER_PTR(arg->props_ptr);
+	const uint64_t *values = USER_PTR(arg->prop_values_ptr);
+
+	struct fake_state *state = fake_state_new(file->card, file);
+	int ret = 0;
+	size_t prop_index = 0;
+	for (uint32_t i = 0; i < arg->count_objs && !ret; i++) {
+		for (uint32_t j = 0; j < count_props[i] && !ret; j++, prop_index++)
+			ret = fake_state_set(state, objs[i], props[prop_index],
+					     values[prop_index]);
+	}
+
+	if (!ret)
+		ret = fake_state_commit(state, arg->flags, arg->user_data);
+	fake_state_destroy(&state);
+	return ret;
+}
+
+static int ioctl_create_dumb(struct fake_file *file, struct drm_mode_create_dumb *arg)
+{
+	if (!arg->width || !arg->height || !arg->bpp || arg->flags)
+		return -EINVAL;
+
+	uint64_t pitch = FAKE_ALIGN((uint64_t)arg->width * FAKE_DIV_ROUND_UP(arg->bpp, 8), 64);
+	uint64_t size = pitch * arg->height;
+	if (pitch > UINT32_MAX)
+		return -EINVAL;
+
+	struct fake_buffer *buffer = fake_buffer_new(size);
+	if (!buffer)
+		return -ENOMEM;
+
+	arg->handle = fake_file_add_handle(file, buffer);
+	arg->pitch = pitch;
+	arg->size = size;
+	return 0;
+}
+
+static int ioctl_map_dumb(struct fake_file *file, struct drm_mode_map_dumb *arg)
+{
+	struct fake_buffer *buffer = fake_file_handle(file, arg->handle);
+	if (!buffer)
+		return -ENOENT;
+	arg->offset = buffer->map_offset;
+	return 0;
+}
+
+static int ioctl_prime_handle_to_fd(struct fake_file *file, struct drm_prime_handle *arg)
+{
+	struct fake_buffer *buffer = fake_file_handle(file, arg->handle);
+	if (!buffer)
+		return -ENOENT;
+	if (arg->flags & ~(DRM_CLOEXEC | DRM_RDWR))
+		return -EINVAL;
+
+	int fd = fcntl(buffer->memfd, (arg->flags & DRM_CLOEXEC) ? F_DUPFD_CLOEXEC : F_DUPFD, 0);
+	if (fd < 0)
+		return -errno;
+	arg->fd = fd;
+	return 0;
+}
+
+static int ioctl_prime_fd_to_handle(struct fake_file *file, struct drm_prime_handle *arg)
+{
+	struct fake_buffer *buffer = fake_buffer_import(arg->fd);
+	if (!buffer)
+		return -errno;
+
+	// Importing the same buffer twice gives back the same handle.
+	for (size_t i = 0; i < file->handle_capacity; i++) {
+		if (file->handles[i] == buffer) {
+			fake_buffer_unref(buffer);
+			arg->handle = i + 1;
+			return 0;
+		}
+	}
+
+	arg->handle = fake_file_add_handle(file, buffer);
+	return 0;
+}
+
+int fake_ioctl(struct fake_file *file, unsigned long request, void *arg)
+{
+	switch (request) {
+		case DRM_IOCTL_VERSION:
+			return ioctl_version(file, arg);
+		case DRM_IOCTL_GET_CAP:
+			return ioctl_get_cap(file, arg);
+		case DRM_IOCTL_SET_CLIENT_CAP:
+			return ioctl_set_client_cap(file, arg);
+		case DRM_IOCTL_SET_MASTER:
+		case DRM_IOCTL_DROP_MASTER:
+			return 0;
+		case DRM_IOCTL_WAIT_VBLANK:
+			return ioctl_wait_vblank(file, arg);
+		case DRM_IOCTL_MODE_GETRESOURCES:
+			return ioctl_get_resources(file, arg);
+		case DRM_IOCTL_MODE_GETCONNECTOR:
+			return ioctl_get_connector(file, arg);
+		case DRM_IOCTL_MODE_GETENCODER:
+			return ioctl_get_encoder(file, arg);
+		case DRM_IOCTL_MODE_GETCRTC:
+			return ioctl_get_crtc(file, arg);
+		case DRM_IOCTL_MODE_GETPLANERESOURCES:
+			return ioctl_get_plane_resources(file, arg);
+		case DRM_IOCTL_MODE_GETPLANE:
+			return ioctl_get_plane(file, arg);
+		case DRM_IOCTL_MODE_OBJ_GETPROPERTIES:
+			return ioctl_obj_get_properties(file, arg);
+		case DRM_IOCTL_MODE_GETPROPERTY:
+			return ioctl_get_property(file, arg);
+		case DRM_IOCTL_MODE_GETPROPBLOB:
+			return ioctl_get_prop_blob(file, arg);
+		case DRM_IOCTL_MODE_CREATEPROPBLOB:
+			return ioctl_create_prop_blob(file, arg);
+		case DRM_IOCTL_MODE_DESTROYPROPBLOB:
+			return ioctl_destroy_prop_blob(file, arg);
+		case DRM_IOCTL_MODE_ADDFB:
+			return ioctl_add_fb(file, arg);
+		case DRM_IOCTL_MODE_ADDFB2:
+			return add_fb(file, arg);
+		case DRM_IOCTL_MODE_RMFB:
+			return ioctl_rm_fb(file, arg);
+		case DRM_IOCTL_MODE_GETFB:
+			return ioctl_get_fb(file, arg);
+		case DRM_IOCTL_MODE_SETCRTC:
+			return ioctl_set_crtc(file, arg);
+		case DRM_IOCTL_MODE_PAGE_FLIP:
+			return ioctl_page_flip(file, arg);
+		case DRM_IOCTL_MODE_SETPLANE:
+			return ioctl_set_plane(file, arg);
+		case DRM_IOCTL_MODE_CURSOR: {
+			struct drm_mode_cursor2 cursor2 = { 0 };
+			memcpy(&cursor2, arg, sizeof(struct drm_mode_cursor));
+			return ioctl_cursor(file, &cursor2);
+		}
+		case DRM_IOCTL_MODE_CURSOR2:
+			return ioctl_cursor(file, arg);
+		case DRM_IOCTL_MODE_GETGAMMA:
+			return ioctl_gamma(file, arg, false);
+		case DRM_IOCTL_MODE_SETGAMMA:
+			return ioctl_gamma(file, arg, true);
+		case DRM_IOCTL_MODE_SETPROPERTY: {
+			struct drm_mode_connector_set_property *set = arg;
+			return set_property(file, set->connector_id, DRM_MODE_OBJECT_CONNECTOR,
+					    set->prop_id, set->value);
+		}
+		case DRM_IOCTL_MODE_OBJ_SETPROPERTY: {
+			struct drm_mode_obj_set_property *set = arg;
+			return set_property(file, set->obj_id, set->obj_type, set->prop_id,
+					    set->value);
+		}
+		case DRM_IOCTL_MODE_ATOMIC:
+			return ioctl_atomic(file, arg);
+		case DRM_IOCTL_MODE_CREATE_DUMB:
+			return ioctl_create_dumb(file, arg);
+		case DRM_IOCTL_MODE_MAP_DUMB:
+			return ioctl_map_dumb(file, arg);
+		case DRM_IOCTL_MODE_DESTROY_DUMB:
+			return fake_file_close_handle(
+			    file, ((struct drm_mode_destroy_dumb *)arg)->handle);
+		case DRM_IOCTL_GEM_CLOSE:
+			return fake_file_close_handle(file, ((struct drm_gem_close *)arg)->handle);
+		case DRM_IOCTL_PRIME_HANDLE_TO_FD:
+			return ioctl_prime_handle_to_fd(file, arg);
+		case DRM_IOCTL_PRIME_FD_TO_HANDLE:
+			return ioctl_prime_fd_to_handle(file, arg);
+		default:
+			fake_debug("unsupported ioctl 0x%lx", request);
+			return -EINVAL;
+	}
+}
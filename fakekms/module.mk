@@ -0,0 +1,20 @@
+# Copyright 2018 The Chromium OS Authors. All rights reserved.
+# Use of this source code is governed by a BSD-style license that can be
+# found in the LICENSE file.
+
+include common.mk
+
+CFLAGS += -std=gnu99
+
+CC_LIBRARY(fakekms/libfakekms.so): \
+  fakekms/atomic.o \
+  fakekms/card.o \
+  fakekms/config.o \
+  fakekms/debugfs.o \
+  fakekms/event.o \
+  fakekms/format.o \
+  fakekms/gbm.o \
+  fakekms/ioctl.o \
+  fakekms/preload.o \
+  fakekms/writeback.o
+CC_LIBRARY(fakekms/libfakekms.so): LDLIBS += -ldl -lpthread
@@ -0,0 +1,280 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <dlfcn.h>
+#include <linux/dma-buf.h>
+
+#include "fakekms.h"
+
+#define FAKE_CARD_PATH "/dev/dri/card"
+#define FAKE_SYSFS_PATH "/sys/class/drm"
+#define FAKE_DEBUGFS_PATH "/sys/kernel/debug/dri/"
+
+struct fake_kms fake_kms = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static int (*real_open)(const char *, int, ...);
+static int (*real_openat)(int, const char *, int, ...);
+static int (*real_ioctl)(int, unsigned long, ...);
+static ssize_t (*real_read)(int, void *, size_t);
+static void *(*real_mmap)(void *, size_t, int, int, int, off_t);
+static DIR *(*real_opendir)(const char *);
+
+static void *real_symbol(const char *name)
+{
+	void *symbol = dlsym(RTLD_NEXT, name);
+	if (!symbol) {
+		fprintf(stderr, "fakekms: failed to find %s: %s\n", name, dlerror());
+		abort();
+	}
+	return symbol;
+}
+
+static void fake_init(void)
+{
+	real_open = real_symbol("open");
+	real_openat = real_symbol("openat");
+	real_ioctl = real_symbol("ioctl");
+	real_read = real_symbol("read");
+	real_mmap = real_symbol("mmap");
+	real_opendir = real_symbol("opendir");
+
+	fake_config_init(&fake_kms.config, getenv("FAKEKMS_CONFIG"));
+	for (unsigned minor = 0; minor < fake_kms.config.card_count; minor++)
+		fake_card_init(&fake_kms.cards[minor], minor, &fake_kms.config);
+}
+
+__attribute__((constructor)) static void fake_constructor(void)
+{
+	pthread_once(&init_once, fake_init);
+}
+
+void fake_debug(const char *format, ...)
+{
+	if (!fake_kms.config.debug)
+		return;
+
+	va_list args;
+	va_start(args, format);
+	fprintf(stderr, "fakekms: ");
+	vfprintf(stderr, format, args);
+	fprintf(stderr, "\n");
+	va_end(args);
+}
+
+int fake_real_ioctl(int fd, unsigned long request, void *arg)
+{
+	return real_ioctl(fd, request, arg);
+}
+
+ssize_t fake_real_read(int fd, void *buffer, size_t size)
+{
+	return real_read(fd, buffer, size);
+}
+
+void *fake_real_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+	return real_mmap(addr, length, prot, flags, fd, offset);
+}
+
+// Returns the minor of a card node path or -1 for everything else.
+static int card_minor(const char *path)
+{
+	unsigned minor;
+	int end = 0;
+	if (strncmp(path, FAKE_CARD_PATH, strlen(FAKE_CARD_PATH)))
+		return -1;
+	if (sscanf(path + strlen(FAKE_CARD_PATH), "%u%n", &minor, &end) != 1 ||
+	    path[strlen(FAKE_CARD_PATH) + end] != '\0' || minor >= DRM_MAX_MINOR)
+		return -1;
+	return minor;
+}
+
+static int open_card(unsigned minor, int flags)
+{
+	int fd = -1;
+	pthread_mutex_lock(&fake_kms.lock);
+	struct fake_file *file = fake_file_open(minor, flags, &fd);
+	pthread_mutex_unlock(&fake_kms.lock);
+	if (!file)
+		return -1;
+	fake_debug("opened card %u as fd %d", minor, fd);
+	return fd;
+}
+
+static mode_t open_mode(int flags, va_list args)
+{
+	return (flags & (O_CREAT | O_TMPFILE)) ? va_arg(args, mode_t) : 0;
+}
+
+FAKE_EXPORT int open(const char *path, int flags, ...)
+{
+	pthread_once(&init_once, fake_init);
+	va_list args;
+	va_start(args, flags);
+	mode_t mode = open_mode(flags, args);
+	va_end(args);
+
+	int minor = card_minor(path);
+	if (minor >= 0)
+		return open_card(minor, flags);
+	if (!strncmp(path, FAKE_DEBUGFS_PATH, strlen(FAKE_DEBUGFS_PATH)))
+		return fake_debugfs_open(path + strlen(FAKE_DEBUGFS_PATH), flags);
+	return real_open(path, flags, mode);
+}
+
+FAKE_EXPORT int open64(const char *path, int flags, ...)
+{
+	va_list args;
+	va_start(args, flags);
+	mode_t mode = open_mode(flags, args);
+	va_end(args);
+	return open(path, flags | O_LARGEFILE, mode);
+}
+
+FAKE_EXPORT int openat(int dirfd, const char *path, int flags, ...)
+{
+	pthread_once(&init_once, fake_init);
+	va_list args;
+	va_start(args, flags);
+	mode_t mode = open_mode(flags, args);
+	va_end(args);
+
+	int minor = card_minor(path);
+	if (minor >= 0)
+		return open_card(minor, flags);
+	if (!strncmp(path, FAKE_DEBUGFS_PATH, strlen(FAKE_DEBUGFS_PATH)))
+		return fake_debugfs_open(path + strlen(FAKE_DEBUGFS_PATH), flags);
+	return real_openat(dirfd, path, flags, mode);
+}
+
+FAKE_EXPORT int openat64(int dirfd, const char *path, int flags, ...)
+{
+	va_list args;
+	va_start(args, flags);
+	mode_t mode = open_mode(flags, args);
+	va_end(args);
+	return openat(dirfd, path, flags | O_LARGEFILE, mode);
+}
+
+// Buffers are plain memfds that don't know about DMA_BUF_IOCTL_SYNC. CPU access is always
+// coherent, so syncing them is a no-op.
+static bool is_fake_buffer(int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+		return false;
+	return fake_buffer_find_ino(st.st_ino) != NULL;
+}
+
+FAKE_EXPORT int ioctl(int fd, unsigned long request, ...)
+{
+	pthread_once(&init_once, fake_init);
+	va_list args;
+	va_start(args, request);
+	void *arg = va_arg(args, void *);
+	va_end(args);
+
+	if (!fake_kms.files)
+		return real_ioctl(fd, request, arg);
+
+	pthread_mutex_lock(&fake_kms.lock);
+	struct fake_file *file = fake_file_find(fd);
+	if (!file) {
+		bool sync = request == DMA_BUF_IOCTL_SYNC && is_fake_buffer(fd);
+		pthread_mutex_unlock(&fake_kms.lock);
+		return sync ? 0 : real_ioctl(fd, request, arg);
+	}
+
+	int ret = fake_ioctl(file, request, arg);
+	pthread_mutex_unlock(&fake_kms.lock);
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+	return ret;
+}
+
+FAKE_EXPORT ssize_t read(int fd, void *buffer, size_t size)
+{
+	pthread_once(&init_once, fake_init);
+	if (!fake_kms.files)
+		return real_read(fd, buffer, size);
+
+	pthread_mutex_lock(&fake_kms.lock);
+	struct fake_file *file = fake_file_find(fd);
+	if (!file) {
+		pthread_mutex_unlock(&fake_kms.lock);
+		return real_read(fd, buffer, size);
+	}
+
+	ssize_t ret = fake_event_read(file, fd, buffer, size);
+	pthread_mutex_unlock(&fake_kms.lock);
+	return ret;
+}
+
+// Fortified builds call this instead of read().
+FAKE_EXPORT ssize_t __read_chk(int fd, void *buffer, size_t size, size_t buffer_size)
+{
+	if (size > buffer_size)
+		abort();
+	return read(fd, buffer, size);
+}
+
+FAKE_EXPORT void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+	pthread_once(&init_once, fake_init);
+	if (!fake_kms.files)
+		return real_mmap(addr, length, prot, flags, fd, offset);
+
+	pthread_mutex_lock(&fake_kms.lock);
+	struct fake_file *file = fake_file_find(fd);
+	if (!file) {
+		pthread_mutex_unlock(&fake_kms.lock);
+		return real_mmap(addr, length, prot, flags, fd, offset);
+	}
+
+	// Dumb buffer offsets from MAP_DUMB select the buffer, which is then mapped from its start.
+	int memfd = -1;
+	off_t memfd_offset = 0;
+	for (struct fake_buffer *buffer = fake_kms.buffers; buffer; buffer = buffer->next) {
+		if ((uint64_t)offset >= buffer->map_offset &&
+		    (uint64_t)offset + length <=
+			buffer->map_offset + FAKE_ALIGN(buffer->size, (uint64_t)getpagesize())) {
+			memfd = buffer->memfd;
+			memfd_offset = offset - buffer->map_offset;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&fake_kms.lock);
+
+	if (memfd < 0) {
+		fake_debug("no buffer at map offset 0x%llx", (unsigned long long)offset);
+		errno = EINVAL;
+		return MAP_FAILED;
+	}
+	return real_mmap(addr, length, prot, flags, memfd, memfd_offset);
+}
+
+FAKE_EXPORT void *mmap64(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+	return mmap(addr, length, prot, flags, fd, offset);
+}
+
+// Hiding the real sysfs keeps callers that discover cards there from finding real hardware, so
+// they fall back to opening card nodes, which lands here.
+FAKE_EXPORT DIR *opendir(const char *path)
+{
+	pthread_once(&init_once, fake_init);
+	if (!strncmp(path, FAKE_SYSFS_PATH, strlen(FAKE_SYSFS_PATH))) {
+		errno = ENOENT;
+		return NULL;
+	}
+	return real_opendir(path);
+}
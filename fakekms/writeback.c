@@ -0,0 +1,407 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "fakekms.h"
+
+#define OPAQUE_BLACK 0xff000000u
+
+// The planes of a framebuffer, mapped for as long as a capture reads or writes them.
+struct capture_map {
+	const struct fake_fb *fb;
+	uint8_t *data[FAKE_MAX_FB_PLANES];
+	void *maps[FAKE_MAX_FB_PLANES];
+};
+
+// A source or destination index and the next one, with the weight of the next in 1/256ths.
+struct capture_tap {
+	uint32_t index;
+	uint32_t next;
+	uint32_t weight;
+};
+
+static bool capture_map_init(struct capture_map *map, const struct fake_fb *fb, int prot)
+{
+	memset(map, 0, sizeof(*map));
+	map->fb = fb;
+	for (size_t i = 0; i < fb->plane_count; i++) {
+		struct fake_buffer *buffer = fb->buffers[i];
+		// The mmap() wrapper would take the lock the caller holds.
+		void *addr = fake_real_mmap(NULL, buffer->size, prot, MAP_SHARED, buffer->memfd, 0);
+		if (addr == MAP_FAILED) {
+			fake_debug("failed to map framebuffer %u: %s", fb->base.id,
+				   strerror(errno));
+			while (i-- > 0)
+				munmap(map->maps[i], fb->buffers[i]->size);
+			return false;
+		}
+		map->maps[i] = addr;
+		map->data[i] = (uint8_t *)addr + fb->offsets[i];
+	}
+	return true;
+}
+
+static void capture_map_release(struct capture_map *map)
+{
+	for (size_t i = 0; i < map->fb->plane_count; i++)
+		munmap(map->maps[i], map->fb->buffers[i]->size);
+}
+
+static uint8_t clamp_byte(int32_t v)
+{
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+// BT.601 limited range, like the YUV test patterns.
+static uint32_t yuv_to_argb(int32_t y, int32_t u, int32_t v)
+{
+	int32_t c = 298 * (y - 16) + 128;
+	int32_t d = u - 128;
+	int32_t e = v - 128;
+	return OPAQUE_BLACK | clamp_byte((c + 409 * e) >> 8) << 16 |
+	       clamp_byte((c - 100 * d - 208 * e) >> 8) << 8 | clamp_byte((c + 516 * d) >> 8);
+}
+
+static uint32_t swap_red_blue(uint32_t p)
+{
+	return (p & 0xff00ff00) | (p & 0xff) << 16 | ((p >> 16) & 0xff);
+}
+
+// Reads the framebuffer pixel at (x, y) as ARGB8888.
+static uint32_t fetch_pixel(const struct capture_map *map, uint32_t x, uint32_t y)
+{
+	const struct fake_fb *fb = map->fb;
+	const uint8_t *row = map->data[0] + (size_t)y * fb->pitches[0];
+	const uint32_t *row32 = (const uint32_t *)row;
+	const uint8_t *u, *v;
+	switch (fb->format) {
+		case DRM_FORMAT_XRGB8888:
+			return row32[x] | OPAQUE_BLACK;
+		case DRM_FORMAT_ARGB8888:
+			return row32[x];
+		case DRM_FORMAT_XBGR8888:
+			return swap_red_blue(row32[x]) | OPAQUE_BLACK;
+		case DRM_FORMAT_ABGR8888:
+			return swap_red_blue(row32[x]);
+		case DRM_FORMAT_RGB565: {
+			uint16_t p = ((const uint16_t *)row)[x];
+			uint32_t r = (p >> 11) & 0x1f;
+			uint32_t g = (p >> 5) & 0x3f;
+			uint32_t b = p & 0x1f;
+			return OPAQUE_BLACK | ((r << 3) | (r >> 2)) << 16 |
+			       ((g << 2) | (g >> 4)) << 8 | ((b << 3) | (b >> 2));
+		}
+		case DRM_FORMAT_XRGB2101010: {
+			uint32_t p = row32[x];
+			return OPAQUE_BLACK | ((p >> 22) & 0xff) << 16 | ((p >> 12) & 0xff) << 8 |
+			       ((p >> 2) & 0xff);
+		}
+		case DRM_FORMAT_YUYV: {
+			const uint8_t *pair = row + (size_t)(x & ~1u) * 2;
+			return yuv_to_argb(row[(size_t)x * 2], pair[1], pair[3]);
+		}
+		case DRM_FORMAT_NV12:
+			u = map->data[1] + (size_t)(y / 2) * fb->pitches[1] + (x & ~1u);
+			return yuv_to_argb(row[x], u[0], u[1]);
+		case DRM_FORMAT_YUV420:
+		case DRM_FORMAT_YVU420:
+			u = map->data[1] + (size_t)(y / 2) * fb->pitches[1] + x / 2;
+			v = map->data[2] + (size_t)(y / 2) * fb->pitches[2] + x / 2;
+			if (fb->format == DRM_FORMAT_YVU420) {
+				const uint8_t *t = u;
+				u = v;
+				v = t;
+			}
+			return yuv_to_argb(row[x], *u, *v);
+		default:
+			return OPAQUE_BLACK;
+	}
+}
+
+// Maps the center of destination pixel i of count into the 16.16 source span starting at start,
+// clamped to its edge pixels, the way bilinear plane scalers filter.
+static void compute_tap(struct capture_tap *tap, uint32_t i, uint32_t count, uint32_t start,
+			uint32_t length, uint32_t limit)
+{
+	uint32_t first = start >> 16;
+	uint32_t last = (uint32_t)(((uint64_t)start + length - 1) >> 16);
+	if (last >= limit)
+		last = limit - 1;
+	if (first > last)
+		first = last;
+
+	int64_t pos = start + ((2 * (uint64_t)i + 1) * length) / (2 * (uint64_t)count) - 0x8000;
+	if (pos < (int64_t)first << 16)
+		pos = (int64_t)first << 16;
+	if (pos > (int64_t)last << 16)
+		pos = (int64_t)last << 16;
+
+	tap->index = pos >> 16;
+	tap->next = tap->index < last ? tap->index + 1 : last;
+	tap->weight = (pos >> 8) & 0xff;
+}
+
+// Unscaled planes take the source pixel under the destination pixel's center.
+static void compute_nearest(struct capture_tap *tap, uint32_t i, uint32_t count, uint32_t start,
+			    uint32_t length)
+{
+	tap->index = (start + (2 * (uint64_t)i + 1) * length / (2 * (uint64_t)count)) >> 16;
+	tap->next = tap->index;
+	tap->weight = 0;
+}
+
+static uint32_t lerp(uint32_t a, uint32_t b, uint32_t w)
+{
+	uint32_t out = 0;
+	for (uint32_t shift = 0; shift < 32; shift += 8) {
+		uint32_t x = (a >> shift) & 0xff;
+		uint32_t y = (b >> shift) & 0xff;
+		out |= ((x * (256 - w) + y * w + 128) >> 8) << shift;
+	}
+	return out;
+}
+
+// x * w / 255, rounded like the kernel's blending helpers.
+static uint32_t scale_channel(uint32_t x, uint32_t w)
+{
+	uint32_t t = x * w + 128;
+	return (t + (t >> 8)) >> 8;
+}
+
+// Premultiplied alpha, the kernel's default pixel blend mode.
+static uint32_t blend(uint32_t fg, uint32_t bg)
+{
+	uint32_t a = fg >> 24;
+	if (a == 0xff)
+		return fg;
+
+	uint32_t out = OPAQUE_BLACK;
+	for (uint32_t shift = 0; shift < 24; shift += 8) {
+		uint32_t c = ((fg >> shift) & 0xff) + scale_channel((bg >> shift) & 0xff, 255 - a);
+		out |= (c > 0xff ? 0xff : c) << shift;
+	}
+	return out;
+}
+
+// Span of one axis of a plane: the framebuffer pixels its source rectangle touches, and where the
+// rectangle lies in them once they are mirrored into scanout order.
+struct capture_axis {
+	uint32_t first;
+	uint32_t size;
+	bool flip;
+	uint32_t start;
+	uint32_t length;
+};
+
+static void capture_axis_init(struct capture_axis *axis, uint32_t src, uint32_t src_size, bool flip)
+{
+	axis->first = src >> 16;
+	axis->size = (uint32_t)(((uint64_t)src + src_size + 0xffff) >> 16) - axis->first;
+	axis->flip = flip;
+	axis->length = src_size;
+	axis->start = src - (axis->first << 16);
+	if (flip)
+		axis->start = (axis->size << 16) - axis->start - src_size;
+}
+
+static uint32_t capture_axis_pixel(const struct capture_axis *axis, uint32_t i)
+{
+	return axis->first + (axis->flip ? axis->size - 1 - i : i);
+}
+
+static void capture_plane(struct fake_card *card, struct fake_plane *plane, uint8_t *pixels,
+			  uint32_t pitch, uint32_t width, uint32_t height)
+{
+	size_t offset = plane->value_offset;
+	struct fake_fb *fb = fake_card_fb(card, fake_card_value(card, offset, FAKE_PLANE_FB_ID));
+	int32_t crtc_x = (int32_t)fake_card_value(card, offset, FAKE_PLANE_CRTC_X);
+	int32_t crtc_y = (int32_t)fake_card_value(card, offset, FAKE_PLANE_CRTC_Y);
+	uint32_t crtc_w = fake_card_value(card, offset, FAKE_PLANE_CRTC_W);
+	uint32_t crtc_h = fake_card_value(card, offset, FAKE_PLANE_CRTC_H);
+	uint32_t src_w = fake_card_value(card, offset, FAKE_PLANE_SRC_W);
+	uint32_t src_h = fake_card_value(card, offset, FAKE_PLANE_SRC_H);
+	uint64_t rotation = fake_card_value(card, offset, FAKE_PLANE_ROTATION);
+	if (!fb || !crtc_w || !crtc_h || !src_w || !src_h)
+		return;
+
+	int64_t x0 = crtc_x > 0 ? crtc_x : 0;
+	int64_t y0 = crtc_y > 0 ? crtc_y : 0;
+	int64_t x1 = (int64_t)crtc_x + crtc_w < width ? (int64_t)crtc_x + crtc_w : width;
+	int64_t y1 = (int64_t)crtc_y + crtc_h < height ? (int64_t)crtc_y + crtc_h : height;
+	if (x0 >= x1 || y0 >= y1)
+		return;
+
+	struct capture_map src;
+	if (!capture_map_init(&src, fb, PROT_READ))
+		return;
+
+	bool rotate_180 = rotation & DRM_MODE_ROTATE_180;
+	struct capture_axis axis_x, axis_y;
+	capture_axis_init(&axis_x, fake_card_value(card, offset, FAKE_PLANE_SRC_X), src_w,
+			  rotate_180 ^ !!(rotation & DRM_MODE_REFLECT_X));
+	capture_axis_init(&axis_y, fake_card_value(card, offset, FAKE_PLANE_SRC_Y), src_h,
+			  rotate_180 ^ !!(rotation & DRM_MODE_REFLECT_Y));
+	bool scaled = src_w != crtc_w << 16 || src_h != crtc_h << 16;
+
+	struct capture_tap *columns = calloc(x1 - x0, sizeof(*columns));
+	assert(columns);
+	for (int64_t x = x0; x < x1; x++) {
+		uint32_t i = x - crtc_x;
+		if (scaled)
+			compute_tap(&columns[x - x0], i, crtc_w, axis_x.start, src_w, axis_x.size);
+		else
+			compute_nearest(&columns[x - x0], i, crtc_w, axis_x.start, src_w);
+	}
+
+	for (int64_t y = y0; y < y1; y++) {
+		struct capture_tap row;
+		uint32_t i = y - crtc_y;
+		if (scaled)
+			compute_tap(&row, i, crtc_h, axis_y.start, src_h, axis_y.size);
+		else
+			compute_nearest(&row, i, crtc_h, axis_y.start, src_h);
+		uint32_t row0 = capture_axis_pixel(&axis_y, row.index);
+		uint32_t row1 = capture_axis_pixel(&axis_y, row.next);
+		uint32_t *out = (uint32_t *)(pixels + (size_t)y * pitch);
+		for (int64_t x = x0; x < x1; x++) {
+			const struct capture_tap *column = &columns[x - x0];
+			uint32_t column0 = capture_axis_pixel(&axis_x, column->index);
+			uint32_t pixel = fetch_pixel(&src, column0, row0);
+			if (scaled) {
+				// Rows are blended first, then the columns.
+				uint32_t column1 = capture_axis_pixel(&axis_x, column->next);
+				pixel = lerp(pixel, fetch_pixel(&src, column0, row1), row.weight);
+				uint32_t next = lerp(fetch_pixel(&src, column1, row0),
+						     fetch_pixel(&src, column1, row1), row.weight);
+				pixel = lerp(pixel, next, column->weight);
+			}
+			out[x] = blend(pixel, out[x]);
+		}
+	}
+
+	free(columns);
+	capture_map_release(&src);
+}
+
+// The kernel's CTM entries are S31.32 sign-magnitude, not two's complement.
+static double ctm_value(uint64_t value)
+{
+	double magnitude = (double)(value & ~(1ull << 63)) / 4294967296.0;
+	return (value >> 63) ? -magnitude : magnitude;
+}
+
+static uint16_t lut_channel(const struct drm_color_lut *entry, int channel)
+{
+	return channel == 0 ? entry->red : (channel == 1 ? entry->green : entry->blue);
+}
+
+// Looks up x in [0, 1], interpolating linearly between entries. No LUT is the identity.
+static double lut_lookup(const struct drm_color_lut *lut, size_t size, int channel, double x)
+{
+	if (!lut)
+		return x;
+	if (size == 1)
+		return lut_channel(&lut[0], channel) / 65535.0;
+
+	double pos = x * (size - 1);
+	size_t i = (size_t)pos;
+	if (i >= size - 1)
+		return lut_channel(&lut[size - 1], channel) / 65535.0;
+	double lo = lut_channel(&lut[i], channel);
+	double hi = lut_channel(&lut[i + 1], channel);
+	return (lo + (hi - lo) * (pos - i)) / 65535.0;
+}
+
+static uint8_t unit_to_byte(double x)
+{
+	return (uint8_t)((x < 0.0 ? 0.0 : (x > 1.0 ? 1.0 : x)) * 255.0 + 0.5);
+}
+
+// Runs the composed pixels through the CRTC's CTM and then its GAMMA_LUT, the part of the color
+// pipeline the fake has.
+static void capture_color(struct fake_card *card, struct fake_crtc *crtc, void *pixels,
+			  uint32_t pitch, uint32_t width, uint32_t height)
+{
+	struct fake_blob *ctm_blob =
+	    fake_card_blob(card, fake_card_value(card, crtc->value_offset, FAKE_CRTC_CTM));
+	struct fake_blob *gamma_blob =
+	    fake_card_blob(card, fake_card_value(card, crtc->value_offset, FAKE_CRTC_GAMMA_LUT));
+	if (!ctm_blob && !gamma_blob)
+		return;
+
+	const struct drm_color_ctm *matrix = ctm_blob ? ctm_blob->data : NULL;
+	double ctm[9];
+	for (int i = 0; i < 9; i++)
+		ctm[i] = matrix ? ctm_value(matrix->matrix[i]) : (i % 4 == 0);
+	const struct drm_color_lut *gamma = gamma_blob ? gamma_blob->data : NULL;
+	size_t gamma_size = gamma_blob ? gamma_blob->length / sizeof(*gamma) : 0;
+
+	// Without a CTM every channel maps on its own.
+	uint8_t table[3][256];
+	for (int c = 0; c < 3 && !ctm_blob; c++) {
+		for (int v = 0; v < 256; v++)
+			table[c][v] = unit_to_byte(lut_lookup(gamma, gamma_size, c, v / 255.0));
+	}
+
+	for (uint32_t y = 0; y < height; y++) {
+		uint32_t *row = (uint32_t *)((uint8_t *)pixels + (size_t)y * pitch);
+		for (uint32_t x = 0; x < width; x++) {
+			uint32_t p = row[x];
+			uint32_t out = p & 0xff000000;
+			double in[3] = { ((p >> 16) & 0xff) / 255.0, ((p >> 8) & 0xff) / 255.0,
+					 (p & 0xff) / 255.0 };
+			for (int c = 0; c < 3; c++) {
+				uint8_t v;
+				if (ctm_blob) {
+					double t = ctm[3 * c] * in[0] + ctm[3 * c + 1] * in[1] +
+						   ctm[3 * c + 2] * in[2];
+					t = t < 0.0 ? 0.0 : (t > 1.0 ? 1.0 : t);
+					v = unit_to_byte(lut_lookup(gamma, gamma_size, c, t));
+				} else {
+					v = table[c][(p >> (16 - 8 * c)) & 0xff];
+				}
+				out |= (uint32_t)v << (16 - 8 * c);
+			}
+			row[x] = out;
+		}
+	}
+}
+
+// Composes what the CRTC scans out into width x height ARGB8888 pixels. Planes stack in the order
+// primary, overlays, cursor, then go through the CTM and GAMMA_LUT. The legacy gamma and cursor
+// are left out.
+void fake_writeback_compose(struct fake_card *card, struct fake_crtc *crtc, void *pixels,
+			    uint32_t pitch, uint32_t width, uint32_t height)
+{
+	for (uint32_t y = 0; y < height; y++) {
+		uint32_t *out = (uint32_t *)((uint8_t *)pixels + (size_t)y * pitch);
+		for (uint32_t x = 0; x < width; x++)
+			out[x] = OPAQUE_BLACK;
+	}
+
+	const uint32_t stacking[] = { DRM_PLANE_TYPE_PRIMARY, DRM_PLANE_TYPE_OVERLAY,
+				      DRM_PLANE_TYPE_CURSOR };
+	for (size_t t = 0; t < FAKE_ARRAY_LEN(stacking); t++) {
+		for (size_t i = 0; i < card->plane_count; i++) {
+			struct fake_plane *plane = &card->planes[i];
+			if (plane->type != stacking[t] ||
+			    fake_card_value(card, plane->value_offset, FAKE_PLANE_CRTC_ID) !=
+				crtc->base.id)
+				continue;
+			capture_plane(card, plane, pixels, pitch, width, height);
+		}
+	}
+	capture_color(card, crtc, pixels, pitch, width, height);
+}
+
+void fake_writeback_capture(struct fake_card *card, struct fake_crtc *crtc, struct fake_fb *fb)
+{
+	struct capture_map dst;
+	if (!capture_map_init(&dst, fb, PROT_READ | PROT_WRITE))
+		return;
+
+	fake_writeback_compose(card, crtc, dst.data[0], fb->pitches[0], fb->width, fb->height);
+	capture_map_release(&dst);
+}
@@ -208,6 +208,7 @@ static const struct option longopts[] = {
 	{ "gem", no_argument, NULL, 'g' },
 	{ "dumb", no_argument, NULL, 'd' },
 	{ "tiled", no_argument, NULL, 't' },
+	{ "json", no_argument, NULL, 'j' },
 	{ 0, 0, 0, 0 },
 };
 
@@ -219,13 +220,17 @@ static void print_help(const char *argv0)
 	printf(" -b, --dma-buf  Use dma-buf mmap.\n");
 	printf(" -g, --gem      Use GEM map(by default).\n");
 	printf(" -d, --dumb     Use dump map.\n");
+	printf(" -j, --json     Print presentation stats as JSON.\n");
 }
 
+static struct bs_present_stats *present_stats = NULL;
+
 static void page_flip_handler(int fd, unsigned int frame, unsigned int sec, unsigned int usec,
 			      void *data)
 {
 	int *waiting_for_flip = data;
 	*waiting_for_flip = 0;
+	bs_present_stats_flip(present_stats, frame, sec, usec);
 }
 
 void flush_egl(struct bs_egl *egl, EGLImageKHR image)
@@ -249,9 +254,10 @@ int main(int argc, char **argv)
 	buffer.draw_format = bs_get_draw_format_from_name("ARGB8888");
 	struct bs_mapper *mapper = NULL;
 	uint32_t flags = GBM_BO_USE_TEXTURING;
+	bool json = false;
 
 	int c;
-	while ((c = getopt_long(argc, argv, "f:bgdh", longopts, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "f:bgdjh", longopts, NULL)) != -1) {
 		switch (c) {
 			case 'f':
 				if (!bs_parse_draw_format(optarg, &buffer.draw_format)) {
@@ -274,6 +280,9 @@ int main(int argc, char **argv)
 				flags |= GBM_BO_USE_LINEAR;
 				printf("using dumb map\n");
 				break;
+			case 'j':
+				json = true;
+				break;
 			case 'h':
 			default:
 				print_help(argv[0]);
@@ -356,6 +365,7 @@ int main(int argc, char **argv)
 
 	// The test takes about 2 seconds to complete.
 	const size_t test_frames = 120;
+	present_stats = bs_present_stats_new();
 	for (size_t i = 0; i < test_frames; i++) {
 		int waiting_for_flip = 1;
 
@@ -371,6 +381,7 @@ int main(int argc, char **argv)
 
 		flush_egl(egl, back_fb->image);
 
+		bs_present_stats_submit(present_stats);
 		ret = drmModePageFlip(display_fd, pipe.crtc_id, back_fb->fb_id,
 				      DRM_MODE_PAGE_FLIP_EVENT, &waiting_for_flip);
 		if (ret) {
@@ -397,7 +408,14 @@ int main(int argc, char **argv)
 		front_buffer ^= 1;
 	}
 
+	if (json)
+		bs_present_stats_print_json(present_stats, "mapped_texture_test", stdout);
+	else
+		bs_present_stats_print(present_stats, "mapped_texture_test", stdout);
+
 destroy_gl_resources:
+	if (present_stats)
+		bs_present_stats_destroy(&present_stats);
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
 	glUseProgram(0);
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
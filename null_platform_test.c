@@ -61,11 +61,14 @@ static float f(int i)
 	}
 }
 
+static struct bs_present_stats *present_stats;
+
 static void page_flip_handler(int fd, unsigned int frame, unsigned int sec, unsigned int usec,
 			      void *data)
 {
 	int *waiting_for_flip = data;
 	*waiting_for_flip = 0;
+	bs_present_stats_flip(present_stats, frame, sec, usec);
 }
 
 static uint32_t find_format(char *fourcc)
@@ -85,6 +88,7 @@ static uint32_t find_format(char *fourcc)
 static const struct option longopts[] = {
 	{ "format", required_argument, NULL, 'f' },
 	{ "test-page-flip-format-change", required_argument, NULL, 'p' },
+	{ "json", no_argument, NULL, 'j' },
 	{ "help", no_argument, NULL, 'h' },
 	{ 0, 0, 0, 0 },
 };
@@ -104,6 +108,7 @@ static void print_help(const char *argv0)
 	printf("usage: %s [OPTIONS] [drm_device_path]\n", argv0);
 	printf("  -f, --format <format>			    defines the fb format.\n");
 	printf("  -p, --test-page-flip-format-change <format>	test page flips alternating formats.\n");
+	printf("  -j, --json		    print presentation stats as JSON.\n");
 	printf("  -h, --help		    show help\n");
 	printf("\n");
         printf(" <format> must be one of [ %s ].\n", allowed_formats_string);
@@ -118,9 +123,10 @@ int main(int argc, char **argv)
 	bool help_flag = false;
 	uint32_t format = GBM_FORMAT_XRGB8888;
 	uint32_t test_page_flip_format_change = 0;
+	bool json = false;
 
 	int c = -1;
-	while ((c = getopt_long(argc, argv, "hp:f:", longopts, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "hp:f:j", longopts, NULL)) != -1) {
 		switch (c) {
 			case 'p':
 				test_page_flip_format_change = find_format(optarg);
@@ -132,6 +138,9 @@ int main(int argc, char **argv)
 				if (!format)
 					help_flag = true;
 				break;
+			case 'j':
+				json = true;
+				break;
 			case 'h':
 				help_flag = true;
 				break;
@@ -227,6 +236,7 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	present_stats = bs_present_stats_new();
 	int fb_idx = 1;
 	for (int i = 0; i <= 500; i++) {
 		int waiting_for_flip = 1;
@@ -264,6 +274,7 @@ int main(int argc, char **argv)
 			return 1;
 		}
 
+		bs_present_stats_submit(present_stats);
 		ret = drmModePageFlip(fd, pipe.crtc_id, ids[fb_idx], DRM_MODE_PAGE_FLIP_EVENT,
 				      &waiting_for_flip);
 		if (ret) {
@@ -298,6 +309,12 @@ int main(int argc, char **argv)
 		fb_idx = fb_idx ^ 1;
 	}
 
+	if (json)
+		bs_present_stats_print_json(present_stats, "null_platform_test", stdout);
+	else
+		bs_present_stats_print(present_stats, "null_platform_test", stdout);
+	bs_present_stats_destroy(&present_stats);
+
 	for (size_t fb_index = 0; fb_index < NUM_BUFFERS; fb_index++) {
 		bs_egl_fb_destroy(&egl_fbs[fb_index]);
 		bs_egl_image_destroy(egl, &egl_images[fb_index]);
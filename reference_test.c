@@ -0,0 +1,796 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Checks the vectorized software references the display tests verify against, bs_scale(),
+ * bs_rotate_plane(), bs_crtc_crc_vkms(), bs_color_pipeline_apply() and bs_compositor_compose(),
+ * against straightforward per-pixel versions on random images. It needs no display, so it can run
+ * wherever the library builds.
+ */
+
+#include <getopt.h>
+#include <math.h>
+#include <stdarg.h>
+
+#include "bs_drm.h"
+
+#define CASES 200
+
+struct image {
+	uint32_t *pixels;
+	uint32_t width;
+	uint32_t height;
+	// In bytes, with some padding so strides other than the width get used.
+	uint32_t stride;
+};
+
+static uint32_t random_range(uint32_t min, uint32_t max)
+{
+	return min + (uint32_t)rand() % (max - min + 1);
+}
+
+static uint32_t random_pixel(void)
+{
+	return (uint32_t)rand() << 16 ^ (uint32_t)rand();
+}
+
+static void image_init(struct image *image, uint32_t width, uint32_t height)
+{
+	image->width = width;
+	image->height = height;
+	image->stride = (width + random_range(0, 3)) * sizeof(uint32_t);
+	image->pixels = calloc((size_t)image->stride / sizeof(uint32_t) * height, sizeof(uint32_t));
+	assert(image->pixels);
+}
+
+static void image_fill(struct image *image)
+{
+	for (size_t i = 0; i < (size_t)image->stride / sizeof(uint32_t) * image->height; i++)
+		image->pixels[i] = random_pixel();
+}
+
+static uint32_t *image_row(const struct image *image, uint32_t y)
+{
+	return (uint32_t *)((uint8_t *)image->pixels + (size_t)y * image->stride);
+}
+
+static void image_free(struct image *image)
+{
+	free(image->pixels);
+	image->pixels = NULL;
+}
+
+// Counts a failed case and describes it if it is the check's first, which is usually enough to
+// find what broke without flooding the output.
+__attribute__((format(printf, 2, 3))) static void report_failure(uint64_t *failed,
+								 const char *format, ...)
+{
+	if (!(*failed)++) {
+		char description[256];
+		va_list args;
+		va_start(args, format);
+		vsnprintf(description, sizeof(description), format, args);
+		va_end(args);
+		bs_debug_error("%s", description);
+	}
+}
+
+// Compares the first row_bytes of every row of the images byte by byte, skipping the bytes mask
+// clears in each 32-bit pixel, and reports a failure if any differs by more than tolerance. The
+// format describes the case.
+__attribute__((format(printf, 7, 8))) static void compare_images(
+    const struct image *actual, const struct image *expected, uint32_t row_bytes, uint32_t mask,
+    uint8_t tolerance, uint64_t *failed, const char *format, ...)
+{
+	uint64_t differing = 0;
+	uint32_t first_x = 0, first_y = 0, max_diff = 0;
+	for (uint32_t y = 0; y < expected->height; y++) {
+		const uint8_t *a = (const uint8_t *)image_row(actual, y);
+		const uint8_t *b = (const uint8_t *)image_row(expected, y);
+		for (uint32_t x = 0; x < row_bytes; x++) {
+			if (!((mask >> (x % 4 * 8)) & 0xff))
+				continue;
+			uint32_t diff = a[x] > b[x] ? a[x] - b[x] : b[x] - a[x];
+			if (diff > max_diff)
+				max_diff = diff;
+			if (diff > tolerance && !differing++) {
+				first_x = x;
+				first_y = y;
+			}
+		}
+	}
+	if (!differing)
+		return;
+
+	char what[192];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(what, sizeof(what), format, args);
+	va_end(args);
+	report_failure(failed, "%s is off by up to %u, first at byte %u of row %u, in %llu bytes",
+		       what, max_diff, first_x, first_y, (unsigned long long)differing);
+}
+
+// Where the center of destination pixel i of count lands in the 16.16 source span, in pixels,
+// along with the span's first and last whole pixels.
+static double sample_position(uint32_t i, uint32_t count, uint32_t start, uint32_t length,
+			      uint32_t limit, bool bilinear, uint32_t *first, uint32_t *last)
+{
+	*first = start / 65536;
+	*last = (uint32_t)ceil((start + (double)length) / 65536) - 1;
+	if (*last > limit - 1)
+		*last = limit - 1;
+	if (*first > *last)
+		*first = *last;
+
+	double pos = (start + (i + 0.5) * length / count) / 65536;
+	if (bilinear)
+		pos -= 0.5;
+	return fmin(fmax(pos, *first), *last);
+}
+
+static uint32_t reference_scale_pixel(const struct image *src, const struct bs_scale_source *rect,
+				      bool bilinear, uint32_t x, uint32_t y, uint32_t dst_width,
+				      uint32_t dst_height)
+{
+	uint32_t first_x, last_x, first_y, last_y;
+	double px = sample_position(x, dst_width, rect->x, rect->w, src->width, bilinear, &first_x,
+				    &last_x);
+	double py = sample_position(y, dst_height, rect->y, rect->h, src->height, bilinear,
+				    &first_y, &last_y);
+	uint32_t x0 = (uint32_t)px, y0 = (uint32_t)py;
+	if (!bilinear)
+		return image_row(src, y0)[x0];
+
+	uint32_t x1 = x0 < last_x ? x0 + 1 : x0;
+	uint32_t y1 = y0 < last_y ? y0 + 1 : y0;
+	double fx = px - x0, fy = py - y0;
+	uint32_t corners[4] = { image_row(src, y0)[x0], image_row(src, y0)[x1],
+				image_row(src, y1)[x0], image_row(src, y1)[x1] };
+	uint32_t out = 0;
+	for (int shift = 0; shift < 32; shift += 8) {
+		double c[4];
+		for (int i = 0; i < 4; i++)
+			c[i] = (corners[i] >> shift) & 0xff;
+		double top = c[0] + (c[1] - c[0]) * fx;
+		double bottom = c[2] + (c[3] - c[2]) * fx;
+		out |= (uint32_t)lround(top + (bottom - top) * fy) << shift;
+	}
+	return out;
+}
+
+// Nearest has to pick the very same pixels. Bilinear weights in 8 bits, which is worth up to two
+// steps per channel.
+static bool check_scale(void)
+{
+	uint64_t failed = 0;
+	for (int c = 0; c < CASES; c++) {
+		struct image src, dst, expected;
+		image_init(&src, random_range(1, 300), random_range(1, 300));
+		image_fill(&src);
+
+		struct bs_scale_source rect = { 0 };
+		rect.data = src.pixels;
+		rect.stride = src.stride;
+		rect.width = src.width;
+		rect.height = src.height;
+		rect.x = random_range(0, src.width * 65536 - 1);
+		rect.y = random_range(0, src.height * 65536 - 1);
+		rect.w = random_range(1, src.width * 65536 - rect.x);
+		rect.h = random_range(1, src.height * 65536 - rect.y);
+
+		// Up to four times up or down.
+		uint32_t src_w = rect.w / 65536 + 1, src_h = rect.h / 65536 + 1;
+		image_init(&dst, random_range(src_w / 4 + 1, src_w * 4),
+			   random_range(src_h / 4 + 1, src_h * 4));
+		image_init(&expected, dst.width, dst.height);
+
+		bool bilinear = c % 2;
+		bs_scale(&rect, bilinear ? BS_SCALE_BILINEAR : BS_SCALE_NEAREST, dst.pixels,
+			 dst.stride, dst.width, dst.height);
+		for (uint32_t y = 0; y < dst.height; y++) {
+			for (uint32_t x = 0; x < dst.width; x++)
+				image_row(&expected, y)[x] = reference_scale_pixel(
+				    &src, &rect, bilinear, x, y, dst.width, dst.height);
+		}
+
+		// Like bs_image_compare, this leaves out the X byte of XRGB8888.
+		compare_images(&dst, &expected, dst.width * sizeof(uint32_t), 0x00ffffff,
+			       bilinear ? 2 : 0, &failed,
+			       "%s scaling %.2fx%.2f of a %ux%u image to %ux%u",
+			       bilinear ? "bilinear" : "nearest", rect.w / 65536.0,
+			       rect.h / 65536.0, src.width, src.height, dst.width, dst.height);
+
+		image_free(&src);
+		image_free(&dst);
+		image_free(&expected);
+	}
+	return !failed;
+}
+
+// Reflects first and then rotates counterclockwise, which is how the kernel documents the rotation
+// property.
+static void reference_rotate_position(uint32_t rotation, uint32_t width, uint32_t height,
+				      uint32_t x, uint32_t y, uint32_t *dst_x, uint32_t *dst_y)
+{
+	if (rotation & DRM_MODE_REFLECT_X)
+		x = width - 1 - x;
+	if (rotation & DRM_MODE_REFLECT_Y)
+		y = height - 1 - y;
+
+	switch (rotation & DRM_MODE_ROTATE_MASK) {
+		case DRM_MODE_ROTATE_90:
+			*dst_x = y;
+			*dst_y = width - 1 - x;
+			break;
+		case DRM_MODE_ROTATE_180:
+			*dst_x = width - 1 - x;
+			*dst_y = height - 1 - y;
+			break;
+		case DRM_MODE_ROTATE_270:
+			*dst_x = height - 1 - y;
+			*dst_y = x;
+			break;
+		default:
+			*dst_x = x;
+			*dst_y = y;
+			break;
+	}
+}
+
+// Moves every element, so the result has to match exactly for every element size.
+static bool check_rotate(void)
+{
+	static const uint32_t rotates[] = { DRM_MODE_ROTATE_0, DRM_MODE_ROTATE_90,
+					    DRM_MODE_ROTATE_180, DRM_MODE_ROTATE_270 };
+	static const uint32_t cpps[] = { 1, 2, 4 };
+	uint64_t failed = 0;
+	for (int c = 0; c < CASES; c++) {
+		uint32_t rotation = rotates[c % BS_ARRAY_LEN(rotates)] |
+				    (c / 4 % 4 & 1 ? DRM_MODE_REFLECT_X : 0) |
+				    (c / 4 % 4 & 2 ? DRM_MODE_REFLECT_Y : 0);
+		uint32_t cpp = cpps[c / 16 % BS_ARRAY_LEN(cpps)];
+		uint32_t width = random_range(1, 200), height = random_range(1, 200);
+		uint32_t dst_width, dst_height;
+		bs_rotate_size(rotation, width, height, &dst_width, &dst_height);
+
+		// Images of 4-byte pixels that are wide enough for width elements of cpp bytes.
+		struct image src, dst, expected;
+		image_init(&src, (width * cpp + 3) / 4, height);
+		image_fill(&src);
+		image_init(&dst, (dst_width * cpp + 3) / 4, dst_height);
+		image_init(&expected, (dst_width * cpp + 3) / 4, dst_height);
+
+		if (!bs_rotate_plane(src.pixels, src.stride, width, height, cpp, rotation,
+				     dst.pixels, dst.stride))
+			report_failure(&failed, "rotation 0x%x of %u-byte elements was refused",
+				       rotation, cpp);
+		for (uint32_t y = 0; y < height; y++) {
+			for (uint32_t x = 0; x < width; x++) {
+				uint32_t dst_x, dst_y;
+				reference_rotate_position(rotation, width, height, x, y, &dst_x,
+							  &dst_y);
+				memcpy((uint8_t *)image_row(&expected, dst_y) + dst_x * cpp,
+				       (uint8_t *)image_row(&src, y) + x * cpp, cpp);
+			}
+		}
+
+		compare_images(&dst, &expected, dst_width * cpp, 0xffffffff, 0, &failed,
+			       "rotation 0x%x of %ux%u %u-byte elements", rotation, width, height,
+			       cpp);
+
+		image_free(&src);
+		image_free(&dst);
+		image_free(&expected);
+	}
+	return !failed;
+}
+
+// The kernel's crc32_le a byte at a time, over each pixel in memory order with the alpha byte
+// cleared, which is what vkms hashes.
+static uint32_t reference_crc_vkms(const struct image *image)
+{
+	uint32_t crc = 0;
+	for (uint32_t y = 0; y < image->height; y++) {
+		for (uint32_t x = 0; x < image->width; x++) {
+			uint32_t pixel = image_row(image, y)[x];
+			const uint8_t bytes[4] = { pixel, pixel >> 8, pixel >> 16, 0 };
+			for (int i = 0; i < 4; i++) {
+				crc ^= bytes[i];
+				for (int bit = 0; bit < 8; bit++)
+					crc = (crc >> 1) ^ (crc & 1 ? 0xedb88320 : 0);
+			}
+		}
+	}
+	return crc;
+}
+
+static bool check_crc(void)
+{
+	uint64_t failed = 0;
+	for (int c = 0; c < CASES; c++) {
+		struct image image;
+		image_init(&image, random_range(1, 300), random_range(1, 300));
+		image_fill(&image);
+
+		uint32_t crc = bs_crtc_crc_vkms(image.pixels, image.stride, image.width,
+						image.height);
+		uint32_t expected = reference_crc_vkms(&image);
+		if (crc != expected)
+			report_failure(&failed, "vkms CRC of a %ux%u image is 0x%08x, not 0x%08x",
+				       image.width, image.height, crc, expected);
+		image_free(&image);
+	}
+	return !failed;
+}
+
+static uint16_t lut_value(const struct drm_color_lut *lut, size_t i, int channel)
+{
+	return channel == 0 ? lut[i].red : (channel == 1 ? lut[i].green : lut[i].blue);
+}
+
+// NULL, one entry, a power of two or any other size. Each channel follows its own power curve
+// between random ends, which may run downward, with an exponent from min_exponent up to 2.5.
+static struct drm_color_lut *random_lut(size_t *size, double min_exponent)
+{
+	switch (random_range(0, 3)) {
+		case 0:
+			*size = 0;
+			return NULL;
+		case 1:
+			*size = 1;
+			break;
+		case 2:
+			*size = (size_t)1 << random_range(1, 10);
+			break;
+		default:
+			*size = random_range(2, 1000);
+			break;
+	}
+
+	struct drm_color_lut *lut = calloc(*size, sizeof(*lut));
+	assert(lut);
+	for (int channel = 0; channel < 3; channel++) {
+		double lo = random_range(0, 65535), hi = random_range(0, 65535);
+		double exponent =
+		    min_exponent + (2.5 - min_exponent) * random_range(0, 1000) / 1000.0;
+		for (size_t i = 0; i < *size; i++) {
+			double x = *size > 1 ? (double)i / (*size - 1) : 0.0;
+			uint16_t value = (uint16_t)lround(lo + (hi - lo) * pow(x, exponent));
+			if (channel == 0)
+				lut[i].red = value;
+			else if (channel == 1)
+				lut[i].green = value;
+			else
+				lut[i].blue = value;
+		}
+	}
+	return lut;
+}
+
+// Magnitudes up to 2, so results leave [0, 1] and clamp, and now and then a negative zero, which
+// only reads as zero in sign-magnitude.
+static void random_ctm(int64_t ctm[9])
+{
+	for (int i = 0; i < 9; i++) {
+		uint64_t magnitude = 0;
+		if (random_range(0, 7))
+			magnitude = (uint64_t)random_range(0, 1 << 22) << 11;
+		uint64_t sign = random_range(0, 1) ? 1ull << 63 : 0;
+		ctm[i] = (int64_t)(sign | magnitude);
+	}
+}
+
+// Entry i of a LUT sits at i / (size - 1), with linear interpolation in between.
+static double reference_lut(const struct drm_color_lut *lut, size_t size, int channel, double x)
+{
+	if (!size)
+		return x;
+	if (size == 1)
+		return lut_value(lut, 0, channel) / 65535.0;
+
+	size_t i = (size_t)floor(x * (size - 1));
+	if (i > size - 2)
+		i = size - 2;
+	double t = x * (size - 1) - i;
+	return ((1.0 - t) * lut_value(lut, i, channel) + t * lut_value(lut, i + 1, channel)) /
+	       65535.0;
+}
+
+static uint32_t reference_color_pixel(const struct drm_color_lut *degamma, size_t degamma_size,
+				      const int64_t *ctm, const struct drm_color_lut *gamma,
+				      size_t gamma_size, uint32_t pixel)
+{
+	double linear[3];
+	for (int channel = 0; channel < 3; channel++)
+		linear[channel] = reference_lut(degamma, degamma_size, channel,
+						((pixel >> (16 - 8 * channel)) & 0xff) / 255.0);
+
+	uint32_t out = pixel & 0xff000000;
+	for (int channel = 0; channel < 3; channel++) {
+		double x = linear[channel];
+		if (ctm) {
+			x = 0.0;
+			for (int i = 0; i < 3; i++) {
+				// Bit 63 is the sign, the rest a 32.32 fixed point magnitude.
+				int64_t entry = ctm[3 * channel + i];
+				double value = ldexp((double)((uint64_t)entry & INT64_MAX), -32);
+				x += (entry < 0 ? -value : value) * linear[i];
+			}
+		}
+		x = fmin(fmax(x, 0.0), 1.0);
+		double y = reference_lut(gamma, gamma_size, channel, x);
+		out |= (uint32_t)lround(y * 255.0) << (16 - 8 * channel);
+	}
+	return out;
+}
+
+// bs_color_pipeline_apply promises one step per channel. It quantizes CTM results to 12 bits to
+// index the gamma LUT, so with a CTM the gamma curves stay no steeper than real ones, which rules
+// out exponents below 1.
+static bool check_color(void)
+{
+	uint64_t failed = 0;
+	for (int c = 0; c < CASES; c++) {
+		bool has_ctm = c % 2;
+		int64_t ctm[9];
+		size_t degamma_size, gamma_size;
+		struct drm_color_lut *degamma = random_lut(&degamma_size, 0.4);
+		struct drm_color_lut *gamma = random_lut(&gamma_size, has_ctm ? 1.0 : 0.4);
+		if (has_ctm)
+			random_ctm(ctm);
+		struct bs_color_pipeline *pipeline = bs_color_pipeline_new(
+		    degamma, degamma_size, has_ctm ? ctm : NULL, gamma, gamma_size);
+
+		struct image src, dst, expected;
+		image_init(&src, random_range(1, 64), random_range(1, 16));
+		image_fill(&src);
+		image_init(&dst, src.width, src.height);
+		image_init(&expected, src.width, src.height);
+
+		// Every other pair of cases maps in place.
+		bool in_place = c % 4 >= 2;
+		for (uint32_t y = 0; y < src.height; y++) {
+			if (in_place)
+				memcpy(image_row(&dst, y), image_row(&src, y),
+				       src.width * sizeof(uint32_t));
+			for (uint32_t x = 0; x < src.width; x++)
+				image_row(&expected, y)[x] = reference_color_pixel(
+				    degamma, degamma_size, has_ctm ? ctm : NULL, gamma, gamma_size,
+				    image_row(&src, y)[x]);
+		}
+		const struct image *from = in_place ? &dst : &src;
+		bs_color_pipeline_apply(pipeline, from->pixels, from->stride, dst.pixels,
+					dst.stride, dst.width, dst.height);
+
+		compare_images(&dst, &expected, dst.width * sizeof(uint32_t), 0xffffffff, 1,
+			       &failed,
+			       "color pipeline with %zu degamma entries, %s CTM and %zu gamma "
+			       "entries on a %ux%u image%s",
+			       degamma_size, has_ctm ? "a" : "no", gamma_size, dst.width,
+			       dst.height, in_place ? " in place" : "");
+
+		bs_color_pipeline_destroy(&pipeline);
+		free(degamma);
+		free(gamma);
+		image_free(&src);
+		image_free(&dst);
+		image_free(&expected);
+	}
+	return !failed;
+}
+
+// A layer's source image. RGB565 and NV12 rows are bytes in the images' pixels, and NV12 keeps its
+// interleaved CbCr in the second image.
+struct compose_source {
+	uint32_t format;
+	uint32_t width;
+	uint32_t height;
+	struct image planes[2];
+};
+
+static const uint32_t compose_formats[] = {
+	DRM_FORMAT_XRGB8888, DRM_FORMAT_ARGB8888, DRM_FORMAT_XBGR8888,
+	DRM_FORMAT_ABGR8888, DRM_FORMAT_RGB565,   DRM_FORMAT_NV12,
+};
+
+static void compose_source_init(struct compose_source *source)
+{
+	memset(source, 0, sizeof(*source));
+	source->format = compose_formats[random_range(0, BS_ARRAY_LEN(compose_formats) - 1)];
+	// NV12 is subsampled by two both ways, so it is kept to whole chroma samples.
+	uint32_t align = source->format == DRM_FORMAT_NV12 ? 2 : 1;
+	source->width = random_range(1, 200 / align) * align;
+	source->height = random_range(1, 100 / align) * align;
+	switch (source->format) {
+		case DRM_FORMAT_RGB565:
+			image_init(&source->planes[0], (source->width + 1) / 2, source->height);
+			break;
+		case DRM_FORMAT_NV12:
+			image_init(&source->planes[0], (source->width + 3) / 4, source->height);
+			image_init(&source->planes[1], (source->width + 3) / 4, source->height / 2);
+			image_fill(&source->planes[1]);
+			break;
+		default:
+			image_init(&source->planes[0], source->width, source->height);
+			break;
+	}
+	image_fill(&source->planes[0]);
+}
+
+static void compose_source_free(struct compose_source *source)
+{
+	image_free(&source->planes[0]);
+	if (source->planes[1].pixels)
+		image_free(&source->planes[1]);
+}
+
+// Source pixel (x, y) as red, green, blue and alpha from 0 to 255, with the formulas of the
+// format definitions rather than integer approximations.
+static void reference_source_pixel(const struct compose_source *source, uint32_t x, uint32_t y,
+				   double rgba[4])
+{
+	const uint8_t *row = (const uint8_t *)image_row(&source->planes[0], y);
+	// Only read as a pixel for the 32-bit formats.
+	uint32_t p = 0;
+	if (source->format != DRM_FORMAT_RGB565 && source->format != DRM_FORMAT_NV12)
+		p = image_row(&source->planes[0], y)[x];
+	rgba[3] = 255.0;
+	switch (source->format) {
+		case DRM_FORMAT_ARGB8888:
+			rgba[3] = p >> 24;
+			// Fall through.
+		case DRM_FORMAT_XRGB8888:
+			rgba[0] = (p >> 16) & 0xff;
+			rgba[1] = (p >> 8) & 0xff;
+			rgba[2] = p & 0xff;
+			break;
+		case DRM_FORMAT_ABGR8888:
+			rgba[3] = p >> 24;
+			// Fall through.
+		case DRM_FORMAT_XBGR8888:
+			rgba[0] = p & 0xff;
+			rgba[1] = (p >> 8) & 0xff;
+			rgba[2] = (p >> 16) & 0xff;
+			break;
+		case DRM_FORMAT_RGB565: {
+			uint16_t v = row[2 * x] | row[2 * x + 1] << 8;
+			rgba[0] = (v >> 11) * 255.0 / 31.0;
+			rgba[1] = ((v >> 5) & 0x3f) * 255.0 / 63.0;
+			rgba[2] = (v & 0x1f) * 255.0 / 31.0;
+			break;
+		}
+		case DRM_FORMAT_NV12: {
+			// BT.601 limited range.
+			const uint8_t *uv = (const uint8_t *)image_row(&source->planes[1], y / 2);
+			double luma = (row[x] - 16) * 255.0 / 219.0;
+			double cb = (uv[x / 2 * 2] - 128) * 255.0 / 224.0;
+			double cr = (uv[x / 2 * 2 + 1] - 128) * 255.0 / 224.0;
+			rgba[0] = luma + 1.402 * cr;
+			rgba[1] = luma - 0.344136 * cb - 0.714136 * cr;
+			rgba[2] = luma + 1.772 * cb;
+			for (int i = 0; i < 3; i++)
+				rgba[i] = fmin(fmax(rgba[i], 0.0), 255.0);
+			break;
+		}
+	}
+}
+
+static void random_compose_layer(struct bs_compositor_layer *layer,
+				 const struct compose_source *source, uint32_t width,
+				 uint32_t height)
+{
+	memset(layer, 0, sizeof(*layer));
+	layer->format = source->format;
+	for (int i = 0; i < 2; i++) {
+		layer->data[i] = source->planes[i].pixels;
+		layer->strides[i] = source->planes[i].stride;
+	}
+	layer->src_x = random_range(0, source->width * 65536 - 1);
+	layer->src_y = random_range(0, source->height * 65536 - 1);
+	layer->src_w = random_range(1, source->width * 65536 - layer->src_x);
+	layer->src_h = random_range(1, source->height * 65536 - layer->src_y);
+
+	// A quarter of the layers cover the whole frame, so the ones below get occluded.
+	if (random_range(0, 3)) {
+		layer->crtc_x = (int32_t)random_range(0, width + width / 2) - (int32_t)width / 2;
+		layer->crtc_y = (int32_t)random_range(0, height + height / 2) - (int32_t)height / 2;
+		layer->crtc_w = random_range(1, width + width / 2);
+		layer->crtc_h = random_range(1, height + height / 2);
+	} else {
+		layer->crtc_w = width;
+		layer->crtc_h = height;
+	}
+	// Half of them are unscaled.
+	if (random_range(0, 1)) {
+		layer->src_w = layer->crtc_w << 16;
+		layer->src_h = layer->crtc_h << 16;
+		if (layer->src_w > source->width << 16 || layer->src_h > source->height << 16) {
+			layer->src_w = source->width << 16;
+			layer->src_h = source->height << 16;
+			layer->crtc_w = source->width;
+			layer->crtc_h = source->height;
+		}
+		layer->src_x = random_range(0, (source->width << 16) - layer->src_w) & ~0xffffu;
+		layer->src_y = random_range(0, (source->height << 16) - layer->src_h) & ~0xffffu;
+	}
+
+	layer->zpos = random_range(0, 3);
+	layer->alpha = random_range(0, 1) ? 0xffff : random_range(0, 0xffff);
+	layer->blend_mode = random_range(0, 2);
+	layer->filter = BS_SCALE_NEAREST;
+}
+
+// Where the center of destination pixel i lands in the 16.16 source span, in whole pixels.
+static uint32_t reference_source_position(int64_t i, uint32_t start, uint32_t length,
+					  uint32_t count)
+{
+	return (uint32_t)floor((start + (i + 0.5) * length / count) / 65536.0);
+}
+
+// Blends the layer over the frame in double precision per the kernel's "pixel blend mode"
+// documentation, rounding to 8 bits like the frame holds.
+static void reference_compose_layer(struct image *frame, const struct bs_compositor_layer *layer,
+				    const struct compose_source *source)
+{
+	double plane_alpha = layer->alpha / 65535.0;
+	for (uint32_t y = 0; y < frame->height; y++) {
+		int64_t row = (int64_t)y - layer->crtc_y;
+		if (row < 0 || row >= layer->crtc_h)
+			continue;
+		uint32_t sy = reference_source_position(row, layer->src_y, layer->src_h,
+							layer->crtc_h);
+		for (uint32_t x = 0; x < frame->width; x++) {
+			int64_t column = (int64_t)x - layer->crtc_x;
+			if (column < 0 || column >= layer->crtc_w)
+				continue;
+			uint32_t sx = reference_source_position(column, layer->src_x, layer->src_w,
+								layer->crtc_w);
+			double fg[4];
+			reference_source_pixel(source, sx, sy, fg);
+
+			double alpha = fg[3] / 255.0;
+			double fg_weight, bg_weight;
+			switch (layer->blend_mode) {
+				case BS_COMPOSITOR_BLEND_NONE:
+					fg_weight = plane_alpha;
+					bg_weight = 1.0 - plane_alpha;
+					break;
+				case BS_COMPOSITOR_BLEND_PREMULTIPLIED:
+					fg_weight = plane_alpha;
+					bg_weight = 1.0 - plane_alpha * alpha;
+					break;
+				default:
+					fg_weight = plane_alpha * alpha;
+					bg_weight = 1.0 - plane_alpha * alpha;
+					break;
+			}
+
+			uint32_t *pixel = &image_row(frame, y)[x];
+			uint32_t out = 0xff000000;
+			for (int i = 0; i < 3; i++) {
+				int shift = 16 - 8 * i;
+				double bg = (*pixel >> shift) & 0xff;
+				double v = fmin(fg[i] * fg_weight + bg * bg_weight, 255.0);
+				out |= (uint32_t)lround(v) << shift;
+			}
+			*pixel = out;
+		}
+	}
+}
+
+// Blending in 8 bits, with plane alpha rounded to 8 bits too, costs up to a step per layer, and
+// the integer YCbCr and RGB565 conversions up to one more.
+static bool check_compose(void)
+{
+	uint64_t failed = 0, occluded = 0;
+	for (int c = 0; c < CASES; c++) {
+		// Several tiles both ways, with partial ones at the right and bottom edges.
+		struct image frame, expected;
+		image_init(&frame, random_range(1, 600), random_range(1, 80));
+		image_fill(&frame);
+		image_init(&expected, frame.width, frame.height);
+		image_fill(&expected);
+
+		uint32_t layer_count = random_range(1, 4);
+		struct compose_source sources[4];
+		struct bs_compositor_layer layers[4];
+		for (uint32_t i = 0; i < layer_count; i++) {
+			compose_source_init(&sources[i]);
+			random_compose_layer(&layers[i], &sources[i], frame.width, frame.height);
+		}
+
+		struct bs_compositor *compositor = bs_compositor_new(random_range(1, 4));
+		bool composed = bs_compositor_compose(compositor, layers, layer_count, frame.pixels,
+						      frame.stride, frame.width, frame.height);
+		struct bs_compositor_stats stats;
+		bs_compositor_get_stats(compositor, &stats);
+		occluded += stats.occluded;
+		bs_compositor_destroy(&compositor);
+
+		// Over black, bottom layer first and layers sharing a zpos in the given order.
+		for (uint32_t y = 0; y < expected.height; y++) {
+			for (uint32_t x = 0; x < expected.width; x++)
+				image_row(&expected, y)[x] = 0xff000000;
+		}
+		for (uint64_t zpos = 0; zpos <= 3; zpos++) {
+			for (uint32_t i = 0; i < layer_count; i++) {
+				if (layers[i].zpos == zpos)
+					reference_compose_layer(&expected, &layers[i], &sources[i]);
+			}
+		}
+
+		if (!composed)
+			report_failure(&failed, "compositor refused %u layers", layer_count);
+		else
+			compare_images(&frame, &expected, frame.width * sizeof(uint32_t),
+				       0xffffffff, layer_count + 1, &failed,
+				       "%u layers composed into a %ux%u frame", layer_count,
+				       frame.width, frame.height);
+
+		for (uint32_t i = 0; i < layer_count; i++)
+			compose_source_free(&sources[i]);
+		image_free(&frame);
+		image_free(&expected);
+	}
+
+	if (!occluded)
+		report_failure(&failed, "no layer tile was ever occluded");
+	return !failed;
+}
+
+struct check {
+	const char *name;
+	bool (*run)(void);
+};
+
+static const struct check checks[] = {
+	{ "scale", check_scale },
+	{ "rotate", check_rotate },
+	{ "crc", check_crc },
+	{ "color", check_color },
+	{ "compose", check_compose },
+};
+
+static const struct option longopts[] = {
+	{ "seed", required_argument, NULL, 's' },
+	{ "help", no_argument, NULL, 'h' },
+	{ 0, 0, 0, 0 },
+};
+
+static void print_help(const char *argv0)
+{
+	printf("usage: %s [-s <seed of the random images>]\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned seed = 1;
+	int c;
+	while ((c = getopt_long(argc, argv, "s:h", longopts, NULL)) != -1) {
+		switch (c) {
+			case 's':
+				seed = strtoul(optarg, NULL, 0);
+				break;
+			case 'h':
+				print_help(argv[0]);
+				return 0;
+			default:
+				print_help(argv[0]);
+				return 1;
+		}
+	}
+
+	int ret = 0;
+	for (size_t i = 0; i < BS_ARRAY_LEN(checks); i++) {
+		srand(seed);
+		bool passed = checks[i].run();
+		printf("%s: %s\n", checks[i].name, passed ? "PASSED" : "FAILED");
+		if (!passed)
+			ret = 1;
+	}
+	return ret;
+}
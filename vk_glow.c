@@ -57,11 +57,14 @@ static void __check_vk_success(const char *file, int line, const char *func, VkR
 	exit(EXIT_FAILURE);
 }
 
+static struct bs_present_stats *present_stats;
+
 static void page_flip_handler(int fd, unsigned int frame, unsigned int sec, unsigned int usec,
 			      void *data)
 {
 	bool *waiting_for_flip = data;
 	*waiting_for_flip = false;
+	bs_present_stats_flip(present_stats, frame, sec, usec);
 }
 
 // Choose the first physical device. Exit on failure.
@@ -415,6 +418,7 @@ int main(int argc, char **argv)
 
 	// We set an upper bound on the render loop so we can run this in
 	// from a testsuite.
+	present_stats = bs_present_stats_new();
 	for (int i = 1; i < 500; ++i) {
 		struct frame *fr = &frames[i % BS_ARRAY_LEN(frames)];
 
@@ -479,6 +483,7 @@ int main(int argc, char **argv)
 		check_vk_success(res, "vkQueueWaitIdle");
 
 		bool waiting_for_flip = true;
+		bs_present_stats_submit(present_stats);
 		err = drmModePageFlip(dev_fd, pipe.crtc_id, fr->drm_fb_id, DRM_MODE_PAGE_FLIP_EVENT,
 				      &waiting_for_flip);
 		if (err) {
@@ -516,5 +521,8 @@ int main(int argc, char **argv)
 		}
 	}
 
+	bs_present_stats_print(present_stats, "vk_glow", stdout);
+	bs_present_stats_destroy(&present_stats);
+
 	return 0;
 }